@@ -0,0 +1,457 @@
+//Benchmark of the graph pipeline on synthetic networks.
+//
+//Every topology is generated at sizes 10^min..10^max pipes and each stage is
+//timed on it: graph_new, graph_copy, graph_backpropagate_flowrate,
+//graph_propagate_pressure, graph_find_leaks and the DOT serialisation behind
+//graph_plot (written to /dev/null, dot itself is not run).
+//
+//Results go to stdout as one JSON document: ns per pipe and heap
+//allocations per run for every stage, and the peak RSS of every network.
+//Anything the library prints to stdout is sent to /dev/null so it does not
+//end up in the document.
+//Allocations are counted by wrapping malloc, calloc and realloc at link time
+//(-Wl,--wrap=...), which sees the calls made from this program's objects but
+//not the ones libc makes internally.
+//
+//Topologies (all directed away from node 0, the only input):
+//  tree      random recursive tree, parent chosen uniformly
+//  grid      square mesh with pipes going right and down
+//  ring      ring main fed at node 0 meeting at the far side, with random
+//            trees of service pipes hanging from the ring nodes
+//  powerlaw  preferential attachment tree, heavy tailed degrees
+
+#define _GNU_SOURCE
+#include <graph.h>
+#include <thread_pool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+//Each stage is repeated until it has processed at least this many pipes
+#define BENCH_MIN_PIPES_TIMED 2000000
+#define BENCH_MAX_REPS 1000
+
+//A node out of every BENCH_MEASURED_EVERY has a meter
+#define BENCH_MEASURED_EVERY 97
+
+static FILE *out;
+
+//Allocation counters
+static atomic_long n_mallocs;
+static atomic_long n_reallocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size){
+  atomic_fetch_add_explicit(&n_mallocs, 1, memory_order_relaxed);
+  return __real_malloc(size);
+}
+void *__wrap_calloc(size_t n, size_t size){
+  atomic_fetch_add_explicit(&n_mallocs, 1, memory_order_relaxed);
+  return __real_calloc(n, size);
+}
+void *__wrap_realloc(void *p, size_t size){
+  atomic_fetch_add_explicit(&n_reallocs, 1, memory_order_relaxed);
+  return __real_realloc(p, size);
+}
+
+static long n_allocations(){
+  return atomic_load(&n_mallocs) + atomic_load(&n_reallocs);
+}
+
+//Network description, the arrays graph_new and the setters take
+typedef struct Network{
+  int n_pipes;
+  int cap;
+  int *sorig;
+  int *torig;
+  float *diam;
+  float *length;
+  float *rough;
+} Network;
+
+static void network_add_pipe(Network *net, int s, int t){
+  if (net->n_pipes == net->cap){
+    net->cap = (net->cap == 0) ? 1024 : net->cap * 2;
+    net->sorig = realloc(net->sorig, sizeof(int) * net->cap);
+    net->torig = realloc(net->torig, sizeof(int) * net->cap);
+  }
+  net->sorig[net->n_pipes] = s;
+  net->torig[net->n_pipes] = t;
+  net->n_pipes++;
+}
+static void network_destroy(Network *net){
+  free(net->sorig);
+  free(net->torig);
+  free(net->diam);
+  free(net->length);
+  free(net->rough);
+}
+
+static unsigned long rng_state;
+static unsigned long rng_next(){
+  unsigned long z = (rng_state += 0x9e3779b97f4a7c15ul);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ul;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebul;
+  return z ^ (z >> 31);
+}
+static double rng_uniform(){
+  return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+//Generators. Every one adds about n_pipes pipes.
+static void generate_tree(Network *net, int n_pipes){
+  for (int i = 1; i <= n_pipes; i++){
+    network_add_pipe(net, rng_next() % i, i);
+  }
+}
+static void generate_grid(Network *net, int n_pipes){
+  int side = (int) ceil(sqrt(n_pipes / 2.0 + 1));
+  for (int r = 0; r < side; r++){
+    for (int c = 0; c < side; c++){
+      int i = r * side + c;
+      if (c + 1 < side){
+        network_add_pipe(net, i, i + 1);
+      }
+      if (r + 1 < side){
+        network_add_pipe(net, i, i + side);
+      }
+    }
+  }
+}
+static void generate_ring(Network *net, int n_pipes){
+  //A tenth of the pipes form the ring, at least a triangle
+  int ring = n_pipes / 10;
+  if (ring < 3){
+    ring = 3;
+  }
+  int half = ring / 2;
+  for (int i = 0; i < half; i++){
+    network_add_pipe(net, i, i + 1);
+  }
+  network_add_pipe(net, 0, ring - 1);
+  for (int i = ring - 1; i > half + 1; i--){
+    network_add_pipe(net, i, i - 1);
+  }
+  if (half + 1 < ring){
+    network_add_pipe(net, half + 1, half);
+  }
+
+  //Service trees: each new node hangs from the ring or an earlier branch
+  for (int i = ring; net->n_pipes < n_pipes; i++){
+    int parent;
+    if (rng_uniform() < 0.3){
+      parent = rng_next() % ring;
+    } else {
+      parent = rng_next() % i;
+    }
+    network_add_pipe(net, parent, i);
+  }
+}
+static void generate_powerlaw(Network *net, int n_pipes){
+  //Picking the endpoint of a random existing pipe selects a node with
+  //probability proportional to its degree (Barabasi-Albert, m = 1)
+  network_add_pipe(net, 0, 1);
+  for (int i = 2; i <= n_pipes; i++){
+    int k = rng_next() % net->n_pipes;
+    int parent = (rng_next() & 1) ? net->sorig[k] : net->torig[k];
+    network_add_pipe(net, parent, i);
+  }
+}
+
+typedef struct Topology{
+  const char *name;
+  void (*generate)(Network *net, int n_pipes);
+} Topology;
+
+static Topology topologies[] = {
+  {"tree", generate_tree},
+  {"grid", generate_grid},
+  {"ring", generate_ring},
+  {"powerlaw", generate_powerlaw},
+};
+#define N_TOPOLOGIES (int)(sizeof(topologies) / sizeof(topologies[0]))
+
+static void network_generate(Network *net, Topology *t, int n_pipes){
+  memset(net, 0, sizeof(Network));
+  t->generate(net, n_pipes);
+
+  //Distribution mains are wider than service pipes
+  net->diam = malloc(sizeof(float) * net->n_pipes);
+  net->length = malloc(sizeof(float) * net->n_pipes);
+  net->rough = malloc(sizeof(float) * net->n_pipes);
+  for (int i = 0; i < net->n_pipes; i++){
+    net->diam[i] = (net->sorig[i] == 0) ? 0.3 : 0.075 + 0.025 * (rng_next() % 4);
+    net->length[i] = 5 + 95 * rng_uniform();
+    net->rough[i] = 0.0000015 * (1 + rng_next() % 100);
+  }
+}
+
+//Physical setup done outside the timed stages, O(n) through the node getters
+static void network_setup(Graph *g, Network *net){
+  graph_set_fluid_viscosity(g, 0.08903);
+  graph_set_fluid_density(g, 997.08);
+  graph_set_friction_model(g, friction_model_churchill);
+  graph_set_diameters(g, net->diam);
+  graph_set_lengths(g, net->length);
+  graph_set_roughness(g, net->rough);
+
+  int n_nodes = graph_get_n_nodes(g);
+  for (int i = 0; i < n_nodes; i++){
+    Node *n = graph_get_nth_node(g, i);
+    if (node_get_is_output(n)){
+      node_set_flowrate_measured(n, 0.0001 + 0.0001 * rng_uniform());
+      node_set_flowrate_calculated(n, node_get_flowrate_measured(n));
+    }
+    if (i % BENCH_MEASURED_EVERY == 0){
+      node_set_is_measured(n, true);
+    }
+  }
+
+  Node *input = graph_get_nth_node(g, 0);
+  node_set_height(input, 70);
+  node_set_pressure_calculated(input, node_input_compute_pressure(input));
+}
+
+static double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//Peak RSS in kB since the last reset. Writing 5 to clear_refs resets the
+//high water mark, on older kernels the peak only grows.
+static void peak_rss_reset(){
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd >= 0){
+    if (write(fd, "5", 1) != 1){
+      //Peak keeps counting from process start
+    }
+    close(fd);
+  }
+}
+static long peak_rss_kb(){
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f != NULL){
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f) != NULL){
+      if (strncmp(line, "VmHWM:", 6) == 0){
+        kb = atol(line + 6);
+        break;
+      }
+    }
+    fclose(f);
+    if (kb >= 0){
+      return kb;
+    }
+  }
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+typedef struct Stage{
+  const char *name;
+  double seconds;
+  long allocations;
+  int reps;
+} Stage;
+
+static void stage_print(Stage *s, int n_pipes, _Bool last){
+  fprintf(out, "        \"%s\": {\"ns_per_pipe\": %.3f, \"allocs_per_run\": %.1f, \"reps\": %d}%s\n",
+         s->name, s->seconds * 1e9 / s->reps / n_pipes,
+         (double) s->allocations / s->reps, s->reps, last ? "" : ",");
+}
+
+enum {STAGE_NEW, STAGE_COPY, STAGE_BACKPROPAGATE, STAGE_PROPAGATE,
+      STAGE_FIND_LEAKS, STAGE_WRITE_DOT, N_STAGES};
+
+static void bench_network(Topology *t, int target_pipes, ThreadPool *tp, _Bool dot, _Bool first){
+  Network net;
+  Stage stages[N_STAGES] = {
+    {"graph_new"}, {"graph_copy"}, {"graph_backpropagate_flowrate"},
+    {"graph_propagate_pressure"}, {"graph_find_leaks"}, {"graph_write_dot"}
+  };
+
+  peak_rss_reset();
+  network_generate(&net, t, target_pipes);
+  int n_pipes = net.n_pipes;
+  int reps = BENCH_MIN_PIPES_TIMED / n_pipes;
+  if (reps < 1){
+    reps = 1;
+  } else if (reps > BENCH_MAX_REPS){
+    reps = BENCH_MAX_REPS;
+  }
+
+  fprintf(stderr, "%s %d pipes, %d reps\n", t->name, n_pipes, reps);
+
+  //graph_new, destroying every copy but the last outside the clock
+  Graph *g = NULL;
+  for (int r = 0; r < reps; r++){
+    graph_destroy(g);
+    long a = n_allocations();
+    double t0 = now();
+    g = graph_new(NULL, n_pipes, net.sorig, net.torig);
+    stages[STAGE_NEW].seconds += now() - t0;
+    stages[STAGE_NEW].allocations += n_allocations() - a;
+  }
+  stages[STAGE_NEW].reps = reps;
+  network_setup(g, &net);
+  graph_set_thread_pool(g, tp);
+
+  for (int r = 0; r < reps; r++){
+    long a = n_allocations();
+    double t0 = now();
+    Graph *c = graph_copy(NULL, g);
+    stages[STAGE_COPY].seconds += now() - t0;
+    stages[STAGE_COPY].allocations += n_allocations() - a;
+    graph_destroy(c);
+  }
+  stages[STAGE_COPY].reps = reps;
+
+  //The first run allocates the propagation scratch, it is left untimed
+  graph_backpropagate_flowrate(g);
+  long a = n_allocations();
+  double t0 = now();
+  for (int r = 0; r < reps; r++){
+    graph_backpropagate_flowrate(g);
+  }
+  stages[STAGE_BACKPROPAGATE].seconds = now() - t0;
+  stages[STAGE_BACKPROPAGATE].allocations = n_allocations() - a;
+  stages[STAGE_BACKPROPAGATE].reps = reps;
+
+  a = n_allocations();
+  t0 = now();
+  for (int r = 0; r < reps; r++){
+    graph_propagate_pressure(g);
+  }
+  stages[STAGE_PROPAGATE].seconds = now() - t0;
+  stages[STAGE_PROPAGATE].allocations = n_allocations() - a;
+  stages[STAGE_PROPAGATE].reps = reps;
+
+  for (int r = 0; r < reps; r++){
+    a = n_allocations();
+    t0 = now();
+    Leaks *l = graph_find_leaks(g);
+    stages[STAGE_FIND_LEAKS].seconds += now() - t0;
+    stages[STAGE_FIND_LEAKS].allocations += n_allocations() - a;
+    leaks_destroy(l);
+  }
+  stages[STAGE_FIND_LEAKS].reps = reps;
+
+  if (dot){
+    int fd = open("/dev/null", O_WRONLY);
+    a = n_allocations();
+    t0 = now();
+    for (int r = 0; r < reps; r++){
+      graph_write_dot(g, fd);
+    }
+    stages[STAGE_WRITE_DOT].seconds = now() - t0;
+    stages[STAGE_WRITE_DOT].allocations = n_allocations() - a;
+    stages[STAGE_WRITE_DOT].reps = reps;
+    close(fd);
+  }
+
+  long rss = peak_rss_kb();
+
+  fprintf(out, "%s    {\n", first ? "" : ",\n");
+  fprintf(out, "      \"topology\": \"%s\",\n", t->name);
+  fprintf(out, "      \"n_nodes\": %d,\n", graph_get_n_nodes(g));
+  fprintf(out, "      \"n_pipes\": %d,\n", n_pipes);
+  fprintf(out, "      \"peak_rss_kb\": %ld,\n", rss);
+  fprintf(out, "      \"stages\": {\n");
+  int last = dot ? STAGE_WRITE_DOT : STAGE_FIND_LEAKS;
+  for (int i = 0; i <= last; i++){
+    stage_print(&stages[i], n_pipes, i == last);
+  }
+  fprintf(out, "      }\n");
+  fprintf(out, "    }");
+  fflush(out);
+
+  graph_destroy(g);
+  network_destroy(&net);
+}
+
+int main(int argc, char *argv[]){
+  //Options: --min E --max E (10^E pipes, default 2..5), --topology NAME,
+  //         --threads T (0 = one per CPU, default serial), --seed S,
+  //         --no-dot skips the DOT stage, which grows faster than linear
+  int min_exp = 2;
+  int max_exp = 5;
+  _Bool dot = true;
+  int n_threads = -1;
+  const char *only = NULL;
+  rng_state = 1;
+
+  for (int i = 1; i < argc; i++){
+    if (strcmp(argv[i], "--min") == 0 && i + 1 < argc){
+      min_exp = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--max") == 0 && i + 1 < argc){
+      max_exp = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--topology") == 0 && i + 1 < argc){
+      only = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc){
+      n_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc){
+      rng_state = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--no-dot") == 0){
+      dot = false;
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (min_exp < 1 || max_exp > 8 || min_exp > max_exp){
+    fprintf(stderr, "Sizes must be 10^1 to 10^8 pipes\n");
+    return 1;
+  }
+
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  if (out == NULL || freopen("/dev/null", "w", stdout) == NULL){
+    fprintf(stderr, "Could not redirect stdout\n");
+    return 1;
+  }
+
+  ThreadPool *tp = NULL;
+  if (n_threads >= 0){
+    tp = thread_pool_new(NULL, n_threads);
+  }
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"threads\": %d,\n", tp == NULL ? 1 : thread_pool_get_n_threads(tp));
+  fprintf(out, "  \"networks\": [\n");
+  _Bool first = true;
+  for (int t = 0; t < N_TOPOLOGIES; t++){
+    if (only != NULL && strcmp(only, topologies[t].name) != 0){
+      continue;
+    }
+    int n_pipes = 1;
+    for (int e = 0; e < min_exp; e++){
+      n_pipes *= 10;
+    }
+    for (int e = min_exp; e <= max_exp; e++){
+      bench_network(&topologies[t], n_pipes, tp, dot, first);
+      first = false;
+      n_pipes *= 10;
+    }
+  }
+  fprintf(out, "\n  ]\n}\n");
+
+  if (tp != NULL){
+    thread_pool_destroy(tp);
+  }
+  fclose(out);
+  return 0;
+}
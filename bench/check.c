@@ -0,0 +1,575 @@
+//Regression checks of the library on small hand-made networks.
+//
+//Every check prints one line, "ok" or what went wrong, and the program
+//exits with 1 if any of them failed (make check).
+
+#include <graph.h>
+#include <calibrate.h>
+#include <leakdetect.h>
+#include <log.h>
+#include <partition.h>
+#include <transient.h>
+#include <tree_index.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <math.h>
+
+static int n_failed = 0;
+
+static void check(_Bool ok, const char *name, const char *what){
+  printf("%-24s %s\n", name, ok ? "ok" : what);
+  if (! ok){
+    n_failed++;
+  }
+}
+
+//Every leveled node sits in the level it reports, the rest report -1
+static _Bool levels_consistent(Graph *g){
+  int n_leveled = 0;
+  for (int l = 0; l < graph_get_depth(g); l++){
+    int *nodes = graph_get_level_nodes(g, l);
+    for (int k = 0; k < graph_get_level_size(g, l); k++){
+      if (graph_get_node_level(g, nodes[k]) != l){
+        return false;
+      }
+    }
+    n_leveled += graph_get_level_size(g, l);
+  }
+  int n_reported = 0;
+  for (int i = 0; i < graph_get_n_nodes(g); i++){
+    n_reported += (graph_get_node_level(g, i) != -1);
+  }
+  return n_leveled == n_reported && n_leveled == graph_get_n_leveled_nodes(g);
+}
+
+//Nodes downstream of a deleted node or on a cycle are not leveled
+static void check_levels(){
+  int sorig[] = {1, 1, 2, 3, 4};
+  int torig[] = {2, 3, 4, 4, 5};
+  Graph *g = graph_new(NULL, 5, sorig, torig);
+  graph_del_node(g, 3);
+  check(graph_get_node_level(g, 4) == -1 && graph_get_node_level(g, 5) == -1 &&
+        graph_get_depth(g) == 2 && levels_consistent(g),
+        "levels deleted node", "nodes below the deleted node are leveled");
+  graph_destroy(g);
+
+  int corig[] = {1, 2, 3, 3};
+  int ctorig[] = {2, 3, 2, 4};
+  g = graph_new(NULL, 4, corig, ctorig);
+  check(graph_get_node_level(g, 2) == -1 && graph_get_node_level(g, 3) == -1 &&
+        graph_get_node_level(g, 4) == -1 && graph_get_depth(g) == 1 && levels_consistent(g),
+        "levels cycle", "nodes on or below the cycle are leveled");
+  graph_destroy(g);
+}
+
+//A leak below a diamond is seen once by the meters above it, whichever way
+//they are summed
+static void check_measurement(){
+  int sorig[] = {0, 1, 1, 2, 3, 4};
+  int torig[] = {1, 2, 3, 4, 4, 5};
+  float diameters[] = {0.3, 0.1, 0.2, 0.1, 0.2, 0.3};
+  Graph *g = graph_new(NULL, 6, sorig, torig);
+  graph_set_diameters(g, diameters);
+  Node **nodes = graph_get_nodes(g);
+  node_set_flowrate_calculated(nodes[5], 1e-3);
+  graph_backpropagate_flowrate(g);
+  node_set_is_measured(nodes[1], true);
+  node_set_is_measured(nodes[2], true);
+  node_set_is_measured(nodes[4], true);
+  node_set_leak_flowrate(nodes[5], 1e-4);
+  graph_add_leaks_to_measured_nodes(g);
+
+  float diff[6], successors_diff[6];
+  graph_measurement_get_diffs(g, diff, successors_diff);
+  _Bool agree = true;
+  for (int i = 0; i < 6; i++){
+    agree = agree && fabsf(node_measurement_get_successors_diff(nodes[i]) - successors_diff[i]) < 1e-9;
+  }
+  check(fabsf(successors_diff[1] - diff[1]) < 1e-9 && fabsf(diff[1] - 1e-4) < 1e-9,
+        "measurement diamond", "the meters below do not add up to the leak");
+  check(agree, "measurement walk", "disagrees with graph_measurement_get_diffs");
+  graph_destroy(g);
+
+  //Deeper than the walk keeps on the stack, and walked twice
+  int corig[200], ctorig[200];
+  for (int i = 0; i < 200; i++){
+    corig[i] = i;
+    ctorig[i] = i + 1;
+  }
+  g = graph_new(NULL, 200, corig, ctorig);
+  nodes = graph_get_nodes(g);
+  node_set_flowrate_calculated(nodes[200], 1e-3);
+  graph_backpropagate_flowrate(g);
+  node_set_is_measured(nodes[200], true);
+  node_set_leak_flowrate(nodes[200], 1e-4);
+  graph_add_leaks_to_measured_nodes(g);
+  float first = node_measurement_get_successors_diff(nodes[0]);
+  check(fabsf(first - 1e-4) < 1e-9 && node_measurement_get_successors_diff(nodes[0]) == first,
+        "measurement deep walk", "does not see the meter at the end of the chain twice");
+  graph_destroy(g);
+}
+
+//On a tree the index sees every leak where the meters do, and it refuses
+//the diamond, which splits them between its pipes
+static void check_tree_index(){
+  int sorig[] = {0, 1, 1, 2, 2, 3, 5};
+  int torig[] = {1, 2, 3, 4, 5, 6, 7};
+  float diameters[] = {0.3, 0.2, 0.1, 0.1, 0.2, 0.1, 0.1};
+  float leaks[] = {0, 0, 5e-5, 0, 1e-4, 2e-4, 3e-4, 0};
+  Graph *g = graph_new(NULL, 7, sorig, torig);
+  graph_set_diameters(g, diameters);
+  Node **nodes = graph_get_nodes(g);
+  node_set_flowrate_calculated(nodes[4], 1e-3);
+  node_set_flowrate_calculated(nodes[6], 2e-3);
+  node_set_flowrate_calculated(nodes[7], 1e-3);
+  graph_backpropagate_flowrate(g);
+  TreeIndex *ti = tree_index_new(NULL, g);
+  for (int i = 0; i < 8; i++){
+    node_set_is_measured(nodes[i], i >= 1 && i <= 5);
+    if (leaks[i] > 0){
+      node_set_leak_flowrate(nodes[i], leaks[i]);
+      tree_index_set_leak(ti, i, leaks[i]);
+    }
+  }
+  graph_add_leaks_to_measured_nodes(g);
+
+  float diff[8], successors_diff[8];
+  graph_measurement_get_diffs(g, diff, successors_diff);
+  _Bool agree = true;
+  for (int i = 1; i <= 5; i++){
+    agree = agree && fabsf(tree_index_get_leak_through(ti, i) - diff[i]) < 1e-9;
+  }
+  check(agree, "tree index leaks", "disagrees with graph_add_leaks_to_measured_nodes");
+  tree_index_destroy(ti);
+  graph_destroy(g);
+
+  int dorig[] = {0, 1, 1, 2, 3, 4};
+  int dtorig[] = {1, 2, 3, 4, 4, 5};
+  g = graph_new(NULL, 6, dorig, dtorig);
+  check(tree_index_new(NULL, g) == NULL, "tree index mesh", "builds an index on a mesh");
+  graph_destroy(g);
+}
+
+//The chain input -> 7 -> 8 next to a tree of demands, 0.1 m pipes of 500 m
+static Graph *leakage_network(){
+  int sorig[] = {0, 1, 2, 1, 4, 0, 7, 3, 5};
+  int torig[] = {1, 2, 3, 4, 5, 7, 8, 6, 9};
+  Graph *g = graph_new(NULL, 9, sorig, torig);
+  float diameters[9], roughness[9], lengths[9];
+  for (int i = 0; i < 9; i++){
+    diameters[i] = 0.1;
+    roughness[i] = 0.0005;
+    lengths[i] = 500;
+  }
+  graph_set_fluid_viscosity(g, 0.001);
+  graph_set_fluid_density(g, 998);
+  graph_set_friction_model(g, friction_model_churchill);
+  graph_set_diameters(g, diameters);
+  graph_set_roughness(g, roughness);
+  graph_set_lengths(g, lengths);
+
+  Node **nodes = graph_get_nodes(g);
+  for (int i = 0; i < graph_get_n_nodes(g); i++){
+    if (node_get_is_output(nodes[i])){
+      node_set_flowrate_calculated(nodes[i], 1e-3);
+    }
+  }
+  node_set_height(nodes[0], 70);
+  node_set_pressure_calculated(nodes[0], node_input_compute_pressure(nodes[0]));
+  graph_backpropagate_flowrate(g);
+  graph_propagate_pressure(g);
+  return g;
+}
+
+//Emitters from small to larger than their pipe, and background leakage,
+//converge in single digits to leaks that match the pressures they leave
+static void check_leakage(){
+  float coefficients[] = {1e-5, 1e-4, 7e-4, 8e-4, 2e-3, 1e-2};
+  for (int c = 0; c < (int) (sizeof(coefficients) / sizeof(coefficients[0])); c++){
+    Graph *g = leakage_network();
+    Node *n = graph_get_nodes(g)[8];
+    node_set_emitter(n, coefficients[c], 0.5);
+    node_set_is_measured(n, true);
+    int iterations = graph_solve_leakage(g, 50, 1e-6);
+    double head = node_get_pressure_measured(n) - 101325;
+    double law = coefficients[c] * sqrt(head > 0 ? head : 0);
+    char name[32];
+    snprintf(name, sizeof(name), "leakage emitter %g", coefficients[c]);
+    check(iterations > 0 && iterations < 10 && fabs(node_get_leak_flowrate(n) - law) < 1e-3 * law,
+          name, "does not converge in single digits to the leak of its pressure");
+    graph_destroy(g);
+  }
+
+  Graph *g = leakage_network();
+  Pipe **pipes = graph_get_pipes(g);
+  for (int i = 0; i < graph_get_n_pipes(g); i++){
+    pipe_set_background_leakage(pipes[i], 1e-9, 1.1);
+  }
+  int iterations = graph_solve_leakage(g, 50, 1e-8);
+  check(iterations > 0 && iterations < 10 && graph_get_total_leak_outflow(g) > 0,
+        "leakage background", "does not converge in single digits");
+  graph_destroy(g);
+}
+
+static float misfit_solve(Graph *g){
+  graph_backpropagate_flowrate(g);
+  graph_propagate_pressure(g);
+  return graph_compute_misfit_gradient(g, 1e-6, 1e6, NULL, NULL, NULL);
+}
+
+//Central differences with relative steps agree with the adjoint within 1%
+//for every roughness, diameter and demand. The demands are raised so that
+//friction moves the pressures well past float rounding.
+static void check_misfit_gradient(){
+  Graph *g = leakage_network();
+  Node **nodes = graph_get_nodes(g);
+  Pipe **pipes = graph_get_pipes(g);
+  int n_nodes = graph_get_n_nodes(g);
+  int n_pipes = graph_get_n_pipes(g);
+  for (int i = 0; i < n_nodes; i++){
+    if (node_get_is_output(nodes[i])){
+      node_set_flowrate_calculated(nodes[i], 0.05 + 0.01 * i);
+    }
+  }
+  //Meters off the solved values by a few kPa and m³/s, outputs only for pressure
+  int meters[] = {1, 2, 6, 7, 8};
+  float pressures[] = {703000, 692000, 655000, 762000, 745000};
+  float flowrates[] = {0.24, 0.105, -1, 0.14, -1};
+  for (int k = 0; k < 5; k++){
+    node_set_pressure_measured(nodes[meters[k]], pressures[k]);
+    if (flowrates[k] != -1){
+      node_set_flowrate_measured(nodes[meters[k]], flowrates[k]);
+    }
+    node_set_is_measured(nodes[meters[k]], true);
+  }
+
+  float d_rough[n_pipes], d_diam[n_pipes], d_demand[n_nodes];
+  misfit_solve(g);
+  graph_compute_misfit_gradient(g, 1e-6, 1e6, d_rough, d_diam, d_demand);
+
+  const float h = 1e-3;
+  _Bool agree = true;
+  for (int i = 0; i < n_pipes; i++){
+    float r = pipe_get_rough(pipes[i]);
+    pipe_set_rough(pipes[i], r * (1 + h));
+    float plus = misfit_solve(g);
+    pipe_set_rough(pipes[i], r * (1 - h));
+    float minus = misfit_solve(g);
+    pipe_set_rough(pipes[i], r);
+    double fd = (plus - minus) / (2 * h * r);
+    agree = agree && fabs(fd - d_rough[i]) <= 0.01 * fabs(d_rough[i]) + 1e-6;
+
+    float d = pipe_get_diam(pipes[i]);
+    pipe_set_diam(pipes[i], d * (1 + h));
+    plus = misfit_solve(g);
+    pipe_set_diam(pipes[i], d * (1 - h));
+    minus = misfit_solve(g);
+    pipe_set_diam(pipes[i], d);
+    fd = (plus - minus) / (2 * h * d);
+    agree = agree && fabs(fd - d_diam[i]) <= 0.01 * fabs(d_diam[i]) + 1e-6;
+  }
+  for (int i = 0; i < n_nodes; i++){
+    if (! node_get_is_output(nodes[i])){
+      continue;
+    }
+    float q = node_get_flowrate_calculated(nodes[i]);
+    node_set_flowrate_calculated(nodes[i], q * (1 + h));
+    float plus = misfit_solve(g);
+    node_set_flowrate_calculated(nodes[i], q * (1 - h));
+    float minus = misfit_solve(g);
+    node_set_flowrate_calculated(nodes[i], q);
+    double fd = (plus - minus) / (2 * h * q);
+    agree = agree && fabs(fd - d_demand[i]) <= 0.01 * fabs(d_demand[i]) + 1e-6;
+  }
+  check(agree, "misfit gradient", "the adjoint disagrees with finite differences");
+  graph_destroy(g);
+}
+
+//Readings of a copy with two roughness groups and every demand 1.3 times
+//the one the steps give bring both groups and the multiplier back
+static void check_calibration(){
+  int groups[] = {0, 0, 0, 0, 0, 1, 1, 1, 1};
+  float truth_roughness[] = {0.002, 0.0002};
+  float truth_multiplier = 1.3;
+  int meters[] = {1, 2, 3, 6, 7, 8, 9};
+  float step_scales[] = {1, 0.6, 1.4};
+  int n_meters = sizeof(meters) / sizeof(meters[0]);
+  int n_steps = sizeof(step_scales) / sizeof(step_scales[0]);
+
+  Graph *g = leakage_network();
+  Graph *truth = leakage_network();
+  Node **nodes = graph_get_nodes(g);
+  Node **truth_nodes = graph_get_nodes(truth);
+  Pipe **truth_pipes = graph_get_pipes(truth);
+  int n_nodes = graph_get_n_nodes(g);
+  for (int i = 0; i < graph_get_n_pipes(truth); i++){
+    pipe_set_rough(truth_pipes[i], truth_roughness[groups[i]]);
+  }
+  int demand_groups[n_nodes];
+  for (int i = 0; i < n_nodes; i++){
+    demand_groups[i] = node_get_is_output(nodes[i]) ? 0 : -1;
+  }
+  for (int k = 0; k < n_meters; k++){
+    node_set_is_measured(nodes[meters[k]], true);
+  }
+
+  Calibration *c = calibration_new(NULL, g, n_steps);
+  calibration_set_roughness_groups(c, 2, groups);
+  calibration_set_demand_groups(c, 1, demand_groups);
+  for (int s = 0; s < n_steps; s++){
+    float demands[n_nodes], pressures[n_nodes], flowrates[n_nodes];
+    for (int i = 0; i < n_nodes; i++){
+      demands[i] = node_get_is_output(nodes[i]) ? step_scales[s] * (0.05 + 0.01 * i) : 0;
+      if (node_get_is_output(truth_nodes[i])){
+        node_set_flowrate_calculated(truth_nodes[i], truth_multiplier * demands[i]);
+      }
+      pressures[i] = -1;
+      flowrates[i] = -1;
+    }
+    graph_backpropagate_flowrate(truth);
+    graph_propagate_pressure(truth);
+    for (int k = 0; k < n_meters; k++){
+      pressures[meters[k]] = node_get_pressure_calculated(truth_nodes[meters[k]]);
+      flowrates[meters[k]] = node_get_flowrate_calculated(truth_nodes[meters[k]]);
+    }
+    calibration_set_step(c, s, demands, pressures, flowrates);
+  }
+
+  CalibrationConfig cfg;
+  calibration_config_init(&cfg);
+  calibration_run(c, &cfg);
+  _Bool recovered = true;
+  for (int k = 0; k < 2; k++){
+    recovered = recovered && fabsf(calibration_get_roughness(c, k) - truth_roughness[k]) <= 1e-3 * truth_roughness[k];
+  }
+  recovered = recovered && fabsf(calibration_get_multiplier(c, 0) - truth_multiplier) <= 1e-3 * truth_multiplier;
+  check(recovered && cfg.misfit < cfg.initial_misfit, "calibration recovery",
+        "does not bring back the roughness and demands of the readings");
+  calibration_destroy(c);
+  graph_destroy(truth);
+  graph_destroy(g);
+}
+
+//A meter reading more than the meter below is the only candidate, and the
+//nodes it feeds down to that meter share its score
+static void check_localise(){
+  int sorig[] = {0, 1, 2, 3};
+  int torig[] = {1, 2, 3, 4};
+  LeakDetect *ld = leakdetect_new(NULL, 4, sorig, torig);
+  float diameters[] = {0.1, 0.1, 0.1, 0.1};
+  float roughness[] = {0.0005, 0.0005, 0.0005, 0.0005};
+  float lengths[] = {500, 500, 500, 500};
+  leakdetect_set_pipes(ld, diameters, roughness, lengths);
+  leakdetect_set_height(ld, 0, 70);
+  leakdetect_set_measured(ld, 1, true);
+  leakdetect_set_measured(ld, 3, true);
+  float demands[] = {0, 0, 0, 0, 1e-3};
+  leakdetect_set_demands(ld, demands);
+  leakdetect_solve(ld);
+  float flowrates[] = {-1, 1.2e-3, -1, 1e-3, -1};
+  leakdetect_set_measurements(ld, flowrates);
+
+  int nodes[2];
+  float scores[2], suspicion[5];
+  int found = leakdetect_localise(ld, 1e-5, suspicion, nodes, scores, 2);
+  check(found == 1 && nodes[0] == 1 && fabsf(scores[0] - 2e-4) < 1e-7 &&
+        suspicion[0] == 0 && suspicion[2] == scores[0] && suspicion[3] == 0 && suspicion[4] == 0,
+        "localise chain", "does not single out the meter above the leak");
+  leakdetect_destroy(ld);
+
+  int corig[] = {1, 2};
+  int ctorig[] = {2, 1};
+  ld = leakdetect_new(NULL, 2, corig, ctorig);
+  float cdemands[] = {0, 0, 0};
+  check(leakdetect_set_demands(ld, cdemands) == -1, "localise no input", "sets demands without inputs");
+  leakdetect_destroy(ld);
+}
+
+//A binary tree of 127 pipes with a pipe from every odd node of the upper
+//levels to a child of its sibling, leaks at a few nodes and every fifth
+//node metered. Localising part by part agrees with the whole network.
+static void check_partition_localise(){
+  int sorig[142], torig[142];
+  int n_pipes = 0;
+  for (int i = 1; i < 128; i++){
+    sorig[n_pipes] = (i - 1) / 2;
+    torig[n_pipes++] = i;
+  }
+  for (int i = 1; i < 30; i += 2){
+    sorig[n_pipes] = i;
+    torig[n_pipes++] = 2 * i + 3;
+  }
+  Graph *g = graph_new(NULL, n_pipes, sorig, torig);
+  float diameters[142], roughness[142], lengths[142];
+  for (int i = 0; i < n_pipes; i++){
+    diameters[i] = 0.05 + 0.01 * (i % 4);
+    roughness[i] = 0.0005;
+    lengths[i] = 100;
+  }
+  graph_set_fluid_viscosity(g, 0.001);
+  graph_set_fluid_density(g, 998);
+  graph_set_friction_model(g, friction_model_churchill);
+  graph_set_diameters(g, diameters);
+  graph_set_roughness(g, roughness);
+  graph_set_lengths(g, lengths);
+
+  int n_nodes = graph_get_n_nodes(g);
+  Node **nodes = graph_get_nodes(g);
+  for (int i = 0; i < n_nodes; i++){
+    if (node_get_is_output(nodes[i])){
+      node_set_flowrate_calculated(nodes[i], 1e-4);
+    }
+    node_set_is_measured(nodes[i], i % 5 == 1);
+  }
+  node_set_height(nodes[0], 70);
+  node_set_pressure_calculated(nodes[0], node_input_compute_pressure(nodes[0]));
+  graph_backpropagate_flowrate(g);
+  graph_propagate_pressure(g);
+  node_set_leak_flowrate(nodes[40], 2e-4);
+  node_set_leak_flowrate(nodes[77], 1e-4);
+  node_set_leak_flowrate(nodes[100], 3e-4);
+  graph_add_leaks_to_measured_nodes(g);
+
+  int *meter = malloc(sizeof(int) * n_nodes);
+  float *unexplained = malloc(sizeof(float) * n_nodes);
+  float *suspicion = malloc(sizeof(float) * n_nodes);
+  graph_compute_suspect_zone(g, meter, unexplained);
+
+  Partition *pt = partition_new(NULL, g, 4);
+  int max = 4;
+  int found[4], candidates[16];
+  float scores[16];
+  int iterations = partition_localise(pt, g, NULL, 1e-6, suspicion, candidates, scores, max, found);
+
+  _Bool agree = iterations > 0;
+  for (int i = 0; i < n_nodes; i++){
+    float whole = (meter[i] != -1) ? unexplained[meter[i]] : 0;
+    agree = agree && fabsf(suspicion[i] - whole) < 1e-7;
+  }
+  int n_candidates = 0, n_expected = 0;
+  for (int q = 0; q < 4; q++){
+    for (int j = 0; j < found[q]; j++){
+      int m = candidates[q * max + j];
+      agree = agree && partition_get_part(pt, m) == q && fabsf(scores[q * max + j] - unexplained[m]) < 1e-7;
+      n_candidates++;
+    }
+  }
+  for (int i = 0; i < n_nodes; i++){
+    n_expected += (meter[i] == i && unexplained[i] > 1e-6);
+  }
+  check(agree && n_candidates == n_expected && n_expected > 0 && partition_get_n_cut_pipes(pt) > 0,
+        "localise partition", "parts disagree with the whole network");
+
+  partition_destroy(pt);
+  free(meter);
+  free(unexplained);
+  free(suspicion);
+  graph_destroy(g);
+}
+
+//With its boundaries held, the method of characteristics stays on the
+//Darcy pressures and flowrates of graph_propagate_pressure
+static void check_transient(){
+  Graph *g = leakage_network();
+  Node **nodes = graph_get_nodes(g);
+  Pipe **pipes = graph_get_pipes(g);
+  Transient *t = transient_new(NULL, g, 1000, 0.001);
+  transient_run(t, 2000);
+
+  _Bool steady = true;
+  for (int i = 0; i < graph_get_n_nodes(g); i++){
+    float p = node_get_pressure_calculated(nodes[i]);
+    steady = steady && fabsf(transient_get_node_pressure(t, i) - p) <= 1e-6 * p;
+  }
+  for (int i = 0; i < graph_get_n_pipes(g); i++){
+    float q = pipe_get_flowrate(pipes[i]);
+    steady = steady && fabsf(transient_get_pipe_flowrate_in(t, i) - q) <= 1e-6 * q &&
+             fabsf(transient_get_pipe_flowrate_out(t, i) - q) <= 1e-6 * q;
+  }
+  check(steady, "transient steady state", "drifts from the steady pressures");
+  transient_destroy(t);
+  graph_destroy(g);
+}
+
+//A leak opening at node 7 drops it by the Joukowsky head rho a q / ΣA of its
+//two pipes until the reflections come back 2L/a = 1 s later
+static void check_transient_leak(){
+  Graph *g = leakage_network();
+  Node *n = graph_get_nodes(g)[7];
+  Transient *t = transient_new(NULL, g, 1000, 0.001);
+  float q = 1e-3;
+  transient_add_leak(t, 7, q);
+  transient_run(t, 10);
+
+  float area = 0;
+  for (int j = 0; j < node_get_n_pipes_in(n); j++){
+    area += pipe_get_area(node_get_nth_pipe_in(n, j));
+  }
+  for (int j = 0; j < node_get_n_pipes_out(n); j++){
+    area += pipe_get_area(node_get_nth_pipe_out(n, j));
+  }
+  float expected = graph_get_fluid_density(g) * 1000 * q / area;
+  float drop = node_get_pressure_calculated(n) - transient_get_node_pressure(t, 7);
+  check(fabsf(drop - expected) <= 1e-3 * expected, "transient leak",
+        "does not drop the node by the Joukowsky head");
+  transient_destroy(t);
+  graph_destroy(g);
+}
+
+//Two inputs feed the demands and a leak between them, and an input without
+//a pressure is refused
+static void check_sources(){
+  int sorig[] = {0, 1, 2, 4, 1};
+  int torig[] = {1, 2, 3, 2, 5};
+  Graph *g = graph_new(NULL, 5, sorig, torig);
+  float diameters[5], roughness[5], lengths[5];
+  for (int i = 0; i < 5; i++){
+    diameters[i] = 0.1;
+    roughness[i] = 0.0005;
+    lengths[i] = 500;
+  }
+  graph_set_fluid_viscosity(g, 0.001);
+  graph_set_fluid_density(g, 998);
+  graph_set_friction_model(g, friction_model_churchill);
+  graph_set_diameters(g, diameters);
+  graph_set_roughness(g, roughness);
+  graph_set_lengths(g, lengths);
+
+  Node **nodes = graph_get_nodes(g);
+  node_set_flowrate_calculated(nodes[3], 2e-3);
+  node_set_flowrate_calculated(nodes[5], 1e-3);
+  node_set_leak_flowrate(nodes[2], 1e-3);
+  node_set_height(nodes[0], 70);
+  node_set_height(nodes[4], 60);
+  node_set_pressure_calculated(nodes[0], node_input_compute_pressure(nodes[0]));
+  node_set_pressure_calculated(nodes[4], node_input_compute_pressure(nodes[4]));
+  int iterations = graph_solve_sources(g, 50, 1e-6);
+  double supplied = node_get_flowrate_calculated(nodes[0]) + node_get_flowrate_calculated(nodes[4]);
+  check(iterations > 0 && fabs(supplied - 4e-3) < 1e-6, "sources leak",
+        "the inputs do not supply the demands and the leak");
+
+  node_set_pressure_calculated(nodes[4], -1);
+  check(graph_solve_sources(g, 50, 1e-6) == -1, "sources no pressure",
+        "solves with an input without pressure");
+  graph_destroy(g);
+}
+
+int main(){
+  //Warnings and errors only, so every check stays on one line
+  log_set_level(LOG_LEVEL_WARN);
+  check_levels();
+  check_measurement();
+  check_tree_index();
+  check_leakage();
+  check_misfit_gradient();
+  check_calibration();
+  check_localise();
+  check_partition_localise();
+  check_transient();
+  check_transient_leak();
+  check_sources();
+
+  return n_failed > 0;
+}
@@ -0,0 +1,102 @@
+//Throughput of the lodepng checksums: CRC32 and Adler-32, portable code
+//against the runtime dispatched fast path. lodepng.c is included so the
+//static routines can be timed one by one.
+//
+//Every buffer size is also checked for equal results on every path before
+//it is timed.
+
+#include "../src/lodepng.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_BYTES (64 * 1024 * 1024)
+
+static unsigned crc32_bytewise(const unsigned char *data, size_t length){
+  unsigned r = 0xffffffffu;
+  size_t i;
+  for (i = 0; i < length; i++){
+    r = lodepng_crc32_table[0][(r ^ data[i]) & 0xff] ^ (r >> 8);
+  }
+  return r ^ 0xffffffffu;
+}
+static unsigned crc32_slice8_only(const unsigned char *data, size_t length){
+  return crc32_slice8(0xffffffffu, data, length) ^ 0xffffffffu;
+}
+static unsigned adler32_portable(const unsigned char *data, size_t length){
+  return update_adler32_portable(1, data, length);
+}
+static unsigned adler32_dispatched(const unsigned char *data, size_t length){
+  return update_adler32(1, data, length);
+}
+
+typedef struct Checksum{
+  const char *name;
+  unsigned (*f)(const unsigned char *data, size_t length);
+} Checksum;
+
+static Checksum checksums[] = {
+  {"crc32 bytewise", crc32_bytewise},
+  {"crc32 slice-by-8", crc32_slice8_only},
+  {"crc32 dispatched", lodepng_crc32},
+  {"adler32 portable", adler32_portable},
+  {"adler32 dispatched", adler32_dispatched},
+};
+#define N_CHECKSUMS (sizeof(checksums) / sizeof(checksums[0]))
+
+static double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]){
+  size_t sizes[] = {64, 1024, 16384, 65536, 1 << 20};
+  size_t max_size = 1 << 20;
+  unsigned char *data = malloc(max_size + 1);
+  unsigned volatile sink = 0;
+  size_t i, s, c;
+  int failed = 0;
+
+  srand(1);
+  for (i = 0; i < max_size + 1; i++){
+    data[i] = rand();
+  }
+
+  //Every length up to 4096 and a misaligned start, against the bytewise loops
+  for (i = 0; i <= 4096; i++){
+    if (lodepng_crc32(data + 1, i) != crc32_bytewise(data + 1, i) ||
+        crc32_slice8_only(data + 1, i) != crc32_bytewise(data + 1, i) ||
+        adler32_dispatched(data + 1, i) != adler32_portable(data + 1, i)){
+      printf("Checksum mismatch at length %zu\n", i);
+      failed = 1;
+      break;
+    }
+  }
+
+  printf("simd: ");
+#ifdef LODEPNG_COMPILE_SIMD
+  printf("%s%s%s\n", LODEPNG_HAS_PCLMUL() ? "pclmul " : "",
+                     LODEPNG_HAS_SSSE3() ? "ssse3 " : "",
+                     LODEPNG_HAS_AVX2() ? "avx2" : "");
+#else
+  printf("disabled\n");
+#endif
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++){
+    size_t reps = BENCH_BYTES / sizes[s];
+    printf("%8zu B:", sizes[s]);
+    for (c = 0; c < N_CHECKSUMS; c++){
+      double t = now();
+      for (i = 0; i < reps; i++){
+        sink += checksums[c].f(data + (i & 1), sizes[s]);
+      }
+      t = now() - t;
+      printf("  %s %.0f MB/s", checksums[c].name, reps * sizes[s] / t / 1e6);
+    }
+    printf("\n");
+  }
+
+  return failed;
+}
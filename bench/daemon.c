@@ -0,0 +1,328 @@
+//Client and latency benchmark of the solver daemon (server.h).
+//
+//Unless --socket is given, a server is forked on a temporary socket. The
+//client loads a random tree network, meters one node out of
+//DAEMON_MEASURED_EVERY, sets the demands and then times:
+//  latency    one request at a time (SOLVE, LOCALISE, GET_NODES),
+//             percentiles in microseconds
+//  pipelined  queries of SET_MEASUREMENTS + SOLVE + LOCALISE sent --depth
+//             queries ahead of the responses, queries per second
+//  half_close GET_NODES until the server waits on its output, then INFO
+//             requests filling whole server reads and a shutdown of the
+//             sending side, every response must still arrive
+//Every response is checked for status and id. Results go to stdout as JSON.
+
+#define _GNU_SOURCE
+#include <server.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define DAEMON_MEASURED_EVERY 10
+
+typedef struct Client{
+  int fd;
+  uint32_t next_id;
+  char *buf;
+  size_t cap;
+} Client;
+
+static double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void die(const char *msg){
+  fprintf(stderr, "%s\n", msg);
+  exit(1);
+}
+
+static void write_all(int fd, const void *p, size_t len){
+  while (len > 0){
+    ssize_t r = write(fd, p, len);
+    if (r <= 0){
+      die("Could not write to the server");
+    }
+    p = (const char *) p + r;
+    len -= r;
+  }
+}
+static void read_all(int fd, void *p, size_t len){
+  while (len > 0){
+    ssize_t r = read(fd, p, len);
+    if (r <= 0){
+      die("Could not read from the server");
+    }
+    p = (char *) p + r;
+    len -= r;
+  }
+}
+
+static int client_connect(Client *c, const char *path){
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  memset(c, 0, sizeof(Client));
+  c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  return connect(c->fd, (struct sockaddr *) &addr, sizeof(addr));
+}
+
+//Sends without waiting, returns the request id
+static uint32_t client_send(Client *c, int op, const void *payload, size_t length){
+  ServerHeader h = {length, op, 0, c->next_id++};
+  write_all(c->fd, &h, sizeof(h));
+  write_all(c->fd, payload, length);
+  return h.id;
+}
+//Reads one response into the client buffer, returns its payload length
+static size_t client_receive(Client *c, uint32_t id){
+  ServerHeader h;
+  read_all(c->fd, &h, sizeof(h));
+  if (h.length > c->cap){
+    c->buf = realloc(c->buf, h.length);
+    c->cap = h.length;
+  }
+  read_all(c->fd, c->buf, h.length);
+  if (h.id != id || h.status != SERVER_OK){
+    fprintf(stderr, "Request %u (op %d): status %d, id %u\n", id, h.op, h.status, h.id);
+    exit(1);
+  }
+  return h.length;
+}
+static size_t client_call(Client *c, int op, const void *payload, size_t length){
+  return client_receive(c, client_send(c, op, payload, length));
+}
+
+static int compare_double(const void *a, const void *b){
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static void bench_latency(Client *c, const char *name, int op, const void *payload,
+                          size_t length, int n, _Bool last){
+  double *t = malloc(sizeof(double) * n);
+  for (int i = 0; i < n; i++){
+    double t0 = now();
+    client_call(c, op, payload, length);
+    t[i] = (now() - t0) * 1e6;
+  }
+  qsort(t, n, sizeof(double), compare_double);
+  printf("    \"%s\": {\"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f}%s\n",
+         name, t[n / 2], t[(int) (n * 0.99)], t[n - 1], last ? "" : ",");
+  free(t);
+}
+
+int main(int argc, char *argv[]){
+  //Options: --socket PATH uses a running daemon, --pipes N (default 1000),
+  //         --queries Q (default 10000), --depth D (default 16)
+  const char *path = NULL;
+  int n_pipes = 1000;
+  int n_queries = 10000;
+  int depth = 16;
+  for (int i = 1; i < argc; i++){
+    if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc){
+      path = argv[++i];
+    } else if (strcmp(argv[i], "--pipes") == 0 && i + 1 < argc){
+      n_pipes = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--queries") == 0 && i + 1 < argc){
+      n_queries = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc){
+      depth = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (n_pipes < 1 || n_queries < 1 || depth < 1){
+    die("Sizes must be positive");
+  }
+
+  char tmp_path[64];
+  pid_t server_pid = -1;
+  if (path == NULL){
+    snprintf(tmp_path, sizeof(tmp_path), "/tmp/leakdetect-bench-%d.sock", (int) getpid());
+    path = tmp_path;
+    Server *s = server_new(NULL, path, NULL);
+    if (s == NULL){
+      return 1;
+    }
+    server_pid = fork();
+    if (server_pid == 0){
+      server_run(s);
+      server_destroy(s);
+      _exit(0);
+    }
+  }
+
+  Client c;
+  if (client_connect(&c, path) != 0){
+    perror("Could not connect:");
+    return 1;
+  }
+
+  //Random tree fed from node 0
+  srand(1);
+  size_t load_len = 4 + 20 * (size_t) n_pipes;
+  char *load = malloc(load_len);
+  uint32_t n = n_pipes;
+  int32_t *orig = (int32_t *) (load + 4);
+  int32_t *dest = orig + n;
+  float *diam = (float *) (dest + n);
+  memcpy(load, &n, 4);
+  for (int i = 0; i < n_pipes; i++){
+    orig[i] = rand() % (i + 1);
+    dest[i] = i + 1;
+    diam[i] = (orig[i] == 0) ? 0.3 : 0.075 + 0.025 * (rand() % 4);
+    diam[n + i] = 0.0000015 * (1 + rand() % 100);
+    diam[2 * n + i] = 5 + rand() % 95;
+  }
+  double t0 = now();
+  client_call(&c, SERVER_OP_LOAD, load, load_len);
+  double load_time = now() - t0;
+  uint32_t n_nodes = ((uint32_t *) c.buf)[0];
+  free(load);
+
+  struct { int32_t node; float height; } height = {0, 70};
+  client_call(&c, SERVER_OP_SET_HEIGHT, &height, sizeof(height));
+
+  int32_t *measured = malloc(sizeof(int32_t) * n_nodes);
+  int n_measured = 0;
+  for (uint32_t i = 0; i < n_nodes; i += DAEMON_MEASURED_EVERY){
+    measured[n_measured++] = i;
+  }
+  client_call(&c, SERVER_OP_SET_MEASURED, measured, sizeof(int32_t) * n_measured);
+  free(measured);
+
+  float *demands = malloc(sizeof(float) * n_nodes);
+  for (uint32_t i = 0; i < n_nodes; i++){
+    demands[i] = 0.0001 * (1 + rand() % 10);
+  }
+  client_call(&c, SERVER_OP_SET_DEMANDS, demands, sizeof(float) * n_nodes);
+  client_call(&c, SERVER_OP_SOLVE, NULL, 0);
+
+  //Measurements with a leak on the first metered node below the input
+  client_call(&c, SERVER_OP_GET_NODES, NULL, 0);
+  float *flowrates = malloc(sizeof(float) * n_nodes);
+  memcpy(flowrates, c.buf + sizeof(float) * n_nodes, sizeof(float) * n_nodes);
+  if (n_nodes > DAEMON_MEASURED_EVERY){
+    flowrates[0] += 0.001;
+    flowrates[DAEMON_MEASURED_EVERY] += 0.001;
+  }
+  client_call(&c, SERVER_OP_SET_MEASUREMENTS, flowrates, sizeof(float) * n_nodes);
+  struct { float threshold; uint32_t max; } localise = {1e-6, 4};
+
+  printf("{\n");
+  printf("  \"pipes\": %d,\n", n_pipes);
+  printf("  \"nodes\": %u,\n", n_nodes);
+  printf("  \"load_ms\": %.3f,\n", load_time * 1e3);
+  printf("  \"latency\": {\n");
+  bench_latency(&c, "solve", SERVER_OP_SOLVE, NULL, 0, n_queries, false);
+  bench_latency(&c, "localise", SERVER_OP_LOCALISE, &localise, sizeof(localise), n_queries, false);
+  bench_latency(&c, "get_nodes", SERVER_OP_GET_NODES, NULL, 0, n_queries, true);
+  printf("  },\n");
+
+  //Pipelined queries, depth of them in flight
+  uint32_t *ids = malloc(sizeof(uint32_t) * 3 * depth);
+  int sent = 0;
+  int received = 0;
+  t0 = now();
+  while (received < n_queries){
+    while (sent < n_queries && sent - received < depth){
+      int slot = 3 * (sent % depth);
+      ids[slot] = client_send(&c, SERVER_OP_SET_MEASUREMENTS, flowrates, sizeof(float) * n_nodes);
+      ids[slot + 1] = client_send(&c, SERVER_OP_SOLVE, NULL, 0);
+      ids[slot + 2] = client_send(&c, SERVER_OP_LOCALISE, &localise, sizeof(localise));
+      sent++;
+    }
+    int slot = 3 * (received % depth);
+    client_receive(&c, ids[slot]);
+    client_receive(&c, ids[slot + 1]);
+    client_receive(&c, ids[slot + 2]);
+    received++;
+  }
+  double elapsed = now() - t0;
+  int k = *(int32_t *) c.buf;
+  int top = (k > 0) ? *(int32_t *) (c.buf + 4) : -1;
+  printf("  \"pipelined\": {\"depth\": %d, \"queries_per_s\": %.0f, \"us_per_query\": %.2f},\n",
+         depth, n_queries / elapsed, elapsed / n_queries * 1e6);
+  printf("  \"candidates\": %d,\n", k);
+  printf("  \"top_candidate\": %d,\n", top);
+
+  //Pipelined then half closed. The GET_NODES responses fill the socket, so
+  //the server stops reading until they are read. The rest comes in one
+  //write of a multiple of its 64 KiB reads, so it reaches the end of the
+  //stream in the same event as the last requests.
+  Client h;
+  if (client_connect(&h, path) != 0){
+    perror("Could not connect:");
+    return 1;
+  }
+  int n_get = 4 * depth;
+  for (int i = 0; i < n_get; i++){
+    client_send(&h, SERVER_OP_GET_NODES, NULL, 0);
+  }
+  usleep(100000);
+
+  size_t info_size = sizeof(ServerHeader);
+  size_t height_size = sizeof(ServerHeader) + sizeof(height);
+  size_t rest = 2 * 65536;
+  int n_height = 0;
+  while ((rest - n_height * height_size) % info_size != 0){
+    n_height++;
+  }
+  int n_info = (rest - n_height * height_size) / info_size;
+  char *burst = malloc(rest);
+  char *b = burst;
+  for (int i = 0; i < n_height + n_info; i++){
+    ServerHeader req = {0, SERVER_OP_INFO, 0, h.next_id++};
+    if (i < n_height){
+      req.length = sizeof(height);
+      req.op = SERVER_OP_SET_HEIGHT;
+    }
+    memcpy(b, &req, sizeof(req));
+    memcpy(b + sizeof(req), &height, req.length);
+    b += sizeof(req) + req.length;
+  }
+  write_all(h.fd, burst, rest);
+  shutdown(h.fd, SHUT_WR);
+  free(burst);
+
+  int n_half = n_get + n_height + n_info;
+  for (int i = 0; i < n_half; i++){
+    client_receive(&h, i);
+  }
+  char eof;
+  if (read(h.fd, &eof, 1) != 0){
+    die("The server did not close after the last response");
+  }
+  free(h.buf);
+  close(h.fd);
+  printf("  \"half_close_responses\": %d\n", n_half);
+  printf("}\n");
+
+  free(ids);
+  free(flowrates);
+  free(demands);
+  free(c.buf);
+  close(c.fd);
+
+  if (server_pid > 0){
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, NULL, 0);
+    unlink(path);
+  }
+  return 0;
+}
@@ -0,0 +1,210 @@
+//Bit identity of the lodepng SIMD paths. The same program is built twice,
+//with and without LODEPNG_NO_COMPILE_SIMD (make bench_simd_identity), and
+//every build encodes a rendered network at every width from 1 to 1023, as
+//RGB and as RGBA, with every filter strategy.
+//
+//  bench_simd_identity <own.bin> [<other.bin>]
+//
+//writes the encodings to own.bin and decodes each one back. Given the file
+//written by the other build, the bytes must be equal and this build must
+//decode them to the rendered pixels too.
+
+#include <render.h>
+#include <lodepng.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define IDENTITY_MAX_WIDTH 1023
+#define IDENTITY_HEIGHT 64
+
+//Every heuristic, then every filter type on all rows (LFS_ZERO is filter 0)
+//and the five of them in turn
+typedef struct Strategy{
+  LodePNGFilterStrategy strategy;
+  int filter;   //Row filter for LFS_PREDEFINED, -1 cycles through them
+} Strategy;
+
+static Strategy strategies[] = {
+  {LFS_ZERO, 0}, {LFS_MINSUM, 0}, {LFS_ENTROPY, 0}, {LFS_BRUTE_FORCE, 0},
+  {LFS_PREDEFINED, 1}, {LFS_PREDEFINED, 2}, {LFS_PREDEFINED, 3}, {LFS_PREDEFINED, 4},
+  {LFS_PREDEFINED, -1},
+};
+#define N_STRATEGIES (sizeof(strategies) / sizeof(strategies[0]))
+
+static LodePNGColorType colortypes[] = {LCT_RGB, LCT_RGBA};
+#define N_COLORTYPES (sizeof(colortypes) / sizeof(colortypes[0]))
+
+//Two trees joined by a cross pipe, so the layout has crossings and diagonals
+static Graph *identity_network(){
+  int sorig[] = {0, 1, 1, 2, 2, 3, 3, 4, 5, 6, 0, 11, 11, 12, 13, 14, 7, 9};
+  int torig[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 15, 16};
+  int n_pipes = sizeof(sorig) / sizeof(sorig[0]);
+  Graph *g = graph_new(NULL, n_pipes, sorig, torig);
+  float diameters[n_pipes], roughness[n_pipes], lengths[n_pipes];
+  for (int i = 0; i < n_pipes; i++){
+    diameters[i] = 0.05 + 0.01 * (i % 5);
+    roughness[i] = 0.0005;
+    lengths[i] = 100 + 40 * i;
+  }
+  graph_set_fluid_viscosity(g, 0.001);
+  graph_set_fluid_density(g, 998);
+  graph_set_friction_model(g, friction_model_churchill);
+  graph_set_diameters(g, diameters);
+  graph_set_roughness(g, roughness);
+  graph_set_lengths(g, lengths);
+
+  Node **nodes = graph_get_nodes(g);
+  for (int i = 0; i < graph_get_n_nodes(g); i++){
+    if (node_get_is_output(nodes[i])){
+      node_set_flowrate_calculated(nodes[i], 1e-4 * (1 + i % 7));
+    }
+  }
+  node_set_height(nodes[0], 70);
+  node_set_pressure_calculated(nodes[0], node_input_compute_pressure(nodes[0]));
+  node_set_is_measured(nodes[3], true);
+  graph_backpropagate_flowrate(g);
+  graph_propagate_pressure(g);
+  return g;
+}
+
+//The rendered alpha is always opaque, which would leave the fourth lane of
+//every filter at zero, so RGBA images get a pattern in it
+static void identity_render(Graph *g, int width, unsigned char *rgba, unsigned char *rgb){
+  Renderer *r = render_new(NULL, g, width, IDENTITY_HEIGHT);
+  render_set_color_mode(r, RENDER_COLOR_PRESSURE);
+  render_draw(r, g);
+  memcpy(rgba, render_get_pixels(r), (size_t) width * IDENTITY_HEIGHT * 4);
+  render_destroy(r);
+  for (int i = 0; i < width * IDENTITY_HEIGHT; i++){
+    memcpy(rgb + 3 * i, rgba + 4 * i, 3);
+    rgba[4 * i + 3] = 255 - ((i * 7) ^ rgba[4 * i]) % 64;
+  }
+}
+
+static unsigned identity_encode(unsigned char **png, size_t *png_size, const unsigned char *image,
+                                int width, LodePNGColorType colortype,
+                                Strategy strategy){
+  unsigned char predefined[IDENTITY_HEIGHT];
+  for (int y = 0; y < IDENTITY_HEIGHT; y++){
+    predefined[y] = strategy.filter < 0 ? y % 5 : strategy.filter;
+  }
+  LodePNGState state;
+  lodepng_state_init(&state);
+  lodepng_compress_settings_init_fast(&state.encoder.zlibsettings);
+  state.encoder.auto_convert = 0;
+  state.encoder.filter_strategy = strategy.strategy;
+  state.encoder.predefined_filters = predefined;
+  state.info_raw.colortype = colortype;
+  state.info_raw.bitdepth = 8;
+  state.info_png.color.colortype = colortype;
+  state.info_png.color.bitdepth = 8;
+  unsigned error = lodepng_encode(png, png_size, image, width, IDENTITY_HEIGHT, &state);
+  lodepng_state_cleanup(&state);
+  return error;
+}
+
+//0 when png decodes to exactly image
+static int identity_decode(const unsigned char *png, size_t png_size, const unsigned char *image,
+                           int width, LodePNGColorType colortype){
+  unsigned char *decoded = NULL;
+  unsigned w, h;
+  unsigned error = lodepng_decode_memory(&decoded, &w, &h, png, png_size, colortype, 8);
+  size_t size = (size_t) width * IDENTITY_HEIGHT * (colortype == LCT_RGBA ? 4 : 3);
+  int failed = error || (int) w != width || h != IDENTITY_HEIGHT || memcmp(decoded, image, size) != 0;
+  free(decoded);
+  return failed;
+}
+
+int main(int argc, char *argv[]){
+  if (argc < 2){
+    fprintf(stderr, "usage: %s <own.bin> [<other.bin>]\n", argv[0]);
+    return 2;
+  }
+  FILE *own = fopen(argv[1], "wb");
+  FILE *other = argc > 2 ? fopen(argv[2], "rb") : NULL;
+  if (own == NULL || (argc > 2 && other == NULL)){
+    fprintf(stderr, "Could not open %s\n", own == NULL ? argv[1] : argv[2]);
+    return 2;
+  }
+
+#ifdef LODEPNG_COMPILE_SIMD
+  printf("simd: on\n");
+#else
+  printf("simd: off\n");
+#endif
+
+  Graph *g = identity_network();
+  unsigned char *rgba = malloc((size_t) IDENTITY_MAX_WIDTH * IDENTITY_HEIGHT * 4);
+  unsigned char *rgb = malloc((size_t) IDENTITY_MAX_WIDTH * IDENTITY_HEIGHT * 3);
+  unsigned char *other_png = NULL;
+  size_t other_capacity = 0;
+
+  int n_cases = 0, n_failed = 0;
+  for (int width = 1; width <= IDENTITY_MAX_WIDTH; width++){
+    identity_render(g, width, rgba, rgb);
+    for (size_t c = 0; c < N_COLORTYPES; c++){
+      unsigned char *image = colortypes[c] == LCT_RGBA ? rgba : rgb;
+      for (size_t s = 0; s < N_STRATEGIES; s++){
+        unsigned char *png = NULL;
+        size_t png_size = 0;
+        const char *what = NULL;
+        if (identity_encode(&png, &png_size, image, width, colortypes[c], strategies[s])){
+          what = "does not encode";
+        } else if (identity_decode(png, png_size, image, width, colortypes[c])){
+          what = "does not decode to the image";
+        }
+
+        //Size first, then the bytes, so the files can be walked case by case
+        unsigned long long size = png_size;
+        fwrite(&size, sizeof(size), 1, own);
+        fwrite(png, 1, png_size, own);
+        if (other != NULL){
+          unsigned long long other_size = 0;
+          if (fread(&other_size, sizeof(other_size), 1, other) != 1){
+            what = "is missing from the other build";
+          } else {
+            if (other_size > other_capacity){
+              other_capacity = other_size;
+              other_png = realloc(other_png, other_capacity);
+            }
+            if (fread(other_png, 1, other_size, other) != other_size){
+              what = "is missing from the other build";
+            } else if (what == NULL && (other_size != png_size || memcmp(other_png, png, png_size) != 0)){
+              what = "differs from the other build";
+            } else if (what == NULL && identity_decode(other_png, other_size, image, width, colortypes[c])){
+              what = "of the other build does not decode to the image";
+            }
+          }
+        }
+        if (what != NULL){
+          if (n_failed < 20){
+            printf("width %d %s strategy %d filter %d %s\n", width,
+                   colortypes[c] == LCT_RGBA ? "rgba" : "rgb", (int) strategies[s].strategy,
+                   strategies[s].filter, what);
+          }
+          n_failed++;
+          if (other != NULL && strcmp(what, "is missing from the other build") == 0){
+            fclose(other);
+            other = NULL;
+          }
+        }
+        free(png);
+        n_cases++;
+      }
+    }
+  }
+
+  printf("%d encodings, %d failed\n", n_cases, n_failed);
+  free(other_png);
+  free(rgba);
+  free(rgb);
+  graph_destroy(g);
+  fclose(own);
+  if (other != NULL){
+    fclose(other);
+  }
+  return n_failed > 0;
+}
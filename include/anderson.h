@@ -0,0 +1,25 @@
+#ifndef __ANDERSON_H_
+#define __ANDERSON_H_
+
+//Anderson acceleration of fixed-point iterations x = G(x).
+//
+//Plain iteration only uses the last G(x). Anderson keeps the changes of the
+//last history iterates and of their residuals G(x) - x, and steps to the
+//combination of them whose linearised residual is smallest (least squares
+//of size history, solved by its normal equations). On contractions this
+//turns the linear convergence of plain iteration into something close to
+//a quasi-Newton method, at O(history * n) per step.
+
+typedef struct Anderson Anderson;
+
+//Iterates of n values, keeping the last history differences
+Anderson *anderson_new(Anderson **ret, int n, int history);
+void anderson_destroy(Anderson *a);
+
+//Forgets the history, the next step is a plain iteration
+void anderson_reset(Anderson *a);
+
+//Given x and G(x), writes the next iterate to x
+void anderson_step(Anderson *a, double *x, const double *gx);
+
+#endif //__ANDERSON_H_
@@ -0,0 +1,77 @@
+#ifndef __CALIBRATE_H_
+#define __CALIBRATE_H_
+
+#include <graph.h>
+#include <lbfgsb.h>
+
+//Roughness and demand calibration against historical measurements.
+//
+//Pipes are put in roughness groups that share one roughness, and output
+//nodes in demand groups that share one multiplier of their demand. Every
+//time step holds the demand of every output and what the meters read.
+//calibration_run fits the groups to the readings by minimising the misfit
+//of graph_compute_misfit_gradient averaged over every step, with
+//lbfgsb_minimize inside the configured bounds.
+//
+//One evaluation solves every step forwards and through the adjoint, so its
+//cost does not depend on the number of groups. The steps are split in
+//batches between the threads of the pool, each working on its own copy of
+//the network. Every step keeps its own misfit and gradient, added up in
+//step order afterwards, so the result does not depend on the number of
+//threads.
+//
+//The meters are the measured nodes of the network that are not inputs.
+//Everything else (geometry, fluid, friction model, input pressures) is
+//taken from the network as it is when calibration_new is called.
+
+typedef struct CalibrationConfig{
+  LbfgsbConfig optimizer;
+  float pressure_sigma;     //Pa, expected error of a pressure reading
+  float flowrate_sigma;     //m³/s, same for flowrate
+  float min_roughness;      //m
+  float max_roughness;
+  float min_multiplier;
+  float max_multiplier;
+
+  //Filled by calibration_run
+  double initial_misfit;    //Per step
+  double misfit;
+  int iterations;
+  int evaluations;
+  double elapsed;           //Seconds
+} CalibrationConfig;
+
+//Meters good to 1000 Pa and 0.0001 m³/s, roughness 0.001 to 10 mm,
+//multipliers 0.1 to 10
+void calibration_config_init(CalibrationConfig *c);
+
+typedef struct Calibration Calibration;
+
+Calibration *calibration_new(Calibration **ret, Graph *g, int n_steps);
+void calibration_destroy(Calibration *c);
+
+//Steps are evaluated in parallel on the pool (defaults to the graph pool)
+void calibration_set_thread_pool(Calibration *c, ThreadPool *tp);
+
+//Group of every pipe (by pipe ID) or node (by node ID, only outputs count),
+//-1 keeps it as it is. Groups start at the mean roughness of their pipes
+//and at a multiplier of 1. Return -1 if a group is out of range.
+int calibration_set_roughness_groups(Calibration *c, int n_groups, const int *groups);
+int calibration_set_demand_groups(Calibration *c, int n_groups, const int *groups);
+
+//Data of one step, by node ID: the demand of every output, and the
+//pressure and flowrate of every meter (negative for no reading). NULL
+//arrays keep what the step has, which starts as the demands of the network
+//and no readings. Returns -1 if the step is out of range.
+int calibration_set_step(Calibration *c, int step, const float *demands,
+                         const float *pressures, const float *flowrates);
+
+//Fits every group. Returns the lbfgsb result.
+int calibration_run(Calibration *c, CalibrationConfig *cfg);
+
+float calibration_get_roughness(Calibration *c, int group);
+float calibration_get_multiplier(Calibration *c, int group);
+//Writes the roughness of every grouped pipe to g (the same network or a copy)
+void calibration_apply(Calibration *c, Graph *g);
+
+#endif //__CALIBRATE_H_
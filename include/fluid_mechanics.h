@@ -20,6 +20,38 @@ float friction_model_stokes(float diam,
                             float visc,
                             float vel);
 
+//Friction model derivatives: return the friction factor and write its
+//partial derivatives with respect to diameter, roughness and velocity
+typedef float (*FrictionModelDerivatives)(float diam,
+                                          float rough,
+                                          float dens,
+                                          float visc,
+                                          float vel,
+                                          float *d_diam,
+                                          float *d_rough,
+                                          float *d_vel);
+
+float friction_model_churchill_derivatives(float diam,
+                                           float rough,
+                                           float dens,
+                                           float visc,
+                                           float vel,
+                                           float *d_diam,
+                                           float *d_rough,
+                                           float *d_vel);
+
+float friction_model_stokes_derivatives(float diam,
+                                        float rough,
+                                        float dens,
+                                        float visc,
+                                        float vel,
+                                        float *d_diam,
+                                        float *d_rough,
+                                        float *d_vel);
+
+//Derivatives of one of the models above, NULL for any other
+FrictionModelDerivatives friction_model_get_derivatives(FrictionModel fm);
+
 
 float compute_reynolds_number(float u, float d, float l, float v);
 
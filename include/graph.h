@@ -1,4 +1,9 @@
+#ifndef __GRAPH_H_
+#define __GRAPH_H_
+
 #include <fluid_mechanics.h>
+#include <thread_pool.h>
+#include <scenario.h>
 
 typedef struct Pipe Pipe;
 typedef struct Node Node;
@@ -24,6 +29,10 @@ void leaks_destroy(Leaks *l);
 void graph_destroy(Graph *g);
 
 //IO
+//Writes the diagnostic diagram in DOT format. graph_save_dot writes to
+//stdout when filename is NULL or "-". graph_plot pipes it to dot (test.png).
+void graph_write_dot(Graph *g, int fd);
+int graph_save_dot(Graph *g, const char *filename);
 void graph_plot(Graph *g);
 
 //Node functions
@@ -53,9 +62,56 @@ float node_input_compute_pressure(Node *n);
 void node_set_is_measured(Node *n, _Bool measured);
 _Bool node_get_is_measured(Node *n);
 
+void node_set_leak_flowrate(Node *n, float f);
+float node_get_leak_flowrate(Node *n);
+_Bool node_get_has_leak(Node *n);
+
+//Emitter: the node leaks coefficient * p^exponent m³/s, p the pressure above
+//atmospheric in Pa (exponent 0.5 for an orifice, up to about 1.5 for
+//plastic pipes that open with pressure). Its leak flowrate is set by
+//graph_solve_leakage. A coefficient of 0 removes it.
+void node_set_emitter(Node *n, float coefficient, float exponent);
+float node_get_emitter_coefficient(Node *n);
+float node_get_emitter_exponent(Node *n);
+//Background leakage of the pipes in, set by graph_solve_leakage
+float node_get_background_flowrate(Node *n);
+
+_Bool node_get_is_input(Node *n);
+_Bool node_get_is_output(Node *n);
+_Bool node_get_is_junction(Node *n);
+_Bool node_get_is_connected(Node *n);
+
+float node_get_fluid_density(Node *n);
+
+int node_get_n_pipes_in(Node *n);
+int node_get_n_pipes_out(Node *n);
+Pipe *node_get_nth_pipe_in(Node *n, int i);
+Pipe *node_get_nth_pipe_out(Node *n, int i);
+
 float node_measurement_get_diff(Node *n);
+//Walks down from n and marks the nodes it passes, so calls on one graph must
+//not overlap
 float node_measurement_get_successors_diff(Node *n);
 
+//Both of the above for every node ID in one pass backwards over the levels,
+//without allocating. A measured node reached along several paths counts
+//with the share of its flow that comes through the node, split by pipe
+//area as graph_add_leaks_to_measured_nodes splits leaks, so every leak is
+//seen once.
+void graph_measurement_get_diffs(Graph *g, float *diff, float *successors_diff);
+//Nodes a leak can be in, the faulty region of the diagnostic diagram.
+//Measured nodes whose residual the meters below explain are left out, and
+//so is everything at or below a meter that reads its calculated flowrate.
+//Writes the connected nodes of the zone (up to n_nodes IDs) and returns how
+//many. O(V+E).
+int graph_get_suspect_zone(Graph *g, int *nodes);
+//The same pass for callers scoring the zone themselves, both arrays of
+//n_nodes or NULL. meter gets the measured node every node sits below,
+//following its first pipe in, or -1 above every meter and for unleveled
+//nodes. unexplained gets the part of the difference of every read meter
+//that the meters below do not see, and 0 for every other node.
+void graph_compute_suspect_zone(Graph *g, int *meter, float *unexplained);
+
 //Pipe functions
 void pipe_set_geometry(Pipe *p, int g);
 int pipe_set_diam(Pipe *p, float d);
@@ -64,13 +120,36 @@ int pipe_set_sides(Pipe *p, float s1, float s2);
 int pipe_set_custom_sides(Pipe *p, float *s);
 void pipe_set_rough(Pipe *p, float r);
 void pipe_set_length(Pipe *p, float l);
+//Leaks coefficient * length * p^exponent m³/s along the pipe, p its mean
+//pressure above atmospheric, lumped at its dest node. 0 removes it.
+void pipe_set_background_leakage(Pipe *p, float coefficient, float exponent);
+float pipe_get_background_coefficient(Pipe *p);
+float pipe_get_background_exponent(Pipe *p);
 void pipe_set_id(Pipe *p, int);
 void pipe_print(Pipe *p);
 
+void pipe_set_flowrate(Pipe *p, float f);
+void pipe_set_fluid_velocity(Pipe *p, float v);
+void pipe_set_pressure_in(Pipe *p, float pr);
+void pipe_set_pressure_out(Pipe *p, float pr);
 void pipe_set_friction(Pipe *p, float fd);
 float pipe_get_friction(Pipe *p);
 float pipe_compute_friction(Pipe *p, FrictionModel fm);
 
+int pipe_get_id(Pipe *p);
+Node *pipe_get_orig(Pipe *p);
+Node *pipe_get_dest(Pipe *p);
+float pipe_get_length(Pipe *p);
+float pipe_get_diam(Pipe *p);
+float pipe_get_area(Pipe *p);
+//Share of the flow into the dest of p that comes through p
+float pipe_get_share_in(Pipe *p);
+float pipe_get_rough(Pipe *p);
+float pipe_get_flowrate(Pipe *p);
+float pipe_get_fluid_velocity(Pipe *p);
+float pipe_get_pressure_in(Pipe *p);
+float pipe_get_pressure_out(Pipe *p);
+
 //Graph functions
 void graph_set_diameters(Graph *g, float *d);
 void graph_set_roughness(Graph *g, float *r);
@@ -85,9 +164,18 @@ void graph_print_input_nodes(Graph *g);
 void graph_print_output_nodes(Graph *g);
 void graph_print_leak_nodes(Graph *g);
 
+//Levels: the longest path from the inputs to every node. They are built
+//once in O(V+E) and kept until a node is deleted, and propagation runs
+//level by level over them. Nodes not reachable from an input have level -1.
+//Levels are stored one after another, so the graph_get_n_leveled_nodes IDs
+//from graph_get_level_nodes(g, 0) on are a topological order.
 void graph_calculate_geometry(Graph *g);
-int graph_get_depth(Graph *);
-int graph_get_width(Graph *);
+int graph_get_depth(Graph *);   //Number of levels
+int graph_get_width(Graph *);   //Nodes in the largest level
+int graph_get_node_level(Graph *g, int node);
+int graph_get_level_size(Graph *g, int level);
+int *graph_get_level_nodes(Graph *g, int level);
+int graph_get_n_leveled_nodes(Graph *g);
 
 void graph_cut_node(Graph *g, int i);
 Node *graph_del_node(Graph *g, int i);
@@ -100,6 +188,7 @@ Node **graph_get_nodes(Graph *g);
 Pipe **graph_get_pipes(Graph *g);
 
 int graph_get_n_nodes(Graph *g);
+int graph_get_n_pipes(Graph *g);
 int graph_get_n_disconnected_nodes(Graph *g);
 int graph_get_n_connected_nodes(Graph *g);
 int graph_get_n_junction_nodes(Graph *g);
@@ -118,6 +207,8 @@ Node *graph_get_nth_leak_node(Graph *g, int);
 
 float graph_get_total_outflow(Graph *g);
 float graph_get_total_calculated_outflow(Graph *g);
+//Splits the total outflow evenly between the inputs, only right with a
+//single input (see graph_solve_sources)
 void graph_set_inflow_evenly(Graph *g);
 void graph_add_leaks_to_inflow(Graph *g);
 void graph_add_leaks_to_measured_nodes(Graph *g);
@@ -135,15 +226,71 @@ void graph_set_fluid_density(Graph *g, float d);
 float graph_get_fluid_viscosity(Graph *g);
 float graph_get_fluid_density(Graph *g);
 void graph_set_friction_model(Graph *g, FrictionModel fm);
+FrictionModel graph_get_friction_model(Graph *g);
+
+//Propagation runs level by level on the pool when set (NULL = serial)
+void graph_set_thread_pool(Graph *g, ThreadPool *tp);
+ThreadPool *graph_get_thread_pool(Graph *g);
 
 //Propagates flowrate and velocity
 void graph_backpropagate_flowrate(Graph *g);
 //Propagates pressure and computes friction
 void graph_propagate_pressure(Graph *g);
 
+//Sensor misfit of the solved network,
+//  pressure_weight/2 Σ (pressure calculated - measured)²
+//  + flowrate_weight/2 Σ (flowrate calculated - measured)²
+//over the measured nodes that are not inputs (outputs only count for
+//pressure), and its gradient with respect to every pipe roughness and
+//diameter (by pipe ID) and every output demand (flowrate_calculated, by node
+//ID, 0 for other nodes). NULL arrays are skipped. Adjoint method: costs
+//about one more propagation, both above must have been run first.
+float graph_compute_misfit_gradient(Graph *g, float pressure_weight, float flowrate_weight,
+                                    float *d_rough, float *d_diam, float *d_demand);
+
+//Solves a network with several inputs: every input holds its pressure
+//(pressure_calculated, see node_input_compute_pressure) and how much each
+//one supplies follows from the head losses, as do the flowrates of loops.
+//Newton steps on pressures and flowrates together (global gradient), each
+//a conjugate gradient solve preconditioned by the heaviest spanning tree of
+//the network, until the flowrates change less than tolerance relative to
+//their total. Sets the pressures of every node, the flowrate, friction and
+//pressures of every pipe (flowrate and velocity negative when the water
+//runs from dest to orig), what goes through every junction and what every
+//input supplies (negative when it is being filled). Outputs keep their
+//demand. Every node also loses its leak and background leakage at the
+//flowrate they hold: emitters and background leakage are not re-evaluated
+//at the new pressures (graph_solve_leakage does that on one input).
+//Returns the number of iterations, -1 if max_iterations were not enough or
+//an input has no pressure.
+int graph_solve_sources(Graph *g, int max_iterations, float tolerance);
+//After graph_solve_sources, the fraction of the water of every node that
+//comes from each input: shares[node ID * n + k] for the k-th input (the
+//graph_get_nth_input_node order), n the number of inputs, which is
+//returned. shares holds n_nodes * n, all 0 for nodes no water reaches. All
+//inputs in one pass in flow order.
+int graph_get_source_shares(Graph *g, float *shares);
+
 Leaks *graph_generate_random_leaks(Graph *g, int num);
+//Replaces the leaks with scenario i of c over the junction nodes
+Leaks *graph_generate_scenario_leaks(Graph *g, const ScenarioConfig *c, long i);
 void graph_print_leaks_data(Graph *g);
 
+//Solves the leak flowrates of the emitters and pipe background leakage
+//together with the pressures that drive them, other leaks keeping theirs.
+//Newton steps with Anderson acceleration, one forward solve and O(V) extra
+//per iteration, until no leak is off its root by more than tolerance m³/s
+//(keep it above the float precision of the pressures, about 1e-7 of the
+//leaks). Leaks stop at atmospheric pressure. Emitters far larger than
+//their pipes leave nodes so close to it that float pressures cannot
+//resolve them, and may not converge. The meters are then set to what they
+//read in the leaking network (pressure and flowrate measured), while the
+//calculated values are left those of the network without leaks. Returns
+//the number of iterations, -1 if max_iterations were not enough.
+int graph_solve_leakage(Graph *g, int max_iterations, float tolerance);
+
 _Bool graph_has_leaks(Graph *g);
 Leaks *graph_find_leaks(Graph *g);
 Graph *graph_optimize_naive(Graph *g);
+
+#endif //__GRAPH_H_
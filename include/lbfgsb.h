@@ -0,0 +1,42 @@
+#ifndef __LBFGSB_H_
+#define __LBFGSB_H_
+
+//Bound constrained limited-memory quasi-Newton minimiser (L-BFGS-B).
+//
+//Keeps the last memory steps and gradient changes as an implicit inverse
+//Hessian (two-loop recursion), so every iteration is O(memory * n) on top of
+//the function evaluations. Bounds are handled by projection: variables held
+//at a bound by the gradient are fixed for the iteration, the quasi-Newton
+//direction is computed over the free ones, and the line search backtracks
+//along the projected path until the Armijo condition holds. Curvature pairs
+//with s·y <= 0 are dropped, so the implicit Hessian stays positive definite.
+
+//Results
+#define LBFGSB_CONVERGED_GRADIENT 0     //Projected gradient below tolerance
+#define LBFGSB_CONVERGED_FUNCTION 1     //Relative decrease below tolerance
+#define LBFGSB_MAX_ITERATIONS 2
+#define LBFGSB_LINE_SEARCH_FAILED 3
+#define LBFGSB_ERROR -1                 //Bad arguments or non finite f
+
+typedef struct LbfgsbConfig{
+  int memory;                   //Correction pairs kept
+  int max_iterations;
+  int max_line_search;          //Halvings of the step per iteration
+  double gradient_tolerance;    //Largest projected gradient component
+  double function_tolerance;    //(f_old - f) / max(|f_old|, |f|, 1)
+} LbfgsbConfig;
+
+//Memory 8, 200 iterations, 20 halvings, tolerances 1e-5 and 1e-9
+void lbfgsb_config_init(LbfgsbConfig *c);
+
+//Returns f(x) and writes its gradient
+typedef double (*LbfgsbFunction)(void *arg, const double *x, double *grad);
+
+//Minimises f from x (moved into the bounds first) and leaves the result in
+//x. lower and upper may be NULL for no bounds, their entries may be
+//-INFINITY and INFINITY. fx and iterations may be NULL. Returns one of the
+//results above.
+int lbfgsb_minimize(const LbfgsbConfig *c, int n, double *x, const double *lower, const double *upper,
+                    LbfgsbFunction f, void *arg, double *fx, int *iterations);
+
+#endif //__LBFGSB_H_
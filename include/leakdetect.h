@@ -0,0 +1,69 @@
+#ifndef __LEAKDETECT_H_
+#define __LEAKDETECT_H_
+
+#include <graph.h>
+
+//Embedding API of libleakdetect.
+//
+//A LeakDetect handle owns one network. The topology, its levels
+//and every scratch buffer are built by leakdetect_new, so after the first
+//leakdetect_solve the per-query calls (set demands and measurements, solve,
+//localise, read the state) do not allocate and only write to the buffers
+//the caller passes. A handle is not thread safe: use one per thread, or
+//give it a thread pool to parallelise each solve.
+//
+//Node arrays hold one entry per node ID (leakdetect_get_n_nodes), pipe
+//arrays one per pipe in the order given to leakdetect_new. Functions taking
+//a node return -1 when it is out of range and 0 otherwise.
+
+typedef struct LeakDetect LeakDetect;
+
+//Pipe i goes from node sorig[i] to node torig[i]. Defaults to water at 20ºC
+//and the Churchill friction model.
+LeakDetect *leakdetect_new(LeakDetect **ret, int n_pipes, const int *sorig, const int *torig);
+void leakdetect_destroy(LeakDetect *ld);
+
+int leakdetect_get_n_nodes(LeakDetect *ld);
+int leakdetect_get_n_pipes(LeakDetect *ld);
+
+//For everything the handle does not wrap. Changing the topology through it
+//is not supported.
+Graph *leakdetect_get_graph(LeakDetect *ld);
+
+//Network properties, set once
+void leakdetect_set_fluid(LeakDetect *ld, float viscosity, float density);
+void leakdetect_set_friction_model(LeakDetect *ld, FrictionModel fm);
+void leakdetect_set_thread_pool(LeakDetect *ld, ThreadPool *tp);
+//Any of the arrays may be NULL to keep the current values
+void leakdetect_set_pipes(LeakDetect *ld, const float *diameters,
+                          const float *roughness, const float *lengths);
+int leakdetect_set_height(LeakDetect *ld, int node, float height);
+int leakdetect_set_measured(LeakDetect *ld, int node, _Bool measured);
+
+//Outflow of every output node (other entries are ignored). The inputs share
+//the total evenly. Returns -1, leaving the inputs as they were, when the
+//network has none.
+int leakdetect_set_demands(LeakDetect *ld, const float *demands);
+
+//Flowrate read at every measured node (other entries are ignored). A
+//negative value marks a meter without reading.
+void leakdetect_set_measurements(LeakDetect *ld, const float *flowrates);
+
+//Propagates flowrates from the outputs and pressures from the inputs
+void leakdetect_solve(LeakDetect *ld);
+
+//Calculated state. Any buffer may be NULL. Removed nodes are NaN.
+void leakdetect_get_node_state(LeakDetect *ld, float *pressure, float *flowrate);
+void leakdetect_get_pipe_state(LeakDetect *ld, float *flowrate, float *velocity,
+                               float *pressure_in, float *pressure_out);
+
+//Compares the measurements with the last solve. Every measured node gets
+//the flowrate it sees that the measured nodes below do not explain, and
+//every node inherits the value of the measured node that feeds it.
+//suspicion (per node) may be NULL. Up to max measured nodes whose
+//unexplained flowrate exceeds threshold are written to nodes and scores,
+//largest first. Returns how many were written.
+int leakdetect_localise(LeakDetect *ld, float threshold, float *suspicion,
+                        int *nodes, float *scores, int max);
+
+#endif //__LEAKDETECT_H_
@@ -74,6 +74,18 @@ source files with custom allocators.*/
 #ifndef LODEPNG_NO_COMPILE_ALLOCATORS
 #define LODEPNG_COMPILE_ALLOCATORS
 #endif
+/*SSE2/AVX2 scanline filtering and unfiltering, PCLMULQDQ CRC32 and SSSE3/AVX2
+Adler-32 on x86-64 with GCC or Clang. The output is identical to the portable
+code, the instruction sets beyond SSE2 are detected at runtime.*/
+#ifndef LODEPNG_NO_COMPILE_SIMD
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LODEPNG_COMPILE_SIMD
+#endif
+#endif
+/*parallel deflate with pthreads, see numthreads in LodePNGCompressSettings*/
+#ifndef LODEPNG_NO_COMPILE_THREADS
+#define LODEPNG_COMPILE_THREADS
+#endif
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -290,6 +302,15 @@ struct LodePNGCompressSettings /*deflate = compress*/
   unsigned minmatch; /*mininum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 0*/
   unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 128*/
   unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: true*/
+  unsigned maxchainlength; /*hash chain positions tried per byte, 0 derives it from windowsize. Default: 0*/
+
+  /*Parallel deflate (pigz style). With numthreads > 1 the input is split in
+  chunks of chunksize bytes compressed concurrently. Every chunk is primed with
+  the windowsize bytes before it, so matches still reach back into the previous
+  chunk, and ends with an empty stored block to byte align it. The chunks are
+  then concatenated into one valid deflate stream. Default: 0 (single thread)*/
+  unsigned numthreads;
+  unsigned chunksize; /*0 uses 131072*/
 
   /*use custom zlib encoder instead of built in one (default: null)*/
   unsigned (*custom_zlib)(unsigned char**, size_t*,
@@ -307,6 +328,8 @@ struct LodePNGCompressSettings /*deflate = compress*/
 
 extern const LodePNGCompressSettings lodepng_default_compress_settings;
 void lodepng_compress_settings_init(LodePNGCompressSettings* settings);
+/*fast level: single hash probe per byte, no lazy matching, 32K window*/
+void lodepng_compress_settings_init_fast(LodePNGCompressSettings* settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_PNG
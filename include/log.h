@@ -0,0 +1,86 @@
+#ifndef __LOG_H_
+#define __LOG_H_
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+//Leveled asynchronous logging for the library.
+//
+//Messages are formatted by the caller into a slot of a fixed ring buffer
+//(lock-free, many producers and one consumer) and written to the sink by a
+//background thread, so logging threads never block on I/O. When the ring is
+//full messages are dropped and counted rather than waiting.
+//
+//Levels above LOG_COMPILE_LEVEL are removed by the preprocessor: their
+//arguments are not even evaluated. The default keeps up to LOG_LEVEL_INFO,
+//so the per-node and per-pipe messages in hot loops cost nothing. The debug
+//build compiles everything in. The runtime level (log_set_level or the
+//LEAK_LOG_LEVEL environment variable, a number or a level name) filters
+//what is compiled in.
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+//Ring slots and the longest message kept (longer ones are truncated)
+#define LOG_RING_SIZE 4096
+#define LOG_MESSAGE_SIZE 240
+
+void log_set_level(int level);
+int log_get_level();
+
+//Defaults to stderr. The sink is not closed by the logger.
+void log_set_sink(FILE *f);
+
+//Blocks until every message queued so far is written
+void log_flush();
+
+//Messages lost because the ring was full
+unsigned long log_get_dropped();
+
+//Use the macros below, which check both levels first
+void log_write(int level, const char *file, int line, const char *fmt, ...)
+  __attribute__((format(printf, 4, 5)));
+
+extern atomic_int log_level;
+
+#define LOG_AT(level, ...) \
+  do { \
+    if ((level) <= atomic_load_explicit(&log_level, memory_order_relaxed)){ \
+      log_write((level), __FILE__, __LINE__, __VA_ARGS__); \
+    } \
+  } while (0)
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { } while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) do { } while (0)
+#endif
+
+#endif //__LOG_H_
@@ -0,0 +1,51 @@
+#ifndef __PARTITION_H_
+#define __PARTITION_H_
+
+#include <graph.h>
+#include <thread_pool.h>
+
+//District metered areas.
+//
+//partition_new splits the network into k balanced parts joined by as few
+//pipes as possible. Parts are found by multilevel recursive bisection:
+//heavy edge matching coarsens the network, the coarsest graph is bisected by
+//greedy growing and every level is refined with Fiduccia-Mattheyses moves
+//on the way back up.
+//
+//partition_solve builds one subgraph per part, where every cut pipe is kept
+//on both sides and ends in a ghost node: an output on the upstream side and
+//an input on the downstream side. Parts are solved concurrently and the
+//ghost demands and pressures are exchanged until they stop changing.
+//
+//partition_localise runs leak localisation on the same subgraphs: what the
+//meters of a part see through a cut pipe goes up to the ghost output, and
+//the meter above a cut pipe goes down to the ghost input.
+
+typedef struct Partition Partition;
+
+Partition *partition_new(Partition **ret, Graph *g, int k);
+void partition_destroy(Partition *pt);
+
+int partition_get_k(Partition *pt);
+int partition_get_part(Partition *pt, int node);
+int partition_get_n_nodes(Partition *pt, int part);
+int partition_get_nth_node(Partition *pt, int part, int i);
+int partition_get_n_cut_pipes(Partition *pt);
+int partition_get_nth_cut_pipe(Partition *pt, int i);
+void partition_print(Partition *pt);
+
+//Solves flowrates and pressures of g part by part. tp may be NULL.
+//Returns the number of coupling iterations, -1 if they did not converge.
+int partition_solve(Partition *pt, Graph *g, ThreadPool *tp);
+
+//Leak localisation of g part by part, once g is solved and carries its
+//measurements. suspicion (per node, may be NULL) and the scores are those of
+//leakdetect_localise over the whole network, except on cycles and below
+//removed nodes, which a part levels on its own. Up to max meters of part q
+//whose unexplained flowrate exceeds threshold go to nodes and scores from
+//q * max on, largest first, and found[q] (k entries) tells how many.
+//Returns the number of coupling iterations, -1 if they did not converge.
+int partition_localise(Partition *pt, Graph *g, ThreadPool *tp, float threshold,
+                       float *suspicion, int *nodes, float *scores, int max, int *found);
+
+#endif //__PARTITION_H_
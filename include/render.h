@@ -0,0 +1,52 @@
+#ifndef __RENDER_H_
+#define __RENDER_H_
+
+#include <graph.h>
+
+//Native raster diagrams of the network, without running graphviz.
+//
+//Nodes are placed once when the renderer is created: either from the given
+//coordinates (EPANET [COORDINATES], y pointing up) or with a layered layout
+//where the column is the node depth from the inputs and nodes inside every
+//column are ordered by the mean row of their parents. render_draw only
+//rasterises, so a dashboard can redraw the same renderer every few seconds.
+//
+//Pipes are coloured blue (low) to red (high) by the selected quantity.
+
+#define RENDER_COLOR_PRESSURE 0
+#define RENDER_COLOR_FLOWRATE 1
+#define RENDER_COLOR_SUSPICION 2
+
+typedef struct Renderer Renderer;
+
+Renderer *render_new(Renderer **ret, Graph *g, int width, int height);
+void render_destroy(Renderer *r);
+
+//x and y hold one coordinate per node. NULL goes back to the layered layout.
+void render_set_coordinates(Renderer *r, Graph *g, float *x, float *y);
+void render_set_color_mode(Renderer *r, int mode);
+void render_set_line_width(Renderer *r, int width);
+
+//Suspicion per node in any scale, copied. NULL computes it from the
+//measured nodes: the flowrate difference not explained by the measured
+//nodes below, spread over the area each one meters.
+void render_set_suspicion(Renderer *r, float *suspicion);
+
+//The pixel buffer is allocated by the first render_draw, so a renderer can
+//also be used for its layout alone.
+void render_draw(Renderer *r, Graph *g);
+unsigned char *render_get_pixels(Renderer *r);   //RGBA, width * height * 4
+int render_get_width(Renderer *r);
+int render_get_height(Renderer *r);
+
+//Node position in pixels, NaN for removed or unreachable nodes
+float render_get_node_x(Renderer *r, int node);
+float render_get_node_y(Renderer *r, int node);
+
+//RGB of every pipe (3 * n_pipes bytes) in the current color mode
+void render_compute_pipe_colors(Renderer *r, Graph *g, unsigned char *rgb);
+
+//Returns 0 on success or the lodepng error code
+int render_save_png(Renderer *r, const char *filename);
+
+#endif //__RENDER_H_
@@ -0,0 +1,59 @@
+#ifndef __SCENARIO_H_
+#define __SCENARIO_H_
+
+#include <stdint.h>
+
+//Reproducible leak scenarios.
+//
+//Random numbers come from Philox4x32-10, a counter-based generator: the
+//output is a keyed hash of a counter, so any block of any stream can be
+//computed directly. Scenario i draws from the stream keyed by the seed with
+//i in the counter, which makes it a pure function of (config, candidates,
+//i). Workers can generate any scenarios in any order on any thread without
+//sharing state, and always get the same leaks.
+//
+//The leak nodes of a scenario are distinct candidates sampled with Floyd's
+//algorithm, one draw per leak whatever the number of candidates.
+
+//Number of leaks
+#define SCENARIO_SIZE_FIXED 0           //max_leaks
+#define SCENARIO_SIZE_UNIFORM 1         //min_leaks to max_leaks
+#define SCENARIO_SIZE_POISSON 2         //Mean mean_leaks, clamped to min..max
+
+//Leak flowrates
+#define SCENARIO_FLOW_UNIFORM 0         //min_flowrate to max_flowrate
+#define SCENARIO_FLOW_LOG_UNIFORM 1     //Same, uniform in log scale (min > 0)
+#define SCENARIO_FLOW_EXPONENTIAL 2     //min_flowrate plus an exponential of mean
+                                        //mean_flowrate - min_flowrate, clamped to max
+
+typedef struct ScenarioConfig{
+  uint64_t seed;
+
+  int size_distribution;
+  int min_leaks;
+  int max_leaks;
+  float mean_leaks;
+
+  int flow_distribution;
+  float min_flowrate;     //m³/s
+  float max_flowrate;
+  float mean_flowrate;
+} ScenarioConfig;
+
+//One leak of up to 0.01 m³/s, uniform
+void scenario_config_init(ScenarioConfig *c);
+
+//Philox4x32-10 block counter of key
+void scenario_philox(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]);
+
+//Writes the leaks of scenario i, at most max_leaks and never more than
+//n_candidates, into nodes (entries of candidates, in candidate order) and
+//flowrates. Returns how many there are.
+int scenario_generate(const ScenarioConfig *c, const int *candidates, int n_candidates,
+                      long i, int *nodes, float *flowrates);
+
+//n standard normal draws for scenario i, independent of its leaks. Every
+//stream number gives a different set.
+void scenario_generate_noise(const ScenarioConfig *c, long i, int stream, int n, float *out);
+
+#endif //__SCENARIO_H_
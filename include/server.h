@@ -0,0 +1,79 @@
+#ifndef __SERVER_H_
+#define __SERVER_H_
+
+#include <stdint.h>
+
+#include <leakdetect.h>
+
+//Resident solver serving a binary protocol over a Unix domain socket.
+//
+//One thread runs an epoll loop over the listening socket and every client.
+//Clients may pipeline: every complete request in the input buffer is
+//handled in order and the responses are queued into one write. A client
+//may shut down its sending side after the last request, every complete one
+//is answered before the server closes. Requests from all clients go to the
+//same LeakDetect handle, one at a time.
+//
+//Every message is a ServerHeader followed by length bytes of payload in
+//host byte order. The response copies op and id. Arrays are float32 unless
+//noted. The n in a payload is the node count or pipe count of the network
+//as reported by SERVER_OP_INFO.
+//
+//  op            request payload                      response payload
+//  INFO          -                                    u32 n_nodes, u32 n_pipes
+//  LOAD          u32 n_pipes, i32 orig[n], i32 dest[n],
+//                diam[n], rough[n], length[n]         as INFO
+//  SET_HEIGHT    i32 node, height                     -
+//  SET_MEASURED  i32 node[] (all that are measured)   -
+//  SET_DEMANDS   demand[n_nodes]                      -
+//  SET_MEASUREMENTS flowrate[n_nodes]                 -
+//  SOLVE         -                                    -
+//  LOCALISE      threshold, u32 max                   u32 k, {i32 node, score}[k]
+//  GET_NODES     -                                    pressure[n_nodes], flowrate[n_nodes]
+//  GET_PIPES     -                                    flowrate[n_pipes], velocity[n_pipes],
+//                                                     pressure_in[n_pipes], pressure_out[n_pipes]
+//
+//SET_MEASURED unmarks every node not listed. LOAD replaces the network, so
+//heights, measured nodes and demands must be sent again.
+
+#define SERVER_OP_INFO 0
+#define SERVER_OP_LOAD 1
+#define SERVER_OP_SET_HEIGHT 2
+#define SERVER_OP_SET_MEASURED 3
+#define SERVER_OP_SET_DEMANDS 4
+#define SERVER_OP_SET_MEASUREMENTS 5
+#define SERVER_OP_SOLVE 6
+#define SERVER_OP_LOCALISE 7
+#define SERVER_OP_GET_NODES 8
+#define SERVER_OP_GET_PIPES 9
+
+//Response status
+#define SERVER_OK 0
+#define SERVER_ERROR_OP -1          //Unknown op
+#define SERVER_ERROR_PAYLOAD -2     //Wrong payload length or contents
+#define SERVER_ERROR_NO_NETWORK -3  //Nothing loaded yet
+#define SERVER_ERROR_NO_INPUT -4    //SET_DEMANDS on a network without inputs
+
+//Larger requests close the connection
+#define SERVER_MAX_MESSAGE (64 << 20)
+
+typedef struct ServerHeader{
+  uint32_t length;    //Payload bytes after the header
+  uint16_t op;
+  int16_t status;     //Responses only
+  uint32_t id;        //Chosen by the client, echoed back
+} ServerHeader;
+
+typedef struct Server Server;
+
+//Listens on path (replacing a stale socket file). Takes ownership of ld,
+//which may be NULL until a client sends LOAD. Returns NULL on failure.
+Server *server_new(Server **ret, const char *path, LeakDetect *ld);
+void server_destroy(Server *s);
+
+//Serves until server_stop. Returns 0, or -1 if epoll fails.
+int server_run(Server *s);
+//Async-signal-safe, so it can be called from a signal handler
+void server_stop(Server *s);
+
+#endif //__SERVER_H_
@@ -0,0 +1,159 @@
+#ifndef __STATS_H_
+#define __STATS_H_
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+//Always compiled instrumentation of the hot paths.
+//
+//Every thread accumulates into its own slot (registered on first use), so
+//recording is a couple of relaxed loads and stores with no shared cache
+//lines. Timers read the TSC and are converted to nanoseconds when the stats
+//are collected. When disabled every probe is a single predictable branch.
+//
+//Recording is off until graph_stats_set_enabled(true) or until the process
+//starts with LEAK_STATS set: LEAK_STATS=1 only enables it, LEAK_STATS=FILE
+//also appends one JSON line per second to FILE (LEAK_STATS_PERIOD_MS
+//changes the period).
+
+//Timed phases
+#define STATS_GRAPH_NEW 0
+#define STATS_GRAPH_COPY 1
+#define STATS_BACKPROPAGATE 2
+#define STATS_PROPAGATE_PRESSURE 3
+#define STATS_PROPAGATION_LEVEL 4     //One frontier of either propagation
+#define STATS_FRICTION 5              //Sampled, one call per level task
+#define STATS_FIND_LEAKS 6
+#define STATS_RENDER_DRAW 7
+#define STATS_RENDER_PNG 8
+#define STATS_TILES_EXPORT 9
+#define STATS_ADJOINT 10
+#define STATS_LEAKAGE 11
+#define STATS_SOURCES 12
+#define STATS_N_PHASES 13
+
+//Counters
+#define STATS_NODES_PROPAGATED 0
+#define STATS_FRICTION_EVALS 1
+#define STATS_LEVELS 2
+#define STATS_PARALLEL_LEVELS 3
+#define STATS_PIPES_DRAWN 4           //Segments rasterised by renders and tiles
+#define STATS_TILES_WRITTEN 5
+#define STATS_N_COUNTERS 6
+
+typedef struct GraphStatsPhase{
+  unsigned long calls;
+  double total_ns;
+  double max_ns;
+} GraphStatsPhase;
+
+typedef struct GraphStats{
+  double uptime;        //Seconds since the stats were first used
+  int n_threads;        //Threads that recorded anything
+  GraphStatsPhase phases[STATS_N_PHASES];
+  unsigned long counters[STATS_N_COUNTERS];
+} GraphStats;
+
+void graph_stats_set_enabled(_Bool enabled);
+_Bool graph_stats_get_enabled();
+
+//Sums every thread
+void graph_stats_get(GraphStats *s);
+void graph_stats_reset();
+
+const char *graph_stats_phase_name(int phase);
+const char *graph_stats_counter_name(int counter);
+
+//One JSON object on a single line
+void graph_stats_write_json(GraphStats *s, FILE *f);
+
+//Background thread appending graph_stats_get every period_ms to filename.
+//Starting it enables recording. Returns 0 on success.
+int graph_stats_start_dump(const char *filename, int period_ms);
+void graph_stats_stop_dump();
+
+
+//Probes
+typedef struct StatsSlot{
+  atomic_ulong calls[STATS_N_PHASES];
+  atomic_ulong ticks[STATS_N_PHASES];
+  atomic_ulong max_ticks[STATS_N_PHASES];
+  atomic_ulong counters[STATS_N_COUNTERS];
+  struct StatsSlot *next;
+} StatsSlot;
+
+extern atomic_bool stats_enabled;
+extern _Thread_local StatsSlot *stats_slot;
+
+StatsSlot *stats_register_thread();
+
+static inline unsigned long stats_ticks(){
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+#endif
+}
+
+static inline StatsSlot *stats_local(){
+  StatsSlot *s = stats_slot;
+  return (s != NULL) ? s : stats_register_thread();
+}
+static inline _Bool stats_on(){
+  return atomic_load_explicit(&stats_enabled, memory_order_relaxed);
+}
+
+//Only the owning thread writes its slot, so no atomic read-modify-write
+static inline void stats_slot_add(atomic_ulong *v, unsigned long n){
+  atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void stats_count(int counter, unsigned long n){
+  if (stats_on()){
+    stats_slot_add(&stats_local()->counters[counter], n);
+  }
+}
+
+//0 when disabled, so a phase enabled halfway is not recorded
+static inline unsigned long stats_timer_start(){
+  return stats_on() ? stats_ticks() : 0;
+}
+static inline void stats_add_ticks(int phase, unsigned long ticks, unsigned long calls){
+  StatsSlot *s = stats_local();
+  stats_slot_add(&s->calls[phase], calls);
+  stats_slot_add(&s->ticks[phase], ticks);
+  if (ticks > atomic_load_explicit(&s->max_ticks[phase], memory_order_relaxed)){
+    atomic_store_explicit(&s->max_ticks[phase], ticks, memory_order_relaxed);
+  }
+}
+static inline void stats_timer_stop(int phase, unsigned long start){
+  if (start != 0){
+    stats_add_ticks(phase, stats_ticks() - start, 1);
+  }
+}
+
+//Times the rest of the enclosing block
+typedef struct StatsScope{
+  int phase;
+  unsigned long start;
+} StatsScope;
+
+static inline void stats_scope_end(StatsScope *s){
+  stats_timer_stop(s->phase, s->start);
+}
+
+#define STATS_SCOPE_NAME_(line) stats_scope_ ## line
+#define STATS_SCOPE_NAME(line) STATS_SCOPE_NAME_(line)
+#define STATS_SCOPE(phase) \
+  StatsScope STATS_SCOPE_NAME(__LINE__) __attribute__((cleanup(stats_scope_end))) = \
+    {(phase), stats_timer_start()}
+
+#endif //__STATS_H_
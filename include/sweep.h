@@ -0,0 +1,88 @@
+#ifndef __SWEEP_H_
+#define __SWEEP_H_
+
+#include <graph.h>
+#include <scenario.h>
+
+//Multi-process leak scenario sweeps.
+//
+//The coordinator flattens the network into a read-only shared memory
+//segment and forks the workers, so no worker holds its own copy of the graph.
+//Workers take ranges of scenarios from a shared atomic counter and write one
+//SweepResult per scenario into a shared results region. Scenario i is
+//scenario_generate over the junctions, so results do not depend on which
+//worker ran it.
+//
+//With numa set, worker w is pinned to the CPUs of NUMA node w % n_nodes and
+//the first worker of every node copies the topology into a replica that it
+//touches first, so the rest of the workers on that node read local memory.
+//
+//sweep_study runs the same scenarios as a detectability study of the meter
+//set. Every worker keeps its own SweepStudy of counters and the coordinator
+//adds them up, so memory does not grow with the number of scenarios. With
+//noise set, every meter reads its residual plus a normal error of standard
+//deviation noise_sigma + noise_relative * its calculated flowrate, drawn
+//with scenario_generate_noise. The ROC curve compares the detection score
+//(the largest meter residual) of every scenario with the score of the same
+//meters reading noise alone.
+//
+//The network must already be solved (graph_backpropagate_flowrate) and have
+//its measured nodes set.
+
+#define SWEEP_TOP_K 4
+#define SWEEP_ROC_POINTS 64
+#define SWEEP_MAX_DISTANCE 16   //Localisation distances from here on share a bin
+
+typedef struct SweepConfig{
+  long n_scenarios;
+  int n_workers;            //<= 0 uses one per online CPU
+  int chunk;                //Scenarios taken from the queue at a time
+  ScenarioConfig scenario;  //Leak counts, flowrates and seed
+  float threshold;          //Smallest flowrate residual a meter can see
+  _Bool numa;
+
+  float noise_sigma;        //m³/s, 0 for exact meters
+  float noise_relative;     //Of the calculated flowrate of the meter
+  float roc_min;            //Log spaced ROC thresholds, m³/s
+  float roc_max;
+
+  double elapsed;           //Seconds, filled by sweep_run and sweep_study
+} SweepConfig;
+
+typedef struct SweepResult{
+  float score;              //Largest meter residual
+  int detected;
+  int hit_rank;             //Rank of the first candidate holding a leak, -1 if none
+  int n_candidates;
+  int candidates[SWEEP_TOP_K];  //Measured nodes sorted by unexplained flowrate
+  float scores[SWEEP_TOP_K];
+} SweepResult;
+
+void sweep_config_init(SweepConfig *c);
+
+//Returns the results region (n_scenarios entries) or NULL on failure
+SweepResult *sweep_run(Graph *g, SweepConfig *c);
+void sweep_results_destroy(SweepResult *r, SweepConfig *c);
+void sweep_print_summary(SweepResult *r, SweepConfig *c);
+
+typedef struct SweepStudy{
+  long n_scenarios;
+  long n_leaks;
+  long detected;                        //Score above threshold
+  long hit_rank[SWEEP_TOP_K];           //Scenarios first located at every rank
+  //Pipes along the feeders from the top candidate to the nearest leak, for
+  //the scenarios with candidates
+  long distance[SWEEP_MAX_DISTANCE + 1];
+  double distance_sum;
+  long n_distance;
+
+  float roc_threshold[SWEEP_ROC_POINTS];
+  long roc_positive[SWEEP_ROC_POINTS];  //Scenarios scoring above each threshold
+  long roc_negative[SWEEP_ROC_POINTS];  //Noise alone scoring above it
+} SweepStudy;
+
+//Returns 0, or -1 on failure
+int sweep_study(Graph *g, SweepConfig *c, SweepStudy *study);
+void sweep_print_study(SweepStudy *s, SweepConfig *c);
+
+#endif //__SWEEP_H_
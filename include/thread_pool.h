@@ -0,0 +1,22 @@
+#ifndef __THREAD_POOL_H_
+#define __THREAD_POOL_H_
+
+//Persistent pool of worker threads.
+//
+//thread_pool_run splits [0, n_items) into one contiguous chunk per thread and
+//blocks until every chunk is done. The calling thread runs chunk 0, so a pool
+//of n threads only spawns n-1 workers. Chunk k always runs on thread k, which
+//lets tasks keep per-thread buffers without locking.
+
+typedef struct ThreadPool ThreadPool;
+
+typedef void (*ThreadPoolTask)(void *arg, int first, int last, int thread);
+
+//n_threads <= 0 uses one thread per online CPU
+ThreadPool *thread_pool_new(ThreadPool **ret, int n_threads);
+void thread_pool_destroy(ThreadPool *tp);
+
+int thread_pool_get_n_threads(ThreadPool *tp);
+void thread_pool_run(ThreadPool *tp, ThreadPoolTask task, void *arg, int n_items);
+
+#endif //__THREAD_POOL_H_
@@ -0,0 +1,36 @@
+#ifndef __TILES_H_
+#define __TILES_H_
+
+#include <graph.h>
+#include <render.h>
+#include <thread_pool.h>
+
+//XYZ tile pyramid of the network (dir/z/x/y.png, 256x256 pixels).
+//
+//Node positions are taken from a renderer (its layout or coordinates and
+//color mode), scaled so the whole network fits tile 0/0/0. Pipes are
+//bucketed into a grid per zoom level with one cell per tile, so a tile only
+//draws the pipes whose bounding box touches it.
+//
+//Every export compares the color of each pipe against the previous export
+//and only writes the tiles touched by pipes that changed. Tiles without
+//pipes are never written. Tiles are drawn and encoded on the thread pool.
+
+#define TILES_SIZE 256
+#define TILES_MAX_ZOOM 12
+
+typedef struct Tiles Tiles;
+
+Tiles *tiles_new(Tiles **ret, Graph *g, Renderer *layout, int max_zoom);
+void tiles_destroy(Tiles *t);
+
+void tiles_set_thread_pool(Tiles *t, ThreadPool *tp);   //Defaults to the graph pool
+int tiles_get_max_zoom(Tiles *t);
+
+//Next export writes every tile again
+void tiles_invalidate(Tiles *t);
+
+//Returns the number of tiles written, -1 on error
+int tiles_export(Tiles *t, Graph *g, const char *dir);
+
+#endif //__TILES_H_
@@ -0,0 +1,48 @@
+#ifndef __TRANSIENT_H_
+#define __TRANSIENT_H_
+
+#include <graph.h>
+
+//Method of characteristics (water hammer) solver.
+//
+//Every pipe is split into reaches of length a*dt, so the characteristics of
+//neighbouring points meet exactly on the next timestep (Courant number 1).
+//The wave speed of each pipe is adjusted slightly so that its length is a
+//whole number of reaches. Input nodes behave as fixed head reservoirs, every
+//other node enforces continuity with its demand (outflow plus leak).
+//
+//The initial condition is the steady state currently stored in the graph, so
+//graph_backpropagate_flowrate and graph_propagate_pressure must be run first.
+//Only the departure from it is stepped, so with the boundaries held the
+//solver keeps the steady pressures and flowrates to float resolution.
+
+typedef struct Transient Transient;
+
+Transient *transient_new(Transient **ret, Graph *g, float wave_speed, float dt);
+void transient_destroy(Transient *t);
+
+//Boundary conditions
+void transient_set_node_demand(Transient *t, int node, float q);
+float transient_get_node_demand(Transient *t, int node);
+void transient_add_leak(Transient *t, int node, float q);
+void transient_set_node_pressure(Transient *t, int node, float p);
+
+//Sweeps are split between the pool threads (defaults to the graph pool)
+void transient_set_thread_pool(Transient *t, ThreadPool *tp);
+
+//Time stepping
+void transient_step(Transient *t);
+void transient_run(Transient *t, int steps);
+
+//Results
+float transient_get_time(Transient *t);
+float transient_get_dt(Transient *t);
+int transient_get_n_points(Transient *t);
+float transient_get_node_pressure(Transient *t, int node);
+float transient_get_pipe_flowrate_in(Transient *t, int pipe);
+float transient_get_pipe_flowrate_out(Transient *t, int pipe);
+
+//Copy the current transient node pressures into the graph
+void transient_store(Transient *t);
+
+#endif //__TRANSIENT_H_
@@ -0,0 +1,65 @@
+#ifndef __TREE_INDEX_H_
+#define __TREE_INDEX_H_
+
+#include <graph.h>
+
+//Subtree and path queries on the feeder tree of a network.
+//
+//Only for tree-shaped networks: every node has at most one pipe in, and
+//its origin is the feeder of the node. On a mesh the graph splits a leak
+//between the pipes in by area (graph_add_leaks_to_measured_nodes), which no
+//single feeder can follow, so no index is built there.
+//
+//Nodes are numbered by a depth-first walk that enters the heaviest child
+//first. Every subtree is then one contiguous range of that order (Euler
+//tour), so descendant tests are O(1), and every heavy chain is contiguous
+//too, so any path is O(log n) ranges (heavy-light decomposition).
+//
+//Two sets of values are kept over that order:
+//  weights  added to one node, summed over a subtree (Fenwick tree), both
+//           O(log n). With the output demands as weights the subtree sum of
+//           a node is the flowrate through it.
+//  values   added along a path, read at a node or summed over a path
+//           (segment tree), O(log² n). Leaks live here: a leak adds its
+//           flowrate to every node from its root down to it, so the value
+//           of a meter is the leak flowrate it sees.
+//
+//The index is a snapshot of the topology: build a new one after deleting
+//nodes. Removed nodes and rings fed by nothing are not in any tree, updates
+//on them are ignored and queries return -1 or 0.
+
+typedef struct TreeIndex TreeIndex;
+
+//NULL if a node has more than one pipe in from nodes in the graph
+TreeIndex *tree_index_new(TreeIndex **ret, Graph *g);
+void tree_index_destroy(TreeIndex *ti);
+
+//Zeroes every weight, value and leak
+void tree_index_clear(TreeIndex *ti);
+
+int tree_index_get_parent(TreeIndex *ti, int node);     //-1 for roots
+int tree_index_get_root(TreeIndex *ti, int node);
+int tree_index_get_depth(TreeIndex *ti, int node);      //Pipes from the root
+int tree_index_get_subtree_size(TreeIndex *ti, int node);
+//The subtree_size node IDs of the subtree, node first
+int *tree_index_get_subtree(TreeIndex *ti, int node);
+_Bool tree_index_is_descendant(TreeIndex *ti, int node, int ancestor);
+//Lowest common ancestor, -1 if the nodes are in different trees
+int tree_index_lca(TreeIndex *ti, int a, int b);
+
+//Weights
+void tree_index_add_weight(TreeIndex *ti, int node, float delta);
+float tree_index_get_subtree_weight(TreeIndex *ti, int node);
+
+//Values. Paths include both ends and must be within one tree.
+void tree_index_path_add(TreeIndex *ti, int a, int b, float delta);
+float tree_index_path_sum(TreeIndex *ti, int a, int b);
+float tree_index_get_value(TreeIndex *ti, int node);
+
+//Leaks. Setting a leak replaces the previous one at the node (0 removes it).
+void tree_index_set_leak(TreeIndex *ti, int node, float flowrate);
+float tree_index_get_leak(TreeIndex *ti, int node);
+//Leak flowrate through the node, its own included
+float tree_index_get_leak_through(TreeIndex *ti, int node);
+
+#endif //__TREE_INDEX_H_
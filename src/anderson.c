@@ -0,0 +1,169 @@
+#include <anderson.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+//Relative Tikhonov regularisation of the normal equations
+#define ANDERSON_REGULARISATION 1e-10
+
+typedef struct Anderson{
+  int n;
+  int history;
+  int count;            //Differences stored
+  int newest;           //Slot of the last one
+  _Bool started;        //prev_x and prev_f are set
+
+  double *prev_x;
+  double *prev_f;
+  double *f;
+  double *dx;           //history * n, circular
+  double *df;
+
+  double *matrix;       //history², normal equations
+  double *gamma;
+} Anderson;
+
+Anderson *anderson_new(Anderson **ret, int n, int history){
+  Anderson *a = malloc(sizeof(Anderson));
+  a->n = n;
+  a->history = history > 0 ? history : 1;
+  a->prev_x = malloc(sizeof(double) * n);
+  a->prev_f = malloc(sizeof(double) * n);
+  a->f = malloc(sizeof(double) * n);
+  a->dx = malloc(sizeof(double) * (size_t) a->history * n);
+  a->df = malloc(sizeof(double) * (size_t) a->history * n);
+  a->matrix = malloc(sizeof(double) * a->history * a->history);
+  a->gamma = malloc(sizeof(double) * a->history);
+  anderson_reset(a);
+
+  if (ret != NULL){
+    *ret = a;
+  }
+  return a;
+}
+void anderson_destroy(Anderson *a){
+  if (a == NULL){
+    return;
+  }
+  free(a->prev_x);
+  free(a->prev_f);
+  free(a->f);
+  free(a->dx);
+  free(a->df);
+  free(a->matrix);
+  free(a->gamma);
+  free(a);
+}
+void anderson_reset(Anderson *a){
+  a->count = 0;
+  a->newest = -1;
+  a->started = false;
+}
+
+//Gaussian elimination with partial pivoting of matrix (m x m) gamma = gamma.
+//Returns -1 if it is singular.
+static int anderson_solve(double *matrix, double *gamma, int m){
+  for (int k = 0; k < m; k++){
+    int pivot = k;
+    for (int i = k + 1; i < m; i++){
+      if (fabs(matrix[i * m + k]) > fabs(matrix[pivot * m + k])){
+        pivot = i;
+      }
+    }
+    if (matrix[pivot * m + k] == 0){
+      return -1;
+    }
+    if (pivot != k){
+      for (int j = 0; j < m; j++){
+        double t = matrix[k * m + j];
+        matrix[k * m + j] = matrix[pivot * m + j];
+        matrix[pivot * m + j] = t;
+      }
+      double t = gamma[k];
+      gamma[k] = gamma[pivot];
+      gamma[pivot] = t;
+    }
+    for (int i = k + 1; i < m; i++){
+      double factor = matrix[i * m + k] / matrix[k * m + k];
+      for (int j = k; j < m; j++){
+        matrix[i * m + j] -= factor * matrix[k * m + j];
+      }
+      gamma[i] -= factor * gamma[k];
+    }
+  }
+  for (int k = m - 1; k >= 0; k--){
+    for (int j = k + 1; j < m; j++){
+      gamma[k] -= matrix[k * m + j] * gamma[j];
+    }
+    gamma[k] /= matrix[k * m + k];
+  }
+  return 0;
+}
+
+void anderson_step(Anderson *a, double *x, const double *gx){
+  int n = a->n;
+  for (int i = 0; i < n; i++){
+    a->f[i] = gx[i] - x[i];
+  }
+
+  //Differences with the previous iterate
+  if (a->started){
+    int slot = (a->newest + 1) % a->history;
+    double *dx = a->dx + (size_t) slot * n;
+    double *df = a->df + (size_t) slot * n;
+    for (int i = 0; i < n; i++){
+      dx[i] = x[i] - a->prev_x[i];
+      df[i] = a->f[i] - a->prev_f[i];
+    }
+    a->newest = slot;
+    if (a->count < a->history){
+      a->count++;
+    }
+  }
+  memcpy(a->prev_x, x, sizeof(double) * n);
+  memcpy(a->prev_f, a->f, sizeof(double) * n);
+  a->started = true;
+
+  //min |f - dF gamma|, from (dF' dF) gamma = dF' f
+  int m = a->count;
+  double trace = 0;
+  for (int j = 0; j < m; j++){
+    double *dfj = a->df + (size_t) j * n;
+    for (int k = j; k < m; k++){
+      double *dfk = a->df + (size_t) k * n;
+      double sum = 0;
+      for (int i = 0; i < n; i++){
+        sum += dfj[i] * dfk[i];
+      }
+      a->matrix[j * m + k] = sum;
+      a->matrix[k * m + j] = sum;
+    }
+    trace += a->matrix[j * m + j];
+    double sum = 0;
+    for (int i = 0; i < n; i++){
+      sum += dfj[i] * a->f[i];
+    }
+    a->gamma[j] = sum;
+  }
+  for (int j = 0; j < m; j++){
+    a->matrix[j * m + j] += ANDERSON_REGULARISATION * trace / m;
+  }
+
+  //Plain iteration without history, or when it is degenerate
+  if (m == 0 || trace == 0 || anderson_solve(a->matrix, a->gamma, m) != 0){
+    memcpy(x, gx, sizeof(double) * n);
+    return;
+  }
+
+  //x = G(x) - (dX + dF) gamma
+  memcpy(x, gx, sizeof(double) * n);
+  for (int j = 0; j < m; j++){
+    double *dx = a->dx + (size_t) j * n;
+    double *df = a->df + (size_t) j * n;
+    for (int i = 0; i < n; i++){
+      x[i] -= a->gamma[j] * (dx[i] + df[i]);
+    }
+  }
+}
@@ -0,0 +1,452 @@
+#include <calibrate.h>
+#include <log.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+typedef struct Calibration{
+  Graph *g;             //Copy of the network at calibration_new
+  int n_nodes;
+  int n_pipes;
+  int n_steps;
+  ThreadPool *tp;
+
+  //Node IDs
+  int *outputs;
+  int n_outputs;
+  int *meters;
+  int n_meters;
+
+  //By step, demands over the outputs and readings over the meters
+  float *demands;
+  float *pressures;
+  float *flowrates;
+
+  int n_roughness_groups;
+  int *pipe_group;      //By pipe ID, -1 if fixed
+  double *roughness;
+  double *roughness_scale;  //Starting roughness, optimised relative to it
+  int n_demand_groups;
+  int *output_group;    //By output, -1 if fixed
+  double *multiplier;
+
+  //Per pool thread
+  int n_threads;
+  Graph **replicas;
+  float **d_rough;      //Per pipe
+  float **d_demand;     //Per node
+
+  //Per step, added up in step order
+  double *gradient;     //n_groups per step, roughness first
+  double *misfit;
+
+  //Evaluation in progress
+  float pressure_weight;
+  float flowrate_weight;
+  int evaluations;
+} Calibration;
+
+void calibration_config_init(CalibrationConfig *c){
+  lbfgsb_config_init(&c->optimizer);
+  c->pressure_sigma = 1000;
+  c->flowrate_sigma = 0.0001;
+  c->min_roughness = 0.000001;
+  c->max_roughness = 0.01;
+  c->min_multiplier = 0.1;
+  c->max_multiplier = 10;
+  c->initial_misfit = 0;
+  c->misfit = 0;
+  c->iterations = 0;
+  c->evaluations = 0;
+  c->elapsed = 0;
+}
+
+//Constructors
+Calibration *calibration_new(Calibration **ret, Graph *g, int n_steps){
+  Calibration *c = malloc(sizeof(Calibration));
+
+  c->g = graph_copy(NULL, g);
+  graph_set_thread_pool(c->g, NULL);
+  c->n_nodes = graph_get_n_nodes(g);
+  c->n_pipes = graph_get_n_pipes(g);
+  c->n_steps = n_steps;
+  c->tp = graph_get_thread_pool(g);
+
+  c->outputs = malloc(sizeof(int) * c->n_nodes);
+  c->meters = malloc(sizeof(int) * c->n_nodes);
+  c->n_outputs = 0;
+  c->n_meters = 0;
+  for (int i = 0; i < c->n_nodes; i++){
+    Node *n = graph_get_nth_node(g, i);
+    if (n == NULL){
+      continue;
+    }
+    if (node_get_is_output(n)){
+      c->outputs[c->n_outputs++] = i;
+    }
+    if (node_get_is_measured(n) && ! node_get_is_input(n)){
+      c->meters[c->n_meters++] = i;
+    }
+  }
+
+  c->demands = malloc(sizeof(float) * (size_t) n_steps * c->n_outputs);
+  c->pressures = malloc(sizeof(float) * (size_t) n_steps * c->n_meters);
+  c->flowrates = malloc(sizeof(float) * (size_t) n_steps * c->n_meters);
+  for (int s = 0; s < n_steps; s++){
+    for (int o = 0; o < c->n_outputs; o++){
+      Node *n = graph_get_nth_node(g, c->outputs[o]);
+      c->demands[(size_t) s * c->n_outputs + o] = node_get_flowrate_calculated(n);
+    }
+    for (int m = 0; m < c->n_meters; m++){
+      c->pressures[(size_t) s * c->n_meters + m] = -1;
+      c->flowrates[(size_t) s * c->n_meters + m] = -1;
+    }
+  }
+
+  c->n_roughness_groups = 0;
+  c->pipe_group = malloc(sizeof(int) * c->n_pipes);
+  for (int i = 0; i < c->n_pipes; i++){
+    c->pipe_group[i] = -1;
+  }
+  c->roughness = NULL;
+  c->roughness_scale = NULL;
+  c->n_demand_groups = 0;
+  c->output_group = malloc(sizeof(int) * c->n_outputs);
+  for (int o = 0; o < c->n_outputs; o++){
+    c->output_group[o] = -1;
+  }
+  c->multiplier = NULL;
+
+  c->n_threads = 0;
+  c->replicas = NULL;
+  c->d_rough = NULL;
+  c->d_demand = NULL;
+  c->gradient = NULL;
+  c->misfit = NULL;
+
+  if (ret != NULL){
+    *ret = c;
+  }
+  return c;
+}
+static void calibration_destroy_threads(Calibration *c){
+  for (int t = 0; t < c->n_threads; t++){
+    graph_destroy(c->replicas[t]);
+    free(c->d_rough[t]);
+    free(c->d_demand[t]);
+  }
+  free(c->replicas);
+  free(c->d_rough);
+  free(c->d_demand);
+  free(c->gradient);
+  free(c->misfit);
+  c->n_threads = 0;
+  c->replicas = NULL;
+  c->d_rough = NULL;
+  c->d_demand = NULL;
+  c->gradient = NULL;
+  c->misfit = NULL;
+}
+void calibration_destroy(Calibration *c){
+  if (c == NULL){
+    return;
+  }
+  calibration_destroy_threads(c);
+  graph_destroy(c->g);
+  free(c->outputs);
+  free(c->meters);
+  free(c->demands);
+  free(c->pressures);
+  free(c->flowrates);
+  free(c->pipe_group);
+  free(c->roughness);
+  free(c->roughness_scale);
+  free(c->output_group);
+  free(c->multiplier);
+  free(c);
+}
+
+void calibration_set_thread_pool(Calibration *c, ThreadPool *tp){
+  c->tp = tp;
+}
+
+//Groups
+int calibration_set_roughness_groups(Calibration *c, int n_groups, const int *groups){
+  for (int i = 0; i < c->n_pipes; i++){
+    if (groups[i] < -1 || groups[i] >= n_groups){
+      return -1;
+    }
+  }
+  calibration_destroy_threads(c);
+  memcpy(c->pipe_group, groups, sizeof(int) * c->n_pipes);
+  c->n_roughness_groups = n_groups;
+
+  //Mean roughness of every group
+  int *count = calloc(n_groups + 1, sizeof(int));
+  free(c->roughness);
+  free(c->roughness_scale);
+  c->roughness = calloc(n_groups + 1, sizeof(double));
+  c->roughness_scale = malloc(sizeof(double) * (n_groups + 1));
+  Pipe **pipes = graph_get_pipes(c->g);
+  for (int i = 0; i < c->n_pipes; i++){
+    if (groups[i] != -1){
+      c->roughness[groups[i]] += pipe_get_rough(pipes[i]);
+      count[groups[i]]++;
+    }
+  }
+  for (int k = 0; k < n_groups; k++){
+    if (count[k] > 0){
+      c->roughness[k] /= count[k];
+    }
+  }
+  free(count);
+  return 0;
+}
+int calibration_set_demand_groups(Calibration *c, int n_groups, const int *groups){
+  for (int o = 0; o < c->n_outputs; o++){
+    int k = groups[c->outputs[o]];
+    if (k < -1 || k >= n_groups){
+      return -1;
+    }
+  }
+  calibration_destroy_threads(c);
+  for (int o = 0; o < c->n_outputs; o++){
+    c->output_group[o] = groups[c->outputs[o]];
+  }
+  c->n_demand_groups = n_groups;
+
+  free(c->multiplier);
+  c->multiplier = malloc(sizeof(double) * (n_groups + 1));
+  for (int k = 0; k < n_groups; k++){
+    c->multiplier[k] = 1;
+  }
+  return 0;
+}
+
+//Data
+int calibration_set_step(Calibration *c, int step, const float *demands,
+                         const float *pressures, const float *flowrates){
+  if (step < 0 || step >= c->n_steps){
+    return -1;
+  }
+  if (demands != NULL){
+    float *d = c->demands + (size_t) step * c->n_outputs;
+    for (int o = 0; o < c->n_outputs; o++){
+      d[o] = demands[c->outputs[o]];
+    }
+  }
+  if (pressures != NULL){
+    float *p = c->pressures + (size_t) step * c->n_meters;
+    for (int m = 0; m < c->n_meters; m++){
+      p[m] = pressures[c->meters[m]];
+    }
+  }
+  if (flowrates != NULL){
+    float *f = c->flowrates + (size_t) step * c->n_meters;
+    for (int m = 0; m < c->n_meters; m++){
+      f[m] = flowrates[c->meters[m]];
+    }
+  }
+  return 0;
+}
+
+//Evaluation
+static void calibration_set_threads(Calibration *c, int n_threads){
+  if (c->n_threads == n_threads){
+    return;
+  }
+  calibration_destroy_threads(c);
+  int n_groups = c->n_roughness_groups + c->n_demand_groups;
+  c->n_threads = n_threads;
+  c->replicas = malloc(sizeof(Graph *) * n_threads);
+  c->d_rough = malloc(sizeof(float *) * n_threads);
+  c->d_demand = malloc(sizeof(float *) * n_threads);
+  for (int t = 0; t < n_threads; t++){
+    c->replicas[t] = graph_copy(NULL, c->g);
+    c->d_rough[t] = malloc(sizeof(float) * c->n_pipes);
+    c->d_demand[t] = malloc(sizeof(float) * c->n_nodes);
+  }
+  c->gradient = malloc(sizeof(double) * (size_t) c->n_steps * n_groups);
+  c->misfit = malloc(sizeof(double) * c->n_steps);
+}
+//Solves steps [first, last) on the replica of the thread
+static void calibration_evaluate_steps(void *arg, int first, int last, int thread){
+  Calibration *c = arg;
+  Graph *g = c->replicas[thread];
+  Node **nodes = graph_get_nodes(g);
+  Pipe **pipes = graph_get_pipes(g);
+  float *d_rough = c->d_rough[thread];
+  float *d_demand = c->d_demand[thread];
+  int n_groups = c->n_roughness_groups + c->n_demand_groups;
+  if (first >= last){
+    return;
+  }
+
+  for (int i = 0; i < c->n_pipes; i++){
+    if (c->pipe_group[i] != -1){
+      pipe_set_rough(pipes[i], c->roughness[c->pipe_group[i]]);
+    }
+  }
+
+  for (int s = first; s < last; s++){
+    float *demands = c->demands + (size_t) s * c->n_outputs;
+    float *pressures = c->pressures + (size_t) s * c->n_meters;
+    float *flowrates = c->flowrates + (size_t) s * c->n_meters;
+    double *gradient = c->gradient + (size_t) s * n_groups;
+    double *gradient_demand = gradient + c->n_roughness_groups;
+    for (int o = 0; o < c->n_outputs; o++){
+      int k = c->output_group[o];
+      float multiplier = (k != -1) ? c->multiplier[k] : 1;
+      node_set_flowrate_calculated(nodes[c->outputs[o]], demands[o] * multiplier);
+    }
+    for (int m = 0; m < c->n_meters; m++){
+      Node *n = nodes[c->meters[m]];
+      node_set_pressure_measured(n, pressures[m] < 0 ? -1 : pressures[m]);
+      node_set_flowrate_measured(n, flowrates[m] < 0 ? -1 : flowrates[m]);
+    }
+
+    graph_backpropagate_flowrate(g);
+    graph_propagate_pressure(g);
+    c->misfit[s] = graph_compute_misfit_gradient(g, c->pressure_weight, c->flowrate_weight,
+                                                 d_rough, NULL, d_demand);
+
+    memset(gradient, 0, sizeof(double) * n_groups);
+    for (int i = 0; i < c->n_pipes; i++){
+      if (c->pipe_group[i] != -1){
+        gradient[c->pipe_group[i]] += d_rough[i];
+      }
+    }
+    for (int o = 0; o < c->n_outputs; o++){
+      if (c->output_group[o] != -1){
+        gradient_demand[c->output_group[o]] += d_demand[c->outputs[o]] * demands[o];
+      }
+    }
+  }
+}
+//Objective of lbfgsb over x: roughness over its starting value, then the
+//multipliers. Mean misfit of a step.
+static double calibration_objective(void *arg, const double *x, double *grad){
+  Calibration *c = arg;
+  double *scale = c->roughness_scale;
+  int n_rough = c->n_roughness_groups;
+  int n_groups = n_rough + c->n_demand_groups;
+  for (int k = 0; k < n_rough; k++){
+    c->roughness[k] = x[k] * scale[k];
+  }
+  for (int k = 0; k < c->n_demand_groups; k++){
+    c->multiplier[k] = x[n_rough + k];
+  }
+
+  if (c->tp != NULL){
+    thread_pool_run(c->tp, calibration_evaluate_steps, c, c->n_steps);
+  } else {
+    calibration_evaluate_steps(c, 0, c->n_steps, 0);
+  }
+
+  double misfit = 0;
+  for (int k = 0; k < n_groups; k++){
+    grad[k] = 0;
+  }
+  for (int s = 0; s < c->n_steps; s++){
+    misfit += c->misfit[s];
+    for (int k = 0; k < n_groups; k++){
+      grad[k] += c->gradient[(size_t) s * n_groups + k];
+    }
+  }
+  misfit /= c->n_steps;
+  for (int k = 0; k < n_groups; k++){
+    grad[k] *= (k < n_rough ? scale[k] : 1) / c->n_steps;
+  }
+
+  c->evaluations++;
+  LOG_DEBUG("Calibration evaluation %d, misfit %g", c->evaluations, misfit);
+  return misfit;
+}
+
+int calibration_run(Calibration *c, CalibrationConfig *cfg){
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int n_rough = c->n_roughness_groups;
+  int n_groups = n_rough + c->n_demand_groups;
+  if (n_groups == 0 || c->n_steps <= 0){
+    return LBFGSB_ERROR;
+  }
+  calibration_set_threads(c, (c->tp != NULL) ? thread_pool_get_n_threads(c->tp) : 1);
+  c->pressure_weight = 1 / (cfg->pressure_sigma * cfg->pressure_sigma);
+  c->flowrate_weight = 1 / (cfg->flowrate_sigma * cfg->flowrate_sigma);
+  c->evaluations = 0;
+
+  //Roughness is optimised relative to where it starts, so every variable
+  //is around 1
+  double *scale = c->roughness_scale;
+  double *x = malloc(sizeof(double) * n_groups);
+  double *lower = malloc(sizeof(double) * n_groups);
+  double *upper = malloc(sizeof(double) * n_groups);
+  for (int k = 0; k < n_rough; k++){
+    scale[k] = c->roughness[k];
+    if (scale[k] < cfg->min_roughness || scale[k] > cfg->max_roughness){
+      scale[k] = sqrt(cfg->min_roughness * cfg->max_roughness);
+    }
+    x[k] = c->roughness[k] / scale[k];
+    lower[k] = cfg->min_roughness / scale[k];
+    upper[k] = cfg->max_roughness / scale[k];
+  }
+  for (int k = 0; k < c->n_demand_groups; k++){
+    x[n_rough + k] = c->multiplier[k];
+    lower[n_rough + k] = cfg->min_multiplier;
+    upper[n_rough + k] = cfg->max_multiplier;
+  }
+
+  double *grad = malloc(sizeof(double) * n_groups);
+  cfg->initial_misfit = calibration_objective(c, x, grad);
+  free(grad);
+
+  double misfit;
+  int status = lbfgsb_minimize(&cfg->optimizer, n_groups, x, lower, upper,
+                               calibration_objective, c, &misfit, &cfg->iterations);
+  //Leave the group values at the result, not at the last point tried
+  for (int k = 0; k < n_rough; k++){
+    c->roughness[k] = x[k] * scale[k];
+  }
+  for (int k = 0; k < c->n_demand_groups; k++){
+    c->multiplier[k] = x[n_rough + k];
+  }
+  cfg->misfit = misfit;
+  cfg->evaluations = c->evaluations;
+
+  free(x);
+  free(lower);
+  free(upper);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  cfg->elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  LOG_INFO("Calibration finished (%d) after %d iterations, misfit %g -> %g",
+           status, cfg->iterations, cfg->initial_misfit, cfg->misfit);
+  return status;
+}
+
+//Results
+float calibration_get_roughness(Calibration *c, int group){
+  if (group < 0 || group >= c->n_roughness_groups){
+    return -1;
+  }
+  return c->roughness[group];
+}
+float calibration_get_multiplier(Calibration *c, int group){
+  if (group < 0 || group >= c->n_demand_groups){
+    return -1;
+  }
+  return c->multiplier[group];
+}
+void calibration_apply(Calibration *c, Graph *g){
+  Pipe **pipes = graph_get_pipes(g);
+  for (int i = 0; i < c->n_pipes; i++){
+    if (c->pipe_group[i] != -1){
+      pipe_set_rough(pipes[i], c->roughness[c->pipe_group[i]]);
+    }
+  }
+}
@@ -1,5 +1,6 @@
 #include <fluid_mechanics.h>
 #include <math.h>
+#include <stddef.h>
 
 //FRICTION MODELS:----------------------------
 
@@ -17,6 +18,62 @@ float friction_model_stokes(float diam, float rough, float dens, float visc, flo
   return 0;
 }
 
+//DERIVATIVES:--------------------------------
+
+//Churchill by the chain rule, in double:
+//  f = 8 (a + B^-1.5)^(1/12),  a = (8/Re)^12,  B = Ca + Cb
+//  Ca = X^16,  X = -2.457 ln(Y),  Y = (7/Re)^0.9 + 0.27 rough/diam
+//  Cb = (37530/Re)^16,  Re = dens vel diam / visc
+float friction_model_churchill_derivatives(float diam, float rough, float dens, float visc, float vel,
+                                           float *d_diam, float *d_rough, float *d_vel){
+  double Re = compute_reynolds_number(vel, dens, diam, visc);
+  if (Re <= 0){
+    *d_diam = 0;
+    *d_rough = 0;
+    *d_vel = 0;
+    return friction_model_churchill(diam, rough, dens, visc, vel);
+  }
+  double y_re = pow(7.0/Re, 0.9);
+  double Y = y_re + 0.27*(rough/diam);
+  double X = -2.457*log(Y);
+  double Ca = pow(X, 16.0);
+  double Cb = pow(37530.0/Re, 16.0);
+  double a = pow(8.0/Re, 12);
+  double B = Ca + Cb;
+  double T = a + pow(B, -1.5);
+  double fd = 8*pow(T, 1.0/12.0);
+
+  //df/dT, df/dB and df/dY
+  double f_T = fd / (12*T);
+  double f_B = f_T * -1.5*pow(B, -2.5);
+  double f_Y = f_B * 16*pow(X, 15.0) * (-2.457/Y);
+  //Re * df/dRe
+  double f_Re = f_T * -12*a + f_B * -16*Cb + f_Y * -0.9*y_re;
+
+  *d_vel = f_Re / vel;
+  *d_diam = f_Re / diam - f_Y * 0.27*rough/(diam*diam);
+  *d_rough = f_Y * 0.27/diam;
+  return fd;
+}
+
+float friction_model_stokes_derivatives(float diam, float rough, float dens, float visc, float vel,
+                                        float *d_diam, float *d_rough, float *d_vel){
+  *d_diam = 0;
+  *d_rough = 0;
+  *d_vel = 0;
+  return 0;
+}
+
+FrictionModelDerivatives friction_model_get_derivatives(FrictionModel fm){
+  if (fm == friction_model_churchill){
+    return friction_model_churchill_derivatives;
+  }
+  if (fm == friction_model_stokes){
+    return friction_model_stokes_derivatives;
+  }
+  return NULL;
+}
+
 
 //Misc
 //u = velocity, d = density, L = characteristic linear dimension, v = viscosity
@@ -1,4 +1,7 @@
 #include <graph.h>
+#include <anderson.h>
+#include <stats.h>
+#include <log.h>
 
 #include <stdlib.h>
 #include <math.h>
@@ -18,7 +21,49 @@
 
 #define MAX_LEAK_OUTFLOW 0.01
 
-// #define __GRAPH_C_DEBUG_
+//Levels smaller than this are propagated by the calling thread
+#define GRAPH_PARALLEL_MIN_LEVEL 2048
+
+//One friction evaluation out of this many is timed when stats are on
+#define GRAPH_STATS_FRICTION_SAMPLE 64
+
+//Nodes node_measurement_get_successors_diff walks down without allocating
+#define GRAPH_WALK_STACK 64
+
+//Bytes of DOT text held before each write
+#define GRAPH_DOT_BUFFER_SIZE 65536
+
+//Suspect zone classification
+#define GRAPH_ZONE_SUSPECT 0
+#define GRAPH_ZONE_EXPLAINED 1    //Measured, its residual is seen further down
+#define GRAPH_ZONE_CLEARED 2      //At or below a meter reading its calculated flowrate
+#define GRAPH_ZONE_REMOVED 3
+#define GRAPH_RESIDUAL_TOLERANCE 0.000001
+
+//Relative step of the friction derivatives of models without analytic ones
+#define GRAPH_ADJOINT_STEP 0.001
+
+//Multi-source solve: velocity and head loss gradient floors (zero flow and
+//frictionless models), relative residual and iterations of its CG
+#define GRAPH_SOURCES_MIN_VELOCITY 0.000001
+#define GRAPH_SOURCES_MIN_RESISTANCE 0.001
+#define GRAPH_SOURCES_CG_TOLERANCE 1e-9
+#define GRAPH_SOURCES_CG_ITERATIONS 1000
+
+//Pressure-dependent leakage: leaks are driven by the pressure above this,
+//linearly below this head (Pa), and the fixed point is accelerated over
+//this many iterates
+#define GRAPH_ATMOSPHERIC_PRESSURE 101325
+#define GRAPH_LEAKAGE_LINEAR_HEAD 1000
+#define GRAPH_LEAKAGE_HISTORY 5
+//Most passes of a leakage Newton step
+#define GRAPH_LEAKAGE_PASSES 20
+//Resolution of the pressures the leak laws are evaluated at, relative to
+//the inputs (float drops summed over the levels)
+#define GRAPH_LEAKAGE_PRESSURE_RESOLUTION 1e-5
+//Leakage Newton steps shrinking by at least this factor are taken as they are
+#define GRAPH_LEAKAGE_NEWTON_RATE 0.1
+
 // #define __GRAPH_C_DETECTION_DEBUG_
 
 union dimensions{
@@ -56,6 +101,10 @@ typedef struct Pipe{
 
   float friction;
 
+  //Background leakage, background_coefficient (per metre) * length * p^exponent
+  float background_coefficient;
+  float background_exponent;
+
   float flowrate_ideal;
   float flowrate_real;
 
@@ -78,6 +127,12 @@ typedef struct Node{
   _Bool has_leak;
   float leak_flowrate;
 
+  //Emitter, leaks emitter_coefficient * p^emitter_exponent when solved
+  float emitter_coefficient;
+  float emitter_exponent;
+  //Background leakage of the pipes in, lumped here when solved
+  float background_flowrate;
+
   float height;
 
   float fluid_viscosity;
@@ -95,6 +150,9 @@ typedef struct Node{
 
   _Bool is_measured;
 
+  _Bool visited;    //Entered by the running node_measurement_get_successors_diff
+  float walk_diff;  //and the successors diff it summed for it
+
   int ID;
 } Node;
 
@@ -102,6 +160,13 @@ typedef struct Graph{
   Node **nodes;
   Pipe **pipes;
 
+  //Longest path level of every node from the inputs, built on demand by
+  //graph_calculate_geometry and dropped when a node is deleted
+  _Bool levels_valid;
+  int *level;           //Per node ID, -1 if not reachable from an input
+  int *level_nodes;     //Node IDs grouped by level, a topological order
+  int *level_start;     //n_levels + 1 offsets into level_nodes
+  int n_levels;
   int depth;
   int width;
 
@@ -117,6 +182,29 @@ typedef struct Graph{
 
   int n_pipes;
   int n_nodes;
+
+  ThreadPool *thread_pool;
+
+  //Level being propagated
+  int *frontier;
+
+  //Measurement scratch of graph_get_suspect_zone, allocated on first use
+  float *residuals;         //Diff and successors diff, 2 * n_nodes
+  unsigned char *zone;      //GRAPH_ZONE_* of every node
+
+  //Leak flowrate through every node, graph_add_leaks_to_measured_nodes
+  float *leak_through;
+
+  //Adjoint scratch of graph_compute_misfit_gradient, allocated on first use
+  float *adjoint_node;      //Pressure and flowrate adjoints, 2 * n_nodes
+  float *adjoint_pipe;      //Velocity adjoint, diameter and roughness
+                            //gradients, 3 * n_pipes
+
+  //Leak outflow of every node ID while graph_solve_leakage runs, when the
+  //flowrate propagation adds it to what the pipes in carry, then the
+  //Newton scratch of every node, 5 * n_nodes
+  _Bool leakage_active;
+  float *leakage;
 } Graph;
 
 //Constructors
@@ -139,6 +227,9 @@ Pipe *pipe_new(Pipe **ret, Node *orig, Node *dest){
 
   new->fluid_velocity = -1;
 
+  new->background_coefficient = 0;
+  new->background_exponent = 0.5;
+
   pipe_set_geometry(new, GEOMETRY_CIRCULAR);
 
   pipe_set_diam(new, 0);
@@ -168,6 +259,9 @@ Pipe *pipe_copy(Pipe **r, Pipe *s){
   n->fluid_velocity = s->fluid_velocity;
   n->friction = s->friction;
 
+  n->background_coefficient = s->background_coefficient;
+  n->background_exponent = s->background_exponent;
+
   n->flowrate_ideal = s->flowrate_ideal;
   n->flowrate_real = s->flowrate_real;
 
@@ -201,6 +295,10 @@ Node *node_new(Node **ret){
   new->has_leak = false;
   new->leak_flowrate = 0;
 
+  new->emitter_coefficient = 0;
+  new->emitter_exponent = 0.5;
+  new->background_flowrate = 0;
+
   new->pressure_measured = -1;
   new->pressure_calculated = -1;
   new->flowrate_measured = -1;
@@ -211,6 +309,9 @@ Node *node_new(Node **ret){
 
   new->is_measured = false;
 
+  new->visited = false;
+  new->walk_diff = 0;
+
   if (ret != NULL){
     *ret = new;
   }
@@ -233,6 +334,10 @@ Node *node_copy(Node **r, Node *s){
   n->has_leak = s->has_leak;
   n->leak_flowrate = s->leak_flowrate;
 
+  n->emitter_coefficient = s->emitter_coefficient;
+  n->emitter_exponent = s->emitter_exponent;
+  n->background_flowrate = s->background_flowrate;
+
   n->height = s->height;
 
   n->fluid_velocity = s->fluid_velocity;
@@ -247,6 +352,9 @@ Node *node_copy(Node **r, Node *s){
 
   n->is_measured = s->is_measured;
 
+  n->visited = false;
+  n->walk_diff = 0;
+
   n->ID = s->ID;
 
   if (r != NULL){
@@ -255,6 +363,7 @@ Node *node_copy(Node **r, Node *s){
   return n;
 }
 Graph *graph_new(Graph **ret, int n_pipes, int *sorig, int *torig){
+  STATS_SCOPE(STATS_GRAPH_NEW);
   Graph *g = malloc(sizeof(Graph));
 
   //Get num of nodes
@@ -272,11 +381,28 @@ Graph *graph_new(Graph **ret, int n_pipes, int *sorig, int *torig){
   g->nodes = malloc(sizeof(Node *) * n_nodes);
   g->pipes = malloc(sizeof(Pipe *) * n_pipes);
 
-  g->inc_matrix = calloc(sizeof(int) * n_nodes * n_pipes, 1);
-  g->mass_conservation_matrix = calloc(sizeof(float) * n_nodes * n_pipes, 1);
+  //Dense matrices are only built on demand
+  g->inc_matrix = NULL;
+  g->mass_conservation_matrix = NULL;
 
   g->leaks = NULL;
 
+  g->thread_pool = NULL;
+  g->frontier = NULL;
+  g->residuals = NULL;
+  g->zone = NULL;
+  g->leak_through = NULL;
+  g->adjoint_node = NULL;
+  g->adjoint_pipe = NULL;
+  g->leakage_active = false;
+  g->leakage = NULL;
+
+  g->levels_valid = false;
+  g->level = NULL;
+  g->level_nodes = NULL;
+  g->level_start = NULL;
+  g->n_levels = 0;
+
 
   //Create nodes
   for (int i = 0; i < n_nodes; i++){
@@ -290,9 +416,6 @@ Graph *graph_new(Graph **ret, int n_pipes, int *sorig, int *torig){
 
     node_add_pipe_out(g->nodes[sorig[i]], g->pipes[i]);
     node_add_pipe_in(g->nodes[torig[i]], g->pipes[i]);
-
-    g->inc_matrix[sorig[i]*g->n_pipes + i] = -1;
-    g->inc_matrix[torig[i]*g->n_pipes + i] = 1;
   }
 
   if (ret != NULL){
@@ -326,14 +449,21 @@ Leaks *leaks_copy(Leaks **r, Leaks *s){
   return n;
 }
 Graph *graph_copy(Graph **r, Graph *s){
+  STATS_SCOPE(STATS_GRAPH_COPY);
   Graph *n = malloc(sizeof(Graph));
   n->n_pipes = s->n_pipes;
   n->n_nodes = s->n_nodes;
   n->nodes = malloc(sizeof(Node *) * n->n_nodes);
   n->pipes = malloc(sizeof(Pipe *) * n->n_pipes);
 
-  n->width = s->width;
-  n->depth = s->depth;
+  //Levels are built again when needed
+  n->levels_valid = false;
+  n->level = NULL;
+  n->level_nodes = NULL;
+  n->level_start = NULL;
+  n->n_levels = 0;
+  n->width = -1;
+  n->depth = -1;
 
   //Copy node and pipe values
   for (int i = 0; i < n->n_pipes; i++){
@@ -358,28 +488,44 @@ Graph *graph_copy(Graph **r, Graph *s){
     }
   }
 
-  n->inc_matrix = calloc(sizeof(int) * n->n_nodes * n->n_pipes, 1);
-  n->mass_conservation_matrix = calloc(sizeof(float) * n->n_nodes * n->n_pipes, 1);
-
-  for (int j = 0; j < n->n_nodes; j++){
-  for (int i = 0; i < n->n_pipes; i++){
-    n->mass_conservation_matrix[j*n->n_pipes + i] = s->mass_conservation_matrix[j*n->n_pipes + i];
-    n->inc_matrix[j*n->n_pipes + i] = s->inc_matrix[j*n->n_pipes + i];
+  size_t matrix_size = (size_t) n->n_nodes * n->n_pipes;
+  n->inc_matrix = NULL;
+  n->mass_conservation_matrix = NULL;
+  if (s->inc_matrix != NULL){
+    n->inc_matrix = malloc(sizeof(int) * matrix_size);
+    memcpy(n->inc_matrix, s->inc_matrix, sizeof(int) * matrix_size);
   }
+  if (s->mass_conservation_matrix != NULL){
+    n->mass_conservation_matrix = malloc(sizeof(float) * matrix_size);
+    memcpy(n->mass_conservation_matrix, s->mass_conservation_matrix, sizeof(float) * matrix_size);
   }
 
+  n->thread_pool = s->thread_pool;
+  n->frontier = NULL;
+  n->residuals = NULL;
+  n->zone = NULL;
+  n->leak_through = NULL;
+  n->adjoint_node = NULL;
+  n->adjoint_pipe = NULL;
+  n->leakage_active = false;
+  n->leakage = NULL;
+
   n->friction_model = s->friction_model;
 
   n->fluid_viscosity = s->fluid_viscosity;
   n->fluid_density = s->fluid_density;
 
   //Copy leak data
-  leaks_copy(&n->leaks, s->leaks);
-  Leaks *l = n->leaks;
-
-  //Set leak handlers
-  for (int i = 0; i < l->n; i++){
-    l->nodes[i] = n->nodes[s->leaks->nodes[i]->ID];
+  n->leaks = NULL;
+  if (s->leaks != NULL){
+    leaks_copy(&n->leaks, s->leaks);
+    Leaks *l = n->leaks;
+
+    //Set leak handlers
+    for (int i = 0; i < l->n; i++){
+      l->outfw[i] = s->leaks->outfw[i];
+      l->nodes[i] = n->nodes[s->leaks->nodes[i]->ID];
+    }
   }
 
 
@@ -434,6 +580,16 @@ void graph_destroy(Graph *g){
   free(g->inc_matrix);
   free(g->mass_conservation_matrix);
 
+  free(g->level);
+  free(g->level_nodes);
+  free(g->level_start);
+  free(g->residuals);
+  free(g->zone);
+  free(g->leak_through);
+  free(g->adjoint_node);
+  free(g->adjoint_pipe);
+  free(g->leakage);
+
   free(g);
   return;
 }
@@ -469,9 +625,7 @@ void node_add_pipe_out(Node *n, Pipe *p){
     n->pipes_out = realloc(n->pipes_out, sizeof(Pipe*) * (n->n_pipes_out + 1));
   }
 
-  #ifdef __GRAPH_C_DEBUG_
-  printf("ID: %d, pipes: %d, pipe ID: %d\n", n->ID, n->n_pipes_out, p->ID);
-  #endif
+  LOG_TRACE("ID: %d, pipes: %d, pipe ID: %d", n->ID, n->n_pipes_out, p->ID);
   n->pipes_out[n->n_pipes_out] = p;
   n->n_pipes_out += 1;
 
@@ -540,6 +694,9 @@ void node_print(Node *n){
     } else {
       printf("Doesn't leak\n");
     }
+    if (n->background_flowrate > 0){
+      printf("Background leakage: %f m³/s\n", n->background_flowrate);
+    }
 
     if (n->pressure_measured != -1){  //Pressure measured
       printf("Pressure measured:   %g Pa\n", n->pressure_measured);
@@ -652,6 +809,52 @@ void node_set_leak_flowrate(Node *n, float f){
 float node_get_leak_flowrate(Node *n){
   return n->leak_flowrate;
 }
+_Bool node_get_has_leak(Node *n){
+  return n->has_leak;
+}
+void node_set_emitter(Node *n, float coefficient, float exponent){
+  if (coefficient > 0){
+    n->has_leak = true;
+  } else if (n->emitter_coefficient > 0){
+    n->has_leak = false;
+    n->leak_flowrate = 0;
+  }
+  n->emitter_coefficient = coefficient > 0 ? coefficient : 0;
+  n->emitter_exponent = exponent;
+}
+float node_get_emitter_coefficient(Node *n){
+  return n->emitter_coefficient;
+}
+float node_get_emitter_exponent(Node *n){
+  return n->emitter_exponent;
+}
+float node_get_background_flowrate(Node *n){
+  return n->background_flowrate;
+}
+_Bool node_get_is_input(Node *n){
+  return n->is_input;
+}
+_Bool node_get_is_output(Node *n){
+  return n->is_output;
+}
+_Bool node_get_is_junction(Node *n){
+  return n->is_junction;
+}
+_Bool node_get_is_connected(Node *n){
+  return n->is_connected;
+}
+int node_get_n_pipes_in(Node *n){
+  return n->n_pipes_in;
+}
+int node_get_n_pipes_out(Node *n){
+  return n->n_pipes_out;
+}
+Pipe *node_get_nth_pipe_in(Node *n, int i){
+  return n->pipes_in[i];
+}
+Pipe *node_get_nth_pipe_out(Node *n, int i){
+  return n->pipes_out[i];
+}
 
 //Pipe functions
 int pipe_set_diam(Pipe *p, float d){
@@ -665,6 +868,14 @@ int pipe_set_diam(Pipe *p, float d){
   }
   return -1;
 }
+//d area / d diameter, 0 for geometries without a diameter
+static float pipe_get_area_diam_derivative(Pipe *p){
+  if (p->geometry == GEOMETRY_CIRCULAR ||
+      p->geometry == GEOMETRY_CIRCULAR_ANNULUS){
+    return 1.0/4 * pow(PI, 2);
+  }
+  return 0;
+}
 int pipe_set_side(Pipe *p, float s){
   if (p->geometry == GEOMETRY_SQUARE){
     p->dimensions.squa_side = s;
@@ -691,6 +902,16 @@ void pipe_set_rough(Pipe *p, float r){
 void pipe_set_length(Pipe *p, float l){
   p->length = l;
 }
+void pipe_set_background_leakage(Pipe *p, float coefficient, float exponent){
+  p->background_coefficient = coefficient > 0 ? coefficient : 0;
+  p->background_exponent = exponent;
+}
+float pipe_get_background_coefficient(Pipe *p){
+  return p->background_coefficient;
+}
+float pipe_get_background_exponent(Pipe *p){
+  return p->background_exponent;
+}
 void pipe_set_geometry(Pipe *p, int g){
   p->geometry = g;
 }
@@ -752,12 +973,57 @@ void pipe_set_fluid_density(Pipe *p, float d){
 float pipe_get_fluid_density(Pipe *p){
   return p->fluid_density;
 }
+void pipe_set_flowrate(Pipe *p, float f){
+  p->flowrate = f;
+}
+void pipe_set_fluid_velocity(Pipe *p, float v){
+  p->fluid_velocity = v;
+}
+void pipe_set_pressure_in(Pipe *p, float pr){
+  p->pressure_in = pr;
+}
+void pipe_set_pressure_out(Pipe *p, float pr){
+  p->pressure_out = pr;
+}
 void pipe_set_friction(Pipe *p, float fd){
   p->friction = fd;
 }
 float pipe_get_friction(Pipe *p){
   return p->friction;
 }
+int pipe_get_id(Pipe *p){
+  return p->ID;
+}
+Node *pipe_get_orig(Pipe *p){
+  return p->orig;
+}
+Node *pipe_get_dest(Pipe *p){
+  return p->dest;
+}
+float pipe_get_length(Pipe *p){
+  return p->length;
+}
+float pipe_get_diam(Pipe *p){
+  return p->dimensions.circ_diam;
+}
+float pipe_get_area(Pipe *p){
+  return p->area;
+}
+float pipe_get_rough(Pipe *p){
+  return p->rough;
+}
+float pipe_get_flowrate(Pipe *p){
+  return p->flowrate;
+}
+float pipe_get_fluid_velocity(Pipe *p){
+  return p->fluid_velocity;
+}
+float pipe_get_pressure_in(Pipe *p){
+  return p->pressure_in;
+}
+float pipe_get_pressure_out(Pipe *p){
+  return p->pressure_out;
+}
 float pipe_compute_friction(Pipe *p, FrictionModel fm){
   float fd;
   fd = fm(p->dimensions.circ_diam,
@@ -773,7 +1039,21 @@ float pipe_compute_friction(Pipe *p, FrictionModel fm){
 
 
 //Graph functions
+static void graph_compute_incidence_matrix(Graph *g){
+  if (g->inc_matrix != NULL){
+    return;
+  }
+  g->inc_matrix = calloc(sizeof(int) * (size_t) g->n_nodes * g->n_pipes, 1);
+  for (int i = 0; i < g->n_pipes; i++){
+    g->inc_matrix[(size_t) g->pipes[i]->orig->ID*g->n_pipes + i] = -1;
+    g->inc_matrix[(size_t) g->pipes[i]->dest->ID*g->n_pipes + i] = 1;
+  }
+}
 void graph_compute_mass_conservation_matrix(Graph *g){
+  graph_compute_incidence_matrix(g);
+  if (g->mass_conservation_matrix == NULL){
+    g->mass_conservation_matrix = calloc(sizeof(float) * (size_t) g->n_nodes * g->n_pipes, 1);
+  }
   for (int j = 0; j < g->n_nodes; j++){
   for (int i = 0; i < g->n_pipes; i++){
     g->mass_conservation_matrix[j*g->n_pipes + i] = g->inc_matrix[j*g->n_pipes + i] * g->pipes[i]->area;
@@ -802,6 +1082,7 @@ Pipe **graph_get_pipes(Graph *g){
   return g->pipes;
 }
 void graph_print_incidence_matrix(Graph *g){
+  graph_compute_incidence_matrix(g);
   if (g->inc_matrix == NULL){
     printf("(null)\n");
     return;
@@ -937,6 +1218,9 @@ void graph_print_leak_nodes(Graph *g){
 int graph_get_n_nodes(Graph *g){
   return g->n_nodes;
 }
+int graph_get_n_pipes(Graph *g){
+  return g->n_pipes;
+}
 int graph_get_n_disconnected_nodes(Graph *g){
   int sum = 0;
   for (int i = 0; i < g->n_nodes; i++){
@@ -1132,6 +1416,11 @@ float graph_get_total_outflow(Graph *g){
     float flow = node_get_leak_flowrate(n);
     sum += flow;
   }
+  for (int i = 0; i < g->n_nodes; i++){
+    if (g->nodes[i] != NULL){
+      sum += g->nodes[i]->background_flowrate;
+    }
+  }
   return sum;
 }
 float graph_get_total_leak_outflow(Graph *g){
@@ -1142,7 +1431,12 @@ float graph_get_total_leak_outflow(Graph *g){
     float flow = node_get_leak_flowrate(n);
     sum += flow;
   }
-  printf("%f\n", sum);
+  for (int i = 0; i < g->n_nodes; i++){
+    if (g->nodes[i] != NULL){
+      sum += g->nodes[i]->background_flowrate;
+    }
+  }
+  LOG_DEBUG("Total leak outflow: %f", sum);
   return sum;
 }
 float graph_get_total_calculated_outflow(Graph *g){
@@ -1169,101 +1463,54 @@ void graph_set_inflow_evenly(Graph *g){
     node_set_flowrate_calculated(n, even_outflow);
   }
 }
+//What leaks out of a node: its leak (or emitter) and the background leakage
+//of its pipes in, as last computed
+static float node_get_leak_outflow(Node *n){
+  return (n->has_leak ? n->leak_flowrate : 0) + n->background_flowrate;
+}
+//Every leak flows back up its feeders, split between the pipes in of each
+//node in proportion to their area. All leaks are seeded at once and pushed
+//up in one pass backwards over the levels, so the cost does not depend on
+//the number of leaks, and leaks sharing a meter add up.
 void graph_add_leaks_to_measured_nodes(Graph *g){
-  int num_measured = graph_get_n_measurement_nodes(g);
-  for (int i = 0; i < num_measured; i++){
-    Node *nm = graph_get_nth_measurement_node(g, i);
-    node_set_flowrate_measured(nm, node_get_flowrate_calculated(nm));
+  graph_calculate_geometry(g);
+  if (g->leak_through == NULL){
+    g->leak_through = malloc(sizeof(float) * g->n_nodes);
   }
-
-
-  int num_leaks = graph_get_n_leak_nodes(g);
-
-  for (int index_leak = 0; index_leak < num_leaks; index_leak++){
-    Node *nl = graph_get_nth_leak_node(g, index_leak);
-
-    if (nl->is_measured){
-      if (nl->flowrate_measured != -1){
-        node_set_flowrate_measured(nl, node_get_flowrate_measured(nl) + nl->leak_flowrate);
-      } else {
-        node_set_flowrate_measured(nl, node_get_flowrate_calculated(nl) + nl->leak_flowrate);
-      }
+  float *through = g->leak_through;
+  for (int i = 0; i < g->n_nodes; i++){
+    Node *n = g->nodes[i];
+    through[i] = 0;
+    if (n != NULL){
+      through[i] = node_get_leak_outflow(n);
     }
+  }
 
-    float leak_flowrate = nl->leak_flowrate;
-    float flowrate_per_area;
-
-    Node **node_vector;
-    Node **aux = NULL;
-    float *area_vector;
-    float *aux_area;
-
-    int vector_len = nl->n_pipes_in;
-    int aux_len = 0;
-    node_vector = malloc(sizeof(Node *) * vector_len);
-    area_vector = malloc(sizeof(float) * vector_len);
+  int *order = g->level_nodes;
+  for (int k = g->level_start[g->n_levels] - 1; k >= 0; k--){
+    Node *n = g->nodes[order[k]];
+    float f = through[n->ID];
+    if (f == 0 || n->n_pipes_in == 0){
+      continue;
+    }
+    LOG_TRACE("Node %d carries %f of leaks", n->ID, f);
 
     float total_area_in = 0;
-    for (int i = 0; i < nl->n_pipes_in; i++){
-      Pipe *p = nl->pipes_in[i];
-      node_vector[i] = p->orig;
-      area_vector[i] = p->area;
-      total_area_in += p->area;
+    for (int j = 0; j < n->n_pipes_in; j++){
+      total_area_in += n->pipes_in[j]->area;
     }
-
-    flowrate_per_area = leak_flowrate / total_area_in;
-
-    while (vector_len != 0){
-      for (int i = 0; i < vector_len; i++){
-        Node *n = node_vector[i];
-        int n_pipes = n->n_pipes_in;
-
-        printf("Checking node %d\n", n->ID);
-
-        float node_leaked_flowrate = flowrate_per_area * area_vector[i];
-
-        if (n->is_measured){
-          node_set_flowrate_measured(n, node_get_flowrate_calculated(n) + node_leaked_flowrate);
-        }
-
-        total_area_in = 0;
-        for (int j = 0; j < n_pipes; j++){
-          total_area_in += n->pipes_in[j]->area;
-        }
-        flowrate_per_area = node_leaked_flowrate / total_area_in;
-
-        for (int j = 0; j < n_pipes; j++){
-          Pipe *p = n->pipes_in[j];
-
-          aux_len++;
-          if (aux == NULL){
-            aux = malloc(sizeof(Node *) * aux_len);
-            aux_area = malloc(sizeof(float) * aux_len);
-          } else {
-            aux = realloc(aux, sizeof(Node *) * aux_len);
-            aux_area = realloc(aux_area, sizeof(float) * aux_len);
-          }
-          aux[aux_len - 1] = p->orig;
-          aux_area[aux_len -1] = p->area;
-        }
-      }
-
-      free(node_vector);
-      free(area_vector);
-      node_vector = aux;
-      area_vector = aux_area;
-
-      aux = NULL;
-      aux_area = NULL;
-      vector_len = aux_len;
-      aux_len = 0;
+    for (int j = 0; j < n->n_pipes_in; j++){
+      Pipe *p = n->pipes_in[j];
+      float share = (total_area_in > 0) ? p->area / total_area_in : 1.0f / n->n_pipes_in;
+      through[p->orig->ID] += f * share;
     }
+  }
 
-    if (aux != NULL){
-      free(aux);
+  for (int i = 0; i < g->n_nodes; i++){
+    Node *n = g->nodes[i];
+    if (n != NULL && n->is_measured){
+      node_set_flowrate_measured(n, n->flowrate_calculated + through[i]);
     }
-    free(node_vector);
-
   }
 }
 void graph_add_leaks_to_inflow(Graph *g){
@@ -1358,182 +1605,850 @@ float graph_get_fluid_density(Graph *g){
 void graph_set_friction_model(Graph *g, FrictionModel fm){
   g->friction_model = fm;
 }
-void graph_backpropagate_flowrate(Graph *g){
-  #ifdef __GRAPH_C_DEBUG_
-  printf("BACK PROPAGATING FLOWRATE\n");
-  #endif
+FrictionModel graph_get_friction_model(Graph *g){
+  return g->friction_model;
+}
+void graph_set_thread_pool(Graph *g, ThreadPool *tp){
+  g->thread_pool = tp;
+}
+ThreadPool *graph_get_thread_pool(Graph *g){
+  return g->thread_pool;
+}
 
-  Node **vector;
-  Node **aux = NULL;
-  int n_nodes = graph_get_n_output_nodes(g);
-  int n_aux = 0;
-  vector = malloc(sizeof(Node *) * n_nodes);
-  for (int i = 0; i < n_nodes; i++){
-    vector[i] = graph_get_nth_output_node(g, i);
+//Level-synchronous propagation.
+//Every pipe goes from a lower level to a higher one, so the nodes of one
+//level only depend on the levels before it (pressure) or after it
+//(flowrate) and can be computed in any order, in parallel. Every node only
+//writes its own pipes (its pipes in for flowrate, its pipes out for
+//pressure), so no locks or atomics are needed.
+static void graph_run_levels(Graph *g, int first_level, int step, ThreadPoolTask task){
+  for (int l = first_level; l >= 0 && l < g->n_levels; l += step){
+    int n_frontier = g->level_start[l + 1] - g->level_start[l];
+    unsigned long level_start = stats_timer_start();
+    stats_count(STATS_LEVELS, 1);
+    stats_count(STATS_NODES_PROPAGATED, n_frontier);
+
+    g->frontier = g->level_nodes + g->level_start[l];
+    if (g->thread_pool == NULL || n_frontier < GRAPH_PARALLEL_MIN_LEVEL){
+      task(g, 0, n_frontier, 0);
+    } else {
+      stats_count(STATS_PARALLEL_LEVELS, 1);
+      thread_pool_run(g->thread_pool, task, g, n_frontier);
+    }
+
+    stats_timer_stop(STATS_PROPAGATION_LEVEL, level_start);
   }
+}
 
+static void graph_backpropagate_level(void *arg, int first, int last, int thread){
+  Graph *g = arg;
 
-  while (n_nodes != 0){
-    for (int i = 0; i < n_nodes; i++){
-      Node *n = vector[i];
-      int n_pipes = n->n_pipes_in;
+  for (int i = first; i < last; i++){
+    Node *n = g->nodes[g->frontier[i]];
+    int n_pipes = n->n_pipes_in;
 
-      //Sum flowrate demanded from outgoing pipes:
-      if (! n->is_output){
-        float sum = 0;
-        for (int k = 0; k < n->n_pipes_out; k++){
-          sum += n->pipes_out[k]->flowrate;
-        }
+    //The inflow of the inputs is given
+    if (n->is_input){
+      continue;
+    }
 
-        n->flowrate_calculated = sum;
+    //Sum flowrate demanded from outgoing pipes:
+    if (! n->is_output){
+      float sum = 0;
+      for (int k = 0; k < n->n_pipes_out; k++){
+        sum += n->pipes_out[k]->flowrate;
       }
 
-      float sum_area_in = 0;
-      for (int j = 0; j < n_pipes; j++){
-        sum_area_in += n->pipes_in[j]->area;
-      }
-      float flowrate_divided = n->flowrate_calculated / sum_area_in;
-
-
-      for (int j = 0; j < n_pipes; j++){
-        Pipe *p = n->pipes_in[j];
-        p->flowrate = flowrate_divided * p->area;
-
-        p->fluid_velocity = p->flowrate / p->area;
-
-        if (p->orig->is_input == false){
-          int is_added = false;
-          for (int k = 0; k < n_aux; k++){
-            if (aux[k] == p->orig){
-              is_added = true;
-            }
-          }
-          if (! is_added){
-            n_aux ++;
-            if (aux == NULL){
-              aux = malloc(sizeof(Node *) * n_aux);
-            } else {
-              aux = realloc(aux, sizeof(Node *) *n_aux);
-            }
-            aux[n_aux - 1] = p->orig;
-          }
-        }
-      }
+      n->flowrate_calculated = sum;
     }
 
-    free(vector);
-    vector = aux;
-    aux = NULL;
-    n_nodes = n_aux;
-    n_aux = 0;
-  }
-  if (aux != NULL){
-    free(aux);
+    float inflow = n->flowrate_calculated;
+    if (g->leakage_active){
+      inflow += g->leakage[n->ID];
+    }
+
+    float sum_area_in = 0;
+    for (int j = 0; j < n_pipes; j++){
+      sum_area_in += n->pipes_in[j]->area;
+    }
+    float flowrate_divided = inflow / sum_area_in;
+
+    for (int j = 0; j < n_pipes; j++){
+      Pipe *p = n->pipes_in[j];
+      p->flowrate = flowrate_divided * p->area;
+
+      p->fluid_velocity = p->flowrate / p->area;
+    }
   }
-  free(vector);
 }
-void graph_propagate_pressure(Graph *g){
-  #ifdef __GRAPH_C_DEBUG_
-  printf("PROPAGATING PRESSURES:\n");
-  #endif
+void graph_backpropagate_flowrate(Graph *g){
+  STATS_SCOPE(STATS_BACKPROPAGATE);
+  LOG_DEBUG("Back propagating flowrate");
 
-  Node **vector;
-  Node **aux = NULL;
-  int n_nodes = graph_get_n_input_nodes(g);
-  int n_aux = 0;
-  vector = malloc(sizeof(Node *) * n_nodes);
+  graph_calculate_geometry(g);
+  graph_run_levels(g, g->n_levels - 1, -1, graph_backpropagate_level);
+}
+//Friction evaluations seen by this thread, sampling continues across tasks
+static _Thread_local unsigned long graph_friction_sample = 0;
 
-  for (int i = 0; i < n_nodes; i++){
-    vector[i] = graph_get_nth_input_node(g, i);
-  }
+static void graph_propagate_pressure_level(void *arg, int first, int last, int thread){
+  Graph *g = arg;
 
-  while (n_nodes != 0){
-    for (int i = 0; i < n_nodes; i++){
-      Node *n = vector[i];
-      int n_pipes = n->n_pipes_out;
+  //Friction time is sampled (reading the TSC around every pipe costs about
+  //as much as the friction itself) and recorded once per task
+  _Bool stats = stats_on();
+  unsigned long friction_ticks = 0;
+  unsigned long friction_evals = 0;
 
-      float sum_area_out = 0;
-      for (int j = 0; j < n_pipes; j++){
-        sum_area_out += n->pipes_out[j]->area;
+  for (int i = first; i < last; i++){
+    Node *n = g->nodes[g->frontier[i]];
+    int n_pipes = n->n_pipes_out;
+
+    //Get pressure for every out-pipe
+    float pressure_divided = n->pressure_calculated;
+
+    for (int j = 0; j < n_pipes; j++){
+      Pipe *p = n->pipes_out[j];
+
+      //Set pressure in
+      p->pressure_in = pressure_divided;
+
+      //Calculate friction
+      _Bool sample = false;
+      if (stats){
+        friction_evals++;
+        sample = (graph_friction_sample++ % GRAPH_STATS_FRICTION_SAMPLE == 0);
+      }
+      if (sample){
+        unsigned long t0 = stats_ticks();
+        pipe_compute_friction(p, g->friction_model);
+        friction_ticks += (stats_ticks() - t0) * GRAPH_STATS_FRICTION_SAMPLE;
+      } else {
+        pipe_compute_friction(p, g->friction_model);
       }
 
-      float sum_area_in = 0;
-      for (int j = 0; j < n->n_pipes_in; j++){
-        sum_area_in += n->pipes_in[j]->area;
+      //Set pressure in next node
+      float pressure_drop = calculate_pressure_drop(p->fluid_velocity,
+                                                    p->dimensions.circ_diam,
+                                                    p->length,
+                                                    p->friction,
+                                                    p->fluid_density);
+
+      LOG_TRACE("Pressure drop: %f", pressure_drop);
+
+      p->pressure_out = p->pressure_in - pressure_drop;
+
+      //With several pipes in, the last one sets the node pressure
+      Node *dest = p->dest;
+      if (p == dest->pipes_in[dest->n_pipes_in - 1]){
+        dest->pressure_calculated = p->pressure_out;
       }
+    }
+  }
 
-      //Get pressure for every out-pipe
-      float pressure_divided = n->pressure_calculated;
+  if (friction_evals > 0){
+    stats_add_ticks(STATS_FRICTION, friction_ticks, 1);
+    stats_count(STATS_FRICTION_EVALS, friction_evals);
+  }
+}
+void graph_propagate_pressure(Graph *g){
+  STATS_SCOPE(STATS_PROPAGATE_PRESSURE);
+  LOG_DEBUG("Propagating pressures");
+
+  graph_calculate_geometry(g);
+  graph_run_levels(g, 0, 1, graph_propagate_pressure_level);
+}
+
+//Adjoint of the two propagations above.
+//The forward solve is explicit, so its reverse is too: pressures are
+//differentiated backwards over the levels and flowrates forwards, the
+//opposite order of the passes they reverse. The only checkpoints are the
+//flowrates and velocities the forward solve leaves on the pipes, so the
+//gradient costs about one more solve whatever the number of parameters,
+//and the level tasks are parallel for the same reasons as the forward ones.
+
+//Friction and its derivatives, central differences for models without them
+static double graph_friction_derivatives(Graph *g, Pipe *p, double *d_diam, double *d_rough, double *d_vel){
+  float diam = p->dimensions.circ_diam;
+  float rough = p->rough;
+  float dens = p->fluid_density;
+  float visc = p->fluid_viscosity;
+  float vel = p->fluid_velocity;
+  FrictionModelDerivatives fmd = friction_model_get_derivatives(g->friction_model);
+  if (fmd != NULL){
+    float fd_diam, fd_rough, fd_vel;
+    float fd = fmd(diam, rough, dens, visc, vel, &fd_diam, &fd_rough, &fd_vel);
+    *d_diam = fd_diam;
+    *d_rough = fd_rough;
+    *d_vel = fd_vel;
+    return fd;
+  }
+  FrictionModel fm = g->friction_model;
+  float h = diam * GRAPH_ADJOINT_STEP;
+  *d_diam = (fm(diam + h, rough, dens, visc, vel) - fm(diam - h, rough, dens, visc, vel)) / (2*h);
+  h = (rough > 0 ? rough : diam) * GRAPH_ADJOINT_STEP;
+  *d_rough = (fm(diam, rough + h, dens, visc, vel) - fm(diam, rough - h, dens, visc, vel)) / (2*h);
+  h = fabsf(vel) * GRAPH_ADJOINT_STEP;
+  if (h > 0){
+    *d_vel = (fm(diam, rough, dens, visc, vel + h) - fm(diam, rough, dens, visc, vel - h)) / (2*h);
+  } else {
+    *d_vel = 0;
+  }
+  return fm(diam, rough, dens, visc, vel);
+}
+static void graph_adjoint_pressure_level(void *arg, int first, int last, int thread){
+  Graph *g = arg;
+  float *adjoint_pressure = g->adjoint_node;
+  float *adjoint_velocity = g->adjoint_pipe;
+  float *grad_diam = g->adjoint_pipe + g->n_pipes;
+  float *grad_rough = g->adjoint_pipe + 2 * g->n_pipes;
 
-      // pressure_divided = n->pressure_calculated / sum_area_out;
-      // if (! n->is_input){
-      //   float pout = n->pressure_calculated/sum_area_in;
-      //   float pout = (n->pressure_calculated*sum_area_in)/sum_area_out;
-      //   pressure_divided = pout / sum_area_out;
-      // } else {
-      //   pressure_divided = n->pressure_calculated / sum_area_out;
-      // }
+  for (int i = first; i < last; i++){
+    Node *n = g->nodes[g->frontier[i]];
+    double adjoint = adjoint_pressure[n->ID];
 
-      for (int j = 0; j < n_pipes; j++){
-        Pipe *p = n->pipes_out[j];
+    for (int j = 0; j < n->n_pipes_out; j++){
+      Pipe *p = n->pipes_out[j];
 
-        // printf("Doing pipe %d\n", p->ID);
+      //Only the last pipe in sets the pressure of its node
+      Node *dest = p->dest;
+      if (p != dest->pipes_in[dest->n_pipes_in - 1]){
+        continue;
+      }
+      //pressure_out = pressure_in - drop
+      double adjoint_out = adjoint_pressure[dest->ID];
+      adjoint += adjoint_out;
+
+      //drop = fd L/D dens/2 vel²
+      double d_diam, d_rough, d_vel;
+      double fd = graph_friction_derivatives(g, p, &d_diam, &d_rough, &d_vel);
+      double diam = p->dimensions.circ_diam;
+      double vel = p->fluid_velocity;
+      double k = p->length / diam * p->fluid_density / 2;
+      double adjoint_drop = -adjoint_out;
+
+      adjoint_velocity[p->ID] = adjoint_drop * k * (d_vel * vel * vel + 2 * fd * vel);
+      grad_diam[p->ID] = adjoint_drop * k * vel * vel * (d_diam - fd / diam);
+      grad_rough[p->ID] = adjoint_drop * k * vel * vel * d_rough;
+    }
 
-        //Set pressure in
-        p->pressure_in = pressure_divided;
-        // p->pressure_in = pressure_divided * p->area;
+    adjoint_pressure[n->ID] = adjoint;
+  }
+}
+static void graph_adjoint_flowrate_level(void *arg, int first, int last, int thread){
+  Graph *g = arg;
+  float *adjoint_flowrate = g->adjoint_node + g->n_nodes;
+  float *adjoint_velocity = g->adjoint_pipe;
+  float *grad_diam = g->adjoint_pipe + g->n_pipes;
+
+  for (int i = first; i < last; i++){
+    Node *n = g->nodes[g->frontier[i]];
+    if (n->is_input){
+      continue;
+    }
 
-        // printf("Pressure in  = %f\n", p->pressure_in);
+    //Every pipe in carries flowrate * area / sum_area at flowrate / sum_area,
+    //and its flowrate adds up into the node it comes from
+    float sum_area_in = 0;
+    double adjoint_in = 0;
+    for (int j = 0; j < n->n_pipes_in; j++){
+      Pipe *p = n->pipes_in[j];
+      Node *orig = p->orig;
+      double adjoint_pipe = (orig->is_input || orig->is_output) ? 0 : adjoint_flowrate[orig->ID];
+      sum_area_in += p->area;
+      adjoint_in += adjoint_pipe * p->area + adjoint_velocity[p->ID];
+    }
+    if (sum_area_in == 0){
+      continue;
+    }
+    adjoint_in /= sum_area_in;
+    adjoint_flowrate[n->ID] += adjoint_in;
+
+    double vel = n->flowrate_calculated / sum_area_in;
+    for (int j = 0; j < n->n_pipes_in; j++){
+      Pipe *p = n->pipes_in[j];
+      Node *orig = p->orig;
+      double adjoint_pipe = (orig->is_input || orig->is_output) ? 0 : adjoint_flowrate[orig->ID];
+      grad_diam[p->ID] += vel * (adjoint_pipe - adjoint_in) * pipe_get_area_diam_derivative(p);
+    }
+  }
+}
+float graph_compute_misfit_gradient(Graph *g, float pressure_weight, float flowrate_weight,
+                                    float *d_rough, float *d_diam, float *d_demand){
+  STATS_SCOPE(STATS_ADJOINT);
+  LOG_DEBUG("Computing misfit gradient");
 
+  graph_calculate_geometry(g);
+  if (g->adjoint_node == NULL){
+    g->adjoint_node = malloc(sizeof(float) * 2 * g->n_nodes);
+    g->adjoint_pipe = malloc(sizeof(float) * 3 * g->n_pipes);
+  }
+  float *adjoint_pressure = g->adjoint_node;
+  float *adjoint_flowrate = g->adjoint_node + g->n_nodes;
+  memset(g->adjoint_pipe, 0, sizeof(float) * 3 * g->n_pipes);
 
-        //Calculate friction
-        pipe_compute_friction(p, g->friction_model);
+  //Seed the adjoints with the misfit of every meter
+  double misfit = 0;
+  for (int i = 0; i < g->n_nodes; i++){
+    Node *n = g->nodes[i];
+    adjoint_pressure[i] = 0;
+    adjoint_flowrate[i] = 0;
+    if (n == NULL || ! n->is_measured || n->is_input || g->level[i] == -1){
+      continue;
+    }
+    if (n->pressure_measured != -1){
+      float r = n->pressure_calculated - n->pressure_measured;
+      misfit += 0.5 * pressure_weight * r * r;
+      adjoint_pressure[i] = pressure_weight * r;
+    }
+    if (! n->is_output && n->flowrate_measured != -1){
+      float r = n->flowrate_calculated - n->flowrate_measured;
+      misfit += 0.5 * flowrate_weight * r * r;
+      adjoint_flowrate[i] = flowrate_weight * r;
+    }
+  }
 
-        //Set pressure in next node
-        float pressure_drop = calculate_pressure_drop(p->fluid_velocity,
-                                                      p->dimensions.circ_diam,
-                                                      p->length,
-                                                      p->friction,
-                                                      p->fluid_density);
+  graph_run_levels(g, g->n_levels - 1, -1, graph_adjoint_pressure_level);
+  graph_run_levels(g, 0, 1, graph_adjoint_flowrate_level);
 
-        #ifdef __GRAPH_C_DEBUG_
-        printf("Pressure drop: %f\n", pressure_drop);
-        #endif
+  float *grad_diam = g->adjoint_pipe + g->n_pipes;
+  float *grad_rough = g->adjoint_pipe + 2 * g->n_pipes;
+  if (d_rough != NULL){
+    memcpy(d_rough, grad_rough, sizeof(float) * g->n_pipes);
+  }
+  if (d_diam != NULL){
+    memcpy(d_diam, grad_diam, sizeof(float) * g->n_pipes);
+  }
+  if (d_demand != NULL){
+    for (int i = 0; i < g->n_nodes; i++){
+      Node *n = g->nodes[i];
+      d_demand[i] = (n != NULL && n->is_output && g->level[i] != -1) ? adjoint_flowrate[i] : 0;
+    }
+  }
+  return misfit;
+}
+
+//Multi-source solve (global gradient algorithm).
+//Inputs hold their pressure and every pipe loses h(Q) = fd L/D dens/2 v|v|
+//along its flowrate Q, in either direction. Each Newton step linearises h
+//around the current flowrates, h ≈ h(Q) + h'(Q) (Q' - Q), which makes the
+//new flowrate of every pipe y + w (P_orig - P_dest) with w = 1/h' and
+//y = Q - h/h'. Continuity at every node that is not an input is then the
+//weighted Laplacian system
+//  Σ w (P_node - P_other) = Σ_in y - Σ_out y - demand
+//solved by conjugate gradients. The preconditioner is the same system on
+//the spanning forest of the network rooted at the inputs that keeps the
+//largest weights (rebuilt every step, the weights of a pipe change by
+//orders of magnitude with its flowrate), solved exactly by elimination up
+//and down the forest. Trees take one CG iteration, and the loops left out
+//are the pipes that carry the least.
+
+//Node kinds of the solve
+#define GRAPH_SOURCES_UNREACHED 0
+#define GRAPH_SOURCES_FREE 1
+#define GRAPH_SOURCES_FIXED 2
+
+typedef struct GraphSourcesEdge{
+  double weight;
+  int pipe;
+} GraphSourcesEdge;
+
+typedef struct GraphSources{
+  unsigned char *kind;  //Per node ID
+  int *free;            //Free node IDs, ascending
+  int n_free;
+  int *fixed;           //Input IDs
+  int n_fixed;
+  int *start;           //Per node ID, its pipes of the solve in adj_*
+  int *adj_node;
+  int *adj_pipe;
+  double *weight;       //Per pipe ID, 1/h'
+
+  //Preconditioner
+  GraphSourcesEdge *edges;  //Pipes of the solve
+  int n_edges;
+  int *set;                 //Union-find of the forest, per node ID
+  unsigned char *in_forest; //Per pipe ID
+  int *order;               //Free nodes breadth first, parents first
+  int *up;                  //Per node ID, parent in the forest (-1 an input)
+  double *up_weight;
+  double *pivot;
+} GraphSources;
+
+static int graph_sources_edge_compare(const void *a, const void *b){
+  const GraphSourcesEdge *ea = a;
+  const GraphSourcesEdge *eb = b;
+  if (ea->weight != eb->weight){
+    return ea->weight > eb->weight ? -1 : 1;
+  }
+  return ea->pipe - eb->pipe;
+}
+static int graph_sources_find(int *set, int i){
+  while (set[i] != i){
+    set[i] = set[set[i]];
+    i = set[i];
+  }
+  return i;
+}
+//Maximum weight spanning forest (Kruskal), all inputs being one root, its
+//breadth first order from them and its pivots
+static void graph_sources_forest(GraphSources *s, Graph *g){
+  for (int k = 0; k < s->n_fixed; k++){
+    s->set[s->fixed[k]] = s->fixed[0];
+  }
+  for (int k = 0; k < s->n_free; k++){
+    s->set[s->free[k]] = s->free[k];
+    s->up[s->free[k]] = -2;
+  }
+  for (int e = 0; e < s->n_edges; e++){
+    s->edges[e].weight = s->weight[s->edges[e].pipe];
+  }
+  qsort(s->edges, s->n_edges, sizeof(GraphSourcesEdge), graph_sources_edge_compare);
+  for (int e = 0; e < s->n_edges; e++){
+    Pipe *p = g->pipes[s->edges[e].pipe];
+    int a = graph_sources_find(s->set, p->orig->ID);
+    int b = graph_sources_find(s->set, p->dest->ID);
+    s->in_forest[p->ID] = (a != b);
+    if (a != b){
+      s->set[a] = b;
+    }
+  }
 
-        p->pressure_out = p->pressure_in - pressure_drop;
-        // p->pressure_out = p->friction / (pow(p->fluid_velocity, 2) * p->area);
+  //Inputs, then every free node as it is reached
+  int len = 0;
+  for (int k = -s->n_fixed; k < len; k++){
+    int i = (k < 0) ? s->fixed[k + s->n_fixed] : s->order[k];
+    for (int a = s->start[i]; a < s->start[i + 1]; a++){
+      int o = s->adj_node[a];
+      if (! s->in_forest[s->adj_pipe[a]] || s->kind[o] != GRAPH_SOURCES_FREE || s->up[o] != -2){
+        continue;
+      }
+      s->up[o] = (k < 0) ? -1 : i;
+      s->up_weight[o] = s->weight[s->adj_pipe[a]];
+      s->order[len++] = o;
+    }
+  }
 
-        // printf("Pressure out = %f\n", p->pressure_out);
+  for (int k = 0; k < s->n_free; k++){
+    s->pivot[s->free[k]] = 0;
+  }
+  for (int k = s->n_free - 1; k >= 0; k--){
+    int i = s->order[k];
+    double w = s->up_weight[i];
+    s->pivot[i] += w;
+    if (s->up[i] >= 0){
+      s->pivot[s->up[i]] += w * (1 - w / s->pivot[i]);
+    }
+  }
+}
+//y = A x over the free nodes
+static void graph_sources_multiply(GraphSources *s, const double *x, double *y){
+  for (int k = 0; k < s->n_free; k++){
+    int i = s->free[k];
+    double sum = 0;
+    for (int a = s->start[i]; a < s->start[i + 1]; a++){
+      int o = s->adj_node[a];
+      double w = s->weight[s->adj_pipe[a]];
+      sum += w * x[i];
+      if (s->kind[o] == GRAPH_SOURCES_FREE){
+        sum -= w * x[o];
+      }
+    }
+    y[i] = sum;
+  }
+}
+//z = M⁻¹ r, M the system restricted to the forest
+static void graph_sources_precondition(GraphSources *s, const double *r, double *z){
+  for (int k = 0; k < s->n_free; k++){
+    z[s->free[k]] = r[s->free[k]];
+  }
+  for (int k = s->n_free - 1; k >= 0; k--){
+    int i = s->order[k];
+    if (s->up[i] >= 0){
+      z[s->up[i]] += s->up_weight[i] * z[i] / s->pivot[i];
+    }
+  }
+  for (int k = 0; k < s->n_free; k++){
+    int i = s->order[k];
+    double from = (s->up[i] >= 0) ? s->up_weight[i] * z[s->up[i]] : 0;
+    z[i] = (z[i] + from) / s->pivot[i];
+  }
+}
+static double graph_sources_dot(GraphSources *s, const double *a, const double *b){
+  double sum = 0;
+  for (int k = 0; k < s->n_free; k++){
+    sum += a[s->free[k]] * b[s->free[k]];
+  }
+  return sum;
+}
+//Preconditioned conjugate gradients for A x = b, from x, until the flowrate
+//imbalance is below GRAPH_SOURCES_CG_TOLERANCE of the flowrates around the
+//nodes (scale, b being mostly the pressures of the inputs). Returns the
+//iterations, -1 if GRAPH_SOURCES_CG_ITERATIONS were not enough.
+static int graph_sources_cg(GraphSources *s, const double *b, const double *scale, double *x,
+                            double *r, double *z, double *d, double *ad){
+  graph_sources_multiply(s, x, ad);
+  for (int k = 0; k < s->n_free; k++){
+    int i = s->free[k];
+    r[i] = b[i] - ad[i];
+  }
+  //Nothing flows (no demand): relative to b
+  double norm = sqrt(graph_sources_dot(s, scale, scale));
+  double limit = GRAPH_SOURCES_CG_TOLERANCE * ((norm > 0) ? norm : sqrt(graph_sources_dot(s, b, b)));
+  graph_sources_precondition(s, r, z);
+  double rz = graph_sources_dot(s, r, z);
+  for (int k = 0; k < s->n_free; k++){
+    d[s->free[k]] = z[s->free[k]];
+  }
+
+  for (int it = 0; it < GRAPH_SOURCES_CG_ITERATIONS; it++){
+    if (sqrt(graph_sources_dot(s, r, r)) <= limit){
+      return it;
+    }
+    graph_sources_multiply(s, d, ad);
+    double alpha = rz / graph_sources_dot(s, d, ad);
+    for (int k = 0; k < s->n_free; k++){
+      int i = s->free[k];
+      x[i] += alpha * d[i];
+      r[i] -= alpha * ad[i];
+    }
+    graph_sources_precondition(s, r, z);
+    double rz_new = graph_sources_dot(s, r, z);
+    double beta = rz_new / rz;
+    rz = rz_new;
+    for (int k = 0; k < s->n_free; k++){
+      int i = s->free[k];
+      d[i] = z[i] + beta * d[i];
+    }
+  }
+  return -1;
+}
+int graph_solve_sources(Graph *g, int max_iterations, float tolerance){
+  STATS_SCOPE(STATS_SOURCES);
+  LOG_DEBUG("Solving sources");
 
-        p->dest->pressure_calculated = p->pressure_out;
+  //Every input must hold a pressure
+  for (int i = 0; i < g->n_nodes; i++){
+    Node *n = g->nodes[i];
+    if (n != NULL && n->is_input && n->pressure_calculated == -1){
+      LOG_DEBUG("Input %d has no pressure", i);
+      return -1;
+    }
+  }
 
+  int n_nodes = g->n_nodes;
+  int n_pipes = g->n_pipes;
+  GraphSources s;
+  s.kind = calloc(n_nodes, sizeof(unsigned char));
+  s.free = malloc(sizeof(int) * n_nodes);
+  s.fixed = malloc(sizeof(int) * n_nodes);
+  s.start = calloc(n_nodes + 1, sizeof(int));
+  s.adj_node = malloc(sizeof(int) * 2 * n_pipes);
+  s.adj_pipe = malloc(sizeof(int) * 2 * n_pipes);
+  s.weight = malloc(sizeof(double) * n_pipes);
+  s.edges = malloc(sizeof(GraphSourcesEdge) * n_pipes);
+  s.set = malloc(sizeof(int) * n_nodes);
+  s.in_forest = calloc(n_pipes, sizeof(unsigned char));
+  s.order = malloc(sizeof(int) * n_nodes);
+  s.up = malloc(sizeof(int) * n_nodes);
+  s.up_weight = malloc(sizeof(double) * n_nodes);
+  s.pivot = malloc(sizeof(double) * n_nodes);
+  double *pressure = malloc(sizeof(double) * 7 * n_nodes);
+  double *b = pressure + n_nodes;
+  double *r = pressure + 2 * n_nodes;
+  double *z = pressure + 3 * n_nodes;
+  double *d = pressure + 4 * n_nodes;
+  double *ad = pressure + 5 * n_nodes;
+  double *scale = pressure + 6 * n_nodes;
+  double *flowrate = malloc(sizeof(double) * 2 * n_pipes);
+  double *y = flowrate + n_pipes;
+  int *pipes = malloc(sizeof(int) * n_pipes);
+
+  //Breadth first from every input at once for what they reach
+  s.n_fixed = 0;
+  double max_pressure = 0;
+  for (int i = 0; i < n_nodes; i++){
+    Node *n = g->nodes[i];
+    if (n != NULL && n->is_input){
+      s.kind[i] = GRAPH_SOURCES_FIXED;
+      s.fixed[s.n_fixed++] = i;
+      pressure[i] = n->pressure_calculated;
+      max_pressure = fmax(max_pressure, pressure[i]);
+    }
+  }
+  int len = 0;
+  for (int k = -s.n_fixed; k < len; k++){
+    Node *n = g->nodes[(k < 0) ? s.fixed[k + s.n_fixed] : s.order[k]];
+    for (int j = 0; j < n->n_pipes_in + n->n_pipes_out; j++){
+      Pipe *p = (j < n->n_pipes_in) ? n->pipes_in[j] : n->pipes_out[j - n->n_pipes_in];
+      Node *o = (p->orig == n) ? p->dest : p->orig;
+      if (g->nodes[o->ID] != o || s.kind[o->ID] != GRAPH_SOURCES_UNREACHED){
+        continue;
+      }
+      s.kind[o->ID] = GRAPH_SOURCES_FREE;
+      s.order[len++] = o->ID;
+      pressure[o->ID] = (o->pressure_calculated != -1) ? o->pressure_calculated : max_pressure;
+    }
+  }
+  s.n_free = 0;
+  for (int i = 0; i < n_nodes; i++){
+    if (s.kind[i] == GRAPH_SOURCES_FREE){
+      s.free[s.n_free++] = i;
+    }
+  }
 
+  //Pipes between reached nodes, and the neighbours of every node through them
+  int n_solve = 0;
+  for (int i = 0; i < n_pipes; i++){
+    Pipe *p = g->pipes[i];
+    if (g->nodes[p->orig->ID] == p->orig && g->nodes[p->dest->ID] == p->dest &&
+        s.kind[p->orig->ID] != GRAPH_SOURCES_UNREACHED && s.kind[p->dest->ID] != GRAPH_SOURCES_UNREACHED){
+      pipes[n_solve++] = i;
+      s.start[p->orig->ID + 1]++;
+      s.start[p->dest->ID + 1]++;
+    }
+  }
+  for (int i = 0; i < n_nodes; i++){
+    s.start[i + 1] += s.start[i];
+  }
+  int *fill = s.set;
+  memcpy(fill, s.start, sizeof(int) * n_nodes);
+  for (int e = 0; e < n_solve; e++){
+    Pipe *p = g->pipes[pipes[e]];
+    s.adj_node[fill[p->orig->ID]] = p->dest->ID;
+    s.adj_pipe[fill[p->orig->ID]++] = p->ID;
+    s.adj_node[fill[p->dest->ID]] = p->orig->ID;
+    s.adj_pipe[fill[p->dest->ID]++] = p->ID;
+    s.edges[e].pipe = p->ID;
+  }
+  s.n_edges = n_solve;
+
+  //Start from the area split of the levels where there is one
+  graph_backpropagate_flowrate(g);
+  for (int e = 0; e < n_solve; e++){
+    Pipe *p = g->pipes[pipes[e]];
+    _Bool leveled = g->level[p->orig->ID] != -1 && g->level[p->dest->ID] != -1;
+    flowrate[p->ID] = (leveled && p->flowrate > 0) ? p->flowrate : 0;
+  }
+
+  int iterations = -1;
+  for (int it = 1; it <= max_iterations; it++){
+    //Linearise every pipe
+    for (int e = 0; e < n_solve; e++){
+      Pipe *p = g->pipes[pipes[e]];
+      double q = flowrate[p->ID];
+      double vel = fmax(fabs(q) / p->area, GRAPH_SOURCES_MIN_VELOCITY);
+      p->fluid_velocity = vel;
+      double d_diam, d_rough, d_vel;
+      double fd = graph_friction_derivatives(g, p, &d_diam, &d_rough, &d_vel);
+      double k = p->length / p->dimensions.circ_diam * p->fluid_density / 2;
+      double h = k * fd * vel * vel;
+      double dh = fmax(k * (d_vel * vel * vel + 2 * fd * vel) / p->area, GRAPH_SOURCES_MIN_RESISTANCE);
+      s.weight[p->ID] = 1 / dh;
+      y[p->ID] = q - copysign(h, q) / dh;
+    }
 
-        // printf("\n");
-        if (p->dest->is_output == false){
-          n_aux++;
-          if (aux == NULL){
-            aux = malloc(sizeof(Node *) * n_aux);
-          } else {
-            aux = realloc(aux, sizeof(Node *) * n_aux);
-          }
-          aux[n_aux - 1] = p->dest;
+    //Continuity of every free node
+    for (int k = 0; k < s.n_free; k++){
+      Node *n = g->nodes[s.free[k]];
+      double sum = (n->is_output && n->flowrate_calculated != -1) ? -n->flowrate_calculated : 0;
+      sum -= node_get_leak_outflow(n);
+      double flow = fabs(sum);
+      for (int a = s.start[n->ID]; a < s.start[n->ID + 1]; a++){
+        Pipe *p = g->pipes[s.adj_pipe[a]];
+        int o = s.adj_node[a];
+        sum += (p->dest == n) ? y[p->ID] : -y[p->ID];
+        flow += fabs(flowrate[p->ID]);
+        if (s.kind[o] == GRAPH_SOURCES_FIXED){
+          sum += s.weight[p->ID] * pressure[o];
         }
       }
+      b[n->ID] = sum;
+      scale[n->ID] = flow;
+    }
+
+    graph_sources_forest(&s, g);
+    int cg = graph_sources_cg(&s, b, scale, pressure, r, z, d, ad);
+    if (cg == -1){
+      LOG_DEBUG("Source pressures did not converge");
+      break;
+    }
+
+    //New flowrates
+    double change = 0;
+    double total = 0;
+    for (int e = 0; e < n_solve; e++){
+      Pipe *p = g->pipes[pipes[e]];
+      double q = y[p->ID] + s.weight[p->ID] * (pressure[p->orig->ID] - pressure[p->dest->ID]);
+      change += fabs(q - flowrate[p->ID]);
+      total += fabs(q);
+      flowrate[p->ID] = q;
+    }
+    LOG_DEBUG("Sources iteration %d, %d CG iterations, flowrate change %g", it, cg, change / total);
+    if (change <= tolerance * total){
+      iterations = it;
+      break;
+    }
+  }
+
+  //Pipes carry their flowrate against them when it is negative
+  for (int e = 0; e < n_solve; e++){
+    Pipe *p = g->pipes[pipes[e]];
+    p->flowrate = flowrate[p->ID];
+    p->fluid_velocity = fabs(p->flowrate) / p->area;
+    pipe_compute_friction(p, g->friction_model);
+    p->fluid_velocity = p->flowrate / p->area;
+    p->pressure_in = pressure[p->orig->ID];
+    p->pressure_out = pressure[p->dest->ID];
+  }
+  //Inputs supply what leaves them and their own leak (negative when they
+  //are filled), other nodes carry what enters them
+  for (int i = 0; i < n_nodes; i++){
+    if (s.kind[i] == GRAPH_SOURCES_UNREACHED){
+      continue;
+    }
+    Node *n = g->nodes[i];
+    double supplied = 0;
+    double through = 0;
+    for (int a = s.start[i]; a < s.start[i + 1]; a++){
+      Pipe *p = g->pipes[s.adj_pipe[a]];
+      double q = (p->dest == n) ? flowrate[p->ID] : -flowrate[p->ID];
+      supplied -= q;
+      through += fmax(q, 0);
+    }
+    if (n->is_input){
+      n->flowrate_calculated = supplied + node_get_leak_outflow(n);
+    } else {
+      n->pressure_calculated = pressure[i];
+      if (! n->is_output){
+        n->flowrate_calculated = through;
+      }
+    }
+  }
+
+  free(s.kind);
+  free(s.free);
+  free(s.fixed);
+  free(s.start);
+  free(s.adj_node);
+  free(s.adj_pipe);
+  free(s.weight);
+  free(s.edges);
+  free(s.set);
+  free(s.in_forest);
+  free(s.order);
+  free(s.up);
+  free(s.up_weight);
+  free(s.pivot);
+  free(pressure);
+  free(flowrate);
+  free(pipes);
+  return iterations;
+}
+int graph_get_source_shares(Graph *g, float *shares){
+  int n_nodes = g->n_nodes;
+  int *source = malloc(sizeof(int) * n_nodes);
+  int n_sources = 0;
+  for (int i = 0; i < n_nodes; i++){
+    Node *n = g->nodes[i];
+    source[i] = (n != NULL && n->is_input) ? n_sources++ : -1;
+  }
+
+  //Nodes in the order the water flows through them (Kahn), every node
+  //mixing what its pipes bring in: all sources in one pass
+  int *waiting = calloc(n_nodes, sizeof(int));
+  int *queue = malloc(sizeof(int) * n_nodes);
+  int head = 0;
+  int len = 0;
+  for (int i = 0; i < g->n_pipes; i++){
+    Pipe *p = g->pipes[i];
+    if (g->nodes[p->orig->ID] != p->orig || g->nodes[p->dest->ID] != p->dest || p->flowrate == 0){
+      continue;
     }
-    free(vector);
-    vector = aux;
-    aux = NULL;
-    n_nodes = n_aux;
-    n_aux = 0;
+    waiting[(p->flowrate > 0) ? p->dest->ID : p->orig->ID]++;
   }
-  if (aux != NULL){
-    free(aux);
+  for (int i = 0; i < n_nodes; i++){
+    if (g->nodes[i] != NULL && waiting[i] == 0){
+      queue[len++] = i;
+    }
   }
-  free(vector);
+  while (head < len){
+    Node *n = g->nodes[queue[head++]];
+    float *share = shares + (size_t) n->ID * n_sources;
+    for (int k = 0; k < n_sources; k++){
+      share[k] = 0;
+    }
+    if (source[n->ID] != -1){
+      share[source[n->ID]] = 1;
+    }
+
+    double inflow = 0;
+    for (int j = 0; j < n->n_pipes_in + n->n_pipes_out; j++){
+      Pipe *p = (j < n->n_pipes_in) ? n->pipes_in[j] : n->pipes_out[j - n->n_pipes_in];
+      Node *o = (p->orig == n) ? p->dest : p->orig;
+      if (g->nodes[o->ID] != o){
+        continue;
+      }
+      double q = (p->dest == n) ? p->flowrate : -p->flowrate;
+      if (q > 0 && source[n->ID] == -1){
+        float *from = shares + (size_t) o->ID * n_sources;
+        for (int k = 0; k < n_sources; k++){
+          share[k] += q * from[k];
+        }
+        inflow += q;
+      } else if (q < 0 && --waiting[o->ID] == 0){
+        queue[len++] = o->ID;
+      }
+    }
+    if (inflow > 0){
+      for (int k = 0; k < n_sources; k++){
+        share[k] /= inflow;
+      }
+    }
+  }
+
+  free(source);
+  free(waiting);
+  free(queue);
+  return n_sources;
 }
 
 //LEAKS FUNCTIONS
+//Replaces the leaks of g with scenario i of c drawn over the junctions
+Leaks *graph_generate_scenario_leaks(Graph *g, const ScenarioConfig *c, long i){
+  int n_junction = 0;
+  int *junctions = malloc(sizeof(int) * g->n_nodes);
+  for (int j = 0; j < g->n_nodes; j++){
+    if (g->nodes[j] != NULL && g->nodes[j]->is_junction){
+      junctions[n_junction++] = j;
+    }
+  }
+
+  //Previous leaks are cleared from their nodes
+  if (g->leaks != NULL){
+    for (int j = 0; j < g->leaks->n; j++){
+      g->leaks->nodes[j]->has_leak = false;
+      g->leaks->nodes[j]->leak_flowrate = 0;
+    }
+    leaks_destroy(g->leaks);
+  }
+
+  int max = (c->max_leaks < n_junction) ? c->max_leaks : n_junction;
+  int *nodes = malloc(sizeof(int) * (max > 0 ? max : 1));
+  Leaks *leaks = leaks_new(NULL, max);
+  leaks->n = scenario_generate(c, junctions, n_junction, i, nodes, leaks->outfw);
+  for (int k = 0; k < leaks->n; k++){
+    Node *n = g->nodes[nodes[k]];
+    node_set_leak_flowrate(n, leaks->outfw[k]);
+    leaks->nodes[k] = n;
+  }
+  free(nodes);
+  free(junctions);
+
+  g->leaks = leaks;
+  return leaks;
+}
+//num leaks of up to MAX_LEAK_OUTFLOW, seeded from random()
 Leaks *graph_generate_random_leaks(Graph *g, int num){
   //Check if num is valid
   int n_junction = graph_get_n_junction_nodes(g);
@@ -1541,60 +2456,356 @@ Leaks *graph_generate_random_leaks(Graph *g, int num){
     return NULL;
   }
 
-  //Free previous leaks memory
-  if (g->leaks != NULL){
-    free(g->leaks);
+  ScenarioConfig c;
+  scenario_config_init(&c);
+  c.seed = random();
+  c.max_leaks = num;
+  c.max_flowrate = MAX_LEAK_OUTFLOW;
+  return graph_generate_scenario_leaks(g, &c, 0);
+}
+//Pressure-dependent leakage.
+//Leaks lower the pressures that drive them, so their flowrates x are the
+//root of F(x) = q(p(x)) - x, q the leak law of every site and p(x) the
+//pressures of the network solved with leaks x, one forward solve each.
+//Plain iteration x = q(p(x)) converges linearly and oscillates where leaks
+//are large for their pressure. Every iteration takes a Newton step instead,
+//on the tree of the pipes that set every node pressure (the last pipe in):
+//a few passes up and down the levels solve it with the leak laws and the
+//pipe drops as they are, so the step is exact on trees. Flow split between
+//several pipes in is left out of it, and Anderson acceleration over the
+//last GRAPH_LEAKAGE_HISTORY iterates takes over on meshes once the steps
+//stop shrinking fast. A step after which the Newton step is longer is
+//halved back towards the last iterate after which it was not.
+//
+//Below GRAPH_LEAKAGE_LINEAR_HEAD the law goes linearly to no leak at
+//atmospheric pressure and on below it. Sites whose law is below 0 have no
+//leak, but the slope keeps a site that a pass takes below atmospheric
+//pressure from switching off until it stays there.
+static double graph_leakage_flowrate(double coefficient, double exponent, double pressure,
+                                     double *derivative){
+  double head = pressure - GRAPH_ATMOSPHERIC_PRESSURE;
+  if (head < GRAPH_LEAKAGE_LINEAR_HEAD){
+    *derivative = coefficient * pow(GRAPH_LEAKAGE_LINEAR_HEAD, exponent - 1);
+    return *derivative * head;
+  }
+  double q = coefficient * pow(head, exponent);
+  *derivative = exponent * q / head;
+  return q;
+}
+//Site k of sites is emitter node sites[k] for k < n_emitters, otherwise the
+//background leakage of pipe sites[k], and is seen at its dest node
+static Node *graph_leakage_site_node(Graph *g, const int *sites, int n_emitters, int k){
+  return k < n_emitters ? g->nodes[sites[k]] : g->pipes[sites[k]]->dest;
+}
+//Leak law of site k at its pressure plus the change delta of the nodes
+//(background leakage follows the mean pressure of its pipe)
+static double graph_leakage_site_flowrate(Graph *g, const int *sites, int n_emitters, int k,
+                                          const float *delta, double *derivative){
+  if (k < n_emitters){
+    Node *n = g->nodes[sites[k]];
+    return graph_leakage_flowrate(n->emitter_coefficient, n->emitter_exponent,
+                                  n->pressure_calculated + delta[n->ID], derivative);
+  }
+  Pipe *p = g->pipes[sites[k]];
+  float change = (delta[p->orig->ID] + delta[p->dest->ID]) / 2;
+  return graph_leakage_flowrate(p->background_coefficient * p->length, p->background_exponent,
+                                (p->pressure_in + p->pressure_out) / 2 + change, derivative);
+}
+//Drop along pipe p, the last pipe in of a node, with flow through the node
+//instead of the inflow it was solved with
+static float graph_leakage_pipe_drop(Graph *g, Pipe *p, float inflow, float flow){
+  float vel = fabsf(p->fluid_velocity * flow / inflow);
+  float friction = g->friction_model(p->dimensions.circ_diam, p->rough, p->fluid_density,
+                                     p->fluid_viscosity, vel);
+  return copysignf(calculate_pressure_drop(vel, p->dimensions.circ_diam, p->length, friction,
+                                           p->fluid_density), flow);
+}
+//Solves the network with the leaks x of the sites and writes the Newton
+//step of every site to nx. The step solves the tree of last pipes in with
+//the leak laws and the pipe drops as they are: every pass linearises both
+//at the flows and pressures the last one predicted and solves the linear
+//tree, until the pressures settle. Returns how far the leaks are from the
+//root at most.
+static double graph_leakage_evaluate(Graph *g, const int *sites, int n_emitters, int n_sites,
+                                     const double *x, double *nx, _Bool *below, float resolution){
+  int n_nodes = g->n_nodes;
+  float *leakage = g->leakage;
+  float *inflow = g->leakage + n_nodes;       //Flow through the last pipe in of the node
+  float *drop = g->leakage + 2 * n_nodes;     //and its drop
+  float *through = g->leakage + 3 * n_nodes;  //Newton change of that flow
+  float *offset = g->leakage + 4 * n_nodes;   //Drop change, offset + tangent * through
+  float *tangent = g->leakage + 5 * n_nodes;
+  float *constant = g->leakage + 6 * n_nodes; //Leak of its subtree, constant + slope * δp
+  float *slope = g->leakage + 7 * n_nodes;
+  float *delta = g->leakage + 8 * n_nodes;    //Newton pressure change δp
+  float *path = g->leakage + 9 * n_nodes;     //Drop per m³/s more from the inputs
+
+  for (int i = 0; i < n_nodes; i++){
+    Node *n = g->nodes[i];
+    //Leaks that are not emitters keep their flowrate
+    leakage[i] = (n != NULL && n->has_leak && n->emitter_coefficient == 0) ? n->leak_flowrate : 0;
+    through[i] = 0;
+    delta[i] = 0;
+  }
+  for (int k = 0; k < n_sites; k++){
+    leakage[graph_leakage_site_node(g, sites, n_emitters, k)->ID] += x[k];
+  }
+
+  graph_backpropagate_flowrate(g);
+  graph_propagate_pressure(g);
+
+  //Pipes without flow keep their drop
+  int *order = g->level_nodes;
+  int n_leveled = g->level_start[g->n_levels];
+  for (int k = 0; k < n_leveled; k++){
+    Node *n = g->nodes[order[k]];
+    inflow[n->ID] = 0;
+    path[n->ID] = 0;
+    if (n->is_input || n->n_pipes_in == 0){
+      continue;
+    }
+    Pipe *p = n->pipes_in[n->n_pipes_in - 1];
+    float sum_area_in = 0;
+    for (int j = 0; j < n->n_pipes_in; j++){
+      sum_area_in += n->pipes_in[j]->area;
+    }
+    float q = p->fluid_velocity * sum_area_in;
+    drop[n->ID] = p->pressure_in - p->pressure_out;
+    if (q > 0 && drop[n->ID] > 0){
+      inflow[n->ID] = q;
+      path[n->ID] = 2 * drop[n->ID] / q;
+    }
+    if (g->level[p->orig->ID] != -1){
+      path[n->ID] += path[p->orig->ID];
+    }
   }
-  Leaks *leaks = malloc(sizeof(Leaks));
 
-  //Generate leaks structure
-  leaks->n = num;
-  leaks->outfw = malloc(sizeof(float) * num);
-  leaks->nodes = malloc(sizeof(Node *) * num);
+  //A leak off its law by F moves by F / (1 + dq * path), dq the slope of
+  //the law: where that is steep it is far closer to the root than F. What
+  //the law changes within the resolution of the pressures is not part of F.
+  double residual = 0;
+  for (int k = 0; k < n_sites; k++){
+    double dq;
+    double q = graph_leakage_site_flowrate(g, sites, n_emitters, k, delta, &dq);
+    if (q < 0){
+      dq = 0;
+    }
+    double f = fmax(fabs(fmax(q, 0) - x[k]) - dq * resolution, 0);
+    residual = fmax(residual, f / (1 + dq * path[graph_leakage_site_node(g, sites, n_emitters, k)->ID]));
+    below[k] = (q < 0);
+  }
+
+  for (int pass = 0; pass < GRAPH_LEAKAGE_PASSES; pass++){
+    for (int k = 0; k < n_leveled; k++){
+      int i = order[k];
+      constant[i] = 0;
+      slope[i] = 0;
+      offset[i] = 0;
+      tangent[i] = 0;
+      //Drop at the flow predicted, with the turbulent tangent 2 drop / Q
+      if (inflow[i] > 0){
+        Node *n = g->nodes[i];
+        float flow = inflow[i] + through[i];
+        float predicted = graph_leakage_pipe_drop(g, n->pipes_in[n->n_pipes_in - 1], inflow[i], flow);
+        tangent[i] = (flow > 0) ? 2 * predicted / flow : 0;
+        offset[i] = predicted - drop[i] - tangent[i] * through[i];
+      }
+    }
+    //Leak change of every site, linear in the δp of its node. Sites whose
+    //leak would draw water in at the pressure predicted by two passes in a
+    //row have none (one pass on the linear law first stops them flipping
+    //on and off where the law is steep).
+    for (int k = 0; k < n_sites; k++){
+      int node = graph_leakage_site_node(g, sites, n_emitters, k)->ID;
+      double dq;
+      double q = graph_leakage_site_flowrate(g, sites, n_emitters, k, delta, &dq);
+      _Bool was_below = below[k];
+      below[k] = (q < 0);
+      if (below[k] && was_below){
+        constant[node] -= x[k];
+        continue;
+      }
+      constant[node] += q - dq * delta[node] - x[k];
+      slope[node] += dq;
+    }
 
-  //Auxiliary variables
-  _Bool is_valid;
-  int node;
-  int k = 0;
-  int aux[num];
-  for (int i = 0; i < num; i++){
-    aux[i] = -1;
+    //Up: the subtree leak of every node as a function of its δp
+    for (int k = n_leveled - 1; k >= 0; k--){
+      Node *n = g->nodes[order[k]];
+      if (n->is_input || n->n_pipes_in == 0){
+        continue;
+      }
+      Node *up = n->pipes_in[n->n_pipes_in - 1]->orig;
+      if (g->level[up->ID] == -1){
+        continue;
+      }
+      int i = n->ID;
+      float d = 1 + slope[i] * tangent[i];
+      constant[up->ID] += (constant[i] - slope[i] * offset[i]) / d;
+      slope[up->ID] += slope[i] / d;
+    }
+    //Down: inputs keep their pressure, and the pressures settle when they
+    //move less than their resolution
+    _Bool settled = true;
+    for (int k = 0; k < n_leveled; k++){
+      Node *n = g->nodes[order[k]];
+      if (n->is_input || n->n_pipes_in == 0){
+        continue;
+      }
+      Node *up = n->pipes_in[n->n_pipes_in - 1]->orig;
+      float delta_up = (g->level[up->ID] == -1) ? 0 : delta[up->ID];
+      int i = n->ID;
+      float change = (constant[i] + slope[i] * (delta_up - offset[i])) / (1 + slope[i] * tangent[i]);
+      float next = delta_up - offset[i] - tangent[i] * change;
+      if (fabsf(next - delta[i]) > resolution){
+        settled = false;
+      }
+      delta[i] = next;
+      through[i] = change;
+    }
+    if (settled){
+      break;
+    }
   }
 
-  //Generate the leaks...
+  for (int k = 0; k < n_sites; k++){
+    double unused;
+    nx[k] = fmax(graph_leakage_site_flowrate(g, sites, n_emitters, k, delta, &unused), 0);
+  }
+  return residual;
+}
+int graph_solve_leakage(Graph *g, int max_iterations, float tolerance){
+  STATS_SCOPE(STATS_LEAKAGE);
+  LOG_DEBUG("Solving pressure-dependent leakage");
 
-  //For each leak to generate...
-  for (int i = 0; i < num; i++){
-    is_valid = false;
+  graph_calculate_geometry(g);
+  if (g->leakage == NULL){
+    g->leakage = malloc(sizeof(float) * 10 * g->n_nodes);
+  }
 
-    //Generate randoms until valid
-    while (! is_valid){
-      node = random() % n_junction;
+  //Emitters, then pipes with background leakage
+  int *sites = malloc(sizeof(int) * (g->n_nodes + g->n_pipes));
+  int n_emitters = 0;
+  for (int i = 0; i < g->n_nodes; i++){
+    Node *n = g->nodes[i];
+    if (n != NULL && n->emitter_coefficient > 0 && ! n->is_input && g->level[i] != -1){
+      sites[n_emitters++] = i;
+    }
+  }
+  int n_sites = n_emitters;
+  for (int i = 0; i < g->n_pipes; i++){
+    Pipe *p = g->pipes[i];
+    if (p->background_coefficient > 0 && g->level[p->orig->ID] != -1 && g->level[p->dest->ID] != -1){
+      sites[n_sites++] = i;
+    }
+  }
 
-      //check if valid
-      is_valid = true;
-      for (int j = 0; j < num; j++){
-        if (aux[j] == node){
-          is_valid = false;
-        }
-      }
+  double *x = calloc(n_sites > 0 ? n_sites : 1, sizeof(double));
+  double *nx = malloc(sizeof(double) * (n_sites > 0 ? n_sites : 1));
+  double *accepted = malloc(sizeof(double) * (n_sites > 0 ? n_sites : 1));
+  _Bool *below = malloc(sizeof(_Bool) * (n_sites > 0 ? n_sites : 1));
+  Anderson *a = anderson_new(NULL, n_sites, GRAPH_LEAKAGE_HISTORY);
+
+  //No pressure is above that of the inputs, which bounds every leak
+  float max_pressure = GRAPH_ATMOSPHERIC_PRESSURE;
+  for (int i = 0; i < g->n_nodes; i++){
+    Node *n = g->nodes[i];
+    if (n != NULL && n->is_input && g->level[i] != -1 && n->pressure_calculated > max_pressure){
+      max_pressure = n->pressure_calculated;
+    }
+  }
+  double *upper = malloc(sizeof(double) * (n_sites > 0 ? n_sites : 1));
+  for (int k = 0; k < n_sites; k++){
+    double unused;
+    if (k < n_emitters){
+      Node *n = g->nodes[sites[k]];
+      upper[k] = graph_leakage_flowrate(n->emitter_coefficient, n->emitter_exponent, max_pressure, &unused);
+    } else {
+      Pipe *p = g->pipes[sites[k]];
+      upper[k] = graph_leakage_flowrate(p->background_coefficient * p->length, p->background_exponent,
+                                        max_pressure, &unused);
+    }
+  }
 
-      //Generate the leak
-      if (is_valid){
-        float outflow = (float)rand()/(float)(RAND_MAX/MAX_LEAK_OUTFLOW);
-        Node *n = graph_get_nth_junction_node(g, node);
-        node_set_leak_flowrate(n, outflow);
-        leaks->nodes[k] = n;
+  //Pressures are resolved to a fraction of the highest one
+  float resolution = GRAPH_LEAKAGE_PRESSURE_RESOLUTION * max_pressure;
 
-        aux[k] = node;
-        k++;
+  //The network is left solved with x
+  g->leakage_active = true;
+  int iterations = -1;
+  double accepted_step = INFINITY;
+  for (int k = 1; ; k++){
+    double residual = graph_leakage_evaluate(g, sites, n_emitters, n_sites, x, nx, below, resolution);
+    double step = 0;
+    for (int i = 0; i < n_sites; i++){
+      step = fmax(step, fabs(nx[i] - x[i]));
+    }
+    LOG_DEBUG("Leakage iteration %d, residual %g m³/s, step %g m³/s", k, residual, step);
+    if (residual <= tolerance){
+      iterations = k;
+      break;
+    }
+    if (k >= max_iterations){
+      LOG_DEBUG("Leakage did not converge in %d iterations", k);
+      break;
+    }
+    //Halved back, and the next step after it is Newton's
+    if (step > accepted_step){
+      for (int i = 0; i < n_sites; i++){
+        x[i] = (x[i] + accepted[i]) / 2;
       }
+      anderson_reset(a);
+      continue;
+    }
+    //Newton is taken as is while it converges fast (it is exact on trees),
+    //Anderson steps in when it slows down to linear on meshes
+    _Bool fast = step <= GRAPH_LEAKAGE_NEWTON_RATE * accepted_step;
+    memcpy(accepted, x, sizeof(double) * n_sites);
+    accepted_step = step;
+    anderson_step(a, x, nx);
+    if (fast){
+      memcpy(x, nx, sizeof(double) * n_sites);
+    }
+    for (int i = 0; i < n_sites; i++){
+      x[i] = fmin(fmax(x[i], 0), upper[i]);
+    }
+  }
 
+  //Background leakage is lumped at the dest node of its pipe
+  for (int i = 0; i < g->n_nodes; i++){
+    if (g->nodes[i] != NULL){
+      g->nodes[i]->background_flowrate = 0;
     }
   }
+  for (int k = 0; k < n_emitters; k++){
+    g->nodes[sites[k]]->leak_flowrate = x[k];
+  }
+  for (int k = n_emitters; k < n_sites; k++){
+    g->pipes[sites[k]]->dest->background_flowrate += x[k];
+  }
 
-  g->leaks = leaks;
-  return leaks;
+  //Meters read the pressures of the leaking network
+  for (int i = 0; i < g->n_nodes; i++){
+    Node *n = g->nodes[i];
+    if (n != NULL && n->is_measured && ! n->is_input && g->level[i] != -1){
+      n->pressure_measured = n->pressure_calculated;
+    }
+  }
+
+  //and calculated values stay those of the network without leaks
+  g->leakage_active = false;
+  graph_backpropagate_flowrate(g);
+  graph_propagate_pressure(g);
+  graph_add_leaks_to_measured_nodes(g);
+
+  anderson_destroy(a);
+  free(x);
+  free(nx);
+  free(accepted);
+  free(below);
+  free(upper);
+  free(sites);
+  return iterations;
 }
 void graph_print_leaks_data(Graph *g){
   Leaks *l = g->leaks;
@@ -1630,6 +2841,7 @@ _Bool graph_has_leaks(Graph *g){
   }
 }
 Leaks *graph_find_leaks(Graph *g){
+  STATS_SCOPE(STATS_FIND_LEAKS);
   Leaks *l = leaks_new(NULL, 0);
 
   return l;
@@ -1637,106 +2849,153 @@ Leaks *graph_find_leaks(Graph *g){
 Graph *graph_optimize_naive(Graph *g){
   return NULL;
 }
-void graph_calculate_geometry(Graph *G){
-  Graph *g = graph_copy(NULL, G);
-  int n_input = graph_get_n_input_nodes(g);
-  int width = n_input;
-  int depth = 0;
-  _Bool finished;
+//Longest path level from the inputs, in one pass of Kahn's algorithm. Nodes
+//downstream of a deleted node, on a cycle or without pipes get level -1.
+void graph_calculate_geometry(Graph *g){
+  if (g->levels_valid){
+    return;
+  }
 
-  do {
-    finished = true;
-    depth++;
-    n_input = graph_get_n_input_nodes(g);
-    int level_width = 0;
-    Node **nodev = malloc(sizeof(Node *) * n_input);
-    for (int i = 0; i < n_input; i++){
-      nodev[i] = graph_get_nth_input_node(g, i);
-    }
-    for (int i = 0; i < n_input; i++){
-      Node *n = nodev[i];
-      n->is_input = false;
-      level_width += n->n_pipes_out;
-      for (int p = 0; p < n->n_pipes_out; p++){
-        n->pipes_out[p]->dest->is_input = true;
-        finished = false;
+  if (g->level == NULL){
+    g->level = malloc(sizeof(int) * g->n_nodes);
+    g->level_nodes = malloc(sizeof(int) * g->n_nodes);
+    g->level_start = malloc(sizeof(int) * (g->n_nodes + 1));
+  }
+
+  //Kahn order into level_nodes, pending pipes in kept in level_start
+  int *order = g->level_nodes;
+  int *pending = g->level_start;
+  int head = 0;
+  int tail = 0;
+  for (int i = 0; i < g->n_nodes; i++){
+    Node *n = g->nodes[i];
+    g->level[i] = -1;
+    if (n == NULL){
+      continue;
+    }
+    pending[i] = n->n_pipes_in;
+    if (n->n_pipes_in == 0 && n->n_pipes_out > 0){
+      g->level[i] = 0;
+      order[tail++] = i;
+    }
+  }
+  int n_levels = (tail > 0) ? 1 : 0;
+  while (head < tail){
+    Node *n = g->nodes[order[head++]];
+    int lvl = g->level[n->ID] + 1;
+    for (int j = 0; j < n->n_pipes_out; j++){
+      int d = n->pipes_out[j]->dest->ID;
+      if (g->nodes[d] == NULL){
+        continue;
+      }
+      if (lvl > g->level[d]){
+        g->level[d] = lvl;
+      }
+      if (--pending[d] == 0){
+        order[tail++] = d;
+        if (lvl + 1 > n_levels){
+          n_levels = lvl + 1;
+        }
       }
     }
-    if (level_width >= width){
-      width = level_width;
+  }
+  //Nodes never released kept the level of the paths that did reach them
+  for (int i = 0; i < g->n_nodes; i++){
+    if (g->nodes[i] != NULL && pending[i] > 0){
+      g->level[i] = -1;
     }
+  }
 
-    free(nodev);
-  } while (! finished);
+  //Counting sort by level keeps the topological order inside every level
+  int *count = calloc(sizeof(int) * (n_levels + 1), 1);
+  int *sorted = malloc(sizeof(int) * g->n_nodes);
+  for (int k = 0; k < tail; k++){
+    count[g->level[order[k]] + 1]++;
+  }
+  g->width = 0;
+  for (int l = 0; l < n_levels; l++){
+    if (count[l + 1] > g->width){
+      g->width = count[l + 1];
+    }
+    count[l + 1] += count[l];
+  }
+  memcpy(g->level_start, count, sizeof(int) * (n_levels + 1));
+  for (int k = 0; k < tail; k++){
+    int i = order[k];
+    sorted[count[g->level[i]]++] = i;
+  }
+  memcpy(g->level_nodes, sorted, sizeof(int) * tail);
+  free(sorted);
+  free(count);
 
-  graph_destroy(g);
-  G->width = width;
-  G->depth = depth;
+  g->n_levels = n_levels;
+  g->depth = n_levels;
+  g->levels_valid = true;
 }
 int graph_get_depth(Graph *g){
-  if (g->depth == -1){
-    graph_calculate_geometry(g);
-  }
+  graph_calculate_geometry(g);
   return g->depth;
 }
 int graph_get_width(Graph *g){
-  if (g->width == -1){
-    graph_calculate_geometry(g);
-  }
+  graph_calculate_geometry(g);
   return g->width;
 }
+int graph_get_node_level(Graph *g, int node){
+  graph_calculate_geometry(g);
+  return g->level[node];
+}
+int graph_get_level_size(Graph *g, int level){
+  graph_calculate_geometry(g);
+  return g->level_start[level + 1] - g->level_start[level];
+}
+int *graph_get_level_nodes(Graph *g, int level){
+  graph_calculate_geometry(g);
+  return g->level_nodes + g->level_start[level];
+}
+int graph_get_n_leveled_nodes(Graph *g){
+  graph_calculate_geometry(g);
+  return g->level_start[g->n_levels];
+}
+//Deletes the node and everything downstream of it. Nodes are deleted as they
+//are queued, so each one is queued once even when several paths reach it.
 void graph_cut_node(Graph *g, int node_i){
   Node *ni = g->nodes[node_i];
   if (ni == NULL){
     return;
   }
 
-  Node **node_vector;
-  Node **aux = NULL;
-
-  int vector_len = ni->n_pipes_out;
-  int aux_len = 0;
-
-  node_vector = malloc(sizeof(Node *) * vector_len);
-  for (int i = 0; i < ni->n_pipes_out; i++){
-    node_vector[i] = ni->pipes_out[i]->dest;
-  }
+  int head = 0;
+  int len = 1;
+  int cap = 64;
+  Node **queue = malloc(sizeof(Node *) * cap);
 
+  queue[0] = ni;
   graph_del_node(g, node_i);
 
-  while (vector_len != 0){
-    for (int i = 0; i < vector_len; i++){
-      Node *n = node_vector[i];
-      int n_pipes = n->n_pipes_out;
-
-      for (int j = 0; j < n_pipes; j++){
-        Pipe *p = n->pipes_out[j];
+  while (head < len){
+    Node *n = queue[head++];
 
-        if (g->nodes[p->dest->ID] != NULL){
-          aux_len++;
-
-          if (aux == NULL){
-            aux = malloc(sizeof(Node *) * aux_len);
-          } else {
-            aux = realloc(aux, sizeof(Node *) * aux_len);
-          }
-          aux[aux_len -1] = p->dest;
-        }
+    for (int j = 0; j < n->n_pipes_out; j++){
+      Node *dest = n->pipes_out[j]->dest;
+      if (g->nodes[dest->ID] == NULL){
+        continue;
       }
+      graph_del_node(g, dest->ID);
 
-      graph_del_node(g, n->ID);
+      if (len == cap){
+        cap *= 2;
+        queue = realloc(queue, sizeof(Node *) * cap);
+      }
+      queue[len++] = dest;
     }
-
-    free(node_vector);
-    node_vector = aux;
-    aux = NULL;
-    vector_len = aux_len;
-    aux_len = 0;
   }
+
+  free(queue);
 }
 Node *graph_del_node(Graph *g, int node_i){
   Node *n = g->nodes[node_i];
   g->nodes[node_i] = NULL;
+  g->levels_valid = false;
   return n;
 }
 float node_measurement_get_diff(Node *n){
@@ -1750,337 +3009,396 @@ float node_measurement_get_diff(Node *n){
     return -1;
   }
 }
+//Split by area like graph_add_leaks_to_measured_nodes pushes leaks up
+float pipe_get_share_in(Pipe *p){
+  Node *dest = p->dest;
+  float total_area_in = 0;
+  for (int j = 0; j < dest->n_pipes_in; j++){
+    total_area_in += dest->pipes_in[j]->area;
+  }
+  return (total_area_in > 0) ? p->area / total_area_in : 1.0f / dest->n_pipes_in;
+}
+//Walk stack of node_measurement_get_successors_diff, on the C stack until a
+//walk goes deeper than GRAPH_WALK_STACK nodes
+typedef struct GraphWalk{
+  Node **stack;
+  int *next;      //Pipe out of stack[i] walked next
+  int len;
+  int cap;
+  Node *stack_buf[GRAPH_WALK_STACK];
+  int next_buf[GRAPH_WALK_STACK];
+} GraphWalk;
+
+static void graph_walk_push(GraphWalk *w, Node *n){
+  if (w->len == w->cap){
+    w->cap *= 2;
+    if (w->stack == w->stack_buf){
+      w->stack = malloc(sizeof(Node *) * w->cap);
+      w->next = malloc(sizeof(int) * w->cap);
+      memcpy(w->stack, w->stack_buf, sizeof(w->stack_buf));
+      memcpy(w->next, w->next_buf, sizeof(w->next_buf));
+    } else {
+      w->stack = realloc(w->stack, sizeof(Node *) * w->cap);
+      w->next = realloc(w->next, sizeof(int) * w->cap);
+    }
+  }
+  w->stack[w->len] = n;
+  w->next[w->len] = 0;
+  w->len++;
+}
+//Depth-first walk down to the first measured nodes, every node summing its
+//pipes out once all of them are walked. Every node is entered once, so on
+//meshes the walk stays linear, and a meter reached along several paths
+//counts with the share of its flow that comes through n.
+//
+//The walk marks the nodes it enters and a second walk over the marked nodes
+//clears them, so calls on different graphs can run at the same time.
 float node_measurement_get_successors_diff(Node *n){
-  float result = 0;
-  int vector_len = 1;
-  int aux_len = 0;
-
-  Node **node_vector = malloc(sizeof(Node *) * vector_len);
-  Node **aux = NULL;
-
-  node_vector[0] = n;
-
-  while (vector_len != 0){
-    for (int i = 0; i < vector_len; i++){
-      Node *n = node_vector[i];
-      int n_pipes = n->n_pipes_out;
-
-      for (int j = 0; j < n_pipes; j++){
-        Pipe *p = n->pipes_out[j];
-        Node *dest = p->dest;
-
-        if (dest->is_measured){
-          if (dest->flowrate_measured != -1){
-            result += node_measurement_get_diff(dest);
-          }
-        } else {
-          aux_len++;
-          if (aux == NULL){
-            aux = malloc(sizeof(Node *) * aux_len);
-          } else {
-            aux = realloc(aux, sizeof(Node *) * aux_len);
-          }
-
-          aux[aux_len -1] = dest;
-        }
+  GraphWalk w;
+  w.stack = w.stack_buf;
+  w.next = w.next_buf;
+  w.len = 0;
+  w.cap = GRAPH_WALK_STACK;
+
+  n->visited = true;
+  n->walk_diff = 0;
+  graph_walk_push(&w, n);
+  while (w.len > 0){
+    Node *m = w.stack[w.len - 1];
+    if (w.next[w.len - 1] == m->n_pipes_out){
+      w.len--;
+      if (w.len > 0){
+        Pipe *p = w.stack[w.len - 1]->pipes_out[w.next[w.len - 1] - 1];
+        w.stack[w.len - 1]->walk_diff += pipe_get_share_in(p) * m->walk_diff;
+      }
+      continue;
+    }
+    Pipe *p = m->pipes_out[w.next[w.len - 1]++];
+    Node *dest = p->dest;
+
+    if (dest->is_measured){
+      if (dest->flowrate_measured != -1){
+        m->walk_diff += pipe_get_share_in(p) * node_measurement_get_diff(dest);
       }
+    } else if (dest->visited){
+      m->walk_diff += pipe_get_share_in(p) * dest->walk_diff;
+    } else {
+      dest->visited = true;
+      dest->walk_diff = 0;
+      graph_walk_push(&w, dest);
     }
-    free(node_vector);
-    node_vector = aux;
-    aux = NULL;
-    vector_len = aux_len;
-    aux_len = 0;
   }
+  float successors_diff = n->walk_diff;
 
-  if (aux != NULL){
-    free(aux);
+  n->visited = false;
+  graph_walk_push(&w, n);
+  while (w.len > 0){
+    Node *m = w.stack[w.len - 1];
+    if (w.next[w.len - 1] == m->n_pipes_out){
+      w.len--;
+      continue;
+    }
+    Node *dest = m->pipes_out[w.next[w.len - 1]++]->dest;
+    if (! dest->is_measured && dest->visited){
+      dest->visited = false;
+      graph_walk_push(&w, dest);
+    }
   }
-  free(node_vector);
 
-  return result;
+  if (w.stack != w.stack_buf){
+    free(w.stack);
+    free(w.next);
+  }
+  return successors_diff;
 }
-void graph_plot(Graph *g){
-  //Make copy of graph to not destroy original
-  g = graph_copy(NULL, g);
+//Every node at once: successors diff sums over the pipes out, so one pass
+//backwards over the levels gives the walk of every node.
+void graph_measurement_get_diffs(Graph *g, float *diff, float *successors_diff){
+  graph_calculate_geometry(g);
+  int *order = g->level_nodes;
+  int n_order = g->level_start[g->n_levels];
 
-  const float float_tolerance = 0.000001;
-
-  //Variables for running graphviz
-  int p[2], pid;
-  if (pipe(p) < 0){
-    perror("Could not pipe:");
-  }
-  if ((pid = fork()) < 0){
-    perror("Could not fork:");
+  for (int i = 0; i < g->n_nodes; i++){
+    diff[i] = (g->nodes[i] != NULL) ? node_measurement_get_diff(g->nodes[i]) : -1;
+    successors_diff[i] = 0;
+  }
+  for (int k = n_order - 1; k >= 0; k--){
+    Node *n = g->nodes[order[k]];
+    float sum = 0;
+    for (int j = 0; j < n->n_pipes_out; j++){
+      Pipe *p = n->pipes_out[j];
+      Node *dest = p->dest;
+      if (g->nodes[dest->ID] == NULL){
+        continue;
+      }
+      if (dest->is_measured){
+        if (dest->flowrate_measured != -1){
+          sum += pipe_get_share_in(p) * diff[dest->ID];
+        }
+      } else {
+        sum += pipe_get_share_in(p) * successors_diff[dest->ID];
+      }
+    }
+    successors_diff[n->ID] = sum;
   }
-
-  //Fork for graphviz
-  if (pid == 0){
-    close(0);
-    dup(p[0]);
-    close(p[0]);
-    close(p[1]);
-
-    close(1);
-    fopen("test.png", "w");
-
-    execlp("dot", "dot", "-Tpng", NULL);
-    exit(1);
+}
+//Classifies every node into g->zone. A measured node whose residual is all
+//seen by the meters below is explained, and a meter reading its calculated
+//flowrate clears itself and everything downstream up to an explained node.
+void graph_compute_suspect_zone(Graph *g, int *meter, float *unexplained){
+  if (g->zone == NULL){
+    g->residuals = malloc(sizeof(float) * 2 * g->n_nodes);
+    g->zone = malloc(g->n_nodes);
   }
-  close(p[0]);
+  float *diff = g->residuals;
+  float *successors_diff = g->residuals + g->n_nodes;
+  graph_measurement_get_diffs(g, diff, successors_diff);
 
-  //String for piping to graphviz
-  int str_size = 1024;
-  int buffer_size = 1024;
-
-  //Graphviz header
-  char *str = malloc(sizeof(char) * str_size);
-  char buffer[buffer_size];
-  strcpy(str, "digraph G{fontname=\"Helvetica,Arial,sans-serif\"\nnode [fontname=\"Helvetica,Arial,sans-serif\"]\nedge [fontname=\"Helvetica,Arial,sans-serif\"]\n");
-
-  //Clone again to g2 and cut nodes after leak
-  Graph *g2 = graph_copy(NULL, g);
-  int *nodes_to_del = NULL;
-  int nodes_to_del_l = 0;
-  int *nodes_to_cut = NULL;
-  int nodes_to_cut_l = 0;
-  for (int i = 0; i < graph_get_n_measurement_nodes(g2); i++){
-    Node *nm = graph_get_nth_measurement_node(g2, i);
-    printf("Node %d has %f diff and %f succ diff\n", nm->ID, node_measurement_get_diff(nm), node_measurement_get_successors_diff(nm));
-    if (nm != NULL){
-      _Bool del = false;
-      _Bool cut = false;
-      if (fabs(node_measurement_get_diff(nm) - node_measurement_get_successors_diff(nm)) < float_tolerance && node_measurement_get_diff(nm) > 0){
-        printf("Deleting node %d\n", nm->ID);
-        del = true;
+  for (int i = 0; i < g->n_nodes; i++){
+    Node *n = g->nodes[i];
+    g->zone[i] = GRAPH_ZONE_SUSPECT;
+    if (unexplained != NULL){
+      unexplained[i] = 0;
+    }
+    if (meter != NULL){
+      meter[i] = -1;
+    }
+    if (n == NULL){
+      g->zone[i] = GRAPH_ZONE_REMOVED;
+    } else if (n->is_measured){
+      LOG_DEBUG("Node %d has %f diff and %f succ diff", i, diff[i], successors_diff[i]);
+      if (fabs(diff[i] - successors_diff[i]) < GRAPH_RESIDUAL_TOLERANCE && diff[i] > 0){
+        g->zone[i] = GRAPH_ZONE_EXPLAINED;
+      } else if (n->flowrate_measured == n->flowrate_calculated){
+        g->zone[i] = GRAPH_ZONE_CLEARED;
       }
-      if (nm->flowrate_measured == nm->flowrate_calculated){
-        printf("Cutting node %d\n", nm->ID);
-        cut = true;
+      if (unexplained != NULL && n->flowrate_measured != -1){
+        unexplained[i] = fmaxf(diff[i] - successors_diff[i], 0);
       }
-      if (del){
-        if (nodes_to_del == NULL){
-          nodes_to_del = malloc(sizeof(int));
-          nodes_to_del[nodes_to_del_l] = nm->ID;
-        } else {
-          nodes_to_del = realloc(nodes_to_del, sizeof(int) * (nodes_to_del_l+1));
-          nodes_to_del[nodes_to_del_l] = nm->ID;
-        }
-        nodes_to_del_l++;
+    }
+  }
+
+  int *order = g->level_nodes;
+  int n_order = g->level_start[g->n_levels];
+  for (int k = 0; k < n_order; k++){
+    Node *n = g->nodes[order[k]];
+    if (meter != NULL){
+      if (n->is_measured){
+        meter[n->ID] = n->ID;
+      } else if (n->n_pipes_in > 0){
+        meter[n->ID] = meter[n->pipes_in[0]->orig->ID];
       }
-      if (cut){
-        if (nodes_to_cut == NULL){
-          nodes_to_cut = malloc(sizeof(int));
-          nodes_to_cut[nodes_to_cut_l] = nm->ID;
-        } else {
-          nodes_to_cut = realloc(nodes_to_cut, sizeof(int) * (nodes_to_cut_l+1));
-          nodes_to_cut[nodes_to_cut_l] = nm->ID;
-        }
-        nodes_to_cut_l++;
+    }
+    if (g->zone[n->ID] != GRAPH_ZONE_SUSPECT){
+      continue;
+    }
+    for (int j = 0; j < n->n_pipes_in; j++){
+      if (g->zone[n->pipes_in[j]->orig->ID] == GRAPH_ZONE_CLEARED){
+        g->zone[n->ID] = GRAPH_ZONE_CLEARED;
+        break;
       }
     }
   }
-  for (int i = 0; i < nodes_to_del_l; i++){
-    graph_del_node(g2, nodes_to_del[i]);
+}
+int graph_get_suspect_zone(Graph *g, int *nodes){
+  graph_compute_suspect_zone(g, NULL, NULL);
+  int n_zone = 0;
+  for (int i = 0; i < g->n_nodes; i++){
+    if (g->zone[i] == GRAPH_ZONE_SUSPECT && g->nodes[i]->is_connected){
+      nodes[n_zone++] = i;
+    }
   }
-  for (int i = 0; i < nodes_to_cut_l; i++){
-    graph_cut_node(g2, nodes_to_cut[i]);
+  return n_zone;
+}
+//DOT output is streamed through a fixed buffer that is flushed as it fills
+typedef struct DotWriter{
+  int fd;
+  size_t len;
+  char buf[GRAPH_DOT_BUFFER_SIZE];
+} DotWriter;
+
+static void dot_writer_flush(DotWriter *w){
+  size_t done = 0;
+  while (done < w->len){
+    ssize_t r = write(w->fd, w->buf + done, w->len - done);
+    if (r <= 0){
+      perror("Could not write DOT output:");
+      break;
+    }
+    done += r;
   }
-  if (nodes_to_cut != NULL){
-    free(nodes_to_cut);
+  w->len = 0;
+}
+static void dot_writer_append(DotWriter *w, const char *s, size_t len){
+  while (len > 0){
+    size_t n = sizeof(w->buf) - w->len;
+    if (n > len){
+      n = len;
+    }
+    memcpy(w->buf + w->len, s, n);
+    w->len += n;
+    s += n;
+    len -= n;
+    if (w->len == sizeof(w->buf)){
+      dot_writer_flush(w);
+    }
   }
-  if (nodes_to_del != NULL){
-    free(nodes_to_del);
+}
+static void dot_writer_puts(DotWriter *w, const char *s){
+  dot_writer_append(w, s, strlen(s));
+}
+static void dot_writer_int(DotWriter *w, int v){
+  char digits[12];
+  int i = sizeof(digits);
+  unsigned int u = (v < 0) ? -(unsigned int) v : (unsigned int) v;
+  do {
+    digits[--i] = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (v < 0){
+    digits[--i] = '-';
   }
+  dot_writer_append(w, digits + i, sizeof(digits) - i);
+}
+
+void graph_write_dot(Graph *g, int fd){
+  DotWriter *w = malloc(sizeof(DotWriter));
+  w->fd = fd;
+  w->len = 0;
+
+  //Graphviz header
+  dot_writer_puts(w, "digraph G{fontname=\"Helvetica,Arial,sans-serif\"\nnode [fontname=\"Helvetica,Arial,sans-serif\"]\nedge [fontname=\"Helvetica,Arial,sans-serif\"]\n");
 
-  // g = g2;
+  graph_compute_suspect_zone(g, NULL, NULL);
 
   //FAULTY NODE FORMAT
-  sprintf(buffer, "node [shape=diamond color=red]; ");
-  if (strlen(str) + strlen(buffer) + 10 > str_size){
-    str_size *= 2;
-    str = realloc(str, str_size);
-  }
-  strcat(str, buffer);
-  for (int i = 0; i < graph_get_n_nodes(g2); i++){
-    Node *node = graph_get_nth_node(g2, i);
-
-    if (node != NULL && g->nodes[i]->is_connected){
-      sprintf(buffer, "%d; ", node->ID);
-      if (strlen(str) + strlen(buffer) + 10 < str_size){
-        str_size*=2;
-        str = realloc(str, str_size);
-      }
-      strcat(str, buffer);
+  dot_writer_puts(w, "node [shape=diamond color=red]; ");
+  for (int i = 0; i < g->n_nodes; i++){
+    if (g->zone[i] == GRAPH_ZONE_SUSPECT && g->nodes[i]->is_connected){
+      dot_writer_int(w, g->nodes[i]->ID);
+      dot_writer_append(w, "; ", 2);
     }
   }
 
   //INPUT NODE FORMAT
-  sprintf(buffer, "node [shape=ellipse color=blue]; ");
-  if (strlen(str) + strlen(buffer) + 10 > str_size){
-    str_size *= 2;
-    str = realloc(str, str_size);
-  }
-  strcat(str, buffer);
-  for (int i = 0; i < graph_get_n_input_nodes(g); i++){
-    Node *node = graph_get_nth_input_node(g, i);
-    if (node != NULL){
-      sprintf(buffer, "%d; ", node->ID);
-      if (strlen(str) + strlen(buffer) + 10 < str_size){
-        str_size*=2;
-        str = realloc(str, str_size);
-      }
-      strcat(str, buffer);
+  dot_writer_puts(w, "node [shape=ellipse color=blue]; ");
+  for (int i = 0; i < g->n_nodes; i++){
+    if (g->nodes[i] != NULL && g->nodes[i]->is_input){
+      dot_writer_int(w, g->nodes[i]->ID);
+      dot_writer_append(w, "; ", 2);
     }
   }
 
   //JUNCTION NODE FORMAT
-  sprintf(buffer, "node [shape=diamond color=black]; ");
-  if (strlen(str) + strlen(buffer) + 10 > str_size){
-    str_size *= 2;
-    str = realloc(str, str_size);
-  }
-  strcat(str, buffer);
-  for (int i = 0; i < graph_get_n_junction_nodes(g); i++){
-    Node *node = graph_get_nth_junction_node(g, i);
-
-    if (node != NULL){
-      sprintf(buffer, "%d; ", node->ID);
-      if (strlen(str) + strlen(buffer) + 10 < str_size){
-        str_size*=2;
-        str = realloc(str, str_size);
-      }
-      strcat(str, buffer);
+  dot_writer_puts(w, "node [shape=diamond color=black]; ");
+  for (int i = 0; i < g->n_nodes; i++){
+    if (g->nodes[i] != NULL && g->nodes[i]->is_junction){
+      dot_writer_int(w, g->nodes[i]->ID);
+      dot_writer_append(w, "; ", 2);
     }
   }
 
   //OUTPUT NODE FORMAT
-  sprintf(buffer, "node [shape=box color=green]; ");
-  if (strlen(str) + strlen(buffer) + 10 > str_size){
-    str_size*=2;
-    str = realloc(str, str_size);
-  }
-  strcat(str, buffer);
-  for (int i = 0; i < graph_get_n_output_nodes(g); i++){
-    Node *node = graph_get_nth_output_node(g, i);
-
-    if (node != NULL){
-      sprintf(buffer, "%d; ", node->ID);
-      if (strlen(str) + strlen(buffer) + 10 > str_size){
-        str_size*=2;
-        str = realloc(str, str_size);
-      }
-      strcat(str, buffer);
+  dot_writer_puts(w, "node [shape=box color=green]; ");
+  for (int i = 0; i < g->n_nodes; i++){
+    if (g->nodes[i] != NULL && g->nodes[i]->is_output){
+      dot_writer_int(w, g->nodes[i]->ID);
+      dot_writer_append(w, "; ", 2);
     }
   }
 
-  printf("Draw pupes\n");
+  LOG_DEBUG("Drawing pipes");
 
   //DRAW PIPES
-  Node **node_vector;
-  Node **aux = NULL;
+  //Breadth first from the inputs, every node is expanded once
+  Node **queue = malloc(sizeof(Node *) * (unsigned) g->n_nodes);
+  _Bool *queued = calloc((unsigned) g->n_nodes, sizeof(_Bool));
+  int head = 0, tail = 0;
+  for (int i = 0; i < g->n_nodes; i++){
+    if (g->nodes[i] != NULL && g->nodes[i]->is_input){
+      queue[tail++] = g->nodes[i];
+      queued[i] = true;
+    }
+  }
 
-  int vector_len = graph_get_n_input_nodes(g);
-  int aux_len = 0;
-  node_vector = malloc(sizeof(Node *) * vector_len);
+  while (head < tail){
+    Node *n = queue[head++];
 
-  for (int i = 0; i < vector_len; i++){
-    node_vector[i] = graph_get_nth_input_node(g, i);
-  }
+    for (int j = 0; j < n->n_pipes_out; j++){
+      Pipe *p = n->pipes_out[j];
+      if (g->nodes[p->dest->ID] != NULL){
 
-  while (vector_len != 0){
-    for (int i = 0; i < vector_len; i++){
-      Node *n = node_vector[i];
-      int n_pipes = n->n_pipes_out;
+        LOG_TRACE("Drawing %d->%d", p->orig->ID, p->dest->ID);
 
-      float flowrate_inpipes = 0;
-      float flowrate_outpipes = 0;
-      for (int j = 0; j < n->n_pipes_out; j++){
-        flowrate_outpipes += n->pipes_out[j]->flowrate;
-      }
-      for (int j = 0; j < n->n_pipes_in; j++){
-        flowrate_inpipes += n->pipes_in[j]->flowrate;
-      }
+        dot_writer_int(w, p->orig->ID);
+        dot_writer_append(w, "->", 2);
+        dot_writer_int(w, p->dest->ID);
+        dot_writer_append(w, " ", 1);
 
-      printf("\n");
-      for (int j = 0; j < n_pipes; j++){
-        Pipe *p = n->pipes_out[j];
-        if (g->nodes[p->dest->ID] != NULL){
-
-          printf("Drawing %d->%d\n", p->orig->ID, p->dest->ID);
-
-          sprintf(buffer, "%d->%d ", p->orig->ID, p->dest->ID);
-          if (strlen(str) + strlen(buffer) + 10 > str_size){
-            str_size*=2;
-            str = realloc(str, str_size);
-          }
-          strcat(str, buffer);
-
-          if (g2->nodes[p->orig->ID] != NULL && g2->nodes[p->dest->ID] != NULL){
-            sprintf(buffer, "[color=red] ");
-            if (strlen(str) + strlen(buffer) + 10 > str_size){
-              str_size*=2;
-              str = realloc(str, str_size);
-            }
-            strcat(str, buffer);
-          }
-
-          ////ADD PIPE INFORMATION
-          //sprintf(buffer, "[label=\"Len: %.1fm\nPrssIn: %.1f Pa\nPrssOut: %.1f Pa\nFlowrate: %.4f m³/s\n\"];", p->length, p->pressure_in, p->pressure_out, p->flowrate);
-          //if (strlen(str) + strlen(buffer) + 10 > str_size){
-          //  str_size*=2;
-          //  str = realloc(str, str_size);
-          //}
-          //strcat(str, buffer);
-
-
-          if (p->dest->is_output == false){
-            aux_len++;
-            if (aux == NULL){
-              aux = malloc(sizeof(Node *) * aux_len);
-            } else {
-              aux = realloc(aux, sizeof(Node *) * aux_len);
-            }
-            aux[aux_len -1] = p->dest;
-          }
+        if (g->zone[p->orig->ID] == GRAPH_ZONE_SUSPECT && g->zone[p->dest->ID] == GRAPH_ZONE_SUSPECT){
+          dot_writer_puts(w, "[color=red] ");
+        }
+
+        if (p->dest->is_output == false && !queued[p->dest->ID]){
+          queue[tail++] = p->dest;
+          queued[p->dest->ID] = true;
         }
       }
     }
-    free(node_vector);
-    node_vector = aux;
-    aux = NULL;
-    vector_len = aux_len;
-    aux_len = 0;
   }
+  free(queue);
+  free(queued);
 
-  if (aux != NULL){
-    free(aux);
+  //TERMINATION
+  dot_writer_append(w, "}\n", 2);
+  dot_writer_flush(w);
+  free(w);
+}
+int graph_save_dot(Graph *g, const char *filename){
+  if (filename == NULL || strcmp(filename, "-") == 0){
+    fflush(stdout);
+    graph_write_dot(g, STDOUT_FILENO);
+    return 0;
   }
-  free(node_vector);
 
+  FILE *f = fopen(filename, "w");
+  if (f == NULL){
+    perror("Could not open DOT file:");
+    return -1;
+  }
+  graph_write_dot(g, fileno(f));
+  fclose(f);
+  return 0;
+}
+void graph_plot(Graph *g){
+  //Variables for running graphviz
+  int p[2], pid;
+  if (pipe(p) < 0){
+    perror("Could not pipe:");
+    return;
+  }
+  if ((pid = fork()) < 0){
+    perror("Could not fork:");
+    close(p[0]);
+    close(p[1]);
+    return;
+  }
 
-  // Node **nodes = graph_get_nodes(g);
-  // for (int i = 0; i < graph_get_n_nodes(g); i++){
-  //   Node *node = nodes[i];
-  //   for (int j = 0; j < node->n_pipes_out; j++){
-  //     Pipe *pipe = node->pipes_out[j];
-  //     Node *dest = pipe->dest;
-  //     sprintf(buffer, "%d->%d [label=\"Len: %.1fm\nPrssIn: %.1f Pa\nPrssOut: %.1f Pa\nFlowrate: %.4f m³/s\n\"];", node->ID, dest->ID, pipe->length, pipe->pressure_in, pipe->pressure_out, pipe->flowrate);
-  //     // sprintf(buffer, "%d->%d ", node->ID, dest->ID);
-  //     if (strlen(str) + strlen(buffer) + 10 > str_size){
-  //       str_size*=2;
-  //       str = realloc(str, str_size);
-  //     }
-  //     strcat(str, buffer);
-  //   }
-  // }
+  //Fork for graphviz
+  if (pid == 0){
+    close(0);
+    dup(p[0]);
+    close(p[0]);
+    close(p[1]);
 
+    close(1);
+    fopen("test.png", "w");
 
-  //TERMINATION
-  strcat(str, "}");
-  write(p[1], str, strlen(str)+1);
-  close(p[1]);
+    execlp("dot", "dot", "-Tpng", NULL);
+    exit(1);
+  }
+  close(p[0]);
 
-  graph_destroy(g);
-  graph_destroy(g2);
+  graph_write_dot(g, p[1]);
+  close(p[1]);
 }
@@ -0,0 +1,209 @@
+#include <lbfgsb.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+//Sufficient decrease of the line search
+#define LBFGSB_ARMIJO 0.0001
+//Correction pairs with s·y below this times y·y are dropped
+#define LBFGSB_CURVATURE_EPS 1e-10
+
+void lbfgsb_config_init(LbfgsbConfig *c){
+  c->memory = 8;
+  c->max_iterations = 200;
+  c->max_line_search = 20;
+  c->gradient_tolerance = 0.00001;
+  c->function_tolerance = 0.000000001;
+}
+
+static double lbfgsb_project(double v, const double *lower, const double *upper, int i){
+  if (lower != NULL && v < lower[i]){
+    v = lower[i];
+  }
+  if (upper != NULL && v > upper[i]){
+    v = upper[i];
+  }
+  return v;
+}
+//At a bound with the gradient pointing out of the box
+static _Bool lbfgsb_is_fixed(double x, double g, const double *lower, const double *upper, int i){
+  return (lower != NULL && x <= lower[i] && g > 0) ||
+         (upper != NULL && x >= upper[i] && g < 0);
+}
+static double lbfgsb_dot(const double *a, const double *b, const _Bool *free, int n){
+  double sum = 0;
+  for (int i = 0; i < n; i++){
+    if (free[i]){
+      sum += a[i] * b[i];
+    }
+  }
+  return sum;
+}
+
+int lbfgsb_minimize(const LbfgsbConfig *c, int n, double *x, const double *lower, const double *upper,
+                    LbfgsbFunction f, void *arg, double *fx, int *iterations){
+  if (n <= 0 || c->memory < 1 || f == NULL){
+    return LBFGSB_ERROR;
+  }
+  int m = c->memory;
+  double *s = malloc(sizeof(double) * m * n);
+  double *y = malloc(sizeof(double) * m * n);
+  double *rho = malloc(sizeof(double) * m);
+  double *alpha = malloc(sizeof(double) * m);
+  double *g = malloc(sizeof(double) * n);
+  double *d = malloc(sizeof(double) * n);
+  double *x_new = malloc(sizeof(double) * n);
+  double *g_new = malloc(sizeof(double) * n);
+  _Bool *free_var = malloc(sizeof(_Bool) * n);
+
+  for (int i = 0; i < n; i++){
+    x[i] = lbfgsb_project(x[i], lower, upper, i);
+  }
+  double fk = f(arg, x, g);
+
+  int status = LBFGSB_MAX_ITERATIONS;
+  int n_pairs = 0;
+  int newest = -1;
+  int k = 0;
+  if (! isfinite(fk)){
+    status = LBFGSB_ERROR;
+    k = c->max_iterations;
+  }
+  for (; k < c->max_iterations; k++){
+    //Projected gradient, x - P(x - g)
+    double pg_max = 0;
+    for (int i = 0; i < n; i++){
+      double pg = fabs(lbfgsb_project(x[i] - g[i], lower, upper, i) - x[i]);
+      if (pg > pg_max){
+        pg_max = pg;
+      }
+      free_var[i] = ! lbfgsb_is_fixed(x[i], g[i], lower, upper, i);
+    }
+    if (pg_max <= c->gradient_tolerance){
+      status = LBFGSB_CONVERGED_GRADIENT;
+      break;
+    }
+
+    //d = -H g over the free variables (two-loop recursion)
+    for (int i = 0; i < n; i++){
+      d[i] = free_var[i] ? -g[i] : 0;
+    }
+    for (int j = 0, slot = newest; j < n_pairs; j++, slot = (slot + m - 1) % m){
+      alpha[slot] = rho[slot] * lbfgsb_dot(s + (size_t) slot * n, d, free_var, n);
+      double *ys = y + (size_t) slot * n;
+      for (int i = 0; i < n; i++){
+        if (free_var[i]){
+          d[i] -= alpha[slot] * ys[i];
+        }
+      }
+    }
+    double gamma;
+    if (n_pairs > 0){
+      double *yn = y + (size_t) newest * n;
+      gamma = 1 / (rho[newest] * lbfgsb_dot(yn, yn, free_var, n));
+      if (! isfinite(gamma) || gamma <= 0){
+        gamma = 1;
+      }
+    } else {
+      //First step at most 1 along any variable
+      double g_max = 0;
+      for (int i = 0; i < n; i++){
+        if (free_var[i] && fabs(g[i]) > g_max){
+          g_max = fabs(g[i]);
+        }
+      }
+      gamma = g_max > 1 ? 1 / g_max : 1;
+    }
+    for (int i = 0; i < n; i++){
+      d[i] *= gamma;
+    }
+    for (int j = 0, slot = (newest + m - n_pairs + 1) % m; j < n_pairs; j++, slot = (slot + 1) % m){
+      double beta = rho[slot] * lbfgsb_dot(y + (size_t) slot * n, d, free_var, n);
+      double *ss = s + (size_t) slot * n;
+      for (int i = 0; i < n; i++){
+        if (free_var[i]){
+          d[i] += (alpha[slot] - beta) * ss[i];
+        }
+      }
+    }
+
+    //Not a descent direction: restart from steepest descent
+    if (lbfgsb_dot(g, d, free_var, n) >= 0){
+      n_pairs = 0;
+      for (int i = 0; i < n; i++){
+        d[i] = free_var[i] ? -g[i] : 0;
+      }
+    }
+
+    //Backtracking along the projected path
+    double step = 1;
+    double f_new = 0;
+    _Bool accepted = false;
+    for (int ls = 0; ls < c->max_line_search && ! accepted; ls++, step /= 2){
+      double decrease = 0;
+      for (int i = 0; i < n; i++){
+        x_new[i] = lbfgsb_project(x[i] + step * d[i], lower, upper, i);
+        decrease += g[i] * (x_new[i] - x[i]);
+      }
+      f_new = f(arg, x_new, g_new);
+      accepted = isfinite(f_new) && f_new <= fk + LBFGSB_ARMIJO * fmin(decrease, 0);
+    }
+    if (! accepted){
+      status = LBFGSB_LINE_SEARCH_FAILED;
+      break;
+    }
+
+    //Keep the pair if the curvature is positive
+    int slot = (newest + 1) % m;
+    double *ss = s + (size_t) slot * n;
+    double *ys = y + (size_t) slot * n;
+    double sy = 0;
+    double yy = 0;
+    for (int i = 0; i < n; i++){
+      ss[i] = x_new[i] - x[i];
+      ys[i] = g_new[i] - g[i];
+      sy += ss[i] * ys[i];
+      yy += ys[i] * ys[i];
+    }
+    if (sy > LBFGSB_CURVATURE_EPS * yy){
+      rho[slot] = 1 / sy;
+      newest = slot;
+      if (n_pairs < m){
+        n_pairs++;
+      }
+    } else if (n_pairs == m){
+      //The oldest pair was in that slot
+      n_pairs--;
+    }
+
+    double f_old = fk;
+    fk = f_new;
+    memcpy(x, x_new, sizeof(double) * n);
+    memcpy(g, g_new, sizeof(double) * n);
+    if ((f_old - fk) / fmax(fmax(fabs(f_old), fabs(fk)), 1) <= c->function_tolerance){
+      status = LBFGSB_CONVERGED_FUNCTION;
+      k++;
+      break;
+    }
+  }
+
+  if (fx != NULL){
+    *fx = fk;
+  }
+  if (iterations != NULL){
+    *iterations = k;
+  }
+
+  free(s);
+  free(y);
+  free(rho);
+  free(alpha);
+  free(g);
+  free(d);
+  free(x_new);
+  free(g_new);
+  free(free_var);
+  return status;
+}
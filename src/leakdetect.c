@@ -0,0 +1,236 @@
+#include <leakdetect.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include <fluid_mechanics.h>
+
+//Same fluid as the demo network in main.c
+#define LEAKDETECT_DEFAULT_VISCOSITY 0.08903
+#define LEAKDETECT_DEFAULT_DENSITY 997.08
+
+typedef struct LeakDetect{
+  Graph *g;
+  Node **nodes;
+  Pipe **pipes;
+  int n_nodes;
+  int n_pipes;
+
+  //Node IDs
+  int *inputs;
+  int n_inputs;
+  int *outputs;
+  int n_outputs;
+
+  //Localisation scratch, one per node
+  float *unexplained;
+  int *zone;
+} LeakDetect;
+
+static int leakdetect_check_node(LeakDetect *ld, int node){
+  if (node < 0 || node >= ld->n_nodes || ld->nodes[node] == NULL){
+    return -1;
+  }
+  return 0;
+}
+
+//Constructors
+LeakDetect *leakdetect_new(LeakDetect **ret, int n_pipes, const int *sorig, const int *torig){
+  LeakDetect *ld = malloc(sizeof(LeakDetect));
+
+  ld->g = graph_new(NULL, n_pipes, (int *) sorig, (int *) torig);
+  ld->nodes = graph_get_nodes(ld->g);
+  ld->pipes = graph_get_pipes(ld->g);
+  ld->n_nodes = graph_get_n_nodes(ld->g);
+  ld->n_pipes = graph_get_n_pipes(ld->g);
+
+  graph_set_fluid_viscosity(ld->g, LEAKDETECT_DEFAULT_VISCOSITY);
+  graph_set_fluid_density(ld->g, LEAKDETECT_DEFAULT_DENSITY);
+  graph_set_friction_model(ld->g, friction_model_churchill);
+
+  ld->inputs = malloc(sizeof(int) * ld->n_nodes);
+  ld->outputs = malloc(sizeof(int) * ld->n_nodes);
+  ld->n_inputs = 0;
+  ld->n_outputs = 0;
+  for (int i = 0; i < ld->n_nodes; i++){
+    Node *n = ld->nodes[i];
+    if (n == NULL){
+      continue;
+    }
+    if (node_get_is_input(n)){
+      ld->inputs[ld->n_inputs++] = i;
+    }
+    if (node_get_is_output(n)){
+      ld->outputs[ld->n_outputs++] = i;
+    }
+  }
+  graph_calculate_geometry(ld->g);
+
+  ld->unexplained = malloc(sizeof(float) * ld->n_nodes);
+  ld->zone = malloc(sizeof(int) * ld->n_nodes);
+
+  if (ret != NULL){
+    *ret = ld;
+  }
+  return ld;
+}
+void leakdetect_destroy(LeakDetect *ld){
+  if (ld == NULL){
+    return;
+  }
+  graph_destroy(ld->g);
+  free(ld->inputs);
+  free(ld->outputs);
+  free(ld->unexplained);
+  free(ld->zone);
+  free(ld);
+}
+
+int leakdetect_get_n_nodes(LeakDetect *ld){
+  return ld->n_nodes;
+}
+int leakdetect_get_n_pipes(LeakDetect *ld){
+  return ld->n_pipes;
+}
+Graph *leakdetect_get_graph(LeakDetect *ld){
+  return ld->g;
+}
+
+//Network properties
+void leakdetect_set_fluid(LeakDetect *ld, float viscosity, float density){
+  graph_set_fluid_viscosity(ld->g, viscosity);
+  graph_set_fluid_density(ld->g, density);
+}
+void leakdetect_set_friction_model(LeakDetect *ld, FrictionModel fm){
+  graph_set_friction_model(ld->g, fm);
+}
+void leakdetect_set_thread_pool(LeakDetect *ld, ThreadPool *tp){
+  graph_set_thread_pool(ld->g, tp);
+}
+void leakdetect_set_pipes(LeakDetect *ld, const float *diameters,
+                          const float *roughness, const float *lengths){
+  if (diameters != NULL){
+    graph_set_diameters(ld->g, (float *) diameters);
+  }
+  if (roughness != NULL){
+    graph_set_roughness(ld->g, (float *) roughness);
+  }
+  if (lengths != NULL){
+    graph_set_lengths(ld->g, (float *) lengths);
+  }
+}
+int leakdetect_set_height(LeakDetect *ld, int node, float height){
+  if (leakdetect_check_node(ld, node) != 0){
+    return -1;
+  }
+  node_set_height(ld->nodes[node], height);
+  return 0;
+}
+int leakdetect_set_measured(LeakDetect *ld, int node, _Bool measured){
+  if (leakdetect_check_node(ld, node) != 0){
+    return -1;
+  }
+  node_set_is_measured(ld->nodes[node], measured);
+  return 0;
+}
+
+//Per query
+int leakdetect_set_demands(LeakDetect *ld, const float *demands){
+  float total = 0;
+  for (int i = 0; i < ld->n_outputs; i++){
+    Node *n = ld->nodes[ld->outputs[i]];
+    float d = demands[ld->outputs[i]];
+    node_set_flowrate_measured(n, d);
+    node_set_flowrate_calculated(n, d);
+    total += d;
+  }
+  if (ld->n_inputs == 0){
+    return -1;
+  }
+
+  float even = total / ld->n_inputs;
+  for (int i = 0; i < ld->n_inputs; i++){
+    Node *n = ld->nodes[ld->inputs[i]];
+    node_set_flowrate_calculated(n, even);
+    node_set_flowrate_measured(n, even);
+  }
+  return 0;
+}
+void leakdetect_set_measurements(LeakDetect *ld, const float *flowrates){
+  for (int i = 0; i < ld->n_nodes; i++){
+    Node *n = ld->nodes[i];
+    if (n == NULL || !node_get_is_measured(n)){
+      continue;
+    }
+    node_set_flowrate_measured(n, (flowrates[i] < 0) ? -1 : flowrates[i]);
+  }
+}
+void leakdetect_solve(LeakDetect *ld){
+  for (int i = 0; i < ld->n_inputs; i++){
+    Node *n = ld->nodes[ld->inputs[i]];
+    node_set_pressure_calculated(n, node_input_compute_pressure(n));
+  }
+  graph_backpropagate_flowrate(ld->g);
+  graph_propagate_pressure(ld->g);
+}
+
+void leakdetect_get_node_state(LeakDetect *ld, float *pressure, float *flowrate){
+  for (int i = 0; i < ld->n_nodes; i++){
+    Node *n = ld->nodes[i];
+    if (pressure != NULL){
+      pressure[i] = (n != NULL) ? node_get_pressure_calculated(n) : NAN;
+    }
+    if (flowrate != NULL){
+      flowrate[i] = (n != NULL) ? node_get_flowrate_calculated(n) : NAN;
+    }
+  }
+}
+void leakdetect_get_pipe_state(LeakDetect *ld, float *flowrate, float *velocity,
+                               float *pressure_in, float *pressure_out){
+  for (int i = 0; i < ld->n_pipes; i++){
+    Pipe *p = ld->pipes[i];
+    if (flowrate != NULL){
+      flowrate[i] = pipe_get_flowrate(p);
+    }
+    if (velocity != NULL){
+      velocity[i] = pipe_get_fluid_velocity(p);
+    }
+    if (pressure_in != NULL){
+      pressure_in[i] = pipe_get_pressure_in(p);
+    }
+    if (pressure_out != NULL){
+      pressure_out[i] = pipe_get_pressure_out(p);
+    }
+  }
+}
+
+//Same zones as the suspicion colouring of render.c
+int leakdetect_localise(LeakDetect *ld, float threshold, float *suspicion,
+                        int *nodes, float *scores, int max){
+  graph_compute_suspect_zone(ld->g, ld->zone, ld->unexplained);
+
+  //Insertion of every meter into the top max candidates
+  int found = 0;
+  for (int i = 0; i < ld->n_nodes && max > 0; i++){
+    float u = ld->unexplained[i];
+    if (ld->zone[i] == i && u > threshold && (found < max || u > scores[max - 1])){
+      int pos = (found < max) ? found++ : max - 1;
+      while (pos > 0 && scores[pos - 1] < u){
+        scores[pos] = scores[pos - 1];
+        nodes[pos] = nodes[pos - 1];
+        pos--;
+      }
+      scores[pos] = u;
+      nodes[pos] = i;
+    }
+  }
+
+  if (suspicion != NULL){
+    for (int i = 0; i < ld->n_nodes; i++){
+      suspicion[i] = (ld->zone[i] != -1) ? ld->unexplained[ld->zone[i]] : 0;
+    }
+  }
+
+  return found;
+}
@@ -34,6 +34,20 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef LODEPNG_COMPILE_THREADS
+#include <pthread.h>
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+#ifdef LODEPNG_COMPILE_SIMD
+#include <string.h>
+#include <immintrin.h>
+
+/*runtime CPU checks choosing between the SIMD and the portable code paths*/
+#define LODEPNG_HAS_SSSE3() (__builtin_cpu_supports("ssse3") != 0)
+#define LODEPNG_HAS_AVX2() (__builtin_cpu_supports("avx2") != 0)
+#define LODEPNG_HAS_PCLMUL() (__builtin_cpu_supports("pclmul") != 0)
+#endif /*LODEPNG_COMPILE_SIMD*/
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1310) /*Visual Studio: A few warning types are not desired here.*/
 #pragma warning( disable : 4244 ) /*implicit conversions: not warned by gcc -Wall -Wextra and requires too much casts*/
 #pragma warning( disable : 4996 ) /*VS does not like fopen, but fopen_s is not standard C so unusable here*/
@@ -1462,6 +1476,30 @@ static void updateHashChain(Hash* hash, size_t wpos, unsigned hashval, unsigned
   hash->headz[numzeros] = wpos;
 }
 
+/*insert the positions start..end-1 in the hash without encoding them, so the
+bytes before a parallel deflate chunk can be used as its dictionary. size is
+the end of the data that may be read.*/
+static void hash_prime(Hash* hash, const unsigned char* in, size_t start, size_t end, size_t size,
+                       unsigned windowsize)
+{
+  size_t pos;
+  unsigned numzeros = 0;
+  for(pos = start; pos < end; ++pos)
+  {
+    unsigned hashval = getHash(in, size, pos);
+    if(hashval == 0)
+    {
+      if(numzeros == 0) numzeros = countZeros(in, size, pos);
+      else if(pos + numzeros > size || in[pos + numzeros - 1] != 0) --numzeros;
+    }
+    else
+    {
+      numzeros = 0;
+    }
+    updateHashChain(hash, pos & (windowsize - 1), hashval, numzeros);
+  }
+}
+
 /*
 LZ77-encode the data. Return value is error code. The input are raw bytes, the output
 is in the form of unsigned integers with codes representing for example literal bytes, or
@@ -1473,12 +1511,14 @@ this hash technique is one out of several ways to speed this up.
 */
 static unsigned encodeLZ77(uivector* out, Hash* hash,
                            const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
-                           unsigned minmatch, unsigned nicematch, unsigned lazymatching)
+                           unsigned minmatch, unsigned nicematch, unsigned lazymatching,
+                           unsigned maxchainlength)
 {
   size_t pos;
   unsigned i, error = 0;
   /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-  unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
+  unsigned fastinsert = maxchainlength != 0 && !lazymatching;
+  if(maxchainlength == 0) maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
   unsigned maxlazymatch = windowsize >= 8192 ? MAX_SUPPORTED_DEFLATE_LENGTH : 64;
 
   unsigned usezeros = 1; /*not sure if setting it to false for windowsize < 8192 is better or worse*/
@@ -1623,6 +1663,22 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
       length of only 3 may be not worth it then*/
       if(!uivector_push_back(out, in[pos])) ERROR_BREAK(83 /*alloc fail*/);
     }
+    else if(fastinsert && length > nicematch)
+    {
+      /*like zlib's fast levels, the bytes inside long matches are not hashed.
+      Their window slots are cleared so that no chain reads a stale position.*/
+      addLengthDistance(out, length, offset);
+      for(i = 1; i < length; ++i)
+      {
+        ++pos;
+        wpos = pos & (windowsize - 1);
+        hash->val[wpos] = -1;
+        hash->chain[wpos] = (unsigned short)wpos;
+        hash->zeros[wpos] = 0;
+        hash->chainz[wpos] = (unsigned short)wpos;
+      }
+      numzeros = 0;
+    }
     else
     {
       addLengthDistance(out, length, offset);
@@ -1783,7 +1839,8 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
     if(settings->use_lz77)
     {
       error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                         settings->minmatch, settings->nicematch, settings->lazymatching);
+                         settings->minmatch, settings->nicematch, settings->lazymatching,
+                       settings->maxchainlength);
       if(error) break;
     }
     else
@@ -1993,7 +2050,8 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
     uivector lz77_encoded;
     uivector_init(&lz77_encoded);
     error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
-                       settings->minmatch, settings->nicematch, settings->lazymatching);
+                       settings->minmatch, settings->nicematch, settings->lazymatching,
+                       settings->maxchainlength);
     if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
     uivector_cleanup(&lz77_encoded);
   }
@@ -2014,17 +2072,19 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+/*deflate in[start..end) as one or more blocks, using in[dictstart..start) as
+dictionary. If not final, the blocks end with an empty stored block so the
+output is byte aligned and can be followed by the blocks of the next range.*/
+static unsigned deflateRange(ucvector* out, const unsigned char* in, size_t dictstart, size_t start,
+                             size_t end, const LodePNGCompressSettings* settings, unsigned final)
 {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
   size_t bp = 0; /*the bit pointer*/
+  size_t insize = end - start;
   Hash hash;
 
-  if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-  else if(settings->btype == 1) blocksize = insize;
+  if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/
   {
     /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
@@ -2039,15 +2099,27 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   error = hash_init(&hash, settings->windowsize);
   if(error) return error;
 
+  hash_prime(&hash, in, dictstart, start, end, settings->windowsize);
+
   for(i = 0; i != numdeflateblocks && !error; ++i)
   {
-    unsigned final = (i == numdeflateblocks - 1);
-    size_t start = i * blocksize;
-    size_t end = start + blocksize;
-    if(end > insize) end = insize;
+    unsigned blockfinal = final && (i == numdeflateblocks - 1);
+    size_t blockstart = start + i * blocksize;
+    size_t blockend = blockstart + blocksize;
+    if(blockend > end) blockend = end;
 
-    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+    if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, blockstart, blockend, settings, blockfinal);
+    else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, blockstart, blockend, settings, blockfinal);
+  }
+
+  if(!error && !final)
+  {
+    /*empty stored block: BFINAL 0, BTYPE 00, pad to byte, LEN 0, NLEN 65535*/
+    addBitToStream(&bp, out, 0);
+    addBitToStream(&bp, out, 0);
+    addBitToStream(&bp, out, 0);
+    if(!ucvector_push_back(out, 0) || !ucvector_push_back(out, 0) ||
+       !ucvector_push_back(out, 255) || !ucvector_push_back(out, 255)) error = 83; /*alloc fail*/
   }
 
   hash_cleanup(&hash);
@@ -2055,6 +2127,119 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   return error;
 }
 
+#ifdef LODEPNG_COMPILE_THREADS
+
+typedef struct DeflateChunks
+{
+  const unsigned char* in;
+  size_t insize;
+  size_t chunksize;
+  size_t numchunks;
+  const LodePNGCompressSettings* settings;
+  ucvector* outs;
+  unsigned* errors;
+
+  pthread_mutex_t lock;
+  size_t next;
+} DeflateChunks;
+
+static void* deflateChunksWorker(void* arg)
+{
+  DeflateChunks* job = (DeflateChunks*)arg;
+  for(;;)
+  {
+    size_t i, start, end, dictstart;
+    pthread_mutex_lock(&job->lock);
+    i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if(i >= job->numchunks) break;
+
+    start = i * job->chunksize;
+    end = start + job->chunksize;
+    if(end > job->insize) end = job->insize;
+    dictstart = start > job->settings->windowsize ? start - job->settings->windowsize : 0;
+
+    job->errors[i] = deflateRange(&job->outs[i], job->in, dictstart, start, end, job->settings,
+                                  i == job->numchunks - 1);
+  }
+  return 0;
+}
+
+static unsigned deflateParallel(ucvector* out, const unsigned char* in, size_t insize,
+                                const LodePNGCompressSettings* settings)
+{
+  unsigned error = 0;
+  size_t i, j, numthreads;
+  pthread_t* threads;
+  DeflateChunks job;
+
+  job.in = in;
+  job.insize = insize;
+  job.chunksize = settings->chunksize ? settings->chunksize : 131072;
+  job.numchunks = (insize + job.chunksize - 1) / job.chunksize;
+  job.settings = settings;
+  job.next = 0;
+  job.outs = (ucvector*)lodepng_malloc(sizeof(ucvector) * job.numchunks);
+  job.errors = (unsigned*)lodepng_malloc(sizeof(unsigned) * job.numchunks);
+  numthreads = settings->numthreads < job.numchunks ? settings->numthreads : job.numchunks;
+  threads = (pthread_t*)lodepng_malloc(sizeof(pthread_t) * numthreads);
+  if(!job.outs || !job.errors || !threads)
+  {
+    lodepng_free(job.outs);
+    lodepng_free(job.errors);
+    lodepng_free(threads);
+    return 83; /*alloc fail*/
+  }
+  for(i = 0; i != job.numchunks; ++i)
+  {
+    ucvector_init(&job.outs[i]);
+    job.errors[i] = 0;
+  }
+  pthread_mutex_init(&job.lock, 0);
+
+  /*the calling thread is worker 0*/
+  for(i = 1; i < numthreads; ++i)
+  {
+    if(pthread_create(&threads[i], 0, deflateChunksWorker, &job) != 0) break;
+  }
+  deflateChunksWorker(&job);
+  for(j = 1; j < i; ++j) pthread_join(threads[j], 0);
+  pthread_mutex_destroy(&job.lock);
+
+  for(i = 0; i != job.numchunks; ++i)
+  {
+    if(!error) error = job.errors[i];
+    for(j = 0; !error && j != job.outs[i].size; ++j)
+    {
+      if(!ucvector_push_back(out, job.outs[i].data[j])) error = 83; /*alloc fail*/
+    }
+    ucvector_cleanup(&job.outs[i]);
+  }
+
+  lodepng_free(job.outs);
+  lodepng_free(job.errors);
+  lodepng_free(threads);
+  return error;
+}
+
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings)
+{
+  if(settings->btype > 2) return 61;
+  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+
+#ifdef LODEPNG_COMPILE_THREADS
+  if(settings->numthreads > 1 && insize > (settings->chunksize ? settings->chunksize : 131072))
+  {
+    return deflateParallel(out, in, insize, settings);
+  }
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+  return deflateRange(out, in, 0, 0, insize, settings, 1);
+}
+
 unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings)
@@ -2088,7 +2273,95 @@ static unsigned deflate(unsigned char** out, size_t* outsize,
 /* / Adler32                                                                  */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
+#ifdef LODEPNG_COMPILE_SIMD
+/*
+Adler-32 over blocks of 32 (SSSE3) or 64 (AVX2) bytes. Within a block s2
+grows by the block length times s1 plus every byte weighted by its distance
+to the block end, the weighted sum is done by maddubs with a descending tap.
+Blocks are processed in runs short enough for the 32 bit lanes not to
+overflow before the modulo, as the portable loop does every 5550 bytes.
+Both return the number of bytes consumed and leave the tail to the caller.
+*/
+
+static unsigned hsum_epi32(__m128i v)
+{
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  return (unsigned)_mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("ssse3")))
+static unsigned adler32_ssse3(unsigned* s1, unsigned* s2, const unsigned char* data, unsigned len)
+{
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  unsigned blocks = len / 32, done = blocks * 32;
+
+  while(blocks > 0)
+  {
+    unsigned n = blocks > 5536 / 32 ? 5536 / 32 : blocks;
+    __m128i vs1 = zero, vs2 = _mm_cvtsi32_si128((int)*s2);
+    __m128i vps = _mm_cvtsi32_si128((int)(*s1 * n)); /*s1 at the start of every block*/
+    blocks -= n;
+    while(n > 0)
+    {
+      __m128i b1 = _mm_loadu_si128((const __m128i*)data);
+      __m128i b2 = _mm_loadu_si128((const __m128i*)(data + 16));
+      vps = _mm_add_epi32(vps, vs1);
+      vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(b1, zero));
+      vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(b1, tap1), ones));
+      vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(b2, zero));
+      vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_maddubs_epi16(b2, tap2), ones));
+      data += 32;
+      --n;
+    }
+    vs2 = _mm_add_epi32(vs2, _mm_slli_epi32(vps, 5));
+    *s1 = (*s1 + hsum_epi32(vs1)) % 65521;
+    *s2 = hsum_epi32(vs2) % 65521;
+  }
+  return done;
+}
+
+__attribute__((target("avx2")))
+static unsigned adler32_avx2(unsigned* s1, unsigned* s2, const unsigned char* data, unsigned len)
+{
+  const __m256i tap1 = _mm256_setr_epi8(64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49,
+                                        48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33);
+  const __m256i tap2 = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  unsigned blocks = len / 64, done = blocks * 64;
+
+  while(blocks > 0)
+  {
+    unsigned n = blocks > 5504 / 64 ? 5504 / 64 : blocks;
+    __m256i vs1 = zero, vs2 = _mm256_zextsi128_si256(_mm_cvtsi32_si128((int)*s2));
+    __m256i vps = _mm256_zextsi128_si256(_mm_cvtsi32_si128((int)(*s1 * n)));
+    blocks -= n;
+    while(n > 0)
+    {
+      __m256i b1 = _mm256_loadu_si256((const __m256i*)data);
+      __m256i b2 = _mm256_loadu_si256((const __m256i*)(data + 32));
+      vps = _mm256_add_epi32(vps, vs1);
+      vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(b1, zero));
+      vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(b1, tap1), ones));
+      vs1 = _mm256_add_epi32(vs1, _mm256_sad_epu8(b2, zero));
+      vs2 = _mm256_add_epi32(vs2, _mm256_madd_epi16(_mm256_maddubs_epi16(b2, tap2), ones));
+      data += 64;
+      --n;
+    }
+    vs2 = _mm256_add_epi32(vs2, _mm256_slli_epi32(vps, 6));
+    *s1 = (*s1 + hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(vs1), _mm256_extracti128_si256(vs1, 1)))) % 65521;
+    *s2 = hsum_epi32(_mm_add_epi32(_mm256_castsi256_si128(vs2), _mm256_extracti128_si256(vs2, 1))) % 65521;
+  }
+  return done;
+}
+#endif /*LODEPNG_COMPILE_SIMD*/
+
+static unsigned update_adler32_portable(unsigned adler, const unsigned char* data, unsigned len)
 {
    unsigned s1 = adler & 0xffff;
    unsigned s2 = (adler >> 16) & 0xffff;
@@ -2111,6 +2384,21 @@ static unsigned update_adler32(unsigned adler, const unsigned char* data, unsign
   return (s2 << 16) | s1;
 }
 
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
+{
+#ifdef LODEPNG_COMPILE_SIMD
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+  unsigned done = 0;
+  if(len >= 64 && LODEPNG_HAS_AVX2()) done = adler32_avx2(&s1, &s2, data, len);
+  else if(len >= 32 && LODEPNG_HAS_SSSE3()) done = adler32_ssse3(&s1, &s2, data, len);
+  adler = (s2 << 16) | s1;
+  data += done;
+  len -= done;
+#endif /*LODEPNG_COMPILE_SIMD*/
+  return update_adler32_portable(adler, data, len);
+}
+
 /*Return the adler32 of the bytes data[0..len-1]*/
 static unsigned adler32(const unsigned char* data, unsigned len)
 {
@@ -2279,13 +2567,26 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->minmatch = 3;
   settings->nicematch = 128;
   settings->lazymatching = 1;
+  settings->maxchainlength = 0;
+  settings->numthreads = 0;
+  settings->chunksize = 0;
 
   settings->custom_zlib = 0;
   settings->custom_deflate = 0;
   settings->custom_context = 0;
 }
 
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0};
+void lodepng_compress_settings_init_fast(LodePNGCompressSettings* settings)
+{
+  lodepng_compress_settings_init(settings);
+  /*a full window is cheap with one probe and finds the previous scanline*/
+  settings->windowsize = 32768;
+  settings->maxchainlength = 1;
+  settings->nicematch = 32;
+  settings->lazymatching = 0;
+}
+
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 128, 1, 0, 0, 0, 0, 0, 0};
 
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -2319,52 +2620,392 @@ const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0,
 
 
 #ifndef LODEPNG_NO_COMPILE_CRC
-/* CRC polynomial: 0xedb88320 */
-static unsigned lodepng_crc32_table[256] = {
-           0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
-   249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
-   498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
-   325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
-   997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
-   901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
-   651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
-   671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
-  1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
-  2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
-  1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
-  1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
-  1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
-  1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
-  1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
-  1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
-  3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
-  3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
-  4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
-  4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
-  3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
-  3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
-  3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
-  3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
-  2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
-  2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
-  2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
-  2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
-  2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
-  2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
-  3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
-  3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+/* CRC polynomial: 0xedb88320. Table k holds the CRC of byte n followed by k zero
+bytes, for slicing by 8 bytes at a time */
+static const unsigned lodepng_crc32_table[8][256] = {
+  {
+            0u, 1996959894u, 3993919788u, 2567524794u,  124634137u, 1886057615u, 3915621685u, 2657392035u,
+    249268274u, 2044508324u, 3772115230u, 2547177864u,  162941995u, 2125561021u, 3887607047u, 2428444049u,
+    498536548u, 1789927666u, 4089016648u, 2227061214u,  450548861u, 1843258603u, 4107580753u, 2211677639u,
+    325883990u, 1684777152u, 4251122042u, 2321926636u,  335633487u, 1661365465u, 4195302755u, 2366115317u,
+    997073096u, 1281953886u, 3579855332u, 2724688242u, 1006888145u, 1258607687u, 3524101629u, 2768942443u,
+    901097722u, 1119000684u, 3686517206u, 2898065728u,  853044451u, 1172266101u, 3705015759u, 2882616665u,
+    651767980u, 1373503546u, 3369554304u, 3218104598u,  565507253u, 1454621731u, 3485111705u, 3099436303u,
+    671266974u, 1594198024u, 3322730930u, 2970347812u,  795835527u, 1483230225u, 3244367275u, 3060149565u,
+   1994146192u,   31158534u, 2563907772u, 4023717930u, 1907459465u,  112637215u, 2680153253u, 3904427059u,
+   2013776290u,  251722036u, 2517215374u, 3775830040u, 2137656763u,  141376813u, 2439277719u, 3865271297u,
+   1802195444u,  476864866u, 2238001368u, 4066508878u, 1812370925u,  453092731u, 2181625025u, 4111451223u,
+   1706088902u,  314042704u, 2344532202u, 4240017532u, 1658658271u,  366619977u, 2362670323u, 4224994405u,
+   1303535960u,  984961486u, 2747007092u, 3569037538u, 1256170817u, 1037604311u, 2765210733u, 3554079995u,
+   1131014506u,  879679996u, 2909243462u, 3663771856u, 1141124467u,  855842277u, 2852801631u, 3708648649u,
+   1342533948u,  654459306u, 3188396048u, 3373015174u, 1466479909u,  544179635u, 3110523913u, 3462522015u,
+   1591671054u,  702138776u, 2966460450u, 3352799412u, 1504918807u,  783551873u, 3082640443u, 3233442989u,
+   3988292384u, 2596254646u,   62317068u, 1957810842u, 3939845945u, 2647816111u,   81470997u, 1943803523u,
+   3814918930u, 2489596804u,  225274430u, 2053790376u, 3826175755u, 2466906013u,  167816743u, 2097651377u,
+   4027552580u, 2265490386u,  503444072u, 1762050814u, 4150417245u, 2154129355u,  426522225u, 1852507879u,
+   4275313526u, 2312317920u,  282753626u, 1742555852u, 4189708143u, 2394877945u,  397917763u, 1622183637u,
+   3604390888u, 2714866558u,  953729732u, 1340076626u, 3518719985u, 2797360999u, 1068828381u, 1219638859u,
+   3624741850u, 2936675148u,  906185462u, 1090812512u, 3747672003u, 2825379669u,  829329135u, 1181335161u,
+   3412177804u, 3160834842u,  628085408u, 1382605366u, 3423369109u, 3138078467u,  570562233u, 1426400815u,
+   3317316542u, 2998733608u,  733239954u, 1555261956u, 3268935591u, 3050360625u,  752459403u, 1541320221u,
+   2607071920u, 3965973030u, 1969922972u,   40735498u, 2617837225u, 3943577151u, 1913087877u,   83908371u,
+   2512341634u, 3803740692u, 2075208622u,  213261112u, 2463272603u, 3855990285u, 2094854071u,  198958881u,
+   2262029012u, 4057260610u, 1759359992u,  534414190u, 2176718541u, 4139329115u, 1873836001u,  414664567u,
+   2282248934u, 4279200368u, 1711684554u,  285281116u, 2405801727u, 4167216745u, 1634467795u,  376229701u,
+   2685067896u, 3608007406u, 1308918612u,  956543938u, 2808555105u, 3495958263u, 1231636301u, 1047427035u,
+   2932959818u, 3654703836u, 1088359270u,  936918000u, 2847714899u, 3736837829u, 1202900863u,  817233897u,
+   3183342108u, 3401237130u, 1404277552u,  615818150u, 3134207493u, 3453421203u, 1423857449u,  601450431u,
+   3009837614u, 3294710456u, 1567103746u,  711928724u, 3020668471u, 3272380065u, 1510334235u,  755167117u
+  },
+  {
+            0u,  421212481u,  842424962u,  724390851u, 1684849924u, 2105013317u, 1448781702u, 1329698503u,
+   3369699848u, 3519200073u, 4210026634u, 3824474571u, 2897563404u, 3048111693u, 2659397006u, 2274893007u,
+   1254232657u, 1406739216u, 2029285587u, 1643069842u,  783210325u,  934667796u,  479770071u,   92505238u,
+   2182846553u, 2600511768u, 2955803355u, 2838940570u, 3866582365u, 4285295644u, 3561045983u, 3445231262u,
+   2508465314u, 2359236067u, 2813478432u, 3198777185u, 4058571174u, 3908292839u, 3286139684u, 3670389349u,
+   1566420650u, 1145479147u, 1869335592u, 1987116393u,  959540142u,  539646703u,  185010476u,  303839341u,
+   3745920755u, 3327985586u, 3983561841u, 4100678960u, 3140154359u, 2721170102u, 2300350837u, 2416418868u,
+    396344571u,  243568058u,  631889529u, 1018359608u, 1945336319u, 1793607870u, 1103436669u, 1490954812u,
+   4034481925u, 3915546180u, 3259968903u, 3679722694u, 2484439553u, 2366552896u, 2787371139u, 3208174018u,
+    950060301u,  565965900u,  177645455u,  328046286u, 1556873225u, 1171730760u, 1861902987u, 2011255754u,
+   3132841300u, 2745199637u, 2290958294u, 2442530455u, 3738671184u, 3352078609u, 3974232786u, 4126854035u,
+   1919080284u, 1803150877u, 1079293406u, 1498383519u,  370020952u,  253043481u,  607678682u, 1025720731u,
+   1711106983u, 2095471334u, 1472923941u, 1322268772u,   26324643u,  411738082u,  866634785u,  717028704u,
+   2904875439u, 3024081134u, 2668790573u, 2248782444u, 3376948395u, 3495106026u, 4219356713u, 3798300520u,
+    792689142u,  908347575u,  487136116u,   68299317u, 1263779058u, 1380486579u, 2036719216u, 1618931505u,
+   3890672638u, 4278043327u, 3587215740u, 3435896893u, 2206873338u, 2593195963u, 2981909624u, 2829542713u,
+    998479947u,  580430090u,  162921161u,  279890824u, 1609522511u, 1190423566u, 1842954189u, 1958874764u,
+   4082766403u, 3930137346u, 3245109441u, 3631694208u, 2536953671u, 2385372678u, 2768287173u, 3155920004u,
+   1900120602u, 1750776667u, 1131931800u, 1517083097u,  355290910u,  204897887u,  656092572u, 1040194781u,
+   3113746450u, 2692952403u, 2343461520u, 2461357009u, 3723805974u, 3304059991u, 4022511508u, 4141455061u,
+   2919742697u, 3072101800u, 2620513899u, 2234183466u, 3396041197u, 3547351212u, 4166851439u, 3779471918u,
+   1725839073u, 2143618976u, 1424512099u, 1307796770u,   45282277u,  464110244u,  813994343u,  698327078u,
+   3838160568u, 4259225593u, 3606301754u, 3488152955u, 2158586812u, 2578602749u, 2996767038u, 2877569151u,
+    740041904u,  889656817u,  506086962u,  120682355u, 1215357364u, 1366020341u, 2051441462u, 1667084919u,
+   3422213966u, 3538019855u, 4190942668u, 3772220557u, 2945847882u, 3062702859u, 2644537544u, 2226864521u,
+     52649286u,  439905287u,  823476164u,  672009861u, 1733269570u, 2119477507u, 1434057408u, 1281543041u,
+   2167981343u, 2552493150u, 3004082077u, 2853541596u, 3847487515u, 4233048410u, 3613549209u, 3464057816u,
+   1239502615u, 1358593622u, 2077699477u, 1657543892u,  764250643u,  882293586u,  532408465u,  111204816u,
+   1585378284u, 1197851309u, 1816695150u, 1968414767u,  974272232u,  587794345u,  136598634u,  289367339u,
+   2527558116u, 2411481253u, 2760973158u, 3179948583u, 4073438432u, 3956313505u, 3237863010u, 3655790371u,
+    347922877u,  229101820u,  646611775u, 1066513022u, 1892689081u, 1774917112u, 1122387515u, 1543337850u,
+   3697634229u, 3313392372u, 3998419255u, 4148705398u, 3087642289u, 2702352368u, 2319436851u, 2468674930u
+  },
+  {
+            0u,   29518391u,   59036782u,   38190681u,  118073564u,  114017003u,   76381362u,   89069189u,
+    236147128u,  265370511u,  228034006u,  206958561u,  152762724u,  148411219u,  178138378u,  190596925u,
+    472294256u,  501532999u,  530741022u,  509615401u,  456068012u,  451764635u,  413917122u,  426358261u,
+    305525448u,  334993663u,  296822438u,  275991697u,  356276756u,  352202787u,  381193850u,  393929805u,
+    944588512u,  965684439u, 1003065998u,  973863097u, 1061482044u, 1049003019u, 1019230802u, 1023561829u,
+    912136024u,  933002607u,  903529270u,  874031361u,  827834244u,  815125939u,  852716522u,  856752605u,
+    611050896u,  631869351u,  669987326u,  640506825u,  593644876u,  580921211u,  551983394u,  556069653u,
+    712553512u,  733666847u,  704405574u,  675154545u,  762387700u,  749958851u,  787859610u,  792175277u,
+   1889177024u, 1901651959u, 1931368878u, 1927033753u, 2006131996u, 1985040171u, 1947726194u, 1976933189u,
+   2122964088u, 2135668303u, 2098006038u, 2093965857u, 2038461604u, 2017599123u, 2047123658u, 2076625661u,
+   1824272048u, 1836991623u, 1866005214u, 1861914857u, 1807058540u, 1786244187u, 1748062722u, 1777547317u,
+   1655668488u, 1668093247u, 1630251878u, 1625932113u, 1705433044u, 1684323811u, 1713505210u, 1742760333u,
+   1222101792u, 1226154263u, 1263738702u, 1251046777u, 1339974652u, 1310460363u, 1281013650u, 1301863845u,
+   1187289752u, 1191637167u, 1161842422u, 1149379777u, 1103966788u, 1074747507u, 1112139306u, 1133218845u,
+   1425107024u, 1429406311u, 1467333694u, 1454888457u, 1408811148u, 1379576507u, 1350309090u, 1371438805u,
+   1524775400u, 1528845279u, 1499917702u, 1487177649u, 1575719220u, 1546255107u, 1584350554u, 1605185389u,
+   3778354048u, 3774312887u, 3803303918u, 3816007129u, 3862737756u, 3892238699u, 3854067506u, 3833203973u,
+   4012263992u, 4007927823u, 3970080342u, 3982554209u, 3895452388u, 3924658387u, 3953866378u, 3932773565u,
+   4245928176u, 4241609415u, 4271336606u, 4283762345u, 4196012076u, 4225268251u, 4187931714u, 4166823541u,
+   4076923208u, 4072833919u, 4035198246u, 4047918865u, 4094247316u, 4123732899u, 4153251322u, 4132437965u,
+   3648544096u, 3636082519u, 3673983246u, 3678331705u, 3732010428u, 3753090955u, 3723829714u, 3694611429u,
+   3614117080u, 3601426159u, 3572488374u, 3576541825u, 3496125444u, 3516976691u, 3555094634u, 3525581405u,
+   3311336976u, 3298595879u, 3336186494u, 3340255305u, 3260503756u, 3281337595u, 3251864226u, 3222399125u,
+   3410866088u, 3398419871u, 3368647622u, 3372945905u, 3427010420u, 3448139075u, 3485520666u, 3456284973u,
+   2444203584u, 2423127159u, 2452308526u, 2481530905u, 2527477404u, 2539934891u, 2502093554u, 2497740997u,
+   2679949304u, 2659102159u, 2620920726u, 2650438049u, 2562027300u, 2574714131u, 2603727690u, 2599670141u,
+   2374579504u, 2353749767u, 2383274334u, 2412743529u, 2323684844u, 2336421851u, 2298759554u, 2294686645u,
+   2207933576u, 2186809023u, 2149495014u, 2178734801u, 2224278612u, 2236720739u, 2266437690u, 2262135309u,
+   2850214048u, 2820717207u, 2858812622u, 2879680249u, 2934667388u, 2938704459u, 2909776914u, 2897069605u,
+   2817622296u, 2788420399u, 2759153014u, 2780249921u, 2700618180u, 2704950259u, 2742877610u, 2730399645u,
+   3049550800u, 3020298727u, 3057690558u, 3078802825u, 2999835404u, 3004150075u, 2974355298u, 2961925461u,
+   3151438440u, 3121956959u, 3092510214u, 3113327665u, 3168701108u, 3172786307u, 3210370778u, 3197646061u
+  },
+  {
+            0u, 3099354981u, 2852767883u,  313896942u, 2405603159u,  937357362u,  627793884u, 2648127673u,
+   3316918511u, 2097696650u, 1874714724u, 3607201537u, 1255587768u, 4067088605u, 3772741427u, 1482887254u,
+   1343838111u, 3903140090u, 4195393300u, 1118632049u, 3749429448u, 1741137837u, 1970407491u, 3452858150u,
+   2511175536u,  756094997u, 1067759611u, 2266550430u,  449832999u, 2725482306u, 2965774508u,  142231497u,
+   2687676222u,  412010587u,  171665333u, 2995192016u,  793786473u, 2548850444u, 2237264098u, 1038456711u,
+   1703315409u, 3711623348u, 3482275674u, 1999841343u, 3940814982u, 1381529571u, 1089329165u, 4166106984u,
+   4029413537u, 1217896388u, 1512189994u, 3802027855u, 2135519222u, 3354724499u, 3577784189u, 1845280792u,
+    899665998u, 2367928107u, 2677414085u,  657096608u, 3137160985u,   37822588u,  284462994u, 2823350519u,
+   2601801789u,  598228824u,  824021174u, 2309093331u,  343330666u, 2898962447u, 3195996129u,  113467524u,
+   1587572946u, 3860600759u, 4104763481u, 1276501820u, 3519211397u, 1769898208u, 2076913422u, 3279374443u,
+   3406630818u, 1941006535u, 1627703081u, 3652755532u, 1148164341u, 4241751952u, 3999682686u, 1457141531u,
+    247015245u, 3053797416u, 2763059142u,  470583459u, 2178658330u,  963106687u,  735213713u, 2473467892u,
+    992409347u, 2207944806u, 2435792776u,  697522413u, 3024379988u,  217581361u,  508405983u, 2800865210u,
+   4271038444u, 1177467017u, 1419450215u, 3962007554u, 1911572667u, 3377213406u, 3690561584u, 1665525589u,
+   1799331996u, 3548628985u, 3241568279u, 2039091058u, 3831314379u, 1558270126u, 1314193216u, 4142438437u,
+   2928380019u,  372764438u,   75645176u, 3158189981u,  568925988u, 2572515393u, 2346768303u,  861712586u,
+   3982079547u, 1441124702u, 1196457648u, 4293663189u, 1648042348u, 3666298377u, 3358779879u, 1888390786u,
+    686661332u, 2421291441u, 2196002399u,  978858298u, 2811169155u,  523464422u,  226935048u, 3040519789u,
+   3175145892u,  100435649u,  390670639u, 2952089162u,  841119475u, 2325614998u, 2553003640u,  546822429u,
+   2029308235u, 3225988654u, 3539796416u, 1782671013u, 4153826844u, 1328167289u, 1570739863u, 3844338162u,
+   1298864389u, 4124540512u, 3882013070u, 1608431339u, 3255406162u, 2058742071u, 1744848601u, 3501990332u,
+   2296328682u,  811816591u,  584513889u, 2590678532u,  129869501u, 3204563416u, 2914283062u,  352848211u,
+    494030490u, 2781751807u, 3078325777u,  264757620u, 2450577869u,  715964072u,  941166918u, 2158327331u,
+   3636881013u, 1618608400u, 1926213374u, 3396585883u, 1470427426u, 4011365959u, 4255988137u, 1158766284u,
+   1984818694u, 3471935843u, 3695453837u, 1693991400u, 4180638033u, 1100160564u, 1395044826u, 3952793279u,
+   3019491049u,  189112716u,  435162722u, 2706139399u, 1016811966u, 2217162459u, 2526189877u,  774831696u,
+    643086745u, 2666061564u, 2354934034u,  887166583u, 2838900430u,  294275499u,   54519365u, 3145957664u,
+   3823145334u, 1532818963u, 1240029693u, 4048895640u, 1820460577u, 3560857924u, 3331051178u, 2117577167u,
+   3598663992u, 1858283101u, 2088143283u, 3301633750u, 1495127663u, 3785470218u, 4078182116u, 1269332353u,
+    332098007u, 2876706482u, 3116540252u,   25085497u, 2628386432u,  605395429u,  916469259u, 2384220526u,
+   2254837415u, 1054503362u,  745528876u, 2496903497u,  151290352u, 2981684885u, 2735556987u,  464596510u,
+   1137851976u, 4218313005u, 3923506883u, 1365741990u, 3434129695u, 1946996346u, 1723425172u, 3724871409u
+  },
+  {
+            0u, 1029712304u, 2059424608u, 1201699536u, 4118849216u, 3370159984u, 2403399072u, 2988497936u,
+    812665793u,  219177585u, 1253054625u, 2010132753u, 3320900865u, 4170237105u, 3207642721u, 2186319825u,
+   1625331586u, 1568718386u,  438355170u,  658566482u, 2506109250u, 2818578674u, 4020265506u, 3535817618u,
+   1351670851u, 1844508147u,  709922595u,  389064339u, 2769320579u, 2557498163u, 3754961379u, 3803185235u,
+   3250663172u, 4238411444u, 3137436772u, 2254525908u,  876710340u,  153198708u, 1317132964u, 1944187668u,
+   4054934725u, 3436268917u, 2339452837u, 3054575125u,   70369797u,  961670069u, 2129760613u, 1133623509u,
+   2703341702u, 2621542710u, 3689016294u, 3867263574u, 1419845190u, 1774270454u,  778128678u,  318858390u,
+   2438067015u, 2888948471u, 3952189479u, 3606153623u, 1691440519u, 1504803895u,  504432359u,  594620247u,
+   1492342857u, 1704161785u,  573770537u,  525542041u, 2910060169u, 2417219385u, 3618876905u, 3939730521u,
+   1753420680u, 1440954936u,  306397416u,  790849880u, 2634265928u, 2690882808u, 3888375336u, 3668168600u,
+    940822475u,   91481723u, 1121164459u, 2142483739u, 3448989963u, 4042473659u, 3075684971u, 2318603227u,
+    140739594u,  889433530u, 1923340138u, 1338244826u, 4259521226u, 3229813626u, 2267247018u, 3124975642u,
+   2570221389u, 2756861693u, 3824297005u, 3734113693u, 1823658381u, 1372780605u,  376603373u,  722643805u,
+   2839690380u, 2485261628u, 3548540908u, 4007806556u, 1556257356u, 1638052860u,  637716780u,  459464860u,
+   4191346895u, 3300051327u, 2199040943u, 3195181599u,  206718479u,  825388991u, 1989285231u, 1274166495u,
+   3382881038u, 4106388158u, 3009607790u, 2382549470u, 1008864718u,   21111934u, 1189240494u, 2072147742u,
+   2984685714u, 2357631266u, 3408323570u, 4131834434u, 1147541074u, 2030452706u, 1051084082u,   63335554u,
+   2174155603u, 3170292451u, 4216760371u, 3325460867u, 1947622803u, 1232499747u,  248909555u,  867575619u,
+   3506841360u, 3966111392u, 2881909872u, 2527485376u,  612794832u,  434546784u, 1581699760u, 1663499008u,
+   3782634705u, 3692447073u, 2612412337u, 2799048193u,  351717905u,  697754529u, 1849071985u, 1398190273u,
+   1881644950u, 1296545318u,  182963446u,  931652934u, 2242328918u, 3100053734u, 4284967478u, 3255255942u,
+   1079497815u, 2100821479u,  983009079u,  133672583u, 3050795671u, 2293717799u, 3474399735u, 4067887175u,
+    281479188u,  765927844u, 1778867060u, 1466397380u, 3846680276u, 3626469220u, 2676489652u, 2733102084u,
+    548881365u,  500656741u, 1517752501u, 1729575173u, 3577210133u, 3898068133u, 2952246901u, 2459410373u,
+   3910527195u, 3564487019u, 2480257979u, 2931134987u,  479546907u,  569730987u, 1716854139u, 1530213579u,
+   3647316762u, 3825568426u, 2745561210u, 2663766474u,  753206746u,  293940330u, 1445287610u, 1799716618u,
+   2314567513u, 3029685993u, 4080348217u, 3461678473u, 2088098201u, 1091956777u,  112560889u, 1003856713u,
+   3112514712u, 2229607720u, 3276105720u, 4263857736u, 1275433560u, 1902492648u,  918929720u,  195422344u,
+    685033439u,  364179055u, 1377080511u, 1869921551u, 3713294623u, 3761522863u, 2811507327u, 2599689167u,
+    413436958u,  633644462u, 1650777982u, 1594160846u, 3978570462u, 3494118254u, 2548332990u, 2860797966u,
+   1211387997u, 1968470509u,  854852413u,  261368461u, 3182753437u, 2161434413u, 3346310653u, 4195650637u,
+   2017729436u, 1160000044u,   42223868u, 1071931724u, 2378480988u, 2963576044u, 4144295484u, 3395602316u
+  },
+  {
+            0u, 3411858341u, 1304994059u, 2257875630u, 2609988118u, 1355649459u, 3596215069u,  486879416u,
+   3964895853u,  655315400u, 2711298918u, 1791488195u, 2009251963u, 3164476382u,  973758832u, 4048990933u,
+     64357019u, 3364540734u, 1310630800u, 2235723829u, 2554806413u, 1394316072u, 3582976390u,  517157411u,
+   4018503926u,  618222419u, 2722963965u, 1762783832u, 1947517664u, 3209171269u,  970744811u, 4068520014u,
+    128714038u, 3438335635u, 1248109629u, 2167961496u, 2621261600u, 1466012805u, 3522553387u,  447296910u,
+   3959392091u,  547575038u, 2788632144u, 1835791861u, 1886307661u, 3140622056u, 1034314822u, 4143626211u,
+     75106221u, 3475428360u, 1236444838u, 2196665603u, 2682996155u, 1421317662u, 3525567664u,  427767573u,
+   3895035328u,  594892389u, 2782995659u, 1857943406u, 1941489622u, 3101955187u, 1047553757u, 4113347960u,
+    257428076u, 3288652233u, 1116777319u, 2311878850u, 2496219258u, 1603640287u, 3640781169u,  308099796u,
+   3809183745u,  676813732u, 2932025610u, 1704983215u, 2023410199u, 3016104370u,  894593820u, 4262377657u,
+    210634999u, 3352484690u, 1095150076u, 2316991065u, 2535410401u, 1547934020u, 3671583722u,  294336591u,
+   3772615322u,  729897279u, 2903845777u, 1716123700u, 2068629644u, 2953845545u,  914647431u, 4258839074u,
+    150212442u, 3282623743u, 1161604689u, 2388688372u, 2472889676u, 1480171241u, 3735940167u,  368132066u,
+   3836185911u,  805002898u, 2842635324u, 1647574937u, 2134298401u, 3026852996u,  855535146u, 4188192143u,
+    186781121u, 3229539940u, 1189784778u, 2377547631u, 2427670487u, 1542429810u, 3715886812u,  371670393u,
+   3882979244u,  741170185u, 2864262823u, 1642462466u, 2095107514u, 3082559007u,  824732849u, 4201955092u,
+    514856152u, 3589064573u, 1400419795u, 2552522358u, 2233554638u, 1316849003u, 3370776517u,   62202976u,
+   4075001525u,  968836368u, 3207280574u, 1954014235u, 1769133219u, 2720925446u,  616199592u, 4024870413u,
+    493229635u, 3594175974u, 1353627464u, 2616354029u, 2264355925u, 1303087088u, 3409966430u,    6498043u,
+   4046820398u,  979978123u, 3170710821u, 2007099008u, 1789187640u, 2717386141u,  661419827u, 3962610838u,
+    421269998u, 3527459403u, 1423225061u, 2676515648u, 2190300152u, 1238466653u, 3477467891u,   68755798u,
+   4115633027u, 1041448998u, 3095868040u, 1943789869u, 1860096405u, 2776760880u,  588673182u, 3897205563u,
+    449450869u, 3516317904u, 1459794558u, 2623431131u, 2170245475u, 1242006214u, 3432247400u,  131015629u,
+   4137259288u, 1036337853u, 3142660115u, 1879958454u, 1829294862u, 2790523051u,  549483013u, 3952910752u,
+    300424884u, 3669282065u, 1545650111u, 2541513754u, 2323209378u, 1092980487u, 3350330793u,  216870412u,
+   4256931033u,  921128828u, 2960342482u, 2066738807u, 1714085583u, 2910195050u,  736264132u, 3770592353u,
+    306060335u, 3647131530u, 1610005796u, 2494197377u, 2309971513u, 1123257756u, 3295149874u,  255536279u,
+   4268596802u,  892423655u, 3013951305u, 2029645036u, 1711070292u, 2929725425u,  674528607u, 3815288570u,
+    373562242u, 3709388839u, 1535949449u, 2429577516u, 2379569556u, 1183418929u, 3223189663u,  188820282u,
+   4195850735u,  827017802u, 3084859620u, 2089020225u, 1636228089u, 2866415708u,  743340786u, 3876759895u,
+    361896217u, 3738094268u, 1482340370u, 2466671543u, 2382584591u, 1163888810u, 3284924932u,  144124321u,
+   4190215028u,  849168593u, 3020503679u, 2136336858u, 1649465698u, 2836138695u,  798521449u, 3838094284u
+  },
+  {
+            0u, 2792819636u, 2543784233u,  837294749u, 4098827283u, 1379413927u, 1674589498u, 3316072078u,
+    871321191u, 2509784531u, 2758827854u,   34034938u, 3349178996u, 1641505216u, 1346337629u, 4131942633u,
+   1742642382u, 3249117050u, 4030828007u, 1446413907u, 2475800797u,  904311657u,   68069876u, 2725880384u,
+   1412551337u, 4064729373u, 3283010432u, 1708771380u, 2692675258u,  101317902u,  937551763u, 2442587175u,
+   3485284764u, 1774858792u, 1478633653u, 4266992385u, 1005723023u, 2642744891u, 2892827814u,  169477906u,
+   4233263099u, 1512406095u, 1808623314u, 3451546982u,  136139752u, 2926205020u, 2676114113u,  972376437u,
+   2825102674u,  236236518u, 1073525883u, 2576072655u, 1546420545u, 4200303349u, 3417542760u, 1841601500u,
+   2609703733u, 1039917185u,  202635804u, 2858742184u, 1875103526u, 3384067218u, 4166835727u, 1579931067u,
+   1141601657u, 3799809741u, 3549717584u, 1977839588u, 2957267306u,  372464350u,  668680259u, 2175552503u,
+   2011446046u, 3516084394u, 3766168119u, 1175200131u, 2209029901u,  635180217u,  338955812u, 2990736784u,
+    601221559u, 2242044419u, 3024812190u,  306049834u, 3617246628u, 1911408144u, 1074125965u, 3866285881u,
+    272279504u, 3058543716u, 2275784441u,  567459149u, 3832906691u, 1107462263u, 1944752874u, 3583875422u,
+   2343980261u,  767641425u,  472473036u, 3126744696u, 2147051766u, 3649987394u, 3899029983u, 1309766251u,
+   3092841090u,  506333494u,  801510315u, 2310084639u, 1276520081u, 3932237093u, 3683203000u, 2113813516u,
+   3966292011u, 1243601823u, 2079834370u, 3716205238u,  405271608u, 3192979340u, 2411259153u,  701492901u,
+   3750207052u, 2045810168u, 1209569125u, 4000285905u,  734575199u, 2378150379u, 3159862134u,  438345922u,
+   2283203314u,  778166598u,  529136603u, 3120492655u, 2086260449u, 3660498261u, 3955679176u, 1303499900u,
+   3153699989u,  495890209u,  744928700u, 2316418568u, 1337360518u, 3921775410u, 3626602927u, 2120129051u,
+   4022892092u, 1237286280u, 2018993941u, 3726666913u,  461853231u, 3186645403u, 2350400262u,  711936178u,
+   3693557851u, 2052076527u, 1270360434u, 3989775046u,  677911624u, 2384402428u, 3220639073u,  427820757u,
+   1202443118u, 3789347034u, 3493118535u, 1984154099u, 3018127229u,  362020041u,  612099668u, 2181885408u,
+   1950653705u, 3526596285u, 3822816288u, 1168934804u, 2148251930u,  645706414u,  395618355u, 2984485767u,
+    544559008u, 2248295444u, 3085590153u,  295523645u, 3560598451u, 1917673479u, 1134918298u, 3855773998u,
+    328860103u, 3052210803u, 2214924526u,  577903450u, 3889505748u, 1101147744u, 1883911421u, 3594338121u,
+   3424493451u, 1785369663u, 1535282850u, 4260726038u,  944946072u, 2653270060u, 2949491377u,  163225861u,
+   4294103532u, 1501944408u, 1752023237u, 3457862513u,  196998655u, 2915761739u, 2619532502u,  978710370u,
+   2881684293u,  229902577u, 1012666988u, 2586515928u, 1603020630u, 4193987810u, 3356702335u, 1852063179u,
+   2553040162u, 1046169238u,  263412747u, 2848217023u, 1818454321u, 3390333573u, 4227627032u, 1569420204u,
+     60859927u, 2782375331u, 2487203646u,  843627658u, 4159668740u, 1368951216u, 1617990445u, 3322386585u,
+    810543216u, 2520310724u, 2815490393u,   27783917u, 3288386659u, 1652017111u, 1402985802u, 4125677310u,
+   1685994201u, 3255382381u, 4091620336u, 1435902020u, 2419138250u,  910562686u,  128847843u, 2715354199u,
+   1469150398u, 4058414858u, 3222168983u, 1719234083u, 2749255853u,   94984985u,  876691844u, 2453031472u
+  },
+  {
+            0u, 3433693342u, 1109723005u, 2391738339u, 2219446010u, 1222643300u, 3329165703u,  180685081u,
+   3555007413u,  525277995u, 2445286600u, 1567235158u, 1471092047u, 2600801745u,  361370162u, 3642757804u,
+   2092642603u, 2953916853u, 1050555990u, 4063508168u, 4176560081u,  878395215u, 3134470316u, 1987983410u,
+   2942184094u, 1676945920u, 3984272867u,  567356797u,  722740324u, 3887998202u, 1764827929u, 2778407815u,
+   4185285206u,  903635656u, 3142804779u, 2012833205u, 2101111980u, 2979425330u, 1058630609u, 4088621903u,
+    714308067u, 3862526333u, 1756790430u, 2753330688u, 2933487385u, 1651734407u, 3975966820u,  542535930u,
+   2244825981u, 1231508451u, 3353891840u,  188896414u,   25648519u, 3442302233u, 1134713594u, 2399689316u,
+   1445480648u, 2592229462u,  336416693u, 3634843435u, 3529655858u,  516441772u, 2420588879u, 1559052753u,
+    698204909u, 3845636723u, 1807271312u, 2803025166u, 2916600855u, 1635634313u, 4025666410u,  593021940u,
+   4202223960u,  919787974u, 3093159461u, 1962401467u, 2117261218u, 2996361020u, 1008193759u, 4038971457u,
+   1428616134u, 2576151384u,  386135227u, 3685348389u, 3513580860u,  499580322u, 2471098945u, 1608776415u,
+   2260985971u, 1248454893u, 3303468814u,  139259792u,   42591881u, 3458459159u, 1085071860u, 2349261162u,
+   3505103035u,  474062885u, 2463016902u, 1583654744u, 1419882049u, 2550902495u,  377792828u, 3660491170u,
+     51297038u, 3483679632u, 1093385331u, 2374089965u, 2269427188u, 1273935210u, 3311514249u,  164344343u,
+   2890961296u, 1627033870u, 4000683757u,  585078387u,  672833386u, 3836780532u, 1782552599u, 2794821769u,
+   2142603813u, 3005188795u, 1032883544u, 4047146438u, 4227826911u,  928351297u, 3118105506u, 1970307900u,
+   1396409818u, 2677114180u,  287212199u, 3719594553u, 3614542624u,  467372990u, 2505346141u, 1509854403u,
+   2162073199u, 1282711281u, 3271268626u,  240228748u,   76845205u, 3359543307u, 1186043880u, 2317064054u,
+    796964081u, 3811226735u, 1839575948u, 2702160658u, 2882189835u, 1734392469u, 3924802934u,  625327592u,
+   4234522436u,  818917338u, 3191908409u, 1927981223u, 2016387518u, 3028656416u,  973776579u, 4137723485u,
+   2857232268u, 1726474002u, 3899187441u,  616751215u,  772270454u, 3803048424u, 1814228491u, 2693328533u,
+   2041117753u, 3036871847u,  999160644u, 4146592730u, 4259508931u,  826864221u, 3217552830u, 1936586016u,
+   3606501031u,  442291769u, 2496909786u, 1484378436u, 1388107869u, 2652297411u,  278519584u, 3694387134u,
+     85183762u, 3384397196u, 1194773103u, 2342308593u, 2170143720u, 1307820918u, 3279733909u,  265733131u,
+   2057717559u, 3054258089u,  948125770u, 4096344276u, 4276898253u,  843467091u, 3167309488u, 1885556270u,
+   2839764098u, 1709792284u, 3949353983u,  667704161u,  755585656u, 3785577190u, 1865176325u, 2743489947u,
+    102594076u, 3401021058u, 1144549729u, 2291298815u, 2186770662u, 1325234296u, 3228729243u,  215514885u,
+   3589828009u,  424832311u, 2547870420u, 1534552650u, 1370645331u, 2635621325u,  328688686u, 3745342640u,
+   2211456353u, 1333405183u, 3254067740u,  224338562u,  127544219u, 3408931589u, 1170156774u, 2299866232u,
+   1345666772u, 2627681866u,  303053225u, 3736746295u, 3565105198u,  416624816u, 2522494803u, 1525692365u,
+   4285207626u,  868291796u, 3176010551u, 1910772649u, 2065767088u, 3079346734u,  956571085u, 4121828691u,
+    747507711u, 3760459617u, 1856702594u, 2717976604u, 2831417605u, 1684930971u, 3940615800u,  642451174u
+  }
 };
 
+/*updates the (not inverted) CRC register r with 8 bytes per step*/
+static unsigned crc32_slice8(unsigned r, const unsigned char* data, size_t length)
+{
+  while(length >= 8)
+  {
+    unsigned lo = r ^ (data[0] | ((unsigned)data[1] << 8) | ((unsigned)data[2] << 16) | ((unsigned)data[3] << 24));
+    unsigned hi = data[4] | ((unsigned)data[5] << 8) | ((unsigned)data[6] << 16) | ((unsigned)data[7] << 24);
+    r = lodepng_crc32_table[7][lo & 0xff] ^ lodepng_crc32_table[6][(lo >> 8) & 0xff]
+      ^ lodepng_crc32_table[5][(lo >> 16) & 0xff] ^ lodepng_crc32_table[4][lo >> 24]
+      ^ lodepng_crc32_table[3][hi & 0xff] ^ lodepng_crc32_table[2][(hi >> 8) & 0xff]
+      ^ lodepng_crc32_table[1][(hi >> 16) & 0xff] ^ lodepng_crc32_table[0][hi >> 24];
+    data += 8;
+    length -= 8;
+  }
+  while(length > 0)
+  {
+    r = lodepng_crc32_table[0][(r ^ *data++) & 0xff] ^ (r >> 8);
+    --length;
+  }
+  return r;
+}
+
+#ifdef LODEPNG_COMPILE_SIMD
+/*
+CRC register update by carry-less multiplication folding (Gopal et al., "Fast
+CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"), with the
+bit reflected constants of the paper for 0xedb88320. Four 128 bit lanes are
+folded 64 bytes at a time, merged into one, then reduced to 32 bits with a
+Barrett reduction. length must be at least 64 and a multiple of 16.
+*/
+__attribute__((target("pclmul,sse2")))
+static unsigned crc32_pclmul(unsigned r, const unsigned char* data, size_t length)
+{
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596ll, 0x0154442bd4ll);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009ell, 0x01751997d0ll);
+  const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124ll);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641ll, 0x01db710641ll);
+  const __m128i mask32 = _mm_setr_epi32(-1, 0, -1, 0);
+  __m128i x1, x2, x3, x4, t;
+
+  x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)data), _mm_cvtsi32_si128((int)r));
+  x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+  x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+  x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+  data += 64;
+  length -= 64;
+
+  while(length >= 64)
+  {
+    __m128i t1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    __m128i t2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    __m128i t3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    __m128i t4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x11), t1);
+    x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x11), t2);
+    x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x11), t3);
+    x4 = _mm_xor_si128(_mm_clmulepi64_si128(x4, k1k2, 0x11), t4);
+    x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data));
+    x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i*)(data + 16)));
+    x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i*)(data + 32)));
+    x4 = _mm_xor_si128(x4, _mm_loadu_si128((const __m128i*)(data + 48)));
+    data += 64;
+    length -= 64;
+  }
+
+  /*fold the four lanes, then the remaining 16 byte blocks, into x1*/
+  t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t), x2);
+  t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t), x3);
+  t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t), x4);
+  while(length >= 16)
+  {
+    t = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), t);
+    x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data));
+    data += 16;
+    length -= 16;
+  }
+
+  /*128 to 64 bits*/
+  t = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t);
+  t = _mm_srli_si128(x1, 4);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k5, 0x00), t);
+
+  /*Barrett reduction to 32 bits*/
+  t = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), poly, 0x10);
+  t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), poly, 0x00);
+  x1 = _mm_xor_si128(x1, t);
+  return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif /*LODEPNG_COMPILE_SIMD*/
+
 /*Return the CRC of the bytes buf[0..len-1].*/
 unsigned lodepng_crc32(const unsigned char* data, size_t length)
 {
   unsigned r = 0xffffffffu;
-  size_t i;
-  for(i = 0; i < length; ++i)
+#ifdef LODEPNG_COMPILE_SIMD
+  if(length >= 64 && LODEPNG_HAS_PCLMUL())
   {
-    r = lodepng_crc32_table[(r ^ data[i]) & 0xff] ^ (r >> 8);
+    size_t folded = length & ~(size_t)15;
+    r = crc32_pclmul(r, data, folded);
+    data += folded;
+    length -= folded;
   }
-  return r ^ 0xffffffffu;
+#endif /*LODEPNG_COMPILE_SIMD*/
+  return crc32_slice8(r, data, length) ^ 0xffffffffu;
 }
 #else /* !LODEPNG_NO_COMPILE_CRC */
 unsigned lodepng_crc32(const unsigned char* data, size_t length);
@@ -3843,6 +4484,249 @@ static unsigned char paethPredictor(short a, short b, short c)
   else return (unsigned char)a;
 }
 
+#ifdef LODEPNG_COMPILE_SIMD
+
+/*
+SIMD versions of the scanline filters. Each one processes whole vectors from
+position start and returns the first position it did not process, the caller
+finishes the line with the portable code. Every result is bit identical to
+the scalar filters: the average is floor((a + b) / 2), computed as the
+rounding-up _mm_avg_epu8 minus the lost low bit, and Paeth is evaluated on
+16 bit lanes with the same comparisons as paethPredictor.
+*/
+
+static __m128i paeth_sse2(__m128i a, __m128i b, __m128i c)
+{
+  /*16 bit lanes holding bytes*/
+  __m128i zero = _mm_setzero_si128();
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = _mm_add_epi16(pa, pb);
+  __m128i use_c, use_b;
+  pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+  pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+  pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+  use_c = _mm_and_si128(_mm_cmplt_epi16(pc, pa), _mm_cmplt_epi16(pc, pb));
+  use_b = _mm_andnot_si128(use_c, _mm_cmplt_epi16(pb, pa));
+  a = _mm_andnot_si128(_mm_or_si128(use_b, use_c), a);
+  return _mm_or_si128(a, _mm_or_si128(_mm_and_si128(use_b, b), _mm_and_si128(use_c, c)));
+}
+
+static __m128i avg_floor_sse2(__m128i a, __m128i b)
+{
+  return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+static size_t filterScanline_sse2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                  size_t start, size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i = start;
+  __m128i zero = _mm_setzero_si128();
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i r;
+    if(filterType == 1)
+    {
+      r = _mm_sub_epi8(x, _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth)));
+    }
+    else if(filterType == 2)
+    {
+      r = _mm_sub_epi8(x, _mm_loadu_si128((const __m128i*)(prevline + i)));
+    }
+    else if(filterType == 3)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+      __m128i b = _mm_loadu_si128((const __m128i*)(prevline + i));
+      r = _mm_sub_epi8(x, avg_floor_sse2(a, b));
+    }
+    else
+    {
+      __m128i a = _mm_loadu_si128((const __m128i*)(scanline + i - bytewidth));
+      __m128i b = _mm_loadu_si128((const __m128i*)(prevline + i));
+      __m128i c = _mm_loadu_si128((const __m128i*)(prevline + i - bytewidth));
+      __m128i lo = paeth_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+      __m128i hi = paeth_sse2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero));
+      r = _mm_sub_epi8(x, _mm_packus_epi16(lo, hi));
+    }
+    _mm_storeu_si128((__m128i*)(out + i), r);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static __m256i paeth_avx2(__m256i a, __m256i b, __m256i c)
+{
+  __m256i pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+  __m256i pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+  __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(_mm256_sub_epi16(b, c), _mm256_sub_epi16(a, c)));
+  __m256i use_c = _mm256_and_si256(_mm256_cmpgt_epi16(pa, pc), _mm256_cmpgt_epi16(pb, pc));
+  __m256i use_b = _mm256_andnot_si256(use_c, _mm256_cmpgt_epi16(pa, pb));
+  return _mm256_blendv_epi8(_mm256_blendv_epi8(a, b, use_b), c, use_c);
+}
+
+__attribute__((target("avx2")))
+static size_t filterScanline_avx2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                  size_t start, size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i = start;
+  __m256i zero = _mm256_setzero_si256();
+  __m256i one = _mm256_set1_epi8(1);
+  for(; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    __m256i r;
+    if(filterType == 1)
+    {
+      r = _mm256_sub_epi8(x, _mm256_loadu_si256((const __m256i*)(scanline + i - bytewidth)));
+    }
+    else if(filterType == 2)
+    {
+      r = _mm256_sub_epi8(x, _mm256_loadu_si256((const __m256i*)(prevline + i)));
+    }
+    else if(filterType == 3)
+    {
+      __m256i a = _mm256_loadu_si256((const __m256i*)(scanline + i - bytewidth));
+      __m256i b = _mm256_loadu_si256((const __m256i*)(prevline + i));
+      __m256i avg = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+      r = _mm256_sub_epi8(x, avg);
+    }
+    else
+    {
+      /*unpack and pack work inside each 128 bit lane, so the byte order is kept*/
+      __m256i a = _mm256_loadu_si256((const __m256i*)(scanline + i - bytewidth));
+      __m256i b = _mm256_loadu_si256((const __m256i*)(prevline + i));
+      __m256i c = _mm256_loadu_si256((const __m256i*)(prevline + i - bytewidth));
+      __m256i lo = paeth_avx2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero));
+      __m256i hi = paeth_avx2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero));
+      r = _mm256_sub_epi8(x, _mm256_packus_epi16(lo, hi));
+    }
+    _mm256_storeu_si256((__m256i*)(out + i), r);
+  }
+  return i;
+}
+
+/*positions start..length-1 of a scanline whose prevline exists*/
+static size_t filterScanlineSIMD(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                 size_t start, size_t length, size_t bytewidth, unsigned char filterType)
+{
+  if(LODEPNG_HAS_AVX2()) start = filterScanline_avx2(out, scanline, prevline, start, length, bytewidth, filterType);
+  return filterScanline_sse2(out, scanline, prevline, start, length, bytewidth, filterType);
+}
+
+/*sum of min(v, 255 - v) over the bytes, or of the bytes themselves if raw*/
+__attribute__((target("avx2")))
+static size_t filterSum_avx2(const unsigned char* data, size_t* pos, size_t length, unsigned raw)
+{
+  size_t i = 0;
+  __m256i acc = _mm256_setzero_si256();
+  __m256i zero = _mm256_setzero_si256();
+  __m256i ones = _mm256_set1_epi8(-1);
+  for(; i + 32 <= length; i += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(data + i));
+    if(!raw) v = _mm256_min_epu8(v, _mm256_xor_si256(v, ones));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v, zero));
+  }
+  *pos = i;
+  return (size_t)_mm256_extract_epi64(acc, 0) + (size_t)_mm256_extract_epi64(acc, 1)
+       + (size_t)_mm256_extract_epi64(acc, 2) + (size_t)_mm256_extract_epi64(acc, 3);
+}
+
+/*adds the sum of the whole vectors to *sum and returns the first byte not added*/
+static size_t filterSumSIMD(const unsigned char* data, size_t length, unsigned raw, size_t* sum)
+{
+  size_t i = 0;
+  __m128i acc = _mm_setzero_si128();
+  __m128i zero = _mm_setzero_si128();
+  __m128i ones = _mm_set1_epi8(-1);
+  if(LODEPNG_HAS_AVX2()) *sum += filterSum_avx2(data, &i, length, raw);
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+    if(!raw) v = _mm_min_epu8(v, _mm_xor_si128(v, ones));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+  }
+  *sum += (size_t)_mm_cvtsi128_si64(acc) + (size_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+  return i;
+}
+
+/*Unfiltering. Up is independent per byte. Sub, Average and Paeth depend on
+the previous pixel, so for 3 and 4 byte pixels a whole pixel is done per step.*/
+__attribute__((target("avx2")))
+static size_t unfilterUp_avx2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                              size_t length)
+{
+  size_t i = 0;
+  for(; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(precon + i));
+    _mm256_storeu_si256((__m256i*)(recon + i), _mm256_add_epi8(x, b));
+  }
+  return i;
+}
+
+static size_t unfilterUpSIMD(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                             size_t length)
+{
+  size_t i = LODEPNG_HAS_AVX2() ? unfilterUp_avx2(recon, scanline, precon, length) : 0;
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(precon + i));
+    _mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(x, b));
+  }
+  return i;
+}
+
+static __m128i load_pixel(const unsigned char* p, size_t bytewidth)
+{
+  int v = 0;
+  memcpy(&v, p, bytewidth);
+  return _mm_cvtsi32_si128(v);
+}
+
+static void store_pixel(unsigned char* p, __m128i v, size_t bytewidth)
+{
+  int x = _mm_cvtsi128_si32(v);
+  memcpy(p, &x, bytewidth);
+}
+
+/*filter types 1, 3 and 4 for bytewidth 3 or 4, from position bytewidth on*/
+static size_t unfilterPixelsSIMD(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, unsigned char filterType, size_t length)
+{
+  size_t i = bytewidth;
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = load_pixel(recon, bytewidth);
+  __m128i c = precon ? load_pixel(precon, bytewidth) : zero;
+  for(; i + bytewidth <= length; i += bytewidth)
+  {
+    __m128i x = load_pixel(scanline + i, bytewidth);
+    if(filterType == 1)
+    {
+      a = _mm_add_epi8(x, a);
+    }
+    else if(filterType == 3)
+    {
+      __m128i b = load_pixel(precon + i, bytewidth);
+      a = _mm_add_epi8(x, avg_floor_sse2(a, b));
+    }
+    else
+    {
+      __m128i b = load_pixel(precon + i, bytewidth);
+      __m128i pred = paeth_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero));
+      a = _mm_add_epi8(x, _mm_packus_epi16(pred, pred));
+      c = b;
+    }
+    store_pixel(recon + i, a, bytewidth);
+  }
+  return i;
+}
+
+#endif /*LODEPNG_COMPILE_SIMD*/
+
 /*shared values used by multiple Adam7 related functions*/
 
 static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
@@ -3986,12 +4870,20 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
       break;
     case 1:
       for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) recon[i] = scanline[i] + recon[i - bytewidth];
+      i = bytewidth;
+#ifdef LODEPNG_COMPILE_SIMD
+      if(bytewidth == 3 || bytewidth == 4) i = unfilterPixelsSIMD(recon, scanline, precon, bytewidth, 1, length);
+#endif /*LODEPNG_COMPILE_SIMD*/
+      for(; i < length; ++i) recon[i] = scanline[i] + recon[i - bytewidth];
       break;
     case 2:
       if(precon)
       {
-        for(i = 0; i != length; ++i) recon[i] = scanline[i] + precon[i];
+        i = 0;
+#ifdef LODEPNG_COMPILE_SIMD
+        i = unfilterUpSIMD(recon, scanline, precon, length);
+#endif /*LODEPNG_COMPILE_SIMD*/
+        for(; i != length; ++i) recon[i] = scanline[i] + precon[i];
       }
       else
       {
@@ -4002,7 +4894,11 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
       if(precon)
       {
         for(i = 0; i != bytewidth; ++i) recon[i] = scanline[i] + (precon[i] >> 1);
-        for(i = bytewidth; i < length; ++i) recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) >> 1);
+        i = bytewidth;
+#ifdef LODEPNG_COMPILE_SIMD
+        if(bytewidth == 3 || bytewidth == 4) i = unfilterPixelsSIMD(recon, scanline, precon, bytewidth, 3, length);
+#endif /*LODEPNG_COMPILE_SIMD*/
+        for(; i < length; ++i) recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) >> 1);
       }
       else
       {
@@ -4017,7 +4913,11 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
         {
           recon[i] = (scanline[i] + precon[i]); /*paethPredictor(0, precon[i], 0) is always precon[i]*/
         }
-        for(i = bytewidth; i < length; ++i)
+        i = bytewidth;
+#ifdef LODEPNG_COMPILE_SIMD
+        if(bytewidth == 3 || bytewidth == 4) i = unfilterPixelsSIMD(recon, scanline, precon, bytewidth, 4, length);
+#endif /*LODEPNG_COMPILE_SIMD*/
+        for(; i < length; ++i)
         {
           recon[i] = (scanline[i] + paethPredictor(recon[i - bytewidth], precon[i], precon[i - bytewidth]));
         }
@@ -5152,12 +6052,20 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       break;
     case 1: /*Sub*/
       for(i = 0; i != bytewidth; ++i) out[i] = scanline[i];
-      for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
+      i = bytewidth;
+#ifdef LODEPNG_COMPILE_SIMD
+      i = filterScanlineSIMD(out, scanline, prevline, i, length, bytewidth, 1);
+#endif /*LODEPNG_COMPILE_SIMD*/
+      for(; i < length; ++i) out[i] = scanline[i] - scanline[i - bytewidth];
       break;
     case 2: /*Up*/
       if(prevline)
       {
-        for(i = 0; i != length; ++i) out[i] = scanline[i] - prevline[i];
+        i = 0;
+#ifdef LODEPNG_COMPILE_SIMD
+        i = filterScanlineSIMD(out, scanline, prevline, i, length, bytewidth, 2);
+#endif /*LODEPNG_COMPILE_SIMD*/
+        for(; i != length; ++i) out[i] = scanline[i] - prevline[i];
       }
       else
       {
@@ -5168,7 +6076,11 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       if(prevline)
       {
         for(i = 0; i != bytewidth; ++i) out[i] = scanline[i] - (prevline[i] >> 1);
-        for(i = bytewidth; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
+        i = bytewidth;
+#ifdef LODEPNG_COMPILE_SIMD
+        i = filterScanlineSIMD(out, scanline, prevline, i, length, bytewidth, 3);
+#endif /*LODEPNG_COMPILE_SIMD*/
+        for(; i < length; ++i) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) >> 1);
       }
       else
       {
@@ -5181,7 +6093,11 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       {
         /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
         for(i = 0; i != bytewidth; ++i) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; ++i)
+        i = bytewidth;
+#ifdef LODEPNG_COMPILE_SIMD
+        i = filterScanlineSIMD(out, scanline, prevline, i, length, bytewidth, 4);
+#endif /*LODEPNG_COMPILE_SIMD*/
+        for(; i < length; ++i)
         {
           out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
         }
@@ -5279,13 +6195,17 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
           /*calculate the sum of the result*/
           sum[type] = 0;
+          x = 0;
+#ifdef LODEPNG_COMPILE_SIMD
+          x = (unsigned)filterSumSIMD(attempt[type], linebytes, type == 0, &sum[type]);
+#endif /*LODEPNG_COMPILE_SIMD*/
           if(type == 0)
           {
-            for(x = 0; x != linebytes; ++x) sum[type] += (unsigned char)(attempt[type][x]);
+            for(; x != linebytes; ++x) sum[type] += (unsigned char)(attempt[type][x]);
           }
           else
           {
-            for(x = 0; x != linebytes; ++x)
+            for(; x != linebytes; ++x)
             {
               /*For differences, each byte should be treated as signed, values above 127 are negative
               (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
@@ -0,0 +1,188 @@
+#include <log.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <pthread.h>
+
+//Milliseconds the flush thread sleeps between drains
+#define LOG_FLUSH_PERIOD_MS 20
+
+//Bounded queue with a sequence number per slot (Vyukov). A slot is free for
+//the producer that claims position pos when seq == pos, and holds a message
+//for the consumer when seq == pos + 1.
+typedef struct LogSlot{
+  atomic_ulong seq;
+  int level;
+  int line;
+  const char *file;
+  double time;
+  char message[LOG_MESSAGE_SIZE];
+} LogSlot;
+
+atomic_int log_level = LOG_LEVEL_INFO;
+
+static LogSlot ring[LOG_RING_SIZE];
+static atomic_ulong ring_tail;
+static unsigned long ring_head;      //Only touched with drain_lock held
+static atomic_ulong dropped;
+static unsigned long dropped_reported;
+
+static FILE *sink = NULL;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static struct timespec start_time;
+
+static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+
+static double log_elapsed(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - start_time.tv_sec) + (ts.tv_nsec - start_time.tv_nsec) * 1e-9;
+}
+
+//Writes every committed message. drain_lock must be held.
+static void log_drain(){
+  FILE *f = (sink != NULL) ? sink : stderr;
+  _Bool wrote = false;
+
+  while (true){
+    LogSlot *slot = &ring[ring_head % LOG_RING_SIZE];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != ring_head + 1){
+      break;
+    }
+    fprintf(f, "[%.6f] %-5s %s:%d: %s\n", slot->time, level_names[slot->level],
+            slot->file, slot->line, slot->message);
+    atomic_store_explicit(&slot->seq, ring_head + LOG_RING_SIZE, memory_order_release);
+    ring_head++;
+    wrote = true;
+  }
+
+  unsigned long d = atomic_load(&dropped);
+  if (d != dropped_reported){
+    fprintf(f, "[%.6f] %-5s %lu log messages dropped\n", log_elapsed(),
+            level_names[LOG_LEVEL_WARN], d - dropped_reported);
+    dropped_reported = d;
+    wrote = true;
+  }
+
+  if (wrote){
+    fflush(f);
+  }
+}
+
+static void *log_flush_thread(void *arg){
+  struct timespec period = {0, LOG_FLUSH_PERIOD_MS * 1000000L};
+  while (true){
+    nanosleep(&period, NULL);
+    pthread_mutex_lock(&drain_lock);
+    log_drain();
+    pthread_mutex_unlock(&drain_lock);
+  }
+  return NULL;
+}
+
+static int log_parse_level(const char *s){
+  for (int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_TRACE; i++){
+    if (strcasecmp(s, level_names[i]) == 0){
+      return i;
+    }
+  }
+  return atoi(s);
+}
+
+static void log_init(){
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  for (unsigned long i = 0; i < LOG_RING_SIZE; i++){
+    atomic_init(&ring[i].seq, i);
+  }
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&thread, &attr, log_flush_thread, NULL);
+  pthread_attr_destroy(&attr);
+
+  atexit(log_flush);
+}
+
+//The environment is read before main so it applies to the first message
+__attribute__((constructor))
+static void log_init_from_env(){
+  const char *env = getenv("LEAK_LOG_LEVEL");
+  if (env != NULL && env[0] != '\0'){
+    log_set_level(log_parse_level(env));
+  }
+}
+
+void log_set_level(int level){
+  if (level < LOG_LEVEL_ERROR){
+    level = LOG_LEVEL_ERROR;
+  } else if (level > LOG_LEVEL_TRACE){
+    level = LOG_LEVEL_TRACE;
+  }
+  atomic_store(&log_level, level);
+}
+int log_get_level(){
+  return atomic_load(&log_level);
+}
+
+void log_set_sink(FILE *f){
+  pthread_mutex_lock(&drain_lock);
+  log_drain();
+  sink = f;
+  pthread_mutex_unlock(&drain_lock);
+}
+
+void log_flush(){
+  pthread_mutex_lock(&drain_lock);
+  log_drain();
+  pthread_mutex_unlock(&drain_lock);
+}
+
+unsigned long log_get_dropped(){
+  return atomic_load(&dropped);
+}
+
+void log_write(int level, const char *file, int line, const char *fmt, ...){
+  pthread_once(&init_once, log_init);
+
+  //Claim a position, failing instead of waiting when the ring is full
+  unsigned long pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+  LogSlot *slot;
+  while (true){
+    slot = &ring[pos % LOG_RING_SIZE];
+    unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    long diff = (long) (seq - pos);
+    if (diff == 0){
+      if (atomic_compare_exchange_weak_explicit(&ring_tail, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)){
+        break;
+      }
+    } else if (diff < 0){
+      atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+      return;
+    } else {
+      pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    }
+  }
+
+  slot->level = level;
+  slot->file = file;
+  slot->line = line;
+  slot->time = log_elapsed();
+
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(slot->message, LOG_MESSAGE_SIZE, fmt, args);
+  va_end(args);
+
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
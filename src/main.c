@@ -3,13 +3,65 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include <fluid_mechanics.h>
+#include <sweep.h>
+#include <render.h>
+#include <stats.h>
+#include <leakdetect.h>
+#include <server.h>
 
 #include <lodepng.h>
 
 #include <graphviz/cgraph.h>
 
+#include <signal.h>
+
+static Server *daemon_server = NULL;
+
+static void daemon_signal(int sig){
+  server_stop(daemon_server);
+}
+
+//Serves the demo network until SIGINT or SIGTERM. Clients can LOAD another.
+static int run_daemon(const char *path, int n_pipes, int *sorig, int *torig,
+                      float *diam, float *rough, float *length, float *outfw,
+                      float height_reservoir){
+  LeakDetect *ld = leakdetect_new(NULL, n_pipes, sorig, torig);
+  leakdetect_set_pipes(ld, diam, rough, length);
+  leakdetect_set_height(ld, 1, height_reservoir);
+  for (int i = 1; i <= 12; i++){
+    leakdetect_set_measured(ld, i, true);
+  }
+
+  //outfw is given in output order
+  Graph *g = leakdetect_get_graph(ld);
+  float *demands = calloc(sizeof(float) * leakdetect_get_n_nodes(ld), 1);
+  for (int i = 0; i < graph_get_n_output_nodes(g); i++){
+    demands[node_get_id(graph_get_nth_output_node(g, i))] = outfw[i];
+  }
+  leakdetect_set_demands(ld, demands);
+  leakdetect_solve(ld);
+  free(demands);
+
+  daemon_server = server_new(NULL, path, ld);
+  if (daemon_server == NULL){
+    leakdetect_destroy(ld);
+    return 1;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = daemon_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  int ret = server_run(daemon_server);
+  server_destroy(daemon_server);
+  return (ret == 0) ? 0 : 1;
+}
+
 int main(int argc, char *argv[]){
   //INITIAL DATA:
   float water_viscosity = 0.08903; float water_density = 997.08;   //Asume 20ºC
@@ -34,6 +86,54 @@ int main(int argc, char *argv[]){
   //Aux data:
   srand(69);
 
+  //Options: --sweep N [--workers W] [--leaks K] [--seed S] [--numa]
+  //         --study N [--noise SIGMA] detectability and ROC over N scenarios
+  //         --png FILE draws the result natively instead of through dot
+  //         --stats FILE appends the instrumentation counters as JSON lines
+  //         --daemon SOCKET serves queries on a Unix socket (see server.h)
+  _Bool sweep = false;
+  _Bool study = false;
+  char *png_filename = NULL;
+  char *daemon_path = NULL;
+  SweepConfig sweep_config;
+  sweep_config_init(&sweep_config);
+  for (int i = 1; i < argc; i++){
+    if (strcmp(argv[i], "--sweep") == 0 && i + 1 < argc){
+      sweep = true;
+      sweep_config.n_scenarios = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--study") == 0 && i + 1 < argc){
+      study = true;
+      sweep_config.n_scenarios = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--noise") == 0 && i + 1 < argc){
+      sweep_config.noise_sigma = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc){
+      sweep_config.n_workers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--leaks") == 0 && i + 1 < argc){
+      sweep_config.scenario.max_leaks = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc){
+      sweep_config.scenario.seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--png") == 0 && i + 1 < argc){
+      png_filename = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc){
+      if (graph_stats_start_dump(argv[++i], 1000) != 0){
+        return 1;
+      }
+      atexit(graph_stats_stop_dump);
+    } else if (strcmp(argv[i], "--daemon") == 0 && i + 1 < argc){
+      daemon_path = argv[++i];
+    } else if (strcmp(argv[i], "--numa") == 0){
+      sweep_config.numa = true;
+    } else {
+      printf("Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  if (daemon_path != NULL){
+    return run_daemon(daemon_path, num_pipes, sorig, torig, dorig, rough, lorig,
+                      outfw, height_reservoir);
+  }
+
   //Create graph
   Graph *g = graph_new(NULL, num_pipes, sorig, torig);
 
@@ -90,6 +190,30 @@ int main(int argc, char *argv[]){
   graph_backpropagate_flowrate(g);
   graph_propagate_pressure(g);
 
+  if (sweep){
+    SweepResult *results = sweep_run(g, &sweep_config);
+    if (results == NULL){
+      printf("Scenario sweep failed\n");
+      graph_destroy(g);
+      return 1;
+    }
+    sweep_print_summary(results, &sweep_config);
+    sweep_results_destroy(results, &sweep_config);
+    graph_destroy(g);
+    return 0;
+  }
+  if (study){
+    SweepStudy s;
+    if (sweep_study(g, &sweep_config, &s) != 0){
+      printf("Detectability study failed\n");
+      graph_destroy(g);
+      return 1;
+    }
+    sweep_print_study(&s, &sweep_config);
+    graph_destroy(g);
+    return 0;
+  }
+
 
   ////View result
   //printf("GRAPH WITHOUT LEAKS: \n");
@@ -125,7 +249,16 @@ int main(int argc, char *argv[]){
     printf("Couldnt find leaks\n");
   }
 
-  graph_plot(g);
+  if (png_filename != NULL){
+    Renderer *r = render_new(NULL, g, 1024, 768);
+    render_set_line_width(r, 3);
+    render_set_color_mode(r, RENDER_COLOR_SUSPICION);
+    render_draw(r, g);
+    render_save_png(r, png_filename);
+    render_destroy(r);
+  } else {
+    graph_plot(g);
+  }
 
   graph_destroy(g);
   leaks_destroy(leaks_calc);
@@ -0,0 +1,1114 @@
+#include <partition.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define COARSEST_SIZE 64
+#define BISECTION_TRIALS 4
+#define REFINE_PASSES 8
+#define IMBALANCE 1.03
+
+//Undirected weighted graph in compressed sparse row form
+typedef struct CSRGraph{
+  int n;
+  int *xadj;
+  int *adjncy;
+  int *adjwgt;
+  int *vwgt;
+  int total_vwgt;
+} CSRGraph;
+
+typedef struct HeapItem{
+  int gain;
+  int v;
+  int stamp;
+} HeapItem;
+
+typedef struct Heap{
+  HeapItem *items;
+  int len;
+  int cap;
+} Heap;
+
+//One part prepared for solving
+typedef struct Subgraph{
+  Graph *g;
+  int n_nodes;
+  int *node_global;   //Global ID of every local node, -1 for ghosts
+  int n_pipes;
+  int *pipe_global;   //Global ID of every local pipe
+} Subgraph;
+
+typedef struct Partition{
+  int k;
+  int n_nodes;
+  int *part;          //Part of every node, -1 for removed nodes
+  int *part_offset;   //Nodes of part i are part_nodes[part_offset[i]..part_offset[i+1])
+  int *part_nodes;
+  int n_cut;
+  int *cut_pipes;
+
+  unsigned int seed;
+} Partition;
+
+//Random numbers (xorshift), partitions are reproducible
+static unsigned int partition_rand(Partition *pt){
+  unsigned int x = pt->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  pt->seed = x;
+  return x;
+}
+
+//CSR graphs
+static CSRGraph *csr_new(int n, int n_edges){
+  CSRGraph *g = malloc(sizeof(CSRGraph));
+  g->n = n;
+  g->xadj = malloc(sizeof(int) * (n + 1));
+  g->adjncy = malloc(sizeof(int) * (n_edges > 0 ? n_edges : 1));
+  g->adjwgt = malloc(sizeof(int) * (n_edges > 0 ? n_edges : 1));
+  g->vwgt = malloc(sizeof(int) * (n > 0 ? n : 1));
+  g->total_vwgt = 0;
+  return g;
+}
+static void csr_destroy(CSRGraph *g){
+  if (g == NULL){
+    return;
+  }
+  free(g->xadj);
+  free(g->adjncy);
+  free(g->adjwgt);
+  free(g->vwgt);
+  free(g);
+}
+//Undirected view of the pipes. ids receives the graph node of every vertex.
+static CSRGraph *csr_from_graph(Graph *G, int *ids){
+  int n_nodes = graph_get_n_nodes(G);
+  int n_pipes = graph_get_n_pipes(G);
+  Pipe **pipes = graph_get_pipes(G);
+
+  int *local = malloc(sizeof(int) * n_nodes);
+  int n = 0;
+  for (int i = 0; i < n_nodes; i++){
+    local[i] = -1;
+    if (graph_get_nth_node(G, i) != NULL){
+      ids[n] = i;
+      local[i] = n++;
+    }
+  }
+
+  int *degree = calloc(sizeof(int) * (n + 1), 1);
+  for (int i = 0; i < n_pipes; i++){
+    int o = local[node_get_id(pipe_get_orig(pipes[i]))];
+    int d = local[node_get_id(pipe_get_dest(pipes[i]))];
+    if (o != -1 && d != -1 && o != d){
+      degree[o]++;
+      degree[d]++;
+    }
+  }
+
+  int n_edges = 0;
+  for (int i = 0; i < n; i++){
+    n_edges += degree[i];
+  }
+  CSRGraph *g = csr_new(n, n_edges);
+
+  g->xadj[0] = 0;
+  for (int i = 0; i < n; i++){
+    g->xadj[i + 1] = g->xadj[i] + degree[i];
+    degree[i] = g->xadj[i];
+    g->vwgt[i] = 1;
+  }
+  g->total_vwgt = n;
+  for (int i = 0; i < n_pipes; i++){
+    int o = local[node_get_id(pipe_get_orig(pipes[i]))];
+    int d = local[node_get_id(pipe_get_dest(pipes[i]))];
+    if (o != -1 && d != -1 && o != d){
+      g->adjncy[degree[o]] = d;
+      g->adjwgt[degree[o]++] = 1;
+      g->adjncy[degree[d]] = o;
+      g->adjwgt[degree[d]++] = 1;
+    }
+  }
+
+  free(degree);
+  free(local);
+  return g;
+}
+//Subgraph induced by the vertices with where[v] == side
+static CSRGraph *csr_extract(CSRGraph *g, int *where, int side, int *ids, int *sub_ids){
+  int *local = malloc(sizeof(int) * g->n);
+  int n = 0;
+  int n_edges = 0;
+  for (int v = 0; v < g->n; v++){
+    local[v] = -1;
+    if (where[v] == side){
+      sub_ids[n] = ids[v];
+      local[v] = n++;
+      n_edges += g->xadj[v + 1] - g->xadj[v];
+    }
+  }
+
+  CSRGraph *s = csr_new(n, n_edges);
+  int e_out = 0;
+  s->xadj[0] = 0;
+  for (int v = 0; v < g->n; v++){
+    if (local[v] == -1){
+      continue;
+    }
+    int lv = local[v];
+    for (int e = g->xadj[v]; e < g->xadj[v + 1]; e++){
+      int u = local[g->adjncy[e]];
+      if (u != -1){
+        s->adjncy[e_out] = u;
+        s->adjwgt[e_out++] = g->adjwgt[e];
+      }
+    }
+    s->xadj[lv + 1] = e_out;
+    s->vwgt[lv] = g->vwgt[v];
+    s->total_vwgt += g->vwgt[v];
+  }
+
+  free(local);
+  return s;
+}
+//Heavy edge matching. cmap receives the coarse vertex of every vertex.
+static CSRGraph *csr_coarsen(Partition *pt, CSRGraph *g, int *cmap){
+  int n = g->n;
+  int *match = malloc(sizeof(int) * n);
+  int *perm = malloc(sizeof(int) * n);
+  for (int v = 0; v < n; v++){
+    match[v] = -1;
+    perm[v] = v;
+  }
+  for (int i = n - 1; i > 0; i--){
+    int j = partition_rand(pt) % (i + 1);
+    int aux = perm[i]; perm[i] = perm[j]; perm[j] = aux;
+  }
+
+  //Keep coarse vertices light enough to balance the coarsest graph
+  int max_vwgt = 1.5 * g->total_vwgt / COARSEST_SIZE;
+  if (max_vwgt < 2){
+    max_vwgt = 2;
+  }
+
+  for (int i = 0; i < n; i++){
+    int v = perm[i];
+    if (match[v] != -1){
+      continue;
+    }
+    int best = -1;
+    int best_wgt = -1;
+    for (int e = g->xadj[v]; e < g->xadj[v + 1]; e++){
+      int u = g->adjncy[e];
+      if (match[u] == -1 && u != v &&
+          g->vwgt[u] + g->vwgt[v] <= max_vwgt && g->adjwgt[e] > best_wgt){
+        best = u;
+        best_wgt = g->adjwgt[e];
+      }
+    }
+    if (best == -1){
+      match[v] = v;
+    } else {
+      match[v] = best;
+      match[best] = v;
+    }
+  }
+
+  int cn = 0;
+  for (int v = 0; v < n; v++){
+    cmap[v] = -1;
+  }
+  for (int v = 0; v < n; v++){
+    if (cmap[v] == -1){
+      cmap[v] = cn;
+      cmap[match[v]] = cn;
+      cn++;
+    }
+  }
+
+  CSRGraph *c = csr_new(cn, g->xadj[n]);
+  int *marker = malloc(sizeof(int) * (cn > 0 ? cn : 1));
+  for (int i = 0; i < cn; i++){
+    marker[i] = -1;
+  }
+
+  int n_edges = 0;
+  for (int v = 0; v < n; v++){
+    if (match[v] != v && match[v] < v){
+      continue;   //Already merged with its leader
+    }
+    int cv = cmap[v];
+    c->xadj[cv] = n_edges;
+    c->vwgt[cv] = g->vwgt[v];
+    if (match[v] != v){
+      c->vwgt[cv] += g->vwgt[match[v]];
+    }
+    c->total_vwgt += c->vwgt[cv];
+
+    int members[2] = {v, match[v]};
+    int n_members = (match[v] != v) ? 2 : 1;
+    for (int m = 0; m < n_members; m++){
+      int w = members[m];
+      for (int e = g->xadj[w]; e < g->xadj[w + 1]; e++){
+        int cu = cmap[g->adjncy[e]];
+        if (cu == cv){
+          continue;
+        }
+        if (marker[cu] == -1){
+          marker[cu] = n_edges;
+          c->adjncy[n_edges] = cu;
+          c->adjwgt[n_edges] = g->adjwgt[e];
+          n_edges++;
+        } else {
+          c->adjwgt[marker[cu]] += g->adjwgt[e];
+        }
+      }
+    }
+    for (int e = c->xadj[cv]; e < n_edges; e++){
+      marker[c->adjncy[e]] = -1;
+    }
+  }
+  c->xadj[cn] = n_edges;
+
+  free(marker);
+  free(match);
+  free(perm);
+  return c;
+}
+static int csr_edge_cut(CSRGraph *g, int *where){
+  int cut = 0;
+  for (int v = 0; v < g->n; v++){
+    for (int e = g->xadj[v]; e < g->xadj[v + 1]; e++){
+      if (where[g->adjncy[e]] != where[v]){
+        cut += g->adjwgt[e];
+      }
+    }
+  }
+  return cut / 2;
+}
+
+//Max heap of gains with lazy deletion
+static void heap_push(Heap *h, int gain, int v, int stamp){
+  if (h->len == h->cap){
+    h->cap = (h->cap == 0) ? 64 : h->cap * 2;
+    h->items = realloc(h->items, sizeof(HeapItem) * h->cap);
+  }
+  int i = h->len++;
+  while (i > 0 && h->items[(i - 1) / 2].gain < gain){
+    h->items[i] = h->items[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  h->items[i].gain = gain;
+  h->items[i].v = v;
+  h->items[i].stamp = stamp;
+}
+static HeapItem heap_pop(Heap *h){
+  HeapItem top = h->items[0];
+  HeapItem last = h->items[--h->len];
+  int i = 0;
+  while (true){
+    int child = 2 * i + 1;
+    if (child >= h->len){
+      break;
+    }
+    if (child + 1 < h->len && h->items[child + 1].gain > h->items[child].gain){
+      child++;
+    }
+    if (h->items[child].gain <= last.gain){
+      break;
+    }
+    h->items[i] = h->items[child];
+    i = child;
+  }
+  if (h->len > 0){
+    h->items[i] = last;
+  }
+  return top;
+}
+
+//Fiduccia-Mattheyses refinement of a bisection
+static void bisection_refine(CSRGraph *g, double frac, int *where){
+  int n = g->n;
+  int max_wgt[2] = {frac * g->total_vwgt * IMBALANCE + 1,
+                    (1 - frac) * g->total_vwgt * IMBALANCE + 1};
+
+  int *id = malloc(sizeof(int) * n);
+  int *ed = malloc(sizeof(int) * n);
+  int *stamp = malloc(sizeof(int) * n);
+  int *moves = malloc(sizeof(int) * n);
+  _Bool *locked = malloc(sizeof(_Bool) * n);
+  Heap heap = {NULL, 0, 0};
+
+  //Stop a pass after this many moves without improvement
+  int patience = n / 50 > 25 ? n / 50 : 25;
+
+  for (int pass = 0; pass < REFINE_PASSES; pass++){
+    int part_wgt[2] = {0, 0};
+    int cut = 0;
+    heap.len = 0;
+    for (int v = 0; v < n; v++){
+      id[v] = 0;
+      ed[v] = 0;
+      for (int e = g->xadj[v]; e < g->xadj[v + 1]; e++){
+        if (where[g->adjncy[e]] == where[v]){
+          id[v] += g->adjwgt[e];
+        } else {
+          ed[v] += g->adjwgt[e];
+        }
+      }
+      cut += ed[v];
+      part_wgt[where[v]] += g->vwgt[v];
+      stamp[v] = 0;
+      locked[v] = false;
+      if (ed[v] > 0){
+        heap_push(&heap, ed[v] - id[v], v, 0);
+      }
+    }
+    cut /= 2;
+
+    _Bool over = part_wgt[0] > max_wgt[0] || part_wgt[1] > max_wgt[1];
+    _Bool best_over = over;
+    int best_cut = cut;
+    int best_moves = 0;
+    int n_moves = 0;
+
+    //Overweight partitions may also move interior vertices
+    if (over){
+      for (int v = 0; v < n; v++){
+        if (ed[v] == 0){
+          heap_push(&heap, ed[v] - id[v], v, 0);
+        }
+      }
+    }
+
+    while (heap.len > 0){
+      HeapItem item = heap_pop(&heap);
+      int v = item.v;
+      if (locked[v] || item.stamp != stamp[v]){
+        continue;
+      }
+
+      int from = where[v];
+      int to = 1 - from;
+      if (part_wgt[to] + g->vwgt[v] > max_wgt[to] && part_wgt[from] <= max_wgt[from]){
+        locked[v] = true;
+        continue;
+      }
+
+      cut -= ed[v] - id[v];
+      where[v] = to;
+      part_wgt[from] -= g->vwgt[v];
+      part_wgt[to] += g->vwgt[v];
+      locked[v] = true;
+      moves[n_moves++] = v;
+
+      int aux = id[v]; id[v] = ed[v]; ed[v] = aux;
+      for (int e = g->xadj[v]; e < g->xadj[v + 1]; e++){
+        int u = g->adjncy[e];
+        if (where[u] == to){
+          id[u] += g->adjwgt[e];
+          ed[u] -= g->adjwgt[e];
+        } else {
+          id[u] -= g->adjwgt[e];
+          ed[u] += g->adjwgt[e];
+        }
+        if (! locked[u]){
+          stamp[u]++;
+          heap_push(&heap, ed[u] - id[u], u, stamp[u]);
+        }
+      }
+
+      over = part_wgt[0] > max_wgt[0] || part_wgt[1] > max_wgt[1];
+      if ((best_over && !over) || (best_over == over && cut < best_cut)){
+        best_over = over;
+        best_cut = cut;
+        best_moves = n_moves;
+      } else if (n_moves - best_moves > patience){
+        break;
+      }
+    }
+
+    //Roll back past the best point
+    for (int i = n_moves - 1; i >= best_moves; i--){
+      where[moves[i]] = 1 - where[moves[i]];
+    }
+    if (best_moves == 0){
+      break;
+    }
+  }
+
+  free(heap.items);
+  free(id);
+  free(ed);
+  free(stamp);
+  free(moves);
+  free(locked);
+}
+//Greedy graph growing from random seeds, keeps the best refined cut
+static void bisection_initial(Partition *pt, CSRGraph *g, double frac, int *where){
+  int n = g->n;
+  int *trial = malloc(sizeof(int) * n);
+  int *queue = malloc(sizeof(int) * n);
+  _Bool *queued = malloc(sizeof(_Bool) * n);
+  int target = frac * g->total_vwgt;
+  int best_cut = -1;
+
+  for (int t = 0; t < BISECTION_TRIALS; t++){
+    for (int v = 0; v < n; v++){
+      trial[v] = 1;
+      queued[v] = false;
+    }
+
+    int head = 0, tail = 0;
+    int grown = 0;
+    while (grown < target){
+      if (head == tail){
+        //Start (or continue in another component) from a random vertex
+        int seed = partition_rand(pt) % n;
+        while (queued[seed]){
+          seed = (seed + 1) % n;
+        }
+        queue[tail++] = seed;
+        queued[seed] = true;
+      }
+      int v = queue[head++];
+      trial[v] = 0;
+      grown += g->vwgt[v];
+      for (int e = g->xadj[v]; e < g->xadj[v + 1]; e++){
+        int u = g->adjncy[e];
+        if (! queued[u]){
+          queue[tail++] = u;
+          queued[u] = true;
+        }
+      }
+    }
+
+    bisection_refine(g, frac, trial);
+    int cut = csr_edge_cut(g, trial);
+    if (best_cut == -1 || cut < best_cut){
+      best_cut = cut;
+      memcpy(where, trial, sizeof(int) * n);
+    }
+  }
+
+  free(trial);
+  free(queue);
+  free(queued);
+}
+//Multilevel bisection. frac is the share of vertex weight wanted in side 0.
+static void bisection_multilevel(Partition *pt, CSRGraph *g, double frac, int *where){
+  CSRGraph *levels[64];
+  int *cmaps[64];
+  int n_levels = 1;
+  levels[0] = g;
+
+  while (levels[n_levels - 1]->n > COARSEST_SIZE && n_levels < 64){
+    CSRGraph *fine = levels[n_levels - 1];
+    int *cmap = malloc(sizeof(int) * fine->n);
+    CSRGraph *coarse = csr_coarsen(pt, fine, cmap);
+    if (coarse->n > 0.95 * fine->n){
+      csr_destroy(coarse);
+      free(cmap);
+      break;
+    }
+    cmaps[n_levels - 1] = cmap;
+    levels[n_levels++] = coarse;
+  }
+
+  CSRGraph *coarsest = levels[n_levels - 1];
+  int *coarse_where = malloc(sizeof(int) * coarsest->n);
+  bisection_initial(pt, coarsest, frac, coarse_where);
+
+  //Project back and refine every level
+  for (int l = n_levels - 1; l > 0; l--){
+    CSRGraph *fine = levels[l - 1];
+    int *fine_where = (l == 1) ? where : malloc(sizeof(int) * fine->n);
+    for (int v = 0; v < fine->n; v++){
+      fine_where[v] = coarse_where[cmaps[l - 1][v]];
+    }
+    bisection_refine(fine, frac, fine_where);
+
+    free(coarse_where);
+    free(cmaps[l - 1]);
+    csr_destroy(levels[l]);
+    coarse_where = fine_where;
+  }
+  if (n_levels == 1){
+    memcpy(where, coarse_where, sizeof(int) * g->n);
+    free(coarse_where);
+  }
+}
+//Recursive bisection into k parts numbered from first_part
+static void partition_recurse(Partition *pt, CSRGraph *g, int *ids, int k, int first_part){
+  if (g->n == 0){
+    return;
+  }
+  if (k == 1 || g->n == 1){
+    for (int v = 0; v < g->n; v++){
+      pt->part[ids[v]] = first_part;
+    }
+    return;
+  }
+
+  int k0 = k / 2;
+  int *where = malloc(sizeof(int) * g->n);
+  bisection_multilevel(pt, g, (double) k0 / k, where);
+
+  int *sub_ids = malloc(sizeof(int) * g->n);
+  for (int side = 0; side < 2; side++){
+    CSRGraph *s = csr_extract(g, where, side, ids, sub_ids);
+    if (side == 0){
+      partition_recurse(pt, s, sub_ids, k0, first_part);
+    } else {
+      partition_recurse(pt, s, sub_ids, k - k0, first_part + k0);
+    }
+    csr_destroy(s);
+  }
+
+  free(sub_ids);
+  free(where);
+}
+
+//Constructors
+Partition *partition_new(Partition **ret, Graph *G, int k){
+  Partition *pt = malloc(sizeof(Partition));
+
+  if (k < 1){
+    k = 1;
+  }
+  pt->k = k;
+  pt->n_nodes = graph_get_n_nodes(G);
+  pt->seed = 2463534242u;
+  pt->part = malloc(sizeof(int) * pt->n_nodes);
+  for (int i = 0; i < pt->n_nodes; i++){
+    pt->part[i] = -1;
+  }
+
+  int *ids = malloc(sizeof(int) * pt->n_nodes);
+  CSRGraph *g = csr_from_graph(G, ids);
+  partition_recurse(pt, g, ids, k, 0);
+  csr_destroy(g);
+  free(ids);
+
+  //Node lists per part
+  pt->part_offset = calloc(sizeof(int) * (k + 1), 1);
+  pt->part_nodes = malloc(sizeof(int) * pt->n_nodes);
+  for (int i = 0; i < pt->n_nodes; i++){
+    if (pt->part[i] != -1){
+      pt->part_offset[pt->part[i] + 1]++;
+    }
+  }
+  for (int i = 0; i < k; i++){
+    pt->part_offset[i + 1] += pt->part_offset[i];
+  }
+  int *fill = calloc(sizeof(int) * k, 1);
+  for (int i = 0; i < pt->n_nodes; i++){
+    int q = pt->part[i];
+    if (q != -1){
+      pt->part_nodes[pt->part_offset[q] + fill[q]++] = i;
+    }
+  }
+  free(fill);
+
+  //Cut pipes
+  int n_pipes = graph_get_n_pipes(G);
+  Pipe **pipes = graph_get_pipes(G);
+  pt->n_cut = 0;
+  pt->cut_pipes = malloc(sizeof(int) * (n_pipes > 0 ? n_pipes : 1));
+  for (int i = 0; i < n_pipes; i++){
+    int o = pt->part[node_get_id(pipe_get_orig(pipes[i]))];
+    int d = pt->part[node_get_id(pipe_get_dest(pipes[i]))];
+    if (o != d){
+      pt->cut_pipes[pt->n_cut++] = i;
+    }
+  }
+
+  if (ret != NULL){
+    *ret = pt;
+  }
+  return pt;
+}
+
+//Destructors
+void partition_destroy(Partition *pt){
+  if (pt == NULL){
+    return;
+  }
+  free(pt->part);
+  free(pt->part_offset);
+  free(pt->part_nodes);
+  free(pt->cut_pipes);
+  free(pt);
+}
+
+int partition_get_k(Partition *pt){
+  return pt->k;
+}
+int partition_get_part(Partition *pt, int node){
+  return pt->part[node];
+}
+int partition_get_n_nodes(Partition *pt, int part){
+  return pt->part_offset[part + 1] - pt->part_offset[part];
+}
+int partition_get_nth_node(Partition *pt, int part, int i){
+  return pt->part_nodes[pt->part_offset[part] + i];
+}
+int partition_get_n_cut_pipes(Partition *pt){
+  return pt->n_cut;
+}
+int partition_get_nth_cut_pipe(Partition *pt, int i){
+  return pt->cut_pipes[i];
+}
+void partition_print(Partition *pt){
+  if (pt == NULL){
+    printf("(null)\n");
+    return;
+  }
+  printf("Partition in %d parts, %d cut pipes\n", pt->k, pt->n_cut);
+  for (int i = 0; i < pt->k; i++){
+    printf("Part %d: %d nodes\n", i, partition_get_n_nodes(pt, i));
+  }
+}
+
+//Solving
+
+//Local copy of part q. Cut pipes end in ghost nodes.
+static void subgraph_build(Partition *pt, Graph *G, int q, Subgraph *s){
+  int n_pipes = graph_get_n_pipes(G);
+  Pipe **pipes = graph_get_pipes(G);
+  int n_real = partition_get_n_nodes(pt, q);
+
+  int *local = malloc(sizeof(int) * pt->n_nodes);
+  for (int i = 0; i < n_real; i++){
+    local[partition_get_nth_node(pt, q, i)] = i;
+  }
+
+  //Local pipes keep the global order so nodes see their pipes in the same order
+  int *sorig = malloc(sizeof(int) * (n_pipes > 0 ? n_pipes : 1));
+  int *torig = malloc(sizeof(int) * (n_pipes > 0 ? n_pipes : 1));
+  s->pipe_global = malloc(sizeof(int) * (n_pipes > 0 ? n_pipes : 1));
+  s->n_pipes = 0;
+  int n_local = n_real;
+  for (int i = 0; i < n_pipes; i++){
+    int o = node_get_id(pipe_get_orig(pipes[i]));
+    int d = node_get_id(pipe_get_dest(pipes[i]));
+    if (pt->part[o] != q && pt->part[d] != q){
+      continue;
+    }
+    sorig[s->n_pipes] = (pt->part[o] == q) ? local[o] : n_local++;
+    torig[s->n_pipes] = (pt->part[d] == q) ? local[d] : n_local++;
+    s->pipe_global[s->n_pipes++] = i;
+  }
+
+  s->g = NULL;
+  s->n_nodes = 0;
+  s->node_global = NULL;
+  if (s->n_pipes == 0){
+    free(sorig);
+    free(torig);
+    free(local);
+    return;
+  }
+
+  s->g = graph_new(NULL, s->n_pipes, sorig, torig);
+  s->n_nodes = graph_get_n_nodes(s->g);
+  s->node_global = malloc(sizeof(int) * s->n_nodes);
+  for (int i = 0; i < s->n_nodes; i++){
+    s->node_global[i] = (i < n_real) ? partition_get_nth_node(pt, q, i) : -1;
+  }
+
+  graph_set_fluid_viscosity(s->g, graph_get_fluid_viscosity(G));
+  graph_set_fluid_density(s->g, graph_get_fluid_density(G));
+  graph_set_friction_model(s->g, graph_get_friction_model(G));
+
+  Pipe **local_pipes = graph_get_pipes(s->g);
+  for (int i = 0; i < s->n_pipes; i++){
+    Pipe *p = pipes[s->pipe_global[i]];
+    pipe_set_diam(local_pipes[i], pipe_get_diam(p));
+    pipe_set_rough(local_pipes[i], pipe_get_rough(p));
+    pipe_set_length(local_pipes[i], pipe_get_length(p));
+    pipe_set_flowrate(local_pipes[i], pipe_get_flowrate(p));
+  }
+
+  //Boundary conditions of real nodes
+  for (int i = 0; i < n_real && i < s->n_nodes; i++){
+    Node *n = graph_get_nth_node(G, s->node_global[i]);
+    Node *ln = graph_get_nth_node(s->g, i);
+    node_set_flowrate_calculated(ln, node_get_flowrate_calculated(n));
+    node_set_pressure_calculated(ln, node_get_pressure_calculated(n));
+  }
+
+  //Ghosts start from the current global state
+  for (int i = 0; i < s->n_pipes; i++){
+    Pipe *p = pipes[s->pipe_global[i]];
+    if (torig[i] >= n_real){
+      float demand = pipe_get_flowrate(p);
+      node_set_flowrate_calculated(graph_get_nth_node(s->g, torig[i]), demand != -1 ? demand : 0);
+    }
+    if (sorig[i] >= n_real){
+      node_set_pressure_calculated(graph_get_nth_node(s->g, sorig[i]), node_get_pressure_calculated(pipe_get_orig(p)));
+    }
+  }
+
+  free(sorig);
+  free(torig);
+  free(local);
+}
+static void subgraph_destroy(Subgraph *s){
+  graph_destroy(s->g);
+  free(s->node_global);
+  free(s->pipe_global);
+}
+
+typedef struct SolveTask{
+  Subgraph *subs;
+  _Bool *dirty;       //Parts whose ghosts changed since they were last solved
+  _Bool pressure;
+} SolveTask;
+
+static void partition_solve_task(void *arg, int first, int last, int thread){
+  SolveTask *task = arg;
+  for (int q = first; q < last; q++){
+    Subgraph *s = &task->subs[q];
+    if (s->g == NULL || !task->dirty[q]){
+      continue;
+    }
+    task->dirty[q] = false;
+    if (task->pressure){
+      graph_propagate_pressure(s->g);
+    } else {
+      graph_backpropagate_flowrate(s->g);
+    }
+  }
+}
+static void partition_run_parts(ThreadPool *tp, ThreadPoolTask f, void *task, int k){
+  if (tp == NULL){
+    f(task, 0, k, 0);
+  } else {
+    thread_pool_run(tp, f, task, k);
+  }
+}
+
+//Local copies of every cut pipe on its upstream and downstream side, and the
+//parts of both sides
+static void partition_cut_copies(Partition *pt, Graph *G, Subgraph *subs,
+                                 Pipe **up, Pipe **down, int *up_part, int *down_part){
+  int n_pipes = graph_get_n_pipes(G);
+  Pipe **pipes = graph_get_pipes(G);
+  Pipe **up_of_pipe = malloc(sizeof(Pipe *) * (n_pipes > 0 ? n_pipes : 1));
+  Pipe **down_of_pipe = malloc(sizeof(Pipe *) * (n_pipes > 0 ? n_pipes : 1));
+  for (int q = 0; q < pt->k; q++){
+    Subgraph *s = &subs[q];
+    for (int j = 0; j < s->n_pipes; j++){
+      int i = s->pipe_global[j];
+      if (pt->part[node_get_id(pipe_get_dest(pipes[i]))] != q){
+        up_of_pipe[i] = graph_get_pipes(s->g)[j];
+      }
+      if (pt->part[node_get_id(pipe_get_orig(pipes[i]))] != q){
+        down_of_pipe[i] = graph_get_pipes(s->g)[j];
+      }
+    }
+  }
+  for (int c = 0; c < pt->n_cut; c++){
+    up[c] = up_of_pipe[pt->cut_pipes[c]];
+    down[c] = down_of_pipe[pt->cut_pipes[c]];
+    up_part[c] = pt->part[node_get_id(pipe_get_orig(pipes[pt->cut_pipes[c]]))];
+    down_part[c] = pt->part[node_get_id(pipe_get_dest(pipes[pt->cut_pipes[c]]))];
+  }
+  free(up_of_pipe);
+  free(down_of_pipe);
+}
+
+int partition_solve(Partition *pt, Graph *G, ThreadPool *tp){
+  int k = pt->k;
+  Subgraph *subs = malloc(sizeof(Subgraph) * k);
+  for (int q = 0; q < k; q++){
+    subgraph_build(pt, G, q, &subs[q]);
+  }
+
+  //Local copies of every cut pipe on its upstream and downstream side
+  Pipe **pipes = graph_get_pipes(G);
+  Pipe **up = malloc(sizeof(Pipe *) * (pt->n_cut > 0 ? pt->n_cut : 1));
+  Pipe **down = malloc(sizeof(Pipe *) * (pt->n_cut > 0 ? pt->n_cut : 1));
+  int *up_part = malloc(sizeof(int) * (pt->n_cut > 0 ? pt->n_cut : 1));
+  int *down_part = malloc(sizeof(int) * (pt->n_cut > 0 ? pt->n_cut : 1));
+  partition_cut_copies(pt, G, subs, up, down, up_part, down_part);
+
+  //Any path crosses each cut pipe at most once
+  int max_iterations = pt->n_cut + 2;
+  int iterations = 0;
+  _Bool converged = false;
+
+  _Bool *dirty = malloc(sizeof(_Bool) * k);
+  for (int q = 0; q < k; q++){
+    dirty[q] = true;
+  }
+
+  //Flowrates: downstream parts tell upstream ghosts their demand
+  SolveTask task = {subs, dirty, false};
+  for (int it = 0; it < max_iterations && !converged; it++){
+    partition_run_parts(tp, partition_solve_task, &task, k);
+    iterations++;
+
+    converged = true;
+    for (int c = 0; c < pt->n_cut; c++){
+      Node *ghost = pipe_get_dest(up[c]);
+      float demand = pipe_get_flowrate(down[c]);
+      if (node_get_flowrate_calculated(ghost) != demand){
+        node_set_flowrate_calculated(ghost, demand);
+        dirty[up_part[c]] = true;
+        converged = false;
+      }
+    }
+  }
+
+  //Pressures: upstream parts tell downstream ghosts their pressure
+  if (converged){
+    converged = false;
+    task.pressure = true;
+    for (int q = 0; q < k; q++){
+      dirty[q] = true;
+    }
+    for (int it = 0; it < max_iterations && !converged; it++){
+      partition_run_parts(tp, partition_solve_task, &task, k);
+      iterations++;
+
+      converged = true;
+      for (int c = 0; c < pt->n_cut; c++){
+        Node *ghost = pipe_get_orig(down[c]);
+        float pressure = node_get_pressure_calculated(pipe_get_orig(up[c]));
+        if (node_get_pressure_calculated(ghost) != pressure){
+          node_set_pressure_calculated(ghost, pressure);
+          dirty[down_part[c]] = true;
+          converged = false;
+        }
+      }
+    }
+  }
+
+  //Copy back. Pipes belong to the part of their destination.
+  for (int q = 0; q < k; q++){
+    Subgraph *s = &subs[q];
+    for (int i = 0; i < s->n_nodes; i++){
+      if (s->node_global[i] == -1){
+        continue;
+      }
+      Node *n = graph_get_nth_node(G, s->node_global[i]);
+      Node *ln = graph_get_nth_node(s->g, i);
+      node_set_flowrate_calculated(n, node_get_flowrate_calculated(ln));
+      node_set_pressure_calculated(n, node_get_pressure_calculated(ln));
+    }
+    for (int i = 0; i < s->n_pipes; i++){
+      Pipe *p = pipes[s->pipe_global[i]];
+      Pipe *lp = graph_get_pipes(s->g)[i];
+      if (pt->part[node_get_id(pipe_get_dest(p))] != q){
+        continue;
+      }
+      pipe_set_flowrate(p, pipe_get_flowrate(lp));
+      pipe_set_fluid_velocity(p, pipe_get_fluid_velocity(lp));
+      pipe_set_friction(p, pipe_get_friction(lp));
+      pipe_set_pressure_in(p, pipe_get_pressure_in(lp));
+      pipe_set_pressure_out(p, pipe_get_pressure_out(lp));
+    }
+  }
+
+  for (int q = 0; q < k; q++){
+    subgraph_destroy(&subs[q]);
+  }
+  free(subs);
+  free(up);
+  free(down);
+  free(up_part);
+  free(down_part);
+  free(dirty);
+
+  return converged ? iterations : -1;
+}
+
+//Localisation
+
+typedef struct LocaliseTask{
+  Subgraph *subs;
+  _Bool *dirty;
+  int **meter;          //Local meter of every local node
+  float **unexplained;
+  float **diffs;        //Diff and successors diff, 2 * n_nodes
+} LocaliseTask;
+
+static void partition_localise_task(void *arg, int first, int last, int thread){
+  LocaliseTask *task = arg;
+  for (int q = first; q < last; q++){
+    Subgraph *s = &task->subs[q];
+    if (s->g == NULL || !task->dirty[q]){
+      continue;
+    }
+    task->dirty[q] = false;
+    graph_compute_suspect_zone(s->g, task->meter[q], task->unexplained[q]);
+    graph_measurement_get_diffs(s->g, task->diffs[q], task->diffs[q] + s->n_nodes);
+  }
+}
+
+//Global meter of a local one: ghost inputs pass on the meter above them
+static int partition_global_meter(Subgraph *s, int *ghost_meter, int m){
+  if (m == -1){
+    return -1;
+  }
+  return (s->node_global[m] != -1) ? s->node_global[m] : ghost_meter[m];
+}
+
+int partition_localise(Partition *pt, Graph *G, ThreadPool *tp, float threshold,
+                       float *suspicion, int *nodes, float *scores, int max, int *found){
+  int k = pt->k;
+  Subgraph *subs = malloc(sizeof(Subgraph) * k);
+  for (int q = 0; q < k; q++){
+    subgraph_build(pt, G, q, &subs[q]);
+  }
+
+  Pipe **pipes = graph_get_pipes(G);
+  Pipe **up = malloc(sizeof(Pipe *) * (pt->n_cut > 0 ? pt->n_cut : 1));
+  Pipe **down = malloc(sizeof(Pipe *) * (pt->n_cut > 0 ? pt->n_cut : 1));
+  int *up_part = malloc(sizeof(int) * (pt->n_cut > 0 ? pt->n_cut : 1));
+  int *down_part = malloc(sizeof(int) * (pt->n_cut > 0 ? pt->n_cut : 1));
+  partition_cut_copies(pt, G, subs, up, down, up_part, down_part);
+
+  //Real nodes carry their meters. Ghosts are meters too: the output one
+  //reads what the downstream part sees through the cut pipe, the input one
+  //stands for the meter above it and reads nothing.
+  _Bool *dirty = malloc(sizeof(_Bool) * k);
+  int **meter = malloc(sizeof(int *) * k);
+  int **ghost_meter = malloc(sizeof(int *) * k);
+  float **unexplained = malloc(sizeof(float *) * k);
+  float **diffs = malloc(sizeof(float *) * k);
+  for (int q = 0; q < k; q++){
+    Subgraph *s = &subs[q];
+    dirty[q] = true;
+    meter[q] = malloc(sizeof(int) * (s->n_nodes > 0 ? s->n_nodes : 1));
+    ghost_meter[q] = malloc(sizeof(int) * (s->n_nodes > 0 ? s->n_nodes : 1));
+    unexplained[q] = malloc(sizeof(float) * (s->n_nodes > 0 ? s->n_nodes : 1));
+    diffs[q] = malloc(sizeof(float) * 2 * (s->n_nodes > 0 ? s->n_nodes : 1));
+    for (int i = 0; i < s->n_nodes; i++){
+      Node *ln = graph_get_nth_node(s->g, i);
+      ghost_meter[q][i] = -1;
+      if (s->node_global[i] != -1){
+        Node *n = graph_get_nth_node(G, s->node_global[i]);
+        node_set_flowrate_measured(ln, node_get_flowrate_measured(n));
+        node_set_is_measured(ln, node_get_is_measured(n));
+      } else {
+        node_set_flowrate_calculated(ln, 0);
+        node_set_flowrate_measured(ln, node_get_is_output(ln) ? 0 : -1);
+      }
+    }
+  }
+
+  //Differences go up the cut pipes, one part further every iteration
+  int max_iterations = pt->n_cut + 2;
+  int iterations = 0;
+  _Bool converged = false;
+  LocaliseTask task = {subs, dirty, meter, unexplained, diffs};
+  for (int it = 0; it < max_iterations && !converged; it++){
+    partition_run_parts(tp, partition_localise_task, &task, k);
+    iterations++;
+
+    converged = true;
+    for (int c = 0; c < pt->n_cut; c++){
+      Node *d = pipe_get_dest(down[c]);
+      int dl = node_get_id(d);
+      float *diff = diffs[down_part[c]];
+      float seen;
+      if (node_get_is_measured(d)){
+        seen = (node_get_flowrate_measured(d) != -1) ? diff[dl] : 0;
+      } else {
+        seen = diff[subs[down_part[c]].n_nodes + dl];
+      }
+      seen *= pipe_get_share_in(pipes[pt->cut_pipes[c]]);
+      Node *ghost = pipe_get_dest(up[c]);
+      if (node_get_flowrate_measured(ghost) != seen){
+        node_set_flowrate_measured(ghost, seen);
+        dirty[up_part[c]] = true;
+        converged = false;
+      }
+    }
+  }
+
+  //Meters go down the cut pipes, one part further every pass
+  _Bool settled = false;
+  for (int it = 0; it < max_iterations && !settled; it++){
+    settled = true;
+    for (int c = 0; c < pt->n_cut; c++){
+      int q = up_part[c];
+      int m = meter[q][node_get_id(pipe_get_orig(up[c]))];
+      int global = partition_global_meter(&subs[q], ghost_meter[q], m);
+      int *ghost = &ghost_meter[down_part[c]][node_get_id(pipe_get_orig(down[c]))];
+      if (*ghost != global){
+        *ghost = global;
+        settled = false;
+      }
+    }
+  }
+
+  //Unexplained difference of every real meter, then the candidates of
+  //every part by insertion into its top max
+  float *meter_unexplained = calloc(sizeof(float) * pt->n_nodes, 1);
+  for (int q = 0; q < k; q++){
+    Subgraph *s = &subs[q];
+    found[q] = 0;
+    for (int i = 0; i < s->n_nodes; i++){
+      int global = s->node_global[i];
+      float u = unexplained[q][i];
+      if (global == -1 || meter[q][i] != i){
+        continue;
+      }
+      meter_unexplained[global] = u;
+      if (u > threshold && max > 0 && (found[q] < max || u > scores[q * max + max - 1])){
+        int pos = (found[q] < max) ? found[q]++ : max - 1;
+        while (pos > 0 && scores[q * max + pos - 1] < u){
+          scores[q * max + pos] = scores[q * max + pos - 1];
+          nodes[q * max + pos] = nodes[q * max + pos - 1];
+          pos--;
+        }
+        scores[q * max + pos] = u;
+        nodes[q * max + pos] = global;
+      }
+    }
+  }
+
+  if (suspicion != NULL){
+    for (int i = 0; i < pt->n_nodes; i++){
+      suspicion[i] = 0;
+    }
+    for (int q = 0; q < k; q++){
+      Subgraph *s = &subs[q];
+      for (int i = 0; i < s->n_nodes; i++){
+        int m = partition_global_meter(s, ghost_meter[q], meter[q][i]);
+        if (s->node_global[i] != -1 && m != -1){
+          suspicion[s->node_global[i]] = meter_unexplained[m];
+        }
+      }
+    }
+  }
+
+  for (int q = 0; q < k; q++){
+    subgraph_destroy(&subs[q]);
+    free(meter[q]);
+    free(ghost_meter[q]);
+    free(unexplained[q]);
+    free(diffs[q]);
+  }
+  free(subs);
+  free(meter);
+  free(ghost_meter);
+  free(unexplained);
+  free(diffs);
+  free(meter_unexplained);
+  free(up);
+  free(down);
+  free(up_part);
+  free(down_part);
+  free(dirty);
+
+  return (converged && settled) ? iterations : -1;
+}
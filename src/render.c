@@ -0,0 +1,392 @@
+#include <render.h>
+#include <stats.h>
+#include <log.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <unistd.h>
+
+#include <lodepng.h>
+
+//Pixels left empty around the drawing
+#define RENDER_MARGIN 8
+
+typedef struct Renderer{
+  int width;
+  int height;
+  unsigned char *pixels;
+
+  int n_nodes;
+  int n_pipes;
+
+  //Node positions in pixels, NaN for removed nodes
+  float *px;
+  float *py;
+
+  int color_mode;
+  int line_width;
+
+  float *suspicion;
+  _Bool user_suspicion;
+
+  float *value;
+  unsigned char *color;
+} Renderer;
+
+typedef struct RenderKey{
+  float key;
+  int node;
+} RenderKey;
+
+static int render_key_compare(const void *a, const void *b){
+  const RenderKey *ka = a;
+  const RenderKey *kb = b;
+  if (ka->key != kb->key){
+    return ka->key < kb->key ? -1 : 1;
+  }
+  return ka->node - kb->node;
+}
+
+//Layout
+static void render_layout_layered(Renderer *r, Graph *g){
+  //Levels come from the graph, ordered by row below
+  int n_levels = graph_get_depth(g);
+  int n_order = graph_get_n_leveled_nodes(g);
+  int *order = graph_get_level_nodes(g, 0);
+  RenderKey *keys = malloc(sizeof(RenderKey) * (n_order + 1));
+  for (int k = 0; k < n_order; k++){
+    keys[k].node = order[k];
+  }
+
+  //Row of every node as a fraction of its column, parents first
+  float *row = malloc(sizeof(float) * r->n_nodes);
+  float span_x = r->width - 2 * RENDER_MARGIN;
+  float span_y = r->height - 2 * RENDER_MARGIN;
+  for (int l = 0, off = 0; l < n_levels; l++){
+    RenderKey *lk = keys + off;
+    int count = graph_get_level_size(g, l);
+    off += count;
+    for (int i = 0; i < count; i++){
+      Node *n = graph_get_nth_node(g, lk[i].node);
+      int n_in = node_get_n_pipes_in(n);
+      float sum = 0;
+      for (int j = 0; j < n_in; j++){
+        sum += row[node_get_id(pipe_get_orig(node_get_nth_pipe_in(n, j)))];
+      }
+      lk[i].key = (n_in > 0) ? sum / n_in : lk[i].node;
+    }
+    qsort(lk, count, sizeof(RenderKey), render_key_compare);
+
+    float x = (n_levels > 1) ? RENDER_MARGIN + span_x * l / (n_levels - 1) : r->width / 2.0;
+    for (int i = 0; i < count; i++){
+      row[lk[i].node] = (i + 0.5) / count;
+      r->px[lk[i].node] = x;
+      r->py[lk[i].node] = RENDER_MARGIN + span_y * row[lk[i].node];
+    }
+  }
+
+  free(row);
+  free(keys);
+}
+static void render_layout_coordinates(Renderer *r, Graph *g, float *x, float *y){
+  float min_x = INFINITY, max_x = -INFINITY;
+  float min_y = INFINITY, max_y = -INFINITY;
+  for (int i = 0; i < r->n_nodes; i++){
+    if (graph_get_nth_node(g, i) != NULL){
+      min_x = fminf(min_x, x[i]);
+      max_x = fmaxf(max_x, x[i]);
+      min_y = fminf(min_y, y[i]);
+      max_y = fmaxf(max_y, y[i]);
+    }
+  }
+
+  //Same scale on both axes, centered
+  float span_x = r->width - 2 * RENDER_MARGIN;
+  float span_y = r->height - 2 * RENDER_MARGIN;
+  float dx = (max_x > min_x) ? max_x - min_x : 1;
+  float dy = (max_y > min_y) ? max_y - min_y : 1;
+  float scale = fminf(span_x / dx, span_y / dy);
+  float off_x = RENDER_MARGIN + (span_x - dx * scale) / 2;
+  float off_y = RENDER_MARGIN + (span_y - dy * scale) / 2;
+
+  for (int i = 0; i < r->n_nodes; i++){
+    if (graph_get_nth_node(g, i) != NULL){
+      r->px[i] = off_x + (x[i] - min_x) * scale;
+      r->py[i] = off_y + (max_y - y[i]) * scale;
+    }
+  }
+}
+
+//Every node gets the unexplained difference of the meter it sits below
+static void render_compute_suspicion(Renderer *r, Graph *g){
+  int *meter = malloc(sizeof(int) * r->n_nodes);
+  float *unexplained = malloc(sizeof(float) * r->n_nodes);
+
+  graph_compute_suspect_zone(g, meter, unexplained);
+  for (int i = 0; i < r->n_nodes; i++){
+    r->suspicion[i] = (meter[i] != -1) ? unexplained[meter[i]] : 0;
+  }
+
+  free(meter);
+  free(unexplained);
+}
+
+//Constructors
+Renderer *render_new(Renderer **ret, Graph *g, int width, int height){
+  Renderer *r = malloc(sizeof(Renderer));
+
+  r->width = width;
+  r->height = height;
+  r->pixels = NULL;
+  r->n_nodes = graph_get_n_nodes(g);
+  r->n_pipes = graph_get_n_pipes(g);
+
+  r->px = malloc(sizeof(float) * r->n_nodes);
+  r->py = malloc(sizeof(float) * r->n_nodes);
+  for (int i = 0; i < r->n_nodes; i++){
+    r->px[i] = NAN;
+    r->py[i] = NAN;
+  }
+  r->suspicion = calloc(sizeof(float) * r->n_nodes, 1);
+  r->user_suspicion = false;
+  r->value = malloc(sizeof(float) * r->n_pipes);
+  r->color = malloc(sizeof(unsigned char) * 3 * r->n_pipes);
+
+  r->color_mode = RENDER_COLOR_PRESSURE;
+  r->line_width = 1;
+
+  render_layout_layered(r, g);
+
+  if (ret != NULL){
+    *ret = r;
+  }
+  return r;
+}
+
+//Destructors
+void render_destroy(Renderer *r){
+  if (r == NULL){
+    return;
+  }
+  free(r->pixels);
+  free(r->px);
+  free(r->py);
+  free(r->suspicion);
+  free(r->value);
+  free(r->color);
+  free(r);
+}
+
+//Setters
+void render_set_coordinates(Renderer *r, Graph *g, float *x, float *y){
+  if (x == NULL || y == NULL){
+    render_layout_layered(r, g);
+  } else {
+    render_layout_coordinates(r, g, x, y);
+  }
+}
+void render_set_color_mode(Renderer *r, int mode){
+  r->color_mode = mode;
+}
+void render_set_line_width(Renderer *r, int width){
+  r->line_width = (width > 0) ? width : 1;
+}
+void render_set_suspicion(Renderer *r, float *suspicion){
+  if (suspicion == NULL){
+    r->user_suspicion = false;
+    return;
+  }
+  memcpy(r->suspicion, suspicion, sizeof(float) * r->n_nodes);
+  r->user_suspicion = true;
+}
+
+//Getters
+unsigned char *render_get_pixels(Renderer *r){
+  return r->pixels;
+}
+float render_get_node_x(Renderer *r, int node){
+  return r->px[node];
+}
+float render_get_node_y(Renderer *r, int node){
+  return r->py[node];
+}
+int render_get_width(Renderer *r){
+  return r->width;
+}
+int render_get_height(Renderer *r){
+  return r->height;
+}
+
+//Rasterisation
+static void render_color(float t, unsigned char *rgb){
+  static const unsigned char stops[5][3] = {
+    {  0,   0, 255},
+    {  0, 200, 255},
+    {  0, 200,   0},
+    {255, 210,   0},
+    {220,   0,   0}
+  };
+  if (!(t > 0)){
+    t = 0;
+  }
+  if (t > 1){
+    t = 1;
+  }
+  float f = t * 4;
+  int i = (f >= 4) ? 3 : (int) f;
+  f -= i;
+  for (int c = 0; c < 3; c++){
+    rgb[c] = stops[i][c] + (stops[i + 1][c] - stops[i][c]) * f;
+  }
+}
+static void render_dot(Renderer *r, int x, int y, int radius, const unsigned char *rgb){
+  for (int j = y - radius; j <= y + radius; j++){
+    if (j < 0 || j >= r->height){
+      continue;
+    }
+    for (int i = x - radius; i <= x + radius; i++){
+      if (i < 0 || i >= r->width){
+        continue;
+      }
+      unsigned char *px = r->pixels + 4 * ((size_t) j * r->width + i);
+      px[0] = rgb[0];
+      px[1] = rgb[1];
+      px[2] = rgb[2];
+      px[3] = 255;
+    }
+  }
+}
+static void render_line(Renderer *r, float fx0, float fy0, float fx1, float fy1, const unsigned char *rgb){
+  int x0 = lroundf(fx0), y0 = lroundf(fy0);
+  int x1 = lroundf(fx1), y1 = lroundf(fy1);
+  int radius = (r->line_width - 1) / 2;
+
+  //Bresenham
+  int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+  int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+  int err = dx + dy;
+  while (true){
+    render_dot(r, x0, y0, radius, rgb);
+    if (x0 == x1 && y0 == y1){
+      break;
+    }
+    int e2 = 2 * err;
+    if (e2 >= dy){
+      err += dy;
+      x0 += sx;
+    }
+    if (e2 <= dx){
+      err += dx;
+      y0 += sy;
+    }
+  }
+}
+
+void render_compute_pipe_colors(Renderer *r, Graph *g, unsigned char *rgb){
+  if (r->color_mode == RENDER_COLOR_SUSPICION && !r->user_suspicion){
+    render_compute_suspicion(r, g);
+  }
+
+  //Value of every pipe and its range
+  Pipe **pipes = graph_get_pipes(g);
+  float min = INFINITY, max = -INFINITY;
+  for (int i = 0; i < r->n_pipes; i++){
+    Pipe *p = pipes[i];
+    switch (r->color_mode){
+      case RENDER_COLOR_FLOWRATE:
+        r->value[i] = fabsf(pipe_get_flowrate(p));
+        break;
+      case RENDER_COLOR_SUSPICION:
+        r->value[i] = r->suspicion[node_get_id(pipe_get_dest(p))];
+        break;
+      default:
+        r->value[i] = (pipe_get_pressure_in(p) + pipe_get_pressure_out(p)) / 2;
+        break;
+    }
+    min = fminf(min, r->value[i]);
+    max = fmaxf(max, r->value[i]);
+  }
+  //Suspicion always starts at zero so a clean network stays blue
+  if (r->color_mode == RENDER_COLOR_SUSPICION){
+    min = 0;
+  }
+  float range = (max > min) ? max - min : 1;
+
+  for (int i = 0; i < r->n_pipes; i++){
+    render_color((r->value[i] - min) / range, rgb + 3 * i);
+  }
+}
+
+void render_draw(Renderer *r, Graph *g){
+  STATS_SCOPE(STATS_RENDER_DRAW);
+  if (r->pixels == NULL){
+    r->pixels = malloc(sizeof(unsigned char) * 4 * r->width * r->height);
+  }
+  memset(r->pixels, 255, sizeof(unsigned char) * 4 * r->width * r->height);
+
+  render_compute_pipe_colors(r, g, r->color);
+  Pipe **pipes = graph_get_pipes(g);
+
+  //Pipes
+  int drawn = 0;
+  for (int i = 0; i < r->n_pipes; i++){
+    int o = node_get_id(pipe_get_orig(pipes[i]));
+    int d = node_get_id(pipe_get_dest(pipes[i]));
+    if (graph_get_nth_node(g, o) == NULL || graph_get_nth_node(g, d) == NULL || isnan(r->px[o]) || isnan(r->px[d])){
+      continue;
+    }
+    render_line(r, r->px[o], r->py[o], r->px[d], r->py[d], r->color + 3 * i);
+    drawn++;
+  }
+  stats_count(STATS_PIPES_DRAWN, drawn);
+
+  //Inputs and measured nodes on top
+  static const unsigned char input_rgb[3] = {0, 0, 160};
+  static const unsigned char measured_rgb[3] = {0, 0, 0};
+  int radius = r->line_width / 2 + 1;
+  for (int i = 0; i < r->n_nodes; i++){
+    Node *n = graph_get_nth_node(g, i);
+    if (n == NULL || isnan(r->px[i])){
+      continue;
+    }
+    if (node_get_is_input(n)){
+      render_dot(r, lroundf(r->px[i]), lroundf(r->py[i]), radius + 1, input_rgb);
+    } else if (node_get_is_measured(n)){
+      render_dot(r, lroundf(r->px[i]), lroundf(r->py[i]), radius, measured_rgb);
+    }
+  }
+}
+
+int render_save_png(Renderer *r, const char *filename){
+  STATS_SCOPE(STATS_RENDER_PNG);
+  if (r->pixels == NULL){
+    return 1;
+  }
+
+  //Dashboards favour encoding time over file size
+  LodePNGState state;
+  lodepng_state_init(&state);
+  lodepng_compress_settings_init_fast(&state.encoder.zlibsettings);
+  //Palette detection costs more than the whole deflate, alpha is always opaque
+  state.encoder.auto_convert = 0;
+  state.info_png.color.colortype = LCT_RGB;
+  state.info_png.color.bitdepth = 8;
+  state.encoder.zlibsettings.numthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  unsigned char *png = NULL;
+  size_t png_size = 0;
+  unsigned error = lodepng_encode(&png, &png_size, r->pixels, r->width, r->height, &state);
+  if (! error){
+    error = lodepng_save_file(png, png_size, filename);
+  }
+  if (error){
+    LOG_ERROR("Could not save %s: %s", filename, lodepng_error_text(error));
+  }
+  free(png);
+  lodepng_state_cleanup(&state);
+  return error;
+}
@@ -0,0 +1,199 @@
+#include <scenario.h>
+
+#include <string.h>
+#include <math.h>
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+//Noise streams count blocks from here, far above any leak draw
+#define SCENARIO_NOISE_STREAM 0x80000000u
+
+//Stream of one scenario, consumed four words per block
+typedef struct ScenarioRng{
+  uint32_t counter[4];
+  uint32_t key[2];
+  uint32_t block[4];
+  int used;
+} ScenarioRng;
+
+void scenario_config_init(ScenarioConfig *c){
+  c->seed = 69;
+  c->size_distribution = SCENARIO_SIZE_FIXED;
+  c->min_leaks = 1;
+  c->max_leaks = 1;
+  c->mean_leaks = 1;
+  c->flow_distribution = SCENARIO_FLOW_UNIFORM;
+  c->min_flowrate = 0;
+  c->max_flowrate = 0.01;
+  c->mean_flowrate = 0.005;
+}
+
+void scenario_philox(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]){
+  uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+  uint32_t k0 = key[0], k1 = key[1];
+  for (int r = 0; r < PHILOX_ROUNDS; r++){
+    uint64_t p0 = (uint64_t) PHILOX_M0 * c0;
+    uint64_t p1 = (uint64_t) PHILOX_M1 * c2;
+    c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+    c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+    c1 = (uint32_t) p1;
+    c3 = (uint32_t) p0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+  out[0] = c0;
+  out[1] = c1;
+  out[2] = c2;
+  out[3] = c3;
+}
+
+static void scenario_rng_init(ScenarioRng *r, uint64_t seed, long i){
+  r->key[0] = (uint32_t) seed;
+  r->key[1] = (uint32_t) (seed >> 32);
+  r->counter[0] = 0;
+  r->counter[1] = 0;
+  r->counter[2] = (uint32_t) i;
+  r->counter[3] = (uint32_t) ((uint64_t) i >> 32);
+  r->used = 4;
+}
+static uint32_t scenario_rng_next(ScenarioRng *r){
+  if (r->used == 4){
+    scenario_philox(r->counter, r->key, r->block);
+    if (++r->counter[0] == 0){
+      r->counter[1]++;
+    }
+    r->used = 0;
+  }
+  return r->block[r->used++];
+}
+//[0, 1)
+static double scenario_rng_uniform(ScenarioRng *r){
+  return scenario_rng_next(r) * (1.0 / 4294967296.0);
+}
+//[0, range), unbiased (Lemire's multiply and reject)
+static uint32_t scenario_rng_below(ScenarioRng *r, uint32_t range){
+  uint64_t m = (uint64_t) scenario_rng_next(r) * range;
+  if ((uint32_t) m < range){
+    uint32_t t = -range % range;
+    while ((uint32_t) m < t){
+      m = (uint64_t) scenario_rng_next(r) * range;
+    }
+  }
+  return m >> 32;
+}
+
+static int scenario_size(const ScenarioConfig *c, ScenarioRng *r){
+  int n;
+  switch (c->size_distribution){
+    case SCENARIO_SIZE_UNIFORM:
+      n = c->min_leaks;
+      if (c->max_leaks > c->min_leaks){
+        n += scenario_rng_below(r, c->max_leaks - c->min_leaks + 1);
+      }
+      break;
+    case SCENARIO_SIZE_POISSON: {
+      //Knuth's product of uniforms, linear in the mean
+      double limit = exp(-c->mean_leaks);
+      double p = scenario_rng_uniform(r);
+      n = 0;
+      while (p > limit && n < c->max_leaks){
+        p *= scenario_rng_uniform(r);
+        n++;
+      }
+      if (n < c->min_leaks){
+        n = c->min_leaks;
+      }
+      break;
+    }
+    default:
+      n = c->max_leaks;
+      break;
+  }
+  return n;
+}
+
+static float scenario_flowrate(const ScenarioConfig *c, ScenarioRng *r){
+  double u = scenario_rng_uniform(r);
+  double f;
+  switch (c->flow_distribution){
+    case SCENARIO_FLOW_LOG_UNIFORM:
+      f = c->min_flowrate * pow(c->max_flowrate / c->min_flowrate, u);
+      break;
+    case SCENARIO_FLOW_EXPONENTIAL:
+      f = c->min_flowrate - (c->mean_flowrate - c->min_flowrate) * log1p(-u);
+      if (f > c->max_flowrate){
+        f = c->max_flowrate;
+      }
+      break;
+    default:
+      f = c->min_flowrate + (c->max_flowrate - c->min_flowrate) * u;
+      break;
+  }
+  return f;
+}
+
+int scenario_generate(const ScenarioConfig *c, const int *candidates, int n_candidates,
+                      long i, int *nodes, float *flowrates){
+  ScenarioRng r;
+  scenario_rng_init(&r, c->seed, i);
+
+  int k = scenario_size(c, &r);
+  if (k > n_candidates){
+    k = n_candidates;
+  }
+  if (k < 0){
+    k = 0;
+  }
+
+  //Floyd: for every j of the last k positions pick t in [0, j], and take j
+  //itself when t is already in. Positions are kept sorted in nodes, so the
+  //membership test is a binary search.
+  int len = 0;
+  for (int j = n_candidates - k; j < n_candidates; j++){
+    int t = scenario_rng_below(&r, j + 1);
+    int lo = 0;
+    int hi = len;
+    while (lo < hi){
+      int mid = (lo + hi) / 2;
+      if (nodes[mid] < t){
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo < len && nodes[lo] == t){
+      //Every position taken so far is below j
+      t = j;
+      lo = len;
+    }
+    memmove(nodes + lo + 1, nodes + lo, sizeof(int) * (len - lo));
+    nodes[lo] = t;
+    len++;
+  }
+
+  for (int l = 0; l < k; l++){
+    nodes[l] = candidates[nodes[l]];
+    flowrates[l] = scenario_flowrate(c, &r);
+  }
+  return k;
+}
+
+//Box-Muller, two normals per two words
+void scenario_generate_noise(const ScenarioConfig *c, long i, int stream, int n, float *out){
+  ScenarioRng r;
+  scenario_rng_init(&r, c->seed, i);
+  r.counter[1] = SCENARIO_NOISE_STREAM | (uint32_t) stream;
+
+  for (int k = 0; k < n; k += 2){
+    double radius = sqrt(-2 * log(1 - scenario_rng_uniform(&r)));
+    double angle = 2 * M_PI * scenario_rng_uniform(&r);
+    out[k] = radius * cos(angle);
+    if (k + 1 < n){
+      out[k + 1] = radius * sin(angle);
+    }
+  }
+}
@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+#include <server.h>
+#include <log.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_SIZE 65536
+#define SERVER_READ_BATCH (16 * SERVER_READ_SIZE)   //Per event, the rest waits
+
+//Stop reading from a client while this much output is waiting
+#define SERVER_MAX_PENDING_OUTPUT (4 << 20)
+
+typedef struct ServerClient{
+  int fd;
+
+  char *in;
+  size_t in_len;
+  size_t in_cap;
+
+  char *out;
+  size_t out_len;
+  size_t out_sent;
+  size_t out_cap;
+
+  unsigned events;    //Armed in epoll: EPOLLIN, or EPOLLOUT while output waits
+  _Bool read_closed;  //The client shut down its side, answer what it sent
+
+  struct ServerClient *prev;
+  struct ServerClient *next;
+} ServerClient;
+
+typedef struct Server{
+  int listen_fd;
+  int epoll_fd;
+  int stop_fd;
+  char *path;
+
+  ServerClient *clients;
+
+  LeakDetect *ld;
+  int n_nodes;
+  int n_pipes;
+
+  //LOCALISE candidates, grown to the largest max asked for
+  int *candidates;
+  float *scores;
+  int candidates_cap;
+} Server;
+
+static void *server_buffer_reserve(char **buf, size_t *len, size_t *cap, size_t n){
+  if (*len + n > *cap){
+    size_t c = (*cap == 0) ? 4096 : *cap;
+    while (c < *len + n){
+      c *= 2;
+    }
+    *buf = realloc(*buf, c);
+    *cap = c;
+  }
+  void *p = *buf + *len;
+  *len += n;
+  return p;
+}
+
+//Queues the response header and returns where its payload goes
+static void *server_reply(ServerClient *c, ServerHeader *req, int status, size_t length){
+  ServerHeader h = {length, req->op, status, req->id};
+  char *p = server_buffer_reserve(&c->out, &c->out_len, &c->out_cap, sizeof(ServerHeader) + length);
+  memcpy(p, &h, sizeof(ServerHeader));
+  return p + sizeof(ServerHeader);
+}
+static void server_reply_status(ServerClient *c, ServerHeader *req, int status){
+  server_reply(c, req, status, 0);
+}
+
+static void server_set_network(Server *s, LeakDetect *ld){
+  leakdetect_destroy(s->ld);
+  s->ld = ld;
+  s->n_nodes = (ld != NULL) ? leakdetect_get_n_nodes(ld) : 0;
+  s->n_pipes = (ld != NULL) ? leakdetect_get_n_pipes(ld) : 0;
+}
+
+static void server_load(Server *s, ServerClient *c, ServerHeader *h, const char *payload){
+  uint32_t n;
+  if (h->length < sizeof(uint32_t)){
+    server_reply_status(c, h, SERVER_ERROR_PAYLOAD);
+    return;
+  }
+  memcpy(&n, payload, sizeof(uint32_t));
+  if (n == 0 || h->length != sizeof(uint32_t) + (size_t) n * 20){
+    server_reply_status(c, h, SERVER_ERROR_PAYLOAD);
+    return;
+  }
+
+  const int32_t *orig = (const int32_t *) (payload + 4);
+  const int32_t *dest = orig + n;
+  const float *diam = (const float *) (dest + n);
+  //A network is only usable if its node arrays fit in a message
+  for (uint32_t i = 0; i < 2 * n; i++){
+    if (orig[i] < 0 || orig[i] >= SERVER_MAX_MESSAGE / (int) sizeof(float)){
+      server_reply_status(c, h, SERVER_ERROR_PAYLOAD);
+      return;
+    }
+  }
+
+  LeakDetect *ld = leakdetect_new(NULL, n, orig, dest);
+  leakdetect_set_pipes(ld, diam, diam + n, diam + 2 * n);
+  server_set_network(s, ld);
+  LOG_INFO("Loaded network with %d nodes and %d pipes", s->n_nodes, s->n_pipes);
+
+  uint32_t *r = server_reply(c, h, SERVER_OK, 2 * sizeof(uint32_t));
+  r[0] = s->n_nodes;
+  r[1] = s->n_pipes;
+}
+
+static void server_handle(Server *s, ServerClient *c, ServerHeader *h, const char *payload){
+  if (h->length % 4 != 0){
+    server_reply_status(c, h, SERVER_ERROR_PAYLOAD);
+    return;
+  }
+  if (h->op == SERVER_OP_LOAD){
+    server_load(s, c, h, payload);
+    return;
+  }
+  if (h->op > SERVER_OP_GET_PIPES){
+    server_reply_status(c, h, SERVER_ERROR_OP);
+    return;
+  }
+  if (s->ld == NULL){
+    server_reply_status(c, h, SERVER_ERROR_NO_NETWORK);
+    return;
+  }
+
+  size_t node_array = sizeof(float) * s->n_nodes;
+  switch (h->op){
+    case SERVER_OP_INFO: {
+      uint32_t *r = server_reply(c, h, SERVER_OK, 2 * sizeof(uint32_t));
+      r[0] = s->n_nodes;
+      r[1] = s->n_pipes;
+      break;
+    }
+    case SERVER_OP_SET_HEIGHT: {
+      int32_t node;
+      float height;
+      if (h->length != 8){
+        server_reply_status(c, h, SERVER_ERROR_PAYLOAD);
+        break;
+      }
+      memcpy(&node, payload, 4);
+      memcpy(&height, payload + 4, 4);
+      server_reply_status(c, h, (leakdetect_set_height(s->ld, node, height) == 0) ? SERVER_OK : SERVER_ERROR_PAYLOAD);
+      break;
+    }
+    case SERVER_OP_SET_MEASURED: {
+      const int32_t *nodes = (const int32_t *) payload;
+      int n = h->length / sizeof(int32_t);
+      for (int i = 0; i < n; i++){
+        if (nodes[i] < 0 || nodes[i] >= s->n_nodes){
+          server_reply_status(c, h, SERVER_ERROR_PAYLOAD);
+          return;
+        }
+      }
+      for (int i = 0; i < s->n_nodes; i++){
+        leakdetect_set_measured(s->ld, i, false);
+      }
+      for (int i = 0; i < n; i++){
+        leakdetect_set_measured(s->ld, nodes[i], true);
+      }
+      server_reply_status(c, h, SERVER_OK);
+      break;
+    }
+    case SERVER_OP_SET_DEMANDS:
+    case SERVER_OP_SET_MEASUREMENTS:
+      if (h->length != node_array){
+        server_reply_status(c, h, SERVER_ERROR_PAYLOAD);
+        break;
+      }
+      if (h->op == SERVER_OP_SET_DEMANDS){
+        if (leakdetect_set_demands(s->ld, (const float *) payload) != 0){
+          server_reply_status(c, h, SERVER_ERROR_NO_INPUT);
+          break;
+        }
+      } else {
+        leakdetect_set_measurements(s->ld, (const float *) payload);
+      }
+      server_reply_status(c, h, SERVER_OK);
+      break;
+    case SERVER_OP_SOLVE:
+      leakdetect_solve(s->ld);
+      server_reply_status(c, h, SERVER_OK);
+      break;
+    case SERVER_OP_LOCALISE: {
+      float threshold;
+      uint32_t max;
+      if (h->length != 8){
+        server_reply_status(c, h, SERVER_ERROR_PAYLOAD);
+        break;
+      }
+      memcpy(&threshold, payload, 4);
+      memcpy(&max, payload + 4, 4);
+      if (max > (uint32_t) s->n_nodes){
+        max = s->n_nodes;
+      }
+      if ((int) max > s->candidates_cap){
+        s->candidates = realloc(s->candidates, sizeof(int) * max);
+        s->scores = realloc(s->scores, sizeof(float) * max);
+        s->candidates_cap = max;
+      }
+      int k = leakdetect_localise(s->ld, threshold, NULL, s->candidates, s->scores, max);
+      char *r = server_reply(c, h, SERVER_OK, 4 + 8 * (size_t) k);
+      memcpy(r, &k, 4);
+      for (int i = 0; i < k; i++){
+        memcpy(r + 4 + 8 * i, &s->candidates[i], 4);
+        memcpy(r + 8 + 8 * i, &s->scores[i], 4);
+      }
+      break;
+    }
+    case SERVER_OP_GET_NODES: {
+      float *r = server_reply(c, h, SERVER_OK, 2 * node_array);
+      leakdetect_get_node_state(s->ld, r, r + s->n_nodes);
+      break;
+    }
+    case SERVER_OP_GET_PIPES: {
+      int n = s->n_pipes;
+      float *r = server_reply(c, h, SERVER_OK, 4 * sizeof(float) * n);
+      leakdetect_get_pipe_state(s->ld, r, r + n, r + 2 * n, r + 3 * n);
+      break;
+    }
+  }
+}
+
+//Constructors
+Server *server_new(Server **ret, const char *path, LeakDetect *ld){
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)){
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return NULL;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0){
+    perror("Could not create socket:");
+    return NULL;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0){
+    perror("Could not listen on socket:");
+    close(fd);
+    return NULL;
+  }
+
+  Server *s = malloc(sizeof(Server));
+  s->listen_fd = fd;
+  s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  s->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  s->path = strdup(path);
+  s->clients = NULL;
+  s->ld = NULL;
+  s->candidates = NULL;
+  s->scores = NULL;
+  s->candidates_cap = 0;
+  server_set_network(s, ld);
+
+  //The listening and stop descriptors are told apart from clients by pointer
+  struct epoll_event ev = {EPOLLIN, {.ptr = &s->listen_fd}};
+  epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev);
+  ev.data.ptr = &s->stop_fd;
+  epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->stop_fd, &ev);
+
+  LOG_INFO("Listening on %s", path);
+
+  if (ret != NULL){
+    *ret = s;
+  }
+  return s;
+}
+static void server_client_close(Server *s, ServerClient *c);
+
+void server_destroy(Server *s){
+  if (s == NULL){
+    return;
+  }
+  while (s->clients != NULL){
+    server_client_close(s, s->clients);
+  }
+  close(s->listen_fd);
+  close(s->epoll_fd);
+  close(s->stop_fd);
+  unlink(s->path);
+  free(s->path);
+  leakdetect_destroy(s->ld);
+  free(s->candidates);
+  free(s->scores);
+  free(s);
+}
+
+static void server_client_close(Server *s, ServerClient *c){
+  LOG_DEBUG("Client %d disconnected", c->fd);
+  if (c->prev != NULL){
+    c->prev->next = c->next;
+  } else {
+    s->clients = c->next;
+  }
+  if (c->next != NULL){
+    c->next->prev = c->prev;
+  }
+  epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+
+//Returns -1 when the client has gone
+static int server_client_flush(ServerClient *c){
+  while (c->out_sent < c->out_len){
+    ssize_t r = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+    if (r < 0){
+      if (errno == EAGAIN || errno == EWOULDBLOCK){
+        return 0;
+      }
+      if (errno == EINTR){
+        continue;
+      }
+      return -1;
+    }
+    c->out_sent += r;
+  }
+  c->out_len = 0;
+  c->out_sent = 0;
+  return 0;
+}
+
+//Handles every complete request. Returns -1 on a malformed stream.
+static int server_client_process(Server *s, ServerClient *c){
+  size_t pos = 0;
+  while (c->in_len - pos >= sizeof(ServerHeader) && c->out_len - c->out_sent < SERVER_MAX_PENDING_OUTPUT){
+    ServerHeader h;
+    memcpy(&h, c->in + pos, sizeof(ServerHeader));
+    if (h.length > SERVER_MAX_MESSAGE){
+      return -1;
+    }
+    if (c->in_len - pos - sizeof(ServerHeader) < h.length){
+      break;
+    }
+    server_handle(s, c, &h, c->in + pos + sizeof(ServerHeader));
+    pos += sizeof(ServerHeader) + h.length;
+  }
+
+  if (pos > 0){
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+  }
+  return 0;
+}
+
+static void server_accept(Server *s){
+  while (true){
+    int fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0){
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+        perror("Could not accept client:");
+      }
+      return;
+    }
+
+    ServerClient *c = calloc(sizeof(ServerClient), 1);
+    c->fd = fd;
+    c->events = EPOLLIN;
+    c->next = s->clients;
+    if (s->clients != NULL){
+      s->clients->prev = c;
+    }
+    s->clients = c;
+    struct epoll_event ev = {EPOLLIN, {.ptr = c}};
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    LOG_DEBUG("Client %d connected", fd);
+  }
+}
+
+static void server_client_event(Server *s, ServerClient *c, unsigned events){
+  if (events & EPOLLIN){
+    while (true){
+      char *p = server_buffer_reserve(&c->in, &c->in_len, &c->in_cap, SERVER_READ_SIZE);
+      ssize_t r = recv(c->fd, p, SERVER_READ_SIZE, 0);
+      c->in_len -= SERVER_READ_SIZE - ((r > 0) ? r : 0);
+      if (r == 0){
+        c->read_closed = true;
+        break;
+      }
+      if (r < 0){
+        if (errno == EINTR){
+          continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK){
+          break;
+        }
+        server_client_close(s, c);
+        return;
+      }
+      if (r < SERVER_READ_SIZE || c->in_len >= SERVER_READ_BATCH){
+        break;
+      }
+    }
+  } else if (events & (EPOLLHUP | EPOLLERR)){
+    server_client_close(s, c);
+    return;
+  }
+
+  //Pending output is sent before more requests are handled, so a client
+  //that does not read its responses stops being read
+  while (true){
+    if (server_client_flush(c) != 0){
+      server_client_close(s, c);
+      return;
+    }
+    if (c->out_len != 0){
+      break;
+    }
+    size_t in_len = c->in_len;
+    if (server_client_process(s, c) != 0){
+      server_client_close(s, c);
+      return;
+    }
+    if (c->in_len == in_len){
+      break;
+    }
+  }
+
+  //Every complete request of a closed client is answered and sent, a
+  //partial one never will be
+  if (c->read_closed && c->out_len == 0){
+    server_client_close(s, c);
+    return;
+  }
+
+  unsigned want = (c->out_len != 0) ? EPOLLOUT : EPOLLIN;
+  if (want != c->events){
+    struct epoll_event ev = {want, {.ptr = c}};
+    epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = want;
+  }
+}
+
+int server_run(Server *s){
+  struct epoll_event events[SERVER_MAX_EVENTS];
+
+  while (true){
+    int n = epoll_wait(s->epoll_fd, events, SERVER_MAX_EVENTS, -1);
+    if (n < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      perror("Could not wait for events:");
+      return -1;
+    }
+
+    for (int i = 0; i < n; i++){
+      void *ptr = events[i].data.ptr;
+      if (ptr == &s->stop_fd){
+        uint64_t v;
+        if (read(s->stop_fd, &v, sizeof(v)) < 0){
+          perror("Could not read stop event:");
+        }
+        LOG_INFO("Stopping server");
+        return 0;
+      } else if (ptr == &s->listen_fd){
+        server_accept(s);
+      } else {
+        server_client_event(s, ptr, events[i].events);
+      }
+    }
+  }
+}
+void server_stop(Server *s){
+  uint64_t v = 1;
+  if (write(s->stop_fd, &v, sizeof(v)) < 0){
+    //Already signalled, the counter is full
+  }
+}
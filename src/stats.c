@@ -0,0 +1,252 @@
+#include <stats.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#define STATS_DEFAULT_PERIOD_MS 1000
+
+atomic_bool stats_enabled = false;
+_Thread_local StatsSlot *stats_slot = NULL;
+
+//Slots are never freed: a thread that exits keeps its totals in the list
+static StatsSlot *slots = NULL;
+static int n_slots = 0;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Reference point to convert ticks to nanoseconds
+static pthread_once_t clock_once = PTHREAD_ONCE_INIT;
+static unsigned long clock_ticks0;
+static double clock_ns0;
+
+typedef struct StatsDump{
+  FILE *f;
+  int period_ms;
+  _Bool running;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} StatsDump;
+
+static StatsDump dump = {NULL, 0, false, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static const char *phase_names[STATS_N_PHASES] = {
+  "graph_new",
+  "graph_copy",
+  "backpropagate_flowrate",
+  "propagate_pressure",
+  "propagation_level",
+  "friction",
+  "find_leaks",
+  "render_draw",
+  "render_png",
+  "tiles_export",
+  "adjoint",
+  "leakage",
+  "sources",
+};
+static const char *counter_names[STATS_N_COUNTERS] = {
+  "nodes_propagated",
+  "friction_evals",
+  "levels",
+  "parallel_levels",
+  "pipes_drawn",
+  "tiles_written",
+};
+
+static double stats_clock_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+static void stats_clock_init(){
+  clock_ticks0 = stats_ticks();
+  clock_ns0 = stats_clock_ns();
+}
+
+StatsSlot *stats_register_thread(){
+  pthread_once(&clock_once, stats_clock_init);
+
+  StatsSlot *s = calloc(sizeof(StatsSlot), 1);
+  pthread_mutex_lock(&slots_lock);
+  s->next = slots;
+  slots = s;
+  n_slots++;
+  pthread_mutex_unlock(&slots_lock);
+
+  stats_slot = s;
+  return s;
+}
+
+void graph_stats_set_enabled(_Bool enabled){
+  pthread_once(&clock_once, stats_clock_init);
+  atomic_store(&stats_enabled, enabled);
+}
+_Bool graph_stats_get_enabled(){
+  return atomic_load(&stats_enabled);
+}
+
+void graph_stats_get(GraphStats *s){
+  pthread_once(&clock_once, stats_clock_init);
+  memset(s, 0, sizeof(GraphStats));
+
+  unsigned long ticks[STATS_N_PHASES] = {0};
+  unsigned long max_ticks[STATS_N_PHASES] = {0};
+
+  pthread_mutex_lock(&slots_lock);
+  for (StatsSlot *slot = slots; slot != NULL; slot = slot->next){
+    for (int i = 0; i < STATS_N_PHASES; i++){
+      unsigned long m = atomic_load_explicit(&slot->max_ticks[i], memory_order_relaxed);
+      s->phases[i].calls += atomic_load_explicit(&slot->calls[i], memory_order_relaxed);
+      ticks[i] += atomic_load_explicit(&slot->ticks[i], memory_order_relaxed);
+      if (m > max_ticks[i]){
+        max_ticks[i] = m;
+      }
+    }
+    for (int i = 0; i < STATS_N_COUNTERS; i++){
+      s->counters[i] += atomic_load_explicit(&slot->counters[i], memory_order_relaxed);
+    }
+  }
+  s->n_threads = n_slots;
+  pthread_mutex_unlock(&slots_lock);
+
+  //Ticks per nanosecond measured over the whole uptime
+  double ns = stats_clock_ns() - clock_ns0;
+  unsigned long elapsed_ticks = stats_ticks() - clock_ticks0;
+  double ns_per_tick = (elapsed_ticks > 0) ? ns / elapsed_ticks : 1;
+
+  s->uptime = ns * 1e-9;
+  for (int i = 0; i < STATS_N_PHASES; i++){
+    s->phases[i].total_ns = ticks[i] * ns_per_tick;
+    s->phases[i].max_ns = max_ticks[i] * ns_per_tick;
+  }
+}
+
+//Threads may be recording, so the totals can be a few updates off
+void graph_stats_reset(){
+  pthread_mutex_lock(&slots_lock);
+  for (StatsSlot *slot = slots; slot != NULL; slot = slot->next){
+    for (int i = 0; i < STATS_N_PHASES; i++){
+      atomic_store_explicit(&slot->calls[i], 0, memory_order_relaxed);
+      atomic_store_explicit(&slot->ticks[i], 0, memory_order_relaxed);
+      atomic_store_explicit(&slot->max_ticks[i], 0, memory_order_relaxed);
+    }
+    for (int i = 0; i < STATS_N_COUNTERS; i++){
+      atomic_store_explicit(&slot->counters[i], 0, memory_order_relaxed);
+    }
+  }
+  pthread_mutex_unlock(&slots_lock);
+}
+
+const char *graph_stats_phase_name(int phase){
+  if (phase < 0 || phase >= STATS_N_PHASES){
+    return NULL;
+  }
+  return phase_names[phase];
+}
+const char *graph_stats_counter_name(int counter){
+  if (counter < 0 || counter >= STATS_N_COUNTERS){
+    return NULL;
+  }
+  return counter_names[counter];
+}
+
+void graph_stats_write_json(GraphStats *s, FILE *f){
+  fprintf(f, "{\"uptime\": %.6f, \"threads\": %d, \"phases\": {", s->uptime, s->n_threads);
+  for (int i = 0; i < STATS_N_PHASES; i++){
+    fprintf(f, "%s\"%s\": {\"calls\": %lu, \"total_ns\": %.0f, \"max_ns\": %.0f}",
+            i == 0 ? "" : ", ", phase_names[i],
+            s->phases[i].calls, s->phases[i].total_ns, s->phases[i].max_ns);
+  }
+  fprintf(f, "}, \"counters\": {");
+  for (int i = 0; i < STATS_N_COUNTERS; i++){
+    fprintf(f, "%s\"%s\": %lu", i == 0 ? "" : ", ", counter_names[i], s->counters[i]);
+  }
+  fprintf(f, "}}\n");
+}
+
+static void *stats_dump_thread(void *arg){
+  GraphStats s;
+
+  pthread_mutex_lock(&dump.lock);
+  while (dump.running){
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += dump.period_ms / 1000;
+    deadline.tv_nsec += (dump.period_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L){
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&dump.wake, &dump.lock, &deadline);
+
+    //A last line is written when stopping
+    graph_stats_get(&s);
+    graph_stats_write_json(&s, dump.f);
+    fflush(dump.f);
+  }
+  pthread_mutex_unlock(&dump.lock);
+
+  return NULL;
+}
+
+int graph_stats_start_dump(const char *filename, int period_ms){
+  graph_stats_stop_dump();
+
+  FILE *f = fopen(filename, "a");
+  if (f == NULL){
+    perror("Could not open stats file:");
+    return -1;
+  }
+
+  graph_stats_set_enabled(true);
+
+  pthread_mutex_lock(&dump.lock);
+  dump.f = f;
+  dump.period_ms = (period_ms > 0) ? period_ms : STATS_DEFAULT_PERIOD_MS;
+  dump.running = true;
+  pthread_mutex_unlock(&dump.lock);
+
+  if (pthread_create(&dump.thread, NULL, stats_dump_thread, NULL) != 0){
+    dump.running = false;
+    dump.f = NULL;
+    fclose(f);
+    return -1;
+  }
+  return 0;
+}
+void graph_stats_stop_dump(){
+  pthread_mutex_lock(&dump.lock);
+  if (! dump.running){
+    pthread_mutex_unlock(&dump.lock);
+    return;
+  }
+  dump.running = false;
+  pthread_cond_signal(&dump.wake);
+  pthread_mutex_unlock(&dump.lock);
+
+  pthread_join(dump.thread, NULL);
+  fclose(dump.f);
+  dump.f = NULL;
+}
+
+//LEAK_STATS=1 enables recording, any other value is a file to dump to
+__attribute__((constructor))
+static void stats_init_from_env(){
+  const char *env = getenv("LEAK_STATS");
+  if (env == NULL || env[0] == '\0' || strcmp(env, "0") == 0){
+    return;
+  }
+  if (strcmp(env, "1") == 0){
+    graph_stats_set_enabled(true);
+    return;
+  }
+
+  const char *period = getenv("LEAK_STATS_PERIOD_MS");
+  graph_stats_start_dump(env, (period != NULL) ? atoi(period) : STATS_DEFAULT_PERIOD_MS);
+  atexit(graph_stats_stop_dump);
+}
@@ -0,0 +1,743 @@
+#define _GNU_SOURCE
+#include <sweep.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define SWEEP_MAX_NUMA 64
+
+//Flattened read-only network. Arrays are stored after the header and found
+//by offset, so a replica is a plain copy of the block.
+typedef struct SweepTopology{
+  size_t size;
+  int n_nodes;
+  int n_pipes;
+  int n_junctions;
+  int n_meters;
+
+  size_t in_off;       //int[n_nodes + 1], pipes into each node
+  size_t in_pipe;      //int[n_pipes]
+  size_t pipe_orig;    //int[n_pipes]
+  size_t pipe_share;   //float[n_pipes], share of its destination inflow
+  size_t topo_pos;     //int[n_nodes], position in topological order
+  size_t zone;         //int[n_nodes], nearest measured node upstream (or itself)
+  size_t zone_parent;  //int[n_nodes], zone of the node feeding a measured node
+  size_t measured;     //_Bool[n_nodes]
+  size_t junctions;    //int[n_junctions], leak candidates
+  size_t feeder;       //int[n_nodes], origin of the first pipe in, -1 if none
+  size_t depth;        //int[n_nodes], pipes from the root along the feeders
+  size_t meters;       //int[n_meters], measured nodes
+  size_t meter_sigma;  //float[n_meters], standard deviation of the reading
+} SweepTopology;
+
+#define TOPOLOGY(t, field, type) ((type *)((char *)(t) + (t)->field))
+
+typedef struct SweepControl{
+  atomic_long next;
+  atomic_int ready[SWEEP_MAX_NUMA];
+} SweepControl;
+
+//Per worker scratch, allocated after pinning so it is node local
+typedef struct SweepScratch{
+  float *carry;
+  float *unexplained;
+  _Bool *in_heap;
+  int *heap;
+  int heap_len;
+  int *touched;
+  int n_touched;
+  int *leak_nodes;
+  float *leak_flows;
+  float *noise;         //One per meter
+} SweepScratch;
+
+void sweep_config_init(SweepConfig *c){
+  c->n_scenarios = 1000000;
+  c->n_workers = 0;
+  c->chunk = 4096;
+  scenario_config_init(&c->scenario);
+  c->threshold = 0.0001;
+  c->noise_sigma = 0;
+  c->noise_relative = 0;
+  c->roc_min = 0.000001;
+  c->roc_max = 0.1;
+  c->numa = false;
+  c->elapsed = 0;
+}
+
+static void *sweep_shared_alloc(size_t size){
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED){
+    perror("Could not map shared memory:");
+    return NULL;
+  }
+  return p;
+}
+
+//Topology
+static SweepTopology *sweep_topology_new(Graph *g, SweepConfig *c){
+  int n_nodes = graph_get_n_nodes(g);
+  int n_pipes = graph_get_n_pipes(g);
+  int n_junctions = graph_get_n_junction_nodes(g);
+  int n_meters = 0;
+  for (int i = 0; i < n_nodes; i++){
+    Node *n = graph_get_nth_node(g, i);
+    if (n != NULL && node_get_is_measured(n)){
+      n_meters++;
+    }
+  }
+
+  size_t size = sizeof(SweepTopology);
+  size_t in_off = size;       size += sizeof(int) * (n_nodes + 1);
+  size_t in_pipe = size;      size += sizeof(int) * n_pipes;
+  size_t pipe_orig = size;    size += sizeof(int) * n_pipes;
+  size_t pipe_share = size;   size += sizeof(float) * n_pipes;
+  size_t topo_pos = size;     size += sizeof(int) * n_nodes;
+  size_t zone = size;         size += sizeof(int) * n_nodes;
+  size_t zone_parent = size;  size += sizeof(int) * n_nodes;
+  size_t junctions = size;    size += sizeof(int) * n_junctions;
+  size_t feeder = size;       size += sizeof(int) * n_nodes;
+  size_t depth = size;        size += sizeof(int) * n_nodes;
+  size_t meters = size;       size += sizeof(int) * n_meters;
+  size_t meter_sigma = size;  size += sizeof(float) * n_meters;
+  size_t measured = size;     size += sizeof(_Bool) * n_nodes;
+
+  SweepTopology *t = sweep_shared_alloc(size);
+  if (t == NULL){
+    return NULL;
+  }
+  t->size = size;
+  t->n_nodes = n_nodes;
+  t->n_pipes = n_pipes;
+  t->n_junctions = n_junctions;
+  t->n_meters = n_meters;
+  t->in_off = in_off;
+  t->in_pipe = in_pipe;
+  t->pipe_orig = pipe_orig;
+  t->pipe_share = pipe_share;
+  t->topo_pos = topo_pos;
+  t->zone = zone;
+  t->zone_parent = zone_parent;
+  t->junctions = junctions;
+  t->measured = measured;
+  t->feeder = feeder;
+  t->depth = depth;
+  t->meters = meters;
+  t->meter_sigma = meter_sigma;
+
+  int *t_in_off = TOPOLOGY(t, in_off, int);
+  int *t_in_pipe = TOPOLOGY(t, in_pipe, int);
+  int *t_pipe_orig = TOPOLOGY(t, pipe_orig, int);
+  float *t_pipe_share = TOPOLOGY(t, pipe_share, float);
+  int *t_topo_pos = TOPOLOGY(t, topo_pos, int);
+  int *t_zone = TOPOLOGY(t, zone, int);
+  int *t_zone_parent = TOPOLOGY(t, zone_parent, int);
+  int *t_junctions = TOPOLOGY(t, junctions, int);
+  _Bool *t_measured = TOPOLOGY(t, measured, _Bool);
+  int *t_feeder = TOPOLOGY(t, feeder, int);
+  int *t_depth = TOPOLOGY(t, depth, int);
+  int *t_meters = TOPOLOGY(t, meters, int);
+  float *t_meter_sigma = TOPOLOGY(t, meter_sigma, float);
+
+  //Pipes into every node, with the share of the node inflow they carry
+  t_in_off[0] = 0;
+  for (int i = 0; i < n_nodes; i++){
+    Node *n = graph_get_nth_node(g, i);
+    int n_in = (n != NULL) ? node_get_n_pipes_in(n) : 0;
+    t_in_off[i + 1] = t_in_off[i] + n_in;
+
+    float total_area = 0;
+    for (int j = 0; j < n_in; j++){
+      total_area += pipe_get_area(node_get_nth_pipe_in(n, j));
+    }
+    for (int j = 0; j < n_in; j++){
+      Pipe *p = node_get_nth_pipe_in(n, j);
+      t_in_pipe[t_in_off[i] + j] = pipe_get_id(p);
+      t_pipe_share[pipe_get_id(p)] = pipe_get_area(p) / total_area;
+    }
+    t_measured[i] = (n != NULL) && node_get_is_measured(n);
+  }
+  Pipe **pipes = graph_get_pipes(g);
+  for (int i = 0; i < n_pipes; i++){
+    t_pipe_orig[i] = node_get_id(pipe_get_orig(pipes[i]));
+  }
+
+  //Topological order (Kahn), then zones downstream from the inputs
+  int *pending = malloc(sizeof(int) * n_nodes);
+  int *order = malloc(sizeof(int) * n_nodes);
+  int head = 0, tail = 0;
+  for (int i = 0; i < n_nodes; i++){
+    pending[i] = t_in_off[i + 1] - t_in_off[i];
+    t_topo_pos[i] = -1;
+    t_feeder[i] = -1;
+    t_depth[i] = 0;
+    if (pending[i] == 0){
+      order[tail++] = i;
+    }
+  }
+  while (head < tail){
+    int i = order[head];
+    t_topo_pos[i] = head++;
+    Node *n = graph_get_nth_node(g, i);
+    int n_out = (n != NULL) ? node_get_n_pipes_out(n) : 0;
+    for (int j = 0; j < n_out; j++){
+      int d = node_get_id(pipe_get_dest(node_get_nth_pipe_out(n, j)));
+      if (--pending[d] == 0){
+        order[tail++] = d;
+      }
+    }
+  }
+  for (int k = 0; k < tail; k++){
+    int i = order[k];
+    int parent_zone = -1;
+    if (t_in_off[i + 1] > t_in_off[i]){
+      t_feeder[i] = t_pipe_orig[t_in_pipe[t_in_off[i]]];
+      t_depth[i] = t_depth[t_feeder[i]] + 1;
+      parent_zone = t_zone[t_feeder[i]];
+    }
+    t_zone_parent[i] = parent_zone;
+    t_zone[i] = t_measured[i] ? i : parent_zone;
+  }
+  free(pending);
+  free(order);
+
+  int n_found = 0;
+  int n_meters_found = 0;
+  for (int i = 0; i < n_nodes; i++){
+    Node *n = graph_get_nth_node(g, i);
+    if (n != NULL && node_get_is_junction(n)){
+      t_junctions[n_found++] = i;
+    }
+    if (t_measured[i]){
+      t_meters[n_meters_found] = i;
+      t_meter_sigma[n_meters_found++] = c->noise_sigma
+                                        + c->noise_relative * fabsf(node_get_flowrate_calculated(n));
+    }
+  }
+
+  return t;
+}
+
+//Evaluation
+static void sweep_heap_push(SweepScratch *s, int *topo_pos, int n){
+  int i = s->heap_len++;
+  while (i > 0 && topo_pos[s->heap[(i - 1) / 2]] < topo_pos[n]){
+    s->heap[i] = s->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  s->heap[i] = n;
+  s->in_heap[n] = true;
+}
+static int sweep_heap_pop(SweepScratch *s, int *topo_pos){
+  int top = s->heap[0];
+  int last = s->heap[--s->heap_len];
+  int i = 0;
+  while (true){
+    int child = 2 * i + 1;
+    if (child >= s->heap_len){
+      break;
+    }
+    if (child + 1 < s->heap_len && topo_pos[s->heap[child + 1]] > topo_pos[s->heap[child]]){
+      child++;
+    }
+    if (topo_pos[s->heap[child]] <= topo_pos[last]){
+      break;
+    }
+    s->heap[i] = s->heap[child];
+    i = child;
+  }
+  if (s->heap_len > 0){
+    s->heap[i] = last;
+  }
+  s->in_heap[top] = false;
+  return top;
+}
+//Returns the number of leaks, left in s->leak_nodes
+static int sweep_evaluate(SweepTopology *t, SweepConfig *c, long i, SweepScratch *s, SweepResult *r){
+  int *in_off = TOPOLOGY(t, in_off, int);
+  int *in_pipe = TOPOLOGY(t, in_pipe, int);
+  int *pipe_orig = TOPOLOGY(t, pipe_orig, int);
+  float *pipe_share = TOPOLOGY(t, pipe_share, float);
+  int *topo_pos = TOPOLOGY(t, topo_pos, int);
+  int *zone = TOPOLOGY(t, zone, int);
+  int *zone_parent = TOPOLOGY(t, zone_parent, int);
+  _Bool *measured = TOPOLOGY(t, measured, _Bool);
+
+  int n_leaks = scenario_generate(&c->scenario, TOPOLOGY(t, junctions, int), t->n_junctions,
+                                  i, s->leak_nodes, s->leak_flows);
+
+  //Carry leak flowrate upstream, most downstream nodes first
+  s->heap_len = 0;
+  s->n_touched = 0;
+  for (int k = 0; k < n_leaks; k++){
+    int n = s->leak_nodes[k];
+    s->carry[n] += s->leak_flows[k];
+    if (! s->in_heap[n]){
+      sweep_heap_push(s, topo_pos, n);
+    }
+  }
+  while (s->heap_len > 0){
+    int n = sweep_heap_pop(s, topo_pos);
+    s->touched[s->n_touched++] = n;
+    for (int j = in_off[n]; j < in_off[n + 1]; j++){
+      int p = in_pipe[j];
+      int o = pipe_orig[p];
+      s->carry[o] += s->carry[n] * pipe_share[p];
+      if (! s->in_heap[o]){
+        sweep_heap_push(s, topo_pos, o);
+      }
+    }
+  }
+
+  //Residual of every meter not explained by the meters below it. Exact
+  //meters only see the nodes the leaks reached, noisy ones all read.
+  int *meters = TOPOLOGY(t, meters, int);
+  float *meter_sigma = TOPOLOGY(t, meter_sigma, float);
+  _Bool noisy = c->noise_sigma > 0 || c->noise_relative > 0;
+  int *read = noisy ? meters : s->touched;
+  int n_read = noisy ? t->n_meters : s->n_touched;
+  if (noisy){
+    scenario_generate_noise(&c->scenario, i, 0, t->n_meters, s->noise);
+  }
+
+  r->score = 0;
+  for (int k = 0; k < n_read; k++){
+    int n = read[k];
+    if (measured[n]){
+      float diff = s->carry[n];
+      if (noisy){
+        diff += meter_sigma[k] * s->noise[k];
+      }
+      if (diff > r->score){
+        r->score = diff;
+      }
+      s->unexplained[n] += diff;
+      if (zone_parent[n] != -1){
+        s->unexplained[zone_parent[n]] -= diff;
+      }
+    }
+  }
+  r->detected = r->score > c->threshold;
+
+  //Rank the candidates
+  r->n_candidates = 0;
+  for (int k = 0; k < n_read; k++){
+    int n = read[k];
+    if (! measured[n] || s->unexplained[n] <= c->threshold){
+      continue;
+    }
+    int pos = r->n_candidates < SWEEP_TOP_K ? r->n_candidates++ : SWEEP_TOP_K;
+    while (pos > 0 && r->scores[pos - 1] < s->unexplained[n]){
+      if (pos < SWEEP_TOP_K){
+        r->candidates[pos] = r->candidates[pos - 1];
+        r->scores[pos] = r->scores[pos - 1];
+      }
+      pos--;
+    }
+    if (pos < SWEEP_TOP_K){
+      r->candidates[pos] = n;
+      r->scores[pos] = s->unexplained[n];
+    }
+  }
+
+  r->hit_rank = -1;
+  for (int j = 0; j < r->n_candidates && r->hit_rank == -1; j++){
+    for (int k = 0; k < n_leaks; k++){
+      if (zone[s->leak_nodes[k]] == r->candidates[j]){
+        r->hit_rank = j;
+      }
+    }
+  }
+
+  for (int k = 0; k < s->n_touched; k++){
+    s->carry[s->touched[k]] = 0;
+  }
+  for (int k = 0; k < n_read; k++){
+    s->unexplained[read[k]] = 0;
+  }
+  return n_leaks;
+}
+
+//Study
+static void sweep_study_init(SweepStudy *st, SweepConfig *c){
+  memset(st, 0, sizeof(SweepStudy));
+  for (int b = 0; b < SWEEP_ROC_POINTS; b++){
+    st->roc_threshold[b] = c->roc_min * pow(c->roc_max / c->roc_min, b / (SWEEP_ROC_POINTS - 1.0));
+  }
+}
+//Pipes between two nodes along the feeders, -1 if they have no common root
+static int sweep_feeder_distance(SweepTopology *t, int a, int b){
+  int *feeder = TOPOLOGY(t, feeder, int);
+  int *depth = TOPOLOGY(t, depth, int);
+  int d = 0;
+  while (a != b){
+    if (depth[a] < depth[b]){
+      int x = a;
+      a = b;
+      b = x;
+    }
+    a = feeder[a];
+    if (a == -1){
+      return -1;
+    }
+    d++;
+  }
+  return d;
+}
+static void sweep_study_add(SweepTopology *t, SweepConfig *c, long i, SweepScratch *s,
+                            int n_leaks, SweepResult *r, SweepStudy *st){
+  st->n_scenarios++;
+  st->n_leaks += n_leaks;
+  if (r->detected){
+    st->detected++;
+  }
+  if (r->hit_rank != -1){
+    st->hit_rank[r->hit_rank]++;
+  }
+
+  if (r->n_candidates > 0){
+    int best = -1;
+    for (int k = 0; k < n_leaks; k++){
+      int d = sweep_feeder_distance(t, r->candidates[0], s->leak_nodes[k]);
+      if (d != -1 && (best == -1 || d < best)){
+        best = d;
+      }
+    }
+    if (best != -1){
+      st->distance[best < SWEEP_MAX_DISTANCE ? best : SWEEP_MAX_DISTANCE]++;
+      st->distance_sum += best;
+      st->n_distance++;
+    }
+  }
+
+  //The same meters without leaks, on their own noise stream
+  float noise_score = 0;
+  if (c->noise_sigma > 0 || c->noise_relative > 0){
+    float *meter_sigma = TOPOLOGY(t, meter_sigma, float);
+    scenario_generate_noise(&c->scenario, i, 1, t->n_meters, s->noise);
+    for (int k = 0; k < t->n_meters; k++){
+      float e = meter_sigma[k] * s->noise[k];
+      if (e > noise_score){
+        noise_score = e;
+      }
+    }
+  }
+  for (int b = 0; b < SWEEP_ROC_POINTS; b++){
+    if (r->score > st->roc_threshold[b]){
+      st->roc_positive[b]++;
+    }
+    if (noise_score > st->roc_threshold[b]){
+      st->roc_negative[b]++;
+    }
+  }
+}
+
+//NUMA
+static int sweep_numa_nodes(cpu_set_t *cpus){
+  int n = 0;
+  for (int i = 0; i < SWEEP_MAX_NUMA; i++){
+    char path[128];
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", i);
+    FILE *f = fopen(path, "r");
+    if (f == NULL){
+      break;
+    }
+    CPU_ZERO(&cpus[n]);
+    int first, last;
+    char sep;
+    while (fscanf(f, "%d", &first) == 1){
+      last = first;
+      if (fscanf(f, "%c", &sep) == 1 && sep == '-'){
+        if (fscanf(f, "%d", &last) != 1){
+          break;
+        }
+        if (fscanf(f, "%c", &sep) != 1){
+          sep = '\n';
+        }
+      }
+      for (int cpu = first; cpu <= last; cpu++){
+        CPU_SET(cpu, &cpus[n]);
+      }
+      if (sep != ','){
+        break;
+      }
+    }
+    fclose(f);
+    n++;
+  }
+  return n;
+}
+
+//Writes results[i] for every scenario, or adds them to study when results
+//is NULL
+static void sweep_worker(int w, SweepConfig *c, SweepControl *ctl, SweepTopology **replicas,
+                         int n_numa, cpu_set_t *cpus, SweepResult *results, SweepStudy *study){
+  SweepTopology *t = replicas[0];
+
+  if (c->numa && n_numa > 1){
+    int node = w % n_numa;
+    sched_setaffinity(0, sizeof(cpu_set_t), &cpus[node]);
+
+    //First worker of the node fills the local replica
+    if (w == node){
+      memcpy(replicas[node], replicas[0], replicas[0]->size);
+      atomic_store_explicit(&ctl->ready[node], 1, memory_order_release);
+    } else {
+      while (atomic_load_explicit(&ctl->ready[node], memory_order_acquire) == 0){
+        sched_yield();
+      }
+    }
+    t = replicas[node];
+  }
+
+  SweepScratch s;
+  s.carry = calloc(sizeof(float) * t->n_nodes, 1);
+  s.unexplained = calloc(sizeof(float) * t->n_nodes, 1);
+  s.in_heap = calloc(sizeof(_Bool) * t->n_nodes, 1);
+  s.heap = malloc(sizeof(int) * t->n_nodes);
+  s.touched = malloc(sizeof(int) * t->n_nodes);
+  s.leak_nodes = malloc(sizeof(int) * (c->scenario.max_leaks + 1));
+  s.leak_flows = malloc(sizeof(float) * (c->scenario.max_leaks + 1));
+  s.noise = malloc(sizeof(float) * (t->n_meters + 1));
+
+  while (true){
+    long first = atomic_fetch_add_explicit(&ctl->next, c->chunk, memory_order_relaxed);
+    if (first >= c->n_scenarios){
+      break;
+    }
+    long last = first + c->chunk;
+    if (last > c->n_scenarios){
+      last = c->n_scenarios;
+    }
+    for (long i = first; i < last; i++){
+      if (results != NULL){
+        sweep_evaluate(t, c, i, &s, &results[i]);
+      } else {
+        SweepResult r;
+        int n_leaks = sweep_evaluate(t, c, i, &s, &r);
+        sweep_study_add(t, c, i, &s, n_leaks, &r, study);
+      }
+    }
+  }
+
+  free(s.carry);
+  free(s.unexplained);
+  free(s.in_heap);
+  free(s.heap);
+  free(s.touched);
+  free(s.leak_nodes);
+  free(s.leak_flows);
+  free(s.noise);
+}
+
+static void sweep_config_check(SweepConfig *c){
+  if (c->n_workers <= 0){
+    c->n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (c->chunk <= 0){
+    c->chunk = 1;
+  }
+}
+//Unmaps the first n replicas, all of replicas[0]->size
+static void sweep_replicas_unmap(SweepTopology **replicas, int n){
+  size_t size = replicas[0]->size;
+  for (int i = n - 1; i >= 0; i--){
+    munmap(replicas[i], size);
+  }
+}
+//Forks the workers over every scenario and waits for them. Worker w adds to
+//studies[w] when results is NULL. Returns 0, or -1 on failure.
+static int sweep_launch(Graph *g, SweepConfig *c, SweepResult *results, SweepStudy *studies){
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  cpu_set_t cpus[SWEEP_MAX_NUMA];
+  int n_numa = 1;
+  if (c->numa){
+    n_numa = sweep_numa_nodes(cpus);
+    if (n_numa < 1){
+      n_numa = 1;
+    }
+  }
+
+  SweepTopology *replicas[SWEEP_MAX_NUMA];
+  replicas[0] = sweep_topology_new(g, c);
+  if (replicas[0] == NULL){
+    return -1;
+  }
+  //Replicas are left untouched here so their pages land on the worker's node
+  for (int i = 1; i < n_numa; i++){
+    replicas[i] = sweep_shared_alloc(replicas[0]->size);
+    if (replicas[i] == NULL){
+      sweep_replicas_unmap(replicas, i);
+      return -1;
+    }
+  }
+
+  SweepControl *ctl = sweep_shared_alloc(sizeof(SweepControl));
+  if (ctl == NULL){
+    sweep_replicas_unmap(replicas, n_numa);
+    return -1;
+  }
+  atomic_init(&ctl->next, 0);
+  for (int i = 0; i < SWEEP_MAX_NUMA; i++){
+    atomic_init(&ctl->ready[i], 0);
+  }
+
+  pid_t *pids = malloc(sizeof(pid_t) * c->n_workers);
+  int n_started = 0;
+  for (int w = 0; w < c->n_workers; w++){
+    pids[w] = fork();
+    if (pids[w] < 0){
+      perror("Could not fork:");
+      break;
+    }
+    if (pids[w] == 0){
+      sweep_worker(w, c, ctl, replicas, n_numa, cpus, results,
+                   (studies != NULL) ? &studies[w] : NULL);
+      _exit(0);
+    }
+    n_started++;
+  }
+  //A replica whose owner never started is filled here
+  for (int i = n_started; i < n_numa && i > 0; i++){
+    memcpy(replicas[i], replicas[0], replicas[0]->size);
+    atomic_store(&ctl->ready[i], 1);
+  }
+
+  _Bool failed = (n_started == 0);
+  for (int w = 0; w < n_started; w++){
+    int status;
+    waitpid(pids[w], &status, 0);
+    if (! WIFEXITED(status) || WEXITSTATUS(status) != 0){
+      failed = true;
+    }
+  }
+  free(pids);
+
+  sweep_replicas_unmap(replicas, n_numa);
+  munmap(ctl, sizeof(SweepControl));
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  c->elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+  return failed ? -1 : 0;
+}
+SweepResult *sweep_run(Graph *g, SweepConfig *c){
+  sweep_config_check(c);
+  SweepResult *results = sweep_shared_alloc(sizeof(SweepResult) * c->n_scenarios);
+  if (results == NULL){
+    return NULL;
+  }
+  if (sweep_launch(g, c, results, NULL) != 0){
+    sweep_results_destroy(results, c);
+    return NULL;
+  }
+  return results;
+}
+void sweep_results_destroy(SweepResult *r, SweepConfig *c){
+  if (r != NULL){
+    munmap(r, sizeof(SweepResult) * c->n_scenarios);
+  }
+}
+void sweep_print_summary(SweepResult *r, SweepConfig *c){
+  long detected = 0;
+  long hit_first = 0;
+  long hit_any = 0;
+  long candidates = 0;
+  for (long i = 0; i < c->n_scenarios; i++){
+    if (r[i].detected){
+      detected++;
+    }
+    if (r[i].hit_rank == 0){
+      hit_first++;
+    }
+    if (r[i].hit_rank != -1){
+      hit_any++;
+    }
+    candidates += r[i].n_candidates;
+  }
+
+  double n = c->n_scenarios > 0 ? c->n_scenarios : 1;
+  if (c->scenario.size_distribution == SCENARIO_SIZE_FIXED){
+    printf("Scenarios:          %ld (%d leaks each)\n", c->n_scenarios, c->scenario.max_leaks);
+  } else {
+    printf("Scenarios:          %ld (%d to %d leaks)\n", c->n_scenarios,
+           c->scenario.min_leaks, c->scenario.max_leaks);
+  }
+  printf("Workers:            %d%s\n", c->n_workers, c->numa ? " (NUMA pinned)" : "");
+  printf("Detected:           %.2f%%\n", 100 * detected / n);
+  printf("Located first:      %.2f%%\n", 100 * hit_first / n);
+  printf("Located in top %d:   %.2f%%\n", SWEEP_TOP_K, 100 * hit_any / n);
+  printf("Mean candidates:    %.2f\n", candidates / n);
+  printf("Elapsed:            %.3f s (%.0f scenarios/s)\n", c->elapsed, c->n_scenarios / (c->elapsed > 0 ? c->elapsed : 1));
+}
+
+int sweep_study(Graph *g, SweepConfig *c, SweepStudy *study){
+  sweep_config_check(c);
+  SweepStudy *studies = sweep_shared_alloc(sizeof(SweepStudy) * c->n_workers);
+  if (studies == NULL){
+    return -1;
+  }
+  for (int w = 0; w < c->n_workers; w++){
+    sweep_study_init(&studies[w], c);
+  }
+
+  int ret = sweep_launch(g, c, NULL, studies);
+
+  sweep_study_init(study, c);
+  for (int w = 0; w < c->n_workers; w++){
+    SweepStudy *st = &studies[w];
+    study->n_scenarios += st->n_scenarios;
+    study->n_leaks += st->n_leaks;
+    study->detected += st->detected;
+    for (int k = 0; k < SWEEP_TOP_K; k++){
+      study->hit_rank[k] += st->hit_rank[k];
+    }
+    for (int d = 0; d <= SWEEP_MAX_DISTANCE; d++){
+      study->distance[d] += st->distance[d];
+    }
+    study->distance_sum += st->distance_sum;
+    study->n_distance += st->n_distance;
+    for (int b = 0; b < SWEEP_ROC_POINTS; b++){
+      study->roc_positive[b] += st->roc_positive[b];
+      study->roc_negative[b] += st->roc_negative[b];
+    }
+  }
+  munmap(studies, sizeof(SweepStudy) * c->n_workers);
+  return ret;
+}
+void sweep_print_study(SweepStudy *s, SweepConfig *c){
+  double n = s->n_scenarios > 0 ? s->n_scenarios : 1;
+  printf("Scenarios:          %ld (%ld leaks)\n", s->n_scenarios, s->n_leaks);
+  printf("Workers:            %d%s\n", c->n_workers, c->numa ? " (NUMA pinned)" : "");
+  printf("Meter noise:        %g m3/s + %g of the flowrate\n", c->noise_sigma, c->noise_relative);
+  printf("Detected:           %.2f%%\n", 100 * s->detected / n);
+  long located = 0;
+  for (int k = 0; k < SWEEP_TOP_K; k++){
+    located += s->hit_rank[k];
+    printf("Located in top %d:   %.2f%%\n", k + 1, 100 * located / n);
+  }
+  printf("Mean distance:      %.2f pipes (%ld scenarios with candidates)\n",
+         s->n_distance > 0 ? s->distance_sum / s->n_distance : 0, s->n_distance);
+  printf("Distance histogram:");
+  for (int d = 0; d <= SWEEP_MAX_DISTANCE; d++){
+    printf(" %ld", s->distance[d]);
+  }
+  printf("\n");
+  printf("Elapsed:            %.3f s (%.0f scenarios/s)\n", c->elapsed, s->n_scenarios / (c->elapsed > 0 ? c->elapsed : 1));
+  printf("ROC (threshold m3/s, true positive rate, false positive rate):\n");
+  for (int b = 0; b < SWEEP_ROC_POINTS; b++){
+    printf("  %.4g %.6f %.6f\n", s->roc_threshold[b], s->roc_positive[b] / n, s->roc_negative[b] / n);
+  }
+}
@@ -0,0 +1,175 @@
+#include <thread_pool.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct Worker{
+  ThreadPool *tp;
+  pthread_t thread;
+  int index;
+} Worker;
+
+typedef struct ThreadPool{
+  int n_threads;
+  Worker *workers;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+
+  //Current job, guarded by lock
+  ThreadPoolTask task;
+  void *arg;
+  int n_items;
+  unsigned long generation;
+  int n_pending;
+  _Bool shutdown;
+} ThreadPool;
+
+static void thread_pool_chunk(ThreadPool *tp, int thread, int *first, int *last){
+  int chunk = tp->n_items / tp->n_threads;
+  int extra = tp->n_items % tp->n_threads;
+
+  //First "extra" chunks get one more item
+  *first = thread * chunk + (thread < extra ? thread : extra);
+  *last = *first + chunk + (thread < extra ? 1 : 0);
+}
+
+static void *thread_pool_worker(void *data){
+  Worker *w = data;
+  ThreadPool *tp = w->tp;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&tp->lock);
+  while (true){
+    while (tp->generation == seen && !tp->shutdown){
+      pthread_cond_wait(&tp->start, &tp->lock);
+    }
+    if (tp->shutdown){
+      break;
+    }
+    seen = tp->generation;
+
+    ThreadPoolTask task = tp->task;
+    void *arg = tp->arg;
+    int first, last;
+    thread_pool_chunk(tp, w->index, &first, &last);
+    pthread_mutex_unlock(&tp->lock);
+
+    if (first < last){
+      task(arg, first, last, w->index);
+    }
+
+    pthread_mutex_lock(&tp->lock);
+    tp->n_pending--;
+    if (tp->n_pending == 0){
+      pthread_cond_signal(&tp->done);
+    }
+  }
+  pthread_mutex_unlock(&tp->lock);
+  return NULL;
+}
+
+//Constructors
+ThreadPool *thread_pool_new(ThreadPool **ret, int n_threads){
+  ThreadPool *tp = malloc(sizeof(ThreadPool));
+
+  if (n_threads <= 0){
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (n_threads <= 0){
+    n_threads = 1;
+  }
+
+  tp->n_threads = n_threads;
+  tp->task = NULL;
+  tp->arg = NULL;
+  tp->n_items = 0;
+  tp->generation = 0;
+  tp->n_pending = 0;
+  tp->shutdown = false;
+
+  pthread_mutex_init(&tp->lock, NULL);
+  pthread_cond_init(&tp->start, NULL);
+  pthread_cond_init(&tp->done, NULL);
+
+  //Thread 0 is the caller
+  tp->workers = malloc(sizeof(Worker) * n_threads);
+  for (int i = 1; i < n_threads; i++){
+    tp->workers[i].tp = tp;
+    tp->workers[i].index = i;
+    if (pthread_create(&tp->workers[i].thread, NULL, thread_pool_worker, &tp->workers[i]) != 0){
+      perror("Could not create worker thread:");
+      tp->n_threads = i;
+      break;
+    }
+  }
+
+  if (ret != NULL){
+    *ret = tp;
+  }
+  return tp;
+}
+
+//Destructors
+void thread_pool_destroy(ThreadPool *tp){
+  if (tp == NULL){
+    return;
+  }
+
+  pthread_mutex_lock(&tp->lock);
+  tp->shutdown = true;
+  pthread_cond_broadcast(&tp->start);
+  pthread_mutex_unlock(&tp->lock);
+
+  for (int i = 1; i < tp->n_threads; i++){
+    pthread_join(tp->workers[i].thread, NULL);
+  }
+
+  pthread_mutex_destroy(&tp->lock);
+  pthread_cond_destroy(&tp->start);
+  pthread_cond_destroy(&tp->done);
+
+  free(tp->workers);
+  free(tp);
+}
+
+int thread_pool_get_n_threads(ThreadPool *tp){
+  return tp->n_threads;
+}
+
+void thread_pool_run(ThreadPool *tp, ThreadPoolTask task, void *arg, int n_items){
+  if (n_items <= 0){
+    return;
+  }
+  if (tp->n_threads == 1){
+    task(arg, 0, n_items, 0);
+    return;
+  }
+
+  pthread_mutex_lock(&tp->lock);
+  tp->task = task;
+  tp->arg = arg;
+  tp->n_items = n_items;
+  tp->n_pending = tp->n_threads - 1;
+  tp->generation++;
+  pthread_cond_broadcast(&tp->start);
+
+  int first, last;
+  thread_pool_chunk(tp, 0, &first, &last);
+  pthread_mutex_unlock(&tp->lock);
+
+  if (first < last){
+    task(arg, first, last, 0);
+  }
+
+  pthread_mutex_lock(&tp->lock);
+  while (tp->n_pending != 0){
+    pthread_cond_wait(&tp->done, &tp->lock);
+  }
+  pthread_mutex_unlock(&tp->lock);
+}
@@ -0,0 +1,418 @@
+#include <tiles.h>
+#include <stats.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include <sys/stat.h>
+
+#include <lodepng.h>
+
+typedef struct TileLevel{
+  int n;              //Tiles per side
+  int line_width;
+  int *cell_off;      //n * n + 1
+  int *cell_pipes;
+  _Bool *dirty;       //n * n
+} TileLevel;
+
+typedef struct Tiles{
+  int max_zoom;
+  Renderer *layout;
+  ThreadPool *tp;
+
+  int n_pipes;
+  //Pipe ends in world coordinates, [0, 1] on both axes
+  float *x0;
+  float *y0;
+  float *x1;
+  float *y1;
+  _Bool *drawn;
+
+  TileLevel *levels;
+
+  unsigned char *color;
+  unsigned char *prev_color;
+  _Bool first_export;
+} Tiles;
+
+typedef struct TileJob{
+  Tiles *t;
+  const char *dir;
+  int *tile_z;
+  int *tile_x;
+  int *tile_y;
+  atomic_int errors;
+} TileJob;
+
+//Range of cells of level l covered by pipe p, widened by the line width
+static void tiles_pipe_cells(Tiles *t, TileLevel *l, int p, int *cx0, int *cy0, int *cx1, int *cy1){
+  float pad = (float) l->line_width / (TILES_SIZE * l->n);
+  float min_x = fminf(t->x0[p], t->x1[p]) - pad;
+  float max_x = fmaxf(t->x0[p], t->x1[p]) + pad;
+  float min_y = fminf(t->y0[p], t->y1[p]) - pad;
+  float max_y = fmaxf(t->y0[p], t->y1[p]) + pad;
+
+  *cx0 = floorf(min_x * l->n);
+  *cx1 = floorf(max_x * l->n);
+  *cy0 = floorf(min_y * l->n);
+  *cy1 = floorf(max_y * l->n);
+  *cx0 = *cx0 < 0 ? 0 : *cx0;
+  *cy0 = *cy0 < 0 ? 0 : *cy0;
+  *cx1 = *cx1 >= l->n ? l->n - 1 : *cx1;
+  *cy1 = *cy1 >= l->n ? l->n - 1 : *cy1;
+}
+
+static void tiles_build_index(Tiles *t, TileLevel *l){
+  size_t n_cells = (size_t) l->n * l->n;
+  l->cell_off = calloc(sizeof(int) * (n_cells + 1), 1);
+  l->dirty = calloc(sizeof(_Bool) * n_cells, 1);
+
+  //Count, prefix sum and fill
+  int cx0, cy0, cx1, cy1;
+  for (int p = 0; p < t->n_pipes; p++){
+    if (! t->drawn[p]){
+      continue;
+    }
+    tiles_pipe_cells(t, l, p, &cx0, &cy0, &cx1, &cy1);
+    for (int y = cy0; y <= cy1; y++){
+      for (int x = cx0; x <= cx1; x++){
+        l->cell_off[(size_t) y * l->n + x + 1]++;
+      }
+    }
+  }
+  for (size_t c = 0; c < n_cells; c++){
+    l->cell_off[c + 1] += l->cell_off[c];
+  }
+  int *fill = malloc(sizeof(int) * n_cells);
+  memcpy(fill, l->cell_off, sizeof(int) * n_cells);
+  l->cell_pipes = malloc(sizeof(int) * (l->cell_off[n_cells] + 1));
+  for (int p = 0; p < t->n_pipes; p++){
+    if (! t->drawn[p]){
+      continue;
+    }
+    tiles_pipe_cells(t, l, p, &cx0, &cy0, &cx1, &cy1);
+    for (int y = cy0; y <= cy1; y++){
+      for (int x = cx0; x <= cx1; x++){
+        l->cell_pipes[fill[(size_t) y * l->n + x]++] = p;
+      }
+    }
+  }
+  free(fill);
+}
+
+//Constructors
+Tiles *tiles_new(Tiles **ret, Graph *g, Renderer *layout, int max_zoom){
+  Tiles *t = malloc(sizeof(Tiles));
+
+  if (max_zoom < 0){
+    max_zoom = 0;
+  }
+  if (max_zoom > TILES_MAX_ZOOM){
+    max_zoom = TILES_MAX_ZOOM;
+  }
+  t->max_zoom = max_zoom;
+  t->layout = layout;
+  t->tp = NULL;
+  t->n_pipes = graph_get_n_pipes(g);
+
+  //World is the renderer canvas scaled to a unit square
+  float side = fmaxf(render_get_width(layout), render_get_height(layout));
+  t->x0 = malloc(sizeof(float) * t->n_pipes);
+  t->y0 = malloc(sizeof(float) * t->n_pipes);
+  t->x1 = malloc(sizeof(float) * t->n_pipes);
+  t->y1 = malloc(sizeof(float) * t->n_pipes);
+  t->drawn = malloc(sizeof(_Bool) * t->n_pipes);
+  Pipe **pipes = graph_get_pipes(g);
+  for (int p = 0; p < t->n_pipes; p++){
+    int o = node_get_id(pipe_get_orig(pipes[p]));
+    int d = node_get_id(pipe_get_dest(pipes[p]));
+    t->x0[p] = render_get_node_x(layout, o) / side;
+    t->y0[p] = render_get_node_y(layout, o) / side;
+    t->x1[p] = render_get_node_x(layout, d) / side;
+    t->y1[p] = render_get_node_y(layout, d) / side;
+    t->drawn[p] = graph_get_nth_node(g, o) != NULL && graph_get_nth_node(g, d) != NULL &&
+                  !isnan(t->x0[p]) && !isnan(t->x1[p]);
+  }
+
+  //Lines get wider on the last zoom levels
+  t->levels = malloc(sizeof(TileLevel) * (max_zoom + 1));
+  for (int z = 0; z <= max_zoom; z++){
+    TileLevel *l = &t->levels[z];
+    l->n = 1 << z;
+    l->line_width = (z >= max_zoom - 1) ? 3 : (z >= max_zoom - 3) ? 2 : 1;
+    tiles_build_index(t, l);
+  }
+
+  t->color = malloc(sizeof(unsigned char) * 3 * t->n_pipes);
+  t->prev_color = malloc(sizeof(unsigned char) * 3 * t->n_pipes);
+  t->first_export = true;
+
+  if (ret != NULL){
+    *ret = t;
+  }
+  return t;
+}
+
+//Destructors
+void tiles_destroy(Tiles *t){
+  if (t == NULL){
+    return;
+  }
+  for (int z = 0; z <= t->max_zoom; z++){
+    free(t->levels[z].cell_off);
+    free(t->levels[z].cell_pipes);
+    free(t->levels[z].dirty);
+  }
+  free(t->levels);
+  free(t->x0);
+  free(t->y0);
+  free(t->x1);
+  free(t->y1);
+  free(t->drawn);
+  free(t->color);
+  free(t->prev_color);
+  free(t);
+}
+
+void tiles_set_thread_pool(Tiles *t, ThreadPool *tp){
+  t->tp = tp;
+}
+int tiles_get_max_zoom(Tiles *t){
+  return t->max_zoom;
+}
+void tiles_invalidate(Tiles *t){
+  t->first_export = true;
+}
+
+//Rasterisation
+static void tiles_dot(unsigned char *px, int x, int y, int radius, const unsigned char *rgb){
+  for (int j = y - radius; j <= y + radius; j++){
+    if (j < 0 || j >= TILES_SIZE){
+      continue;
+    }
+    for (int i = x - radius; i <= x + radius; i++){
+      if (i < 0 || i >= TILES_SIZE){
+        continue;
+      }
+      unsigned char *p = px + 4 * (j * TILES_SIZE + i);
+      p[0] = rgb[0];
+      p[1] = rgb[1];
+      p[2] = rgb[2];
+      p[3] = 255;
+    }
+  }
+}
+//Liang-Barsky clip of the segment to the tile widened by pad pixels
+static _Bool tiles_clip(float *x0, float *y0, float *x1, float *y1, float pad){
+  float lo = -pad, hi = TILES_SIZE + pad;
+  float dx = *x1 - *x0, dy = *y1 - *y0;
+  float p[4] = {-dx, dx, -dy, dy};
+  float q[4] = {*x0 - lo, hi - *x0, *y0 - lo, hi - *y0};
+  float u0 = 0, u1 = 1;
+  for (int i = 0; i < 4; i++){
+    if (p[i] == 0){
+      if (q[i] < 0){
+        return false;
+      }
+    } else {
+      float u = q[i] / p[i];
+      if (p[i] < 0){
+        u0 = fmaxf(u0, u);
+      } else {
+        u1 = fminf(u1, u);
+      }
+    }
+  }
+  if (u0 > u1){
+    return false;
+  }
+  float sx = *x0, sy = *y0;
+  *x0 = sx + u0 * dx;
+  *y0 = sy + u0 * dy;
+  *x1 = sx + u1 * dx;
+  *y1 = sy + u1 * dy;
+  return true;
+}
+static void tiles_line(unsigned char *px, float fx0, float fy0, float fx1, float fy1, int width, const unsigned char *rgb){
+  int radius = (width - 1) / 2;
+  if (! tiles_clip(&fx0, &fy0, &fx1, &fy1, radius + 1)){
+    return;
+  }
+  int x0 = lroundf(fx0), y0 = lroundf(fy0);
+  int x1 = lroundf(fx1), y1 = lroundf(fy1);
+
+  //Bresenham
+  int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+  int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+  int err = dx + dy;
+  while (true){
+    tiles_dot(px, x0, y0, radius, rgb);
+    if (x0 == x1 && y0 == y1){
+      break;
+    }
+    int e2 = 2 * err;
+    if (e2 >= dy){
+      err += dy;
+      x0 += sx;
+    }
+    if (e2 <= dx){
+      err += dx;
+      y0 += sy;
+    }
+  }
+}
+
+static void tiles_render_task(void *arg, int first, int last, int thread){
+  TileJob *job = arg;
+  Tiles *t = job->t;
+  unsigned char *px = malloc(sizeof(unsigned char) * 4 * TILES_SIZE * TILES_SIZE);
+  char path[4096];
+
+  //Tiles are already encoded in parallel, each one on a single thread
+  LodePNGState state;
+  lodepng_state_init(&state);
+  lodepng_compress_settings_init_fast(&state.encoder.zlibsettings);
+  //Palette detection costs more than the whole deflate, alpha is always opaque
+  state.encoder.auto_convert = 0;
+  state.info_png.color.colortype = LCT_RGB;
+  state.info_png.color.bitdepth = 8;
+
+  for (int k = first; k < last; k++){
+    int z = job->tile_z[k], x = job->tile_x[k], y = job->tile_y[k];
+    TileLevel *l = &t->levels[z];
+    size_t cell = (size_t) y * l->n + x;
+    float scale = (float) TILES_SIZE * l->n;
+
+    memset(px, 255, sizeof(unsigned char) * 4 * TILES_SIZE * TILES_SIZE);
+    stats_count(STATS_PIPES_DRAWN, l->cell_off[cell + 1] - l->cell_off[cell]);
+    for (int j = l->cell_off[cell]; j < l->cell_off[cell + 1]; j++){
+      int p = l->cell_pipes[j];
+      tiles_line(px,
+                 t->x0[p] * scale - x * TILES_SIZE, t->y0[p] * scale - y * TILES_SIZE,
+                 t->x1[p] * scale - x * TILES_SIZE, t->y1[p] * scale - y * TILES_SIZE,
+                 l->line_width, t->color + 3 * p);
+    }
+
+    snprintf(path, sizeof(path), "%s/%d/%d/%d.png", job->dir, z, x, y);
+    unsigned char *png = NULL;
+    size_t png_size = 0;
+    unsigned error = lodepng_encode(&png, &png_size, px, TILES_SIZE, TILES_SIZE, &state);
+    if (! error){
+      error = lodepng_save_file(png, png_size, path);
+    }
+    if (error){
+      atomic_fetch_add(&job->errors, 1);
+    } else {
+      stats_count(STATS_TILES_WRITTEN, 1);
+    }
+    free(png);
+  }
+  lodepng_state_cleanup(&state);
+  free(px);
+}
+
+static int tiles_mkdir(const char *path){
+  if (mkdir(path, 0755) < 0 && errno != EEXIST){
+    perror("Could not create tile directory:");
+    return -1;
+  }
+  return 0;
+}
+
+int tiles_export(Tiles *t, Graph *g, const char *dir){
+  STATS_SCOPE(STATS_TILES_EXPORT);
+  //Mark the tiles of every pipe that changed color
+  render_compute_pipe_colors(t->layout, g, t->color);
+  for (int p = 0; p < t->n_pipes; p++){
+    if (! t->drawn[p]){
+      continue;
+    }
+    if (! t->first_export && memcmp(t->color + 3 * p, t->prev_color + 3 * p, 3) == 0){
+      continue;
+    }
+    for (int z = 0; z <= t->max_zoom; z++){
+      TileLevel *l = &t->levels[z];
+      int cx0, cy0, cx1, cy1;
+      tiles_pipe_cells(t, l, p, &cx0, &cy0, &cx1, &cy1);
+      for (int y = cy0; y <= cy1; y++){
+        for (int x = cx0; x <= cx1; x++){
+          l->dirty[(size_t) y * l->n + x] = true;
+        }
+      }
+    }
+  }
+  memcpy(t->prev_color, t->color, sizeof(unsigned char) * 3 * t->n_pipes);
+  t->first_export = false;
+
+  //List the dirty tiles and create their directories
+  int n_tiles = 0, cap = 64;
+  TileJob job;
+  job.t = t;
+  job.dir = dir;
+  job.tile_z = malloc(sizeof(int) * cap);
+  job.tile_x = malloc(sizeof(int) * cap);
+  job.tile_y = malloc(sizeof(int) * cap);
+  atomic_init(&job.errors, 0);
+
+  char path[4096];
+  int error = tiles_mkdir(dir);
+  for (int z = 0; z <= t->max_zoom && error == 0; z++){
+    TileLevel *l = &t->levels[z];
+    snprintf(path, sizeof(path), "%s/%d", dir, z);
+    error = tiles_mkdir(path);
+    for (int x = 0; x < l->n && error == 0; x++){
+      _Bool column = false;
+      for (int y = 0; y < l->n; y++){
+        size_t cell = (size_t) y * l->n + x;
+        if (! l->dirty[cell]){
+          continue;
+        }
+        l->dirty[cell] = false;
+        if (l->cell_off[cell] == l->cell_off[cell + 1]){
+          continue;
+        }
+        if (! column){
+          snprintf(path, sizeof(path), "%s/%d/%d", dir, z, x);
+          error = tiles_mkdir(path);
+          column = true;
+        }
+        if (n_tiles == cap){
+          cap *= 2;
+          job.tile_z = realloc(job.tile_z, sizeof(int) * cap);
+          job.tile_x = realloc(job.tile_x, sizeof(int) * cap);
+          job.tile_y = realloc(job.tile_y, sizeof(int) * cap);
+        }
+        job.tile_z[n_tiles] = z;
+        job.tile_x[n_tiles] = x;
+        job.tile_y[n_tiles] = y;
+        n_tiles++;
+      }
+    }
+  }
+
+  if (error == 0){
+    ThreadPool *tp = (t->tp != NULL) ? t->tp : graph_get_thread_pool(g);
+    if (tp != NULL){
+      thread_pool_run(tp, tiles_render_task, &job, n_tiles);
+    } else {
+      tiles_render_task(&job, 0, n_tiles, 0);
+    }
+  }
+
+  free(job.tile_z);
+  free(job.tile_x);
+  free(job.tile_y);
+
+  if (error != 0 || atomic_load(&job.errors) != 0){
+    //Whatever was not written is drawn again next time
+    t->first_export = true;
+    return -1;
+  }
+  return n_tiles;
+}
@@ -0,0 +1,400 @@
+#include <transient.h>
+
+#include <stdlib.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define GRAVITY 9.81
+
+//Below this many points a step is not worth splitting between threads
+#define TRANSIENT_PARALLEL_MIN_POINTS 16384
+
+typedef struct Transient{
+  Graph *g;
+  ThreadPool *thread_pool;
+
+  float dt;
+  float time;
+  float density;
+
+  int n_pipes;
+  int n_nodes;
+  int n_points;
+
+  //Per pipe. Points of pipe i are [offset[i], offset[i+1])
+  int *offset;
+  int *orig;
+  int *dest;
+
+  //Per point, structure of arrays so the stencil vectorizes. Heads and
+  //flowrates are kept as deviations from the initial steady state: in
+  //absolute terms the friction drop of a reach is a few float ulps of the
+  //head, and rounding alone would set the network ringing.
+  float *H;     //Piezometric head above the steady state (m)
+  float *Q;     //Flowrate above the steady state (m³/s)
+  float *Q0;    //Steady state flowrate
+  float *Hn;
+  float *Qn;
+  float *B;     //Characteristic impedance a/(gA) of the owning pipe
+  float *R;     //Friction coefficient f*dx/(2gDA²) of the owning pipe
+  float *cp;    //C+ invariant leaving each point
+  float *cm;    //C- invariant leaving each point
+
+  //Per node. Pipes ending at node i are in_pipe[in_off[i]..in_off[i+1])
+  int *in_off;
+  int *in_pipe;
+  int *out_off;
+  int *out_pipe;
+
+  float *demand;
+  float *demand0;     //Steady state demand
+  float *head;        //Above head0
+  float *head0;       //Steady state head
+  _Bool *fixed_head;
+} Transient;
+
+//Constructors
+Transient *transient_new(Transient **ret, Graph *g, float wave_speed, float dt){
+  Transient *t = malloc(sizeof(Transient));
+
+  t->g = g;
+  t->thread_pool = graph_get_thread_pool(g);
+  t->dt = dt;
+  t->time = 0;
+  t->density = graph_get_fluid_density(g);
+
+  t->n_pipes = graph_get_n_pipes(g);
+  t->n_nodes = graph_get_n_nodes(g);
+
+  Pipe **pipes = graph_get_pipes(g);
+
+  //Discretize every pipe by wave speed
+  int *n_reaches = malloc(sizeof(int) * t->n_pipes);
+  t->offset = malloc(sizeof(int) * (t->n_pipes + 1));
+  t->orig = malloc(sizeof(int) * t->n_pipes);
+  t->dest = malloc(sizeof(int) * t->n_pipes);
+
+  t->n_points = 0;
+  for (int i = 0; i < t->n_pipes; i++){
+    Pipe *p = pipes[i];
+    n_reaches[i] = (int) roundf(pipe_get_length(p) / (wave_speed * dt));
+    if (n_reaches[i] < 1){
+      n_reaches[i] = 1;
+    }
+
+    t->offset[i] = t->n_points;
+    t->n_points += n_reaches[i] + 1;
+
+    t->orig[i] = node_get_id(pipe_get_orig(p));
+    t->dest[i] = node_get_id(pipe_get_dest(p));
+  }
+  t->offset[t->n_pipes] = t->n_points;
+
+  t->H = malloc(sizeof(float) * t->n_points);
+  t->Q = malloc(sizeof(float) * t->n_points);
+  t->Q0 = malloc(sizeof(float) * t->n_points);
+  t->Hn = malloc(sizeof(float) * t->n_points);
+  t->Qn = malloc(sizeof(float) * t->n_points);
+  t->B = malloc(sizeof(float) * t->n_points);
+  t->R = malloc(sizeof(float) * t->n_points);
+  t->cp = malloc(sizeof(float) * t->n_points);
+  t->cm = malloc(sizeof(float) * t->n_points);
+
+  //Pipe constants and initial steady state
+  float rho_g = t->density * GRAVITY;
+  for (int i = 0; i < t->n_pipes; i++){
+    Pipe *p = pipes[i];
+    int n = n_reaches[i];
+
+    float length = pipe_get_length(p);
+    float area = pipe_get_area(p);
+    float diam = pipe_get_diam(p);
+    float friction = pipe_get_friction(p);
+    if (friction < 0){
+      friction = 0;
+    }
+
+    //Adjusted wave speed so the pipe holds a whole number of reaches
+    float a = length / (n * dt);
+    float dx = length / n;
+    float B = a / (GRAVITY * area);
+    float R = friction * dx / (2 * GRAVITY * diam * area * area);
+
+    float q = pipe_get_flowrate(p);
+    if (q == -1){
+      q = 0;
+    }
+
+    for (int k = 0; k <= n; k++){
+      int j = t->offset[i] + k;
+      t->B[j] = B;
+      t->R[j] = R;
+      t->H[j] = 0;
+      t->Q[j] = 0;
+      t->Q0[j] = q;
+    }
+  }
+  free(n_reaches);
+
+  //Node to pipe adjacency (CSR)
+  t->in_off = calloc(sizeof(int) * (t->n_nodes + 1), 1);
+  t->out_off = calloc(sizeof(int) * (t->n_nodes + 1), 1);
+  t->in_pipe = malloc(sizeof(int) * t->n_pipes);
+  t->out_pipe = malloc(sizeof(int) * t->n_pipes);
+  for (int i = 0; i < t->n_pipes; i++){
+    t->in_off[t->dest[i] + 1]++;
+    t->out_off[t->orig[i] + 1]++;
+  }
+  for (int i = 0; i < t->n_nodes; i++){
+    t->in_off[i + 1] += t->in_off[i];
+    t->out_off[i + 1] += t->out_off[i];
+  }
+  int *in_fill = calloc(sizeof(int) * t->n_nodes, 1);
+  int *out_fill = calloc(sizeof(int) * t->n_nodes, 1);
+  for (int i = 0; i < t->n_pipes; i++){
+    t->in_pipe[t->in_off[t->dest[i]] + in_fill[t->dest[i]]++] = i;
+    t->out_pipe[t->out_off[t->orig[i]] + out_fill[t->orig[i]]++] = i;
+  }
+  free(in_fill);
+  free(out_fill);
+
+  //Node boundary conditions
+  t->demand = malloc(sizeof(float) * t->n_nodes);
+  t->demand0 = malloc(sizeof(float) * t->n_nodes);
+  t->head = malloc(sizeof(float) * t->n_nodes);
+  t->head0 = malloc(sizeof(float) * t->n_nodes);
+  t->fixed_head = malloc(sizeof(_Bool) * t->n_nodes);
+  for (int i = 0; i < t->n_nodes; i++){
+    Node *n = graph_get_nth_node(g, i);
+    t->demand[i] = 0;
+    t->demand0[i] = 0;
+    t->head[i] = 0;
+    t->head0[i] = 0;
+    t->fixed_head[i] = false;
+    if (n == NULL){
+      continue;
+    }
+
+    if (node_get_pressure_calculated(n) != -1){
+      t->head0[i] = node_get_pressure_calculated(n) / rho_g;
+    }
+    if (node_get_is_input(n)){
+      t->fixed_head[i] = true;
+    } else if (node_get_is_output(n) && node_get_flowrate_calculated(n) != -1){
+      t->demand[i] = node_get_flowrate_calculated(n);
+    }
+    if (node_get_has_leak(n)){
+      t->demand[i] += node_get_leak_flowrate(n);
+    }
+    t->demand[i] += node_get_background_flowrate(n);
+    t->demand0[i] = t->demand[i];
+  }
+
+  if (ret != NULL){
+    *ret = t;
+  }
+  return t;
+}
+
+//Destructors
+void transient_destroy(Transient *t){
+  if (t == NULL){
+    return;
+  }
+  free(t->offset);
+  free(t->orig);
+  free(t->dest);
+
+  free(t->H);
+  free(t->Q);
+  free(t->Q0);
+  free(t->Hn);
+  free(t->Qn);
+  free(t->B);
+  free(t->R);
+  free(t->cp);
+  free(t->cm);
+
+  free(t->in_off);
+  free(t->in_pipe);
+  free(t->out_off);
+  free(t->out_pipe);
+
+  free(t->demand);
+  free(t->demand0);
+  free(t->head);
+  free(t->head0);
+  free(t->fixed_head);
+
+  free(t);
+}
+
+//Boundary conditions
+void transient_set_node_demand(Transient *t, int node, float q){
+  t->demand[node] = q;
+}
+float transient_get_node_demand(Transient *t, int node){
+  return t->demand[node];
+}
+void transient_add_leak(Transient *t, int node, float q){
+  t->demand[node] += q;
+}
+void transient_set_node_pressure(Transient *t, int node, float p){
+  t->fixed_head[node] = true;
+  t->head[node] = p / (t->density * GRAVITY) - t->head0[node];
+}
+void transient_set_thread_pool(Transient *t, ThreadPool *tp){
+  t->thread_pool = tp;
+}
+
+//Stencil. Every function works on a contiguous range so that sweeps can be
+//split between threads.
+
+//Invariants carried by the C+ and C- characteristics out of every point. The
+//steady state is balanced by the steady friction, so only the friction beyond
+//it enters.
+static void transient_characteristics(Transient *t, int first, int last){
+  const float *restrict H = t->H;
+  const float *restrict Q = t->Q;
+  const float *restrict Q0 = t->Q0;
+  const float *restrict B = t->B;
+  const float *restrict R = t->R;
+  float *restrict cp = t->cp;
+  float *restrict cm = t->cm;
+
+  for (int i = first; i < last; i++){
+    float q = Q0[i] + Q[i];
+    float friction = R[i] * (q * fabsf(q) - Q0[i] * fabsf(Q0[i]));
+    cp[i] = H[i] + B[i] * Q[i] - friction;
+    cm[i] = H[i] - B[i] * Q[i] + friction;
+  }
+}
+//Interior points. Points on pipe ends get overwritten by the node update.
+static void transient_interior(Transient *t, int first, int last){
+  const float *restrict cp = t->cp;
+  const float *restrict cm = t->cm;
+  const float *restrict B = t->B;
+  float *restrict Hn = t->Hn;
+  float *restrict Qn = t->Qn;
+
+  if (first < 1){
+    first = 1;
+  }
+  if (last > t->n_points - 1){
+    last = t->n_points - 1;
+  }
+  for (int i = first; i < last; i++){
+    Hn[i] = 0.5f * (cp[i - 1] + cm[i + 1]);
+    Qn[i] = (cp[i - 1] - cm[i + 1]) / (2.0f * B[i]);
+  }
+}
+//Junction, reservoir and demand boundaries
+static void transient_nodes(Transient *t, int first, int last){
+  for (int n = first; n < last; n++){
+    int in_first = t->in_off[n], in_last = t->in_off[n + 1];
+    int out_first = t->out_off[n], out_last = t->out_off[n + 1];
+    if (in_first == in_last && out_first == out_last){
+      continue;
+    }
+
+    float h;
+    if (t->fixed_head[n]){
+      h = t->head[n];
+    } else {
+      //Continuity: sum((CP-H)/B) over pipes in - sum((H-CM)/B) over pipes out
+      //= demand beyond the steady one
+      float sum_inv_b = 0;
+      float sum_c = 0;
+      for (int k = in_first; k < in_last; k++){
+        int e = t->offset[t->in_pipe[k] + 1] - 1;
+        sum_inv_b += 1 / t->B[e];
+        sum_c += t->cp[e - 1] / t->B[e];
+      }
+      for (int k = out_first; k < out_last; k++){
+        int s = t->offset[t->out_pipe[k]];
+        sum_inv_b += 1 / t->B[s];
+        sum_c += t->cm[s + 1] / t->B[s];
+      }
+      h = (sum_c - (t->demand[n] - t->demand0[n])) / sum_inv_b;
+      t->head[n] = h;
+    }
+
+    for (int k = in_first; k < in_last; k++){
+      int e = t->offset[t->in_pipe[k] + 1] - 1;
+      t->Hn[e] = h;
+      t->Qn[e] = (t->cp[e - 1] - h) / t->B[e];
+    }
+    for (int k = out_first; k < out_last; k++){
+      int s = t->offset[t->out_pipe[k]];
+      t->Hn[s] = h;
+      t->Qn[s] = (h - t->cm[s + 1]) / t->B[s];
+    }
+  }
+}
+
+//Thread pool adapters. Every pipe end belongs to exactly one node, so node
+//ranges never write the same point.
+static void transient_characteristics_task(void *arg, int first, int last, int thread){
+  transient_characteristics(arg, first, last);
+}
+static void transient_interior_task(void *arg, int first, int last, int thread){
+  transient_interior(arg, first, last);
+}
+static void transient_nodes_task(void *arg, int first, int last, int thread){
+  transient_nodes(arg, first, last);
+}
+
+//Time stepping
+void transient_step(Transient *t){
+  if (t->thread_pool == NULL || t->n_points < TRANSIENT_PARALLEL_MIN_POINTS){
+    transient_characteristics(t, 0, t->n_points);
+    transient_interior(t, 0, t->n_points);
+    transient_nodes(t, 0, t->n_nodes);
+  } else {
+    thread_pool_run(t->thread_pool, transient_characteristics_task, t, t->n_points);
+    thread_pool_run(t->thread_pool, transient_interior_task, t, t->n_points);
+    thread_pool_run(t->thread_pool, transient_nodes_task, t, t->n_nodes);
+  }
+
+  float *aux;
+  aux = t->H; t->H = t->Hn; t->Hn = aux;
+  aux = t->Q; t->Q = t->Qn; t->Qn = aux;
+
+  t->time += t->dt;
+}
+void transient_run(Transient *t, int steps){
+  for (int i = 0; i < steps; i++){
+    transient_step(t);
+  }
+}
+
+//Results
+float transient_get_time(Transient *t){
+  return t->time;
+}
+float transient_get_dt(Transient *t){
+  return t->dt;
+}
+int transient_get_n_points(Transient *t){
+  return t->n_points;
+}
+float transient_get_node_pressure(Transient *t, int node){
+  return (t->head0[node] + t->head[node]) * t->density * GRAVITY;
+}
+float transient_get_pipe_flowrate_in(Transient *t, int pipe){
+  int j = t->offset[pipe];
+  return t->Q0[j] + t->Q[j];
+}
+float transient_get_pipe_flowrate_out(Transient *t, int pipe){
+  int j = t->offset[pipe + 1] - 1;
+  return t->Q0[j] + t->Q[j];
+}
+void transient_store(Transient *t){
+  for (int i = 0; i < t->n_nodes; i++){
+    Node *n = graph_get_nth_node(t->g, i);
+    if (n != NULL && (t->in_off[i] != t->in_off[i + 1] || t->out_off[i] != t->out_off[i + 1])){
+      node_set_pressure_calculated(n, transient_get_node_pressure(t, i));
+    }
+  }
+}
@@ -0,0 +1,368 @@
+#include <tree_index.h>
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+typedef struct TreeIndex{
+  int n_nodes;        //Graph node IDs
+  int n;              //Nodes in the forest
+
+  //Per node ID, -1 for nodes outside the forest
+  int *parent;
+  int *depth;
+  int *size;
+  int *head;          //Top of the heavy chain
+  int *pos;           //Position in the walk order
+
+  int *order;         //Node ID at every position
+
+  //Sums are accumulated in double so that adding and removing leaks many
+  //times does not drift
+  double *fenwick;    //Weights, 1-based
+  double *seg_sum;    //Values, segment tree over positions with the pending
+  double *seg_add;    //adds kept on the covering nodes
+  float *leak;
+} TreeIndex;
+
+//Fenwick tree
+static void fenwick_add(TreeIndex *ti, int i, double d){
+  for (i++; i <= ti->n; i += i & -i){
+    ti->fenwick[i] += d;
+  }
+}
+//Sum of positions [0, i)
+static double fenwick_prefix(TreeIndex *ti, int i){
+  double s = 0;
+  for (; i > 0; i -= i & -i){
+    s += ti->fenwick[i];
+  }
+  return s;
+}
+
+//Segment tree. Adds stay on the nodes covering their range and sums include
+//them, so neither update nor query has to push anything down.
+static void segment_add(TreeIndex *ti, int k, int l, int r, int ql, int qr, double d){
+  if (qr < l || r < ql){
+    return;
+  }
+  if (ql <= l && r <= qr){
+    ti->seg_sum[k] += d * (r - l + 1);
+    ti->seg_add[k] += d;
+    return;
+  }
+  int m = (l + r) / 2;
+  segment_add(ti, 2 * k, l, m, ql, qr, d);
+  segment_add(ti, 2 * k + 1, m + 1, r, ql, qr, d);
+  ti->seg_sum[k] = ti->seg_sum[2 * k] + ti->seg_sum[2 * k + 1] + ti->seg_add[k] * (r - l + 1);
+}
+static double segment_sum(TreeIndex *ti, int k, int l, int r, int ql, int qr){
+  if (qr < l || r < ql){
+    return 0;
+  }
+  if (ql <= l && r <= qr){
+    return ti->seg_sum[k];
+  }
+  int lo = (l > ql) ? l : ql;
+  int hi = (r < qr) ? r : qr;
+  int m = (l + r) / 2;
+  return ti->seg_add[k] * (hi - lo + 1)
+         + segment_sum(ti, 2 * k, l, m, ql, qr)
+         + segment_sum(ti, 2 * k + 1, m + 1, r, ql, qr);
+}
+
+static _Bool tree_index_has(TreeIndex *ti, int node){
+  return node >= 0 && node < ti->n_nodes && ti->pos[node] != -1;
+}
+
+//Constructors
+TreeIndex *tree_index_new(TreeIndex **ret, Graph *g){
+  int n_nodes = graph_get_n_nodes(g);
+
+  //Feeders: the origin of the one pipe in from a node still in the graph.
+  //Nodes fed by more than one pipe split their leaks between them, which a
+  //forest cannot hold.
+  int *parent = malloc(sizeof(int) * (n_nodes > 0 ? n_nodes : 1));
+  for (int i = 0; i < n_nodes; i++){
+    Node *n = graph_get_nth_node(g, i);
+    parent[i] = -1;
+    if (n == NULL){
+      continue;
+    }
+    for (int j = 0; j < node_get_n_pipes_in(n); j++){
+      int o = node_get_id(pipe_get_orig(node_get_nth_pipe_in(n, j)));
+      if (graph_get_nth_node(g, o) == NULL){
+        continue;
+      }
+      if (parent[i] != -1 || o == i){
+        free(parent);
+        return NULL;
+      }
+      parent[i] = o;
+    }
+  }
+
+  TreeIndex *ti = malloc(sizeof(TreeIndex));
+  ti->n_nodes = n_nodes;
+
+  ti->parent = parent;
+  ti->depth = malloc(sizeof(int) * n_nodes);
+  ti->size = malloc(sizeof(int) * n_nodes);
+  ti->head = malloc(sizeof(int) * n_nodes);
+  ti->pos = malloc(sizeof(int) * n_nodes);
+  ti->leak = calloc(n_nodes > 0 ? n_nodes : 1, sizeof(float));
+
+  int *n_children = calloc(n_nodes + 1, sizeof(int));
+  for (int i = 0; i < n_nodes; i++){
+    ti->pos[i] = -1;
+    if (ti->parent[i] != -1){
+      n_children[ti->parent[i]]++;
+    }
+  }
+
+  //Children grouped by parent
+  int *child_start = malloc(sizeof(int) * (n_nodes + 1));
+  child_start[0] = 0;
+  for (int i = 0; i < n_nodes; i++){
+    child_start[i + 1] = child_start[i] + n_children[i];
+    n_children[i] = child_start[i];
+  }
+  int *children = malloc(sizeof(int) * (child_start[n_nodes] > 0 ? child_start[n_nodes] : 1));
+  for (int i = 0; i < n_nodes; i++){
+    if (ti->parent[i] != -1){
+      children[n_children[ti->parent[i]]++] = i;
+    }
+  }
+
+  //Breadth-first from the roots for depths, then sizes and heavy children
+  //bottom up. Nodes on a cycle of feeders are never reached and stay out.
+  int *queue = malloc(sizeof(int) * (n_nodes > 0 ? n_nodes : 1));
+  int *heavy = n_children;
+  int len = 0;
+  for (int i = 0; i < n_nodes; i++){
+    if (graph_get_nth_node(g, i) != NULL && ti->parent[i] == -1){
+      ti->depth[i] = 0;
+      queue[len++] = i;
+    }
+  }
+  for (int head = 0; head < len; head++){
+    int v = queue[head];
+    for (int c = child_start[v]; c < child_start[v + 1]; c++){
+      ti->depth[children[c]] = ti->depth[v] + 1;
+      queue[len++] = children[c];
+    }
+  }
+  ti->n = len;
+  for (int k = len - 1; k >= 0; k--){
+    int v = queue[k];
+    ti->size[v] = 1;
+    heavy[v] = -1;
+    for (int c = child_start[v]; c < child_start[v + 1]; c++){
+      int u = children[c];
+      ti->size[v] += ti->size[u];
+      if (heavy[v] == -1 || ti->size[u] > ti->size[heavy[v]]){
+        heavy[v] = u;
+      }
+    }
+  }
+
+  //Depth-first, heavy child first so that it follows its parent. The stack
+  //never holds more than the n nodes.
+  ti->order = malloc(sizeof(int) * (len > 0 ? len : 1));
+  int *stack = queue;
+  int top = 0;
+  int cur = 0;
+  for (int i = n_nodes - 1; i >= 0; i--){
+    if (graph_get_nth_node(g, i) != NULL && ti->parent[i] == -1){
+      ti->head[i] = i;
+      stack[top++] = i;
+    }
+  }
+  while (top > 0){
+    int v = stack[--top];
+    ti->pos[v] = cur;
+    ti->order[cur++] = v;
+    for (int c = child_start[v]; c < child_start[v + 1]; c++){
+      int u = children[c];
+      if (u != heavy[v]){
+        ti->head[u] = u;
+        stack[top++] = u;
+      }
+    }
+    if (heavy[v] != -1){
+      ti->head[heavy[v]] = ti->head[v];
+      stack[top++] = heavy[v];
+    }
+  }
+
+  free(queue);
+  free(n_children);
+  free(child_start);
+  free(children);
+
+  ti->fenwick = calloc(len + 1, sizeof(double));
+  ti->seg_sum = calloc(len > 0 ? 4 * len : 1, sizeof(double));
+  ti->seg_add = calloc(len > 0 ? 4 * len : 1, sizeof(double));
+
+  if (ret != NULL){
+    *ret = ti;
+  }
+  return ti;
+}
+void tree_index_destroy(TreeIndex *ti){
+  if (ti == NULL){
+    return;
+  }
+  free(ti->parent);
+  free(ti->depth);
+  free(ti->size);
+  free(ti->head);
+  free(ti->pos);
+  free(ti->order);
+  free(ti->fenwick);
+  free(ti->seg_sum);
+  free(ti->seg_add);
+  free(ti->leak);
+  free(ti);
+}
+
+void tree_index_clear(TreeIndex *ti){
+  memset(ti->fenwick, 0, sizeof(double) * (ti->n + 1));
+  if (ti->n > 0){
+    memset(ti->seg_sum, 0, sizeof(double) * 4 * ti->n);
+    memset(ti->seg_add, 0, sizeof(double) * 4 * ti->n);
+  }
+  memset(ti->leak, 0, sizeof(float) * ti->n_nodes);
+}
+
+//Structure
+int tree_index_get_parent(TreeIndex *ti, int node){
+  return tree_index_has(ti, node) ? ti->parent[node] : -1;
+}
+int tree_index_get_root(TreeIndex *ti, int node){
+  if (!tree_index_has(ti, node)){
+    return -1;
+  }
+  while (ti->parent[ti->head[node]] != -1){
+    node = ti->parent[ti->head[node]];
+  }
+  return ti->head[node];
+}
+int tree_index_get_depth(TreeIndex *ti, int node){
+  return tree_index_has(ti, node) ? ti->depth[node] : -1;
+}
+int tree_index_get_subtree_size(TreeIndex *ti, int node){
+  return tree_index_has(ti, node) ? ti->size[node] : 0;
+}
+int *tree_index_get_subtree(TreeIndex *ti, int node){
+  return tree_index_has(ti, node) ? &ti->order[ti->pos[node]] : NULL;
+}
+_Bool tree_index_is_descendant(TreeIndex *ti, int node, int ancestor){
+  if (!tree_index_has(ti, node) || !tree_index_has(ti, ancestor)){
+    return false;
+  }
+  int p = ti->pos[ancestor];
+  return p <= ti->pos[node] && ti->pos[node] < p + ti->size[ancestor];
+}
+int tree_index_lca(TreeIndex *ti, int a, int b){
+  if (!tree_index_has(ti, a) || !tree_index_has(ti, b)){
+    return -1;
+  }
+  while (ti->head[a] != ti->head[b]){
+    if (ti->depth[ti->head[a]] < ti->depth[ti->head[b]]){
+      int t = a;
+      a = b;
+      b = t;
+    }
+    //The deeper chain starts at a root only when both do
+    a = ti->parent[ti->head[a]];
+    if (a == -1){
+      return -1;
+    }
+  }
+  return (ti->depth[a] < ti->depth[b]) ? a : b;
+}
+
+//Weights
+void tree_index_add_weight(TreeIndex *ti, int node, float delta){
+  if (tree_index_has(ti, node)){
+    fenwick_add(ti, ti->pos[node], delta);
+  }
+}
+float tree_index_get_subtree_weight(TreeIndex *ti, int node){
+  if (!tree_index_has(ti, node)){
+    return 0;
+  }
+  int p = ti->pos[node];
+  return fenwick_prefix(ti, p + ti->size[node]) - fenwick_prefix(ti, p);
+}
+
+//Values. A path climbs the chain with the deeper top until both ends are
+//on one chain, one position range per chain.
+static double tree_index_path(TreeIndex *ti, int a, int b, _Bool add, double delta){
+  double sum = 0;
+  while (ti->head[a] != ti->head[b]){
+    if (ti->depth[ti->head[a]] < ti->depth[ti->head[b]]){
+      int t = a;
+      a = b;
+      b = t;
+    }
+    int h = ti->head[a];
+    if (add){
+      segment_add(ti, 1, 0, ti->n - 1, ti->pos[h], ti->pos[a], delta);
+    } else {
+      sum += segment_sum(ti, 1, 0, ti->n - 1, ti->pos[h], ti->pos[a]);
+    }
+    a = ti->parent[h];
+    if (a == -1){
+      return sum;
+    }
+  }
+  int lo = (ti->pos[a] < ti->pos[b]) ? ti->pos[a] : ti->pos[b];
+  int hi = (ti->pos[a] < ti->pos[b]) ? ti->pos[b] : ti->pos[a];
+  if (add){
+    segment_add(ti, 1, 0, ti->n - 1, lo, hi, delta);
+  } else {
+    sum += segment_sum(ti, 1, 0, ti->n - 1, lo, hi);
+  }
+  return sum;
+}
+void tree_index_path_add(TreeIndex *ti, int a, int b, float delta){
+  if (tree_index_has(ti, a) && tree_index_has(ti, b)){
+    tree_index_path(ti, a, b, true, delta);
+  }
+}
+float tree_index_path_sum(TreeIndex *ti, int a, int b){
+  if (!tree_index_has(ti, a) || !tree_index_has(ti, b)){
+    return 0;
+  }
+  return tree_index_path(ti, a, b, false, 0);
+}
+float tree_index_get_value(TreeIndex *ti, int node){
+  if (!tree_index_has(ti, node)){
+    return 0;
+  }
+  return segment_sum(ti, 1, 0, ti->n - 1, ti->pos[node], ti->pos[node]);
+}
+
+//Leaks
+void tree_index_set_leak(TreeIndex *ti, int node, float flowrate){
+  if (!tree_index_has(ti, node)){
+    return;
+  }
+  double delta = (double) flowrate - ti->leak[node];
+  ti->leak[node] = flowrate;
+
+  //Root path, one range per chain
+  while (node != -1){
+    int h = ti->head[node];
+    segment_add(ti, 1, 0, ti->n - 1, ti->pos[h], ti->pos[node], delta);
+    node = ti->parent[h];
+  }
+}
+float tree_index_get_leak(TreeIndex *ti, int node){
+  return tree_index_has(ti, node) ? ti->leak[node] : 0;
+}
+float tree_index_get_leak_through(TreeIndex *ti, int node){
+  return tree_index_get_value(ti, node);
+}